@@ -0,0 +1,458 @@
+/*
+ * libdfu, benchmarks: synthetic images (see bench-images.h)
+ * Author Davide Ciminaghi, 2016
+ * Public domain
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench-images.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+static char *_alloc(unsigned long size)
+{
+	char *out = malloc(size);
+
+	if (!out)
+		perror("malloc");
+	return out;
+}
+
+/* Random (but always the same) payload */
+static uint8_t *_payload(unsigned long size)
+{
+	uint8_t *out = (uint8_t *)_alloc(size);
+	uint32_t x = 0x12345678;
+	unsigned long i;
+
+	for (i = 0; out && i < size; i++) {
+		/* xorshift32 */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		out[i] = x;
+	}
+	return out;
+}
+
+static int _ihex_record(char *out, int type, unsigned int addr,
+			const uint8_t *data, int len)
+{
+	uint8_t csum = len + (addr >> 8) + addr + type;
+	int i, ret;
+
+	ret = sprintf(out, ":%02X%04X%02X", len, addr & 0xffff, type);
+	for (i = 0; i < len; i++) {
+		ret += sprintf(&out[ret], "%02X", data[i]);
+		csum += data[i];
+	}
+	ret += sprintf(&out[ret], "%02X\n", (uint8_t)-csum);
+	return ret;
+}
+
+/* Intel hex image, 16 bytes per record by default, made of img->blocks */
+static int _build_ihex(struct bench_image *img)
+{
+	unsigned long tot = 0, off, a, upper = 0, r, nrec;
+	unsigned long rs = img->record_size ? img->record_size : 16;
+	uint8_t ela[2];
+	char *ptr;
+	int i, n, first = 1;
+
+	for (i = 0; i < img->nblocks; i++)
+		tot += img->blocks[i].size;
+	img->data = _payload(tot);
+	/* Data record: 1 + 2 + 4 + 2 + 2 * rs + 2 + 1 chars */
+	img->buf = _alloc((tot / rs + img->nblocks + 1) * (12 + 2 * rs) +
+			  img->nblocks * 17 * 4 + 32);
+	if (!img->data || !img->buf)
+		return -1;
+	ptr = img->buf;
+	for (i = 0, off = 0; i < img->nblocks; i++) {
+		const struct bench_block *b = &img->blocks[i];
+
+		nrec = (b->size + rs - 1) / rs;
+		for (r = 0; r < nrec; r++) {
+			/* Record to be emitted now */
+			unsigned long e = img->swap_records && (r ^ 1) < nrec ?
+				r ^ 1 : r;
+
+			a = b->addr + e * rs;
+			if (first || (a >> 16) != upper) {
+				/* Extended linear address record */
+				upper = a >> 16;
+				ela[0] = upper >> 8;
+				ela[1] = upper;
+				ptr += _ihex_record(ptr, 4, 0, ela, 2);
+				first = 0;
+			}
+			n = b->addr + b->size - a;
+			if (n > rs)
+				n = rs;
+			ptr += _ihex_record(ptr, 0, a, &img->data[off + e * rs],
+					    n);
+		}
+		off += b->size;
+	}
+	ptr += _ihex_record(ptr, 1, 0, NULL, 0);
+	img->size = ptr - img->buf;
+	return 0;
+}
+
+static int _srec_record(char *out, int type, unsigned long addr,
+			const uint8_t *data, int len)
+{
+	/* Address bytes of S0 .. S9 */
+	static const int alen[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2, };
+	uint8_t csum = len + alen[type] + 1;
+	int i, ret;
+
+	ret = sprintf(out, "S%d%02X", type, len + alen[type] + 1);
+	for (i = alen[type] - 1; i >= 0; i--) {
+		ret += sprintf(&out[ret], "%02X", (uint8_t)(addr >> (i * 8)));
+		csum += addr >> (i * 8);
+	}
+	for (i = 0; i < len; i++) {
+		ret += sprintf(&out[ret], "%02X", data[i]);
+		csum += data[i];
+	}
+	ret += sprintf(&out[ret], "%02X\n", (uint8_t)~csum);
+	return ret;
+}
+
+/*
+ * Motorola S-record image, 16 bytes per S3 record by default, made of
+ * img->blocks, with header, record count and entry point
+ */
+static int _build_srec(struct bench_image *img)
+{
+	unsigned long tot = 0, off, a, r, nrec, n_tot = 0;
+	unsigned long rs = img->record_size ? img->record_size : 16;
+	const uint8_t hdr[] = "bench";
+	char *ptr;
+	int i, n;
+
+	for (i = 0; i < img->nblocks; i++)
+		tot += img->blocks[i].size;
+	img->data = _payload(tot);
+	/* Data record: 2 + 2 + 8 + 2 * rs + 2 + 1 chars */
+	img->buf = _alloc((tot / rs + img->nblocks + 3) * (15 + 2 * rs) + 32);
+	if (!img->data || !img->buf)
+		return -1;
+	ptr = img->buf;
+	ptr += _srec_record(ptr, 0, 0, hdr, sizeof(hdr) - 1);
+	for (i = 0, off = 0; i < img->nblocks; i++) {
+		const struct bench_block *b = &img->blocks[i];
+
+		nrec = (b->size + rs - 1) / rs;
+		for (r = 0; r < nrec; r++) {
+			/* Record to be emitted now */
+			unsigned long e = img->swap_records && (r ^ 1) < nrec ?
+				r ^ 1 : r;
+
+			a = b->addr + e * rs;
+			n = b->addr + b->size - a;
+			if (n > rs)
+				n = rs;
+			ptr += _srec_record(ptr, 3, a, &img->data[off + e * rs],
+					    n);
+		}
+		n_tot += nrec;
+		off += b->size;
+	}
+	ptr += _srec_record(ptr, n_tot > 0xffff ? 6 : 5, n_tot, NULL, 0);
+	ptr += _srec_record(ptr, 7, img->blocks[0].addr, NULL, 0);
+	img->size = ptr - img->buf;
+	return 0;
+}
+
+static void _dense_blocks(struct bench_image *img, unsigned long base,
+			  unsigned long size)
+{
+	img->blocks[0].addr = base;
+	img->blocks[0].size = size;
+	img->nblocks = 1;
+}
+
+static int build_hex_dense(struct bench_image *img, unsigned long base,
+			   unsigned long size)
+{
+	_dense_blocks(img, base, size);
+	return _build_ihex(img);
+}
+
+/* MAX_BLOCKS small blocks spread over the image size */
+static int build_hex_sparse(struct bench_image *img, unsigned long base,
+			    unsigned long size)
+{
+	unsigned long stride = size / 8;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		img->blocks[i].addr = base + i * stride;
+		img->blocks[i].size = stride / 4;
+	}
+	img->nblocks = 8;
+	return _build_ihex(img);
+}
+
+/*
+ * Many small blocks at odd addresses, records out of order: lots of
+ * partial pages
+ */
+static void _fragmented_blocks(struct bench_image *img, unsigned long base,
+			       unsigned long size)
+{
+	unsigned long stride = size / MAX_BLOCKS;
+	int i;
+
+	for (i = 0; i < MAX_BLOCKS; i++) {
+		img->blocks[i].addr = base + i * stride + 5 + (i % 7) * 3;
+		img->blocks[i].size = stride / 3;
+	}
+	img->nblocks = MAX_BLOCKS;
+	img->swap_records = 1;
+}
+
+static int build_hex_fragmented(struct bench_image *img, unsigned long base,
+				unsigned long size)
+{
+	_fragmented_blocks(img, base, size);
+	return _build_ihex(img);
+}
+
+/*
+ * Two blocks far apart, then a record going back to the first block's page
+ * (which has been written by then)
+ */
+static int build_hex_backwards(struct bench_image *img, unsigned long base,
+			       unsigned long size)
+{
+	img->blocks[0].addr = base + 16;
+	img->blocks[0].size = size / 4;
+	img->blocks[1].addr = base + size / 2;
+	img->blocks[1].size = size / 4;
+	img->blocks[2].addr = base;
+	img->blocks[2].size = 16;
+	img->nblocks = 3;
+	return _build_ihex(img);
+}
+
+/* Longest records: the input ring must hold a whole record */
+static int build_hex_long(struct bench_image *img, unsigned long base,
+			  unsigned long size)
+{
+	_dense_blocks(img, base, size);
+	img->record_size = 255;
+	return _build_ihex(img);
+}
+
+static int build_srec_dense(struct bench_image *img, unsigned long base,
+			    unsigned long size)
+{
+	_dense_blocks(img, base, size);
+	return _build_srec(img);
+}
+
+static int build_srec_fragmented(struct bench_image *img, unsigned long base,
+				 unsigned long size)
+{
+	_fragmented_blocks(img, base, size);
+	return _build_srec(img);
+}
+
+/* S3 records, byte count 255: 4 address bytes and 250 data bytes */
+static int build_srec_long(struct bench_image *img, unsigned long base,
+			   unsigned long size)
+{
+	_dense_blocks(img, base, size);
+	img->record_size = 250;
+	return _build_srec(img);
+}
+
+static int build_bin(struct bench_image *img, unsigned long base,
+		     unsigned long size)
+{
+	/* Raw binaries are always programmed starting from address 0 */
+	if (base)
+		return 1;
+	img->blocks[0].addr = 0;
+	img->blocks[0].size = size;
+	img->nblocks = 1;
+	img->data = _payload(size);
+	if (!img->data)
+		return -1;
+	img->buf = (char *)img->data;
+	img->size = size;
+	return 0;
+}
+
+/* Raw binary, every other eighth of it is padding (0xff) */
+static int build_bin_padded(struct bench_image *img, unsigned long base,
+			    unsigned long size)
+{
+	unsigned long part = size / 8;
+	int i, stat = build_bin(img, base, size);
+
+	if (stat)
+		return stat;
+	for (i = 1; i < 8; i += 2)
+		memset(&img->data[i * part], 0xff, part);
+	return 0;
+}
+
+uint32_t bench_crc32(const uint8_t *buf, unsigned long len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static char *_put16(char *ptr, uint16_t v)
+{
+	*ptr++ = v;
+	*ptr++ = v >> 8;
+	return ptr;
+}
+
+static char *_put32(char *ptr, uint32_t v)
+{
+	ptr = _put16(ptr, v);
+	return _put16(ptr, v >> 16);
+}
+
+struct zip_entry {
+	const char *name;
+	const void *data;
+	unsigned long size;
+	unsigned long offset;
+	uint32_t crc;
+};
+
+/* Header fields shared by local and central directory headers */
+static char *_zip_file_header(char *ptr, const struct zip_entry *e)
+{
+	/* Version needed, flags, no compression, time, date (1980-01-01) */
+	ptr = _put16(ptr, 20);
+	ptr = _put16(ptr, 0);
+	ptr = _put16(ptr, 0);
+	ptr = _put16(ptr, 0);
+	ptr = _put16(ptr, 0x21);
+	ptr = _put32(ptr, e->crc);
+	ptr = _put32(ptr, e->size);
+	ptr = _put32(ptr, e->size);
+	ptr = _put16(ptr, strlen(e->name));
+	/* No extra field */
+	return _put16(ptr, 0);
+}
+
+/*
+ * Nordic zip (stored, not compressed) with one application image, the bin
+ * file goes to a flash area chosen by the target itself (@base is ignored)
+ */
+static int build_nordic_zip(struct bench_image *img, unsigned long base,
+			    unsigned long size)
+{
+	static const char manifest[] =
+		"{\"manifest\": {\"application\": "
+		"{\"bin_file\": \"app.bin\", \"dat_file\": \"app.dat\"}}}";
+	static uint8_t init_packet[64];
+	struct zip_entry entries[] = {
+		{ .name = "manifest.json", .data = manifest,
+		  .size = sizeof(manifest) - 1, },
+		{ .name = "app.dat", .data = init_packet,
+		  .size = sizeof(init_packet), },
+		{ .name = "app.bin", .size = size, },
+	};
+	char *ptr, *cd;
+	unsigned long cd_size;
+	int i;
+
+	img->blocks[0].addr = 0;
+	img->blocks[0].size = size;
+	img->nblocks = 1;
+	img->data = _payload(size);
+	img->buf = _alloc(size + sizeof(manifest) +
+			  sizeof(init_packet) + 512);
+	if (!img->data || !img->buf)
+		return -1;
+	entries[2].data = img->data;
+	ptr = img->buf;
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		struct zip_entry *e = &entries[i];
+
+		e->crc = bench_crc32(e->data, e->size);
+		e->offset = ptr - img->buf;
+		ptr = _put32(ptr, 0x04034b50);
+		ptr = _zip_file_header(ptr, e);
+		memcpy(ptr, e->name, strlen(e->name));
+		ptr += strlen(e->name);
+		memcpy(ptr, e->data, e->size);
+		ptr += e->size;
+	}
+	cd = ptr;
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		struct zip_entry *e = &entries[i];
+
+		ptr = _put32(ptr, 0x02014b50);
+		/* Version made by */
+		ptr = _put16(ptr, 20);
+		ptr = _zip_file_header(ptr, e);
+		/* Comment length, disk, internal and external attributes */
+		ptr = _put16(ptr, 0);
+		ptr = _put16(ptr, 0);
+		ptr = _put16(ptr, 0);
+		ptr = _put32(ptr, 0);
+		ptr = _put32(ptr, e->offset);
+		memcpy(ptr, e->name, strlen(e->name));
+		ptr += strlen(e->name);
+	}
+	/* End of central directory */
+	cd_size = ptr - cd;
+	ptr = _put32(ptr, 0x06054b50);
+	ptr = _put16(ptr, 0);
+	ptr = _put16(ptr, 0);
+	ptr = _put16(ptr, ARRAY_SIZE(entries));
+	ptr = _put16(ptr, ARRAY_SIZE(entries));
+	ptr = _put32(ptr, cd_size);
+	ptr = _put32(ptr, cd - img->buf);
+	ptr = _put16(ptr, 0);
+	img->size = ptr - img->buf;
+	img->zip = 1;
+	/* Same as the nordic spi target's */
+	img->chunk_size = 128;
+	return 0;
+}
+
+const struct bench_format bench_formats[] = {
+	{ .name = "hex-dense", .build = build_hex_dense, },
+	{ .name = "hex-sparse", .build = build_hex_sparse, },
+	{ .name = "hex-fragmented", .build = build_hex_fragmented, },
+	{ .name = "hex-backwards", .build = build_hex_backwards,
+	  .pages_reject = 1, },
+	{ .name = "hex-long", .build = build_hex_long, },
+	{ .name = "srec-dense", .build = build_srec_dense, },
+	{ .name = "srec-fragmented", .build = build_srec_fragmented, },
+	{ .name = "srec-long", .build = build_srec_long, },
+	{ .name = "bin", .build = build_bin, },
+	{ .name = "bin-padded", .build = build_bin_padded, },
+	{ .name = "nordic-zip", .build = build_nordic_zip,
+	  .null_target_only = 1, },
+};
+
+const int bench_nformats = ARRAY_SIZE(bench_formats);
+
+void bench_free_image(struct bench_image *img)
+{
+	if (img->buf != (char *)img->data)
+		free(img->buf);
+	free(img->data);
+	memset(img, 0, sizeof(*img));
+}
@@ -0,0 +1,65 @@
+#ifndef __BENCH_IMAGES_H__
+#define __BENCH_IMAGES_H__
+
+/*
+ * Synthetic images for the benchmarks: random (but always the same)
+ * payloads encoded as intel hex, s-records, raw binary or nordic zip.
+ */
+
+#include <stdint.h>
+
+/* Contiguous block of data to be programmed */
+struct bench_block {
+	unsigned long addr;
+	unsigned long size;
+};
+
+#define MAX_BLOCKS 64
+
+struct bench_image {
+	char *buf;
+	unsigned long size;
+	/* Payload, what should end up in flash */
+	uint8_t *data;
+	struct bench_block blocks[MAX_BLOCKS];
+	int nblocks;
+	/* Creates a nordic zip (payload is the application image) */
+	int zip;
+	/* Null target write chunk size, 0 for default */
+	int chunk_size;
+	/* Intel hex, s-records: records of each block are swapped in pairs */
+	int swap_records;
+	/* Intel hex, s-records: data bytes per record, 0 for 16 */
+	int record_size;
+};
+
+/*
+ * Image builders: @size payload bytes starting at @base.
+ * Return 0 on success, 1 if the format can't encode such an image,
+ * negative on error.
+ */
+struct bench_format {
+	const char *name;
+	int (*build)(struct bench_image *, unsigned long base,
+		     unsigned long size);
+	/*
+	 * The target chooses where data go (nordic zip): only makes sense
+	 * on the null target
+	 */
+	int null_target_only;
+	/*
+	 * Records go back to pages already written: targets wanting whole
+	 * pages must reject the image (writing a page twice loses data)
+	 */
+	int pages_reject;
+};
+
+extern const struct bench_format bench_formats[];
+extern const int bench_nformats;
+
+extern void bench_free_image(struct bench_image *img);
+
+/* Same crc32 as zlib's */
+extern uint32_t bench_crc32(const uint8_t *buf, unsigned long len);
+
+#endif /* __BENCH_IMAGES_H__ */
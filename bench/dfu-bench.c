@@ -0,0 +1,650 @@
+/*
+ * libdfu, end to end flash throughput benchmark (linux only)
+ * Complete flashes of generated images (dense and sparse intel hex and
+ * s-records, raw binary, nordic zip) through the emulated stm32 and stk500
+ * targets (via the loopback interface) and through the null target.
+ * Prints a table and writes a json result file, see README.
+ * Author Davide Ciminaghi, 2016
+ * Public domain
+ */
+/* For RTLD_NEXT */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <dfu.h>
+#include <dfu-linux.h>
+#include <dfu-stm32.h>
+#include <dfu-stk500.h>
+#include <dfu-emu.h>
+#include <dfu-null.h>
+#include "bench-images.h"
+
+#define APPEND_SIZE 512
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+#define MAX_RUNS 64
+
+/*
+ * Syscalls issued by the library are counted by interposing the libc
+ * wrappers it uses: the definitions below take precedence over libc's for
+ * libdfu.so too. Syscalls libc issues internally (stdio) are not counted.
+ */
+static unsigned long nsyscalls;
+
+#define counted_syscall(ret, name, proto, args)				\
+	ret name proto							\
+	{								\
+		static ret (*f) proto;					\
+									\
+		if (!f)							\
+			f = dlsym(RTLD_NEXT, #name);			\
+		__atomic_add_fetch(&nsyscalls, 1, __ATOMIC_RELAXED);	\
+		return f args;						\
+	}
+
+counted_syscall(ssize_t, read, (int fd, void *b, size_t n), (fd, b, n))
+counted_syscall(ssize_t, write, (int fd, const void *b, size_t n), (fd, b, n))
+counted_syscall(off_t, lseek, (int fd, off_t o, int w), (fd, o, w))
+counted_syscall(int, close, (int fd), (fd))
+counted_syscall(int, unlink, (const char *p), (p))
+counted_syscall(int, poll, (struct pollfd *p, nfds_t n, int t), (p, n, t))
+counted_syscall(int, nanosleep,
+		(const struct timespec *r, struct timespec *rem), (r, rem))
+counted_syscall(int, epoll_wait,
+		(int e, struct epoll_event *ev, int m, int t), (e, ev, m, t))
+counted_syscall(int, epoll_ctl,
+		(int e, int op, int fd, struct epoll_event *ev), (e, op, fd, ev))
+counted_syscall(int, timerfd_settime,
+		(int fd, int fl, const struct itimerspec *n,
+		 struct itimerspec *o), (fd, fl, n, o))
+
+int open(const char *path, int flags, ...)
+{
+	static int (*f)(const char *, int, ...);
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	if (!f)
+		f = dlsym(RTLD_NEXT, "open");
+	__atomic_add_fetch(&nsyscalls, 1, __ATOMIC_RELAXED);
+	return f(path, flags, mode);
+}
+
+static unsigned long syscalls(void)
+{
+	return __atomic_load_n(&nsyscalls, __ATOMIC_RELAXED);
+}
+
+/*
+ * Targets
+ */
+
+struct bench_target {
+	const char *name;
+	/* NULL for the null target */
+	const struct dfu_emu_ops *emu_ops;
+	struct dfu_target_ops *tops;
+	const void *pars;
+	/* Address of the first flash byte and max image size */
+	unsigned long flash_base;
+	unsigned long flash_size;
+	unsigned long image_size;
+	/* Wants whole, aligned write chunks (flash pages) */
+	int whole_pages;
+};
+
+static const struct bench_target targets[] = {
+	{
+		.name = "stm32",
+		.emu_ops = &stm32_usart_emu_ops,
+		.tops = &stm32_dfu_target_ops,
+		.pars = &stm32f469bi_device_data,
+		.flash_base = 0x08000000,
+		.flash_size = 2 * 1024 * 1024,
+		.image_size = 256 * 1024,
+	},
+	{
+		.name = "stk500",
+		.emu_ops = &stk500_emu_ops,
+		.tops = &stk500_dfu_target_ops,
+		.pars = &atmega328p_device_data,
+		.flash_base = 0,
+		.flash_size = 32 * 1024,
+		/* Leave room for the bootloader */
+		.image_size = 28 * 1024,
+		.whole_pages = 1,
+	},
+	{
+		.name = "null",
+		.tops = &null_dfu_target_ops,
+		.flash_base = 0,
+		.image_size = 1024 * 1024,
+		.whole_pages = 1,
+	},
+};
+
+/*
+ * Runs
+ */
+
+struct bench_options {
+	struct dfu_emu_timings timings;
+	int pipelined;
+	int nruns;
+	/* Binary file buffers size, 0 for the library's static buffers */
+	unsigned long ring_size;
+	/* Decoders read the image in place (memory image) */
+	int memory_image;
+	/* Null target write latency (msecs) and queue depth */
+	unsigned long null_latency;
+	int null_queue_depth;
+	/*
+	 * Differential mode: emulated flash contains the image already, but
+	 * for a couple of bytes
+	 */
+	int differential;
+	/*
+	 * Resume journal: each measured run resumes a run interrupted at 90%
+	 * of the image
+	 */
+	int resume;
+	/* File digest, checked against the image's crc32 */
+	int digest;
+};
+
+struct bench_result {
+	/* Wall time and cpu time (user + system) in usecs */
+	unsigned long long wall;
+	unsigned long long cpu;
+	unsigned long syscalls;
+	struct dfu_stats stats;
+	unsigned long emu_errors;
+	int verified;
+};
+
+struct private_data {
+	const struct bench_image *img;
+	/* Appended buffers must fit in the binary file's input buffer */
+	int append_size;
+};
+
+static int binary_file_on_space_available(struct dfu_binary_file *f)
+{
+	struct private_data *priv = dfu_binary_file_get_priv(f);
+	int tot = dfu_binary_file_get_tot_appended(f), stat, sz;
+
+	sz = priv->img->size - tot;
+	if (sz > priv->append_size)
+		sz = priv->append_size;
+	stat = dfu_binary_file_append_partial(f, &priv->img->buf[tot], sz);
+	if (stat < 0)
+		return stat;
+	if (dfu_binary_file_get_tot_appended(f) == priv->img->size)
+		dfu_binary_file_append_buffer(f, NULL, 0);
+	return 0;
+}
+
+static struct dfu_binary_file_ops binary_file_ops = {
+	.on_space_available = binary_file_on_space_available,
+};
+
+static unsigned long long _now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long _cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (unsigned long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+		1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * Differential mode: put the image in the emulated flash, then change a
+ * byte in two places (if they're in the image)
+ */
+static void _preload(const struct bench_image *img,
+		     const struct bench_target *t, uint8_t *flash)
+{
+	unsigned long off = 0, a;
+	int i, k;
+
+	for (i = 0; i < img->nblocks; i++) {
+		const struct bench_block *b = &img->blocks[i];
+
+		memcpy(&flash[b->addr - t->flash_base], &img->data[off],
+		       b->size);
+		off += b->size;
+	}
+	for (k = 1; k < 8; k += 4) {
+		a = t->image_size * k / 8 + 77;
+		flash[a] = ~flash[a];
+	}
+}
+
+/* Check that every block of the image ended up in the emulated flash */
+static int _verify(const struct bench_image *img,
+		   const struct bench_target *t, const uint8_t *flash)
+{
+	unsigned long off = 0;
+	int i;
+
+	for (i = 0; i < img->nblocks; i++) {
+		const struct bench_block *b = &img->blocks[i];
+
+		if (memcmp(&flash[b->addr - t->flash_base], &img->data[off],
+			   b->size))
+			return 0;
+		off += b->size;
+	}
+	return 1;
+}
+
+static unsigned long _payload(const struct bench_image *img)
+{
+	unsigned long out = 0;
+	int i;
+
+	for (i = 0; i < img->nblocks; i++)
+		out += img->blocks[i].size;
+	return out;
+}
+
+/* Resume journal, in the current (temporary) directory */
+#define JOURNAL "journal"
+
+/* @interrupt: stop at 90% of the image, leaving a journal behind */
+static int bench_run(const struct bench_target *t,
+		     const struct bench_image *img,
+		     const struct bench_options *o, uint8_t *flash,
+		     struct bench_result *r, int interrupt)
+{
+	static struct dfu_emu emu;
+	struct private_data priv = { .img = img, .append_size = APPEND_SIZE, };
+	struct null_target_pars npars = {
+		.chunk_size = img->chunk_size,
+		.write_latency = o->null_latency,
+		.queue_depth = o->null_queue_depth,
+	};
+	struct dfu_data *dfu;
+	struct dfu_binary_file *f;
+	unsigned long long wall, cpu;
+	unsigned long sc, arena_size;
+	void *arena = NULL;
+	int ret, diff, resuming = 0;
+	uint32_t crc;
+
+	memset(r, 0, sizeof(*r));
+	if (t->emu_ops) {
+		/* Unknown contents, writes to sectors not erased fail */
+		if (!o->resume || interrupt)
+			memset(flash, 0, t->flash_size);
+		if (dfu_emu_init(&emu, t->emu_ops, t->pars, &o->timings,
+				 flash, t->flash_size) < 0)
+			return -1;
+	}
+	dfu = dfu_init(t->emu_ops ? &linux_loopback_interface_ops :
+		       &null_interface_ops,
+		       NULL,
+		       t->emu_ops ? &emu : NULL,
+		       NULL,
+		       NULL,
+		       t->tops,
+		       t->emu_ops ? t->pars : &npars,
+		       &linux_dfu_host_ops,
+		       img->zip || o->resume ? &posix_fc_ops : NULL,
+		       NULL);
+	if (!dfu)
+		return -1;
+	if (o->memory_image)
+		f = dfu_new_binary_file_from_memory(img->buf, img->size, dfu, 0,
+						    NULL, NULL);
+	else if (o->ring_size) {
+		if (priv.append_size > o->ring_size / 2)
+			priv.append_size = o->ring_size / 2;
+		arena_size = dfu_binary_file_arena_size(dfu, o->ring_size);
+		arena = arena_size ? malloc(arena_size) : NULL;
+		f = arena ? dfu_new_binary_file_arena(NULL, 0, img->size, dfu,
+						      0, &binary_file_ops,
+						      &priv, arena,
+						      arena_size) : NULL;
+	} else
+		f = dfu_new_binary_file(NULL, 0, img->size, dfu, 0,
+					&binary_file_ops, &priv);
+	if (!f) {
+		free(arena);
+		dfu_fini(dfu);
+		return -1;
+	}
+	if (o->pipelined && dfu_binary_file_set_pipelined(f, 1) < 0)
+		fprintf(stderr, "pipeline mode not available\n");
+	diff = o->differential && !dfu_binary_file_set_differential(f, 1);
+	if (o->differential && !diff)
+		fprintf(stderr, "differential mode not available\n");
+	if (diff && t->emu_ops)
+		_preload(img, t, flash);
+	if (o->resume) {
+		resuming = dfu_binary_file_set_journal(f, JOURNAL);
+		if (resuming < 0)
+			fprintf(stderr, "resume journal not available\n");
+	}
+	if (o->digest && dfu_binary_file_set_digest(f, 1) < 0)
+		fprintf(stderr, "file digest not available\n");
+	wall = _now();
+	cpu = _cpu();
+	sc = syscalls();
+	ret = -1;
+	if (dfu_target_reset(dfu) < 0 || dfu_target_probe(dfu) < 0 ||
+	    (!diff && resuming <= 0 && dfu_target_erase_all(dfu) < 0) ||
+	    dfu_binary_file_flush_start(f) < 0)
+		goto end;
+	do {
+		ret = dfu_idle(dfu);
+		if (interrupt) {
+			dfu_get_stats(dfu, &r->stats);
+			if (r->stats.bytes_written >= _payload(img) / 10 * 9)
+				break;
+		}
+	} while (ret == DFU_CONTINUE);
+	if (interrupt) {
+		/* Link dropped (unless the flash was quicker) */
+		dfu_binary_file_fini(f);
+		free(arena);
+		dfu_fini(dfu);
+		return ret == DFU_CONTINUE || ret == DFU_ALL_DONE ? 0 : -1;
+	}
+	ret = ret == DFU_ALL_DONE && dfu_target_go(dfu) >= 0 ? 0 : -1;
+end:
+	r->wall = _now() - wall;
+	r->cpu = _cpu() - cpu;
+	r->syscalls = syscalls() - sc;
+	dfu_get_stats(dfu, &r->stats);
+	r->emu_errors = t->emu_ops ? emu.errors : 0;
+	r->verified = t->emu_ops ? _verify(img, t, flash) : -1;
+	if (o->digest && !ret &&
+	    (dfu_binary_file_get_digest(f, &crc) < 0 ||
+	     crc != bench_crc32((uint8_t *)img->buf, img->size))) {
+		fprintf(stderr, "bad file digest\n");
+		ret = -1;
+	}
+	dfu_binary_file_fini(f);
+	free(arena);
+	dfu_fini(dfu);
+	if (r->emu_errors || !r->verified)
+		ret = -1;
+	return ret;
+}
+
+static int _cmp_wall(const void *a, const void *b)
+{
+	const struct bench_result *ra = a, *rb = b;
+
+	return ra->wall < rb->wall ? -1 : ra->wall > rb->wall;
+}
+
+static void print_header(void)
+{
+	printf("%-18s %8s %8s %7s %9s %9s %9s %9s %8s %s\n", "case", "bytes",
+	       "MB/s", "chunks", "us/chunk", "p99(us)", "cpu(ms)", "syscalls",
+	       "sc/chunk", "verify");
+}
+
+static void print_result(const char *name, const struct bench_image *img,
+			 const struct bench_result *r)
+{
+	unsigned long chunks = r->stats.chunk_latency.count;
+	unsigned long payload = r->stats.bytes_written;
+
+	printf("%-18s %8lu %8.3f %7lu %9.1f %9lu %9.3f %9lu %8.2f %s\n",
+	       name, payload,
+	       r->wall ? (double)payload / r->wall : 0.0, chunks,
+	       chunks ? (double)r->wall / chunks : 0.0,
+	       r->stats.chunk_latency.p99, r->cpu / 1000.0, r->syscalls,
+	       chunks ? (double)r->syscalls / chunks : 0.0,
+	       r->verified < 0 ? "-" : r->verified ? "ok" : "FAILED");
+}
+
+static void json_result(FILE *out, const char *target, const char *format,
+			const struct bench_image *img,
+			const struct bench_result *r, int ok, int first)
+{
+	const struct dfu_stats *s = &r->stats;
+	unsigned long chunks = s->chunk_latency.count;
+
+	fprintf(out, "%s\n\t\t{\n", first ? "" : ",");
+	fprintf(out, "\t\t\t\"target\": \"%s\",\n", target);
+	fprintf(out, "\t\t\t\"format\": \"%s\",\n", format);
+	fprintf(out, "\t\t\t\"ok\": %s,\n", ok ? "true" : "false");
+	fprintf(out, "\t\t\t\"file_bytes\": %lu,\n", img->size);
+	fprintf(out, "\t\t\t\"bytes_written\": %lu,\n", s->bytes_written);
+	fprintf(out, "\t\t\t\"wall_us\": %llu,\n", r->wall);
+	fprintf(out, "\t\t\t\"cpu_us\": %llu,\n", r->cpu);
+	fprintf(out, "\t\t\t\"mb_per_sec\": %.3f,\n",
+		r->wall ? (double)s->bytes_written / r->wall : 0.0);
+	fprintf(out, "\t\t\t\"chunks\": %lu,\n", chunks);
+	fprintf(out, "\t\t\t\"chunks_elided\": %lu,\n", s->chunks_elided);
+	fprintf(out, "\t\t\t\"chunks_unchanged\": %lu,\n",
+		s->chunks_unchanged);
+	fprintf(out, "\t\t\t\"chunks_resumed\": %lu,\n", s->chunks_resumed);
+	fprintf(out, "\t\t\t\"us_per_chunk\": %.1f,\n",
+		chunks ? (double)r->wall / chunks : 0.0);
+	fprintf(out, "\t\t\t\"chunk_latency_us\": { \"min\": %lu, "
+		"\"p50\": %lu, \"p99\": %lu, \"max\": %lu },\n",
+		s->chunk_latency.min, s->chunk_latency.p50,
+		s->chunk_latency.p99, s->chunk_latency.max);
+	fprintf(out, "\t\t\t\"syscalls\": %lu,\n", r->syscalls);
+	fprintf(out, "\t\t\t\"if_bytes_sent\": %llu,\n", s->if_bytes_sent);
+	fprintf(out, "\t\t\t\"if_bytes_received\": %llu,\n",
+		s->if_bytes_received);
+	fprintf(out, "\t\t\t\"erases\": %lu,\n", s->erases);
+	fprintf(out, "\t\t\t\"cmd_retries\": %lu,\n", s->cmd_retries);
+	fprintf(out, "\t\t\t\"cmd_timeouts\": %lu\n", s->cmd_timeouts);
+	fprintf(out, "\t\t}");
+}
+
+static void help(int argc, char *argv[])
+{
+	fprintf(stderr, "Use %s [-n runs] [-b baud] [-p page_program_us] "
+		"[-e sector_erase_us] [-P] [-R ring_size] [-M] [-D] [-J] [-C] "
+		"[-L null_latency_ms] "
+		"[-q null_queue_depth] [-o results_file] [-l log_file] "
+		"[-r revision] [case_filter]\n", argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_options o = { .nruns = 5, };
+	static struct bench_result runs[MAX_RUNS];
+	const char *results = "results.json", *log = NULL, *rev = "unknown";
+	const char *filter = NULL;
+	char name[64], tmpdir[] = "/tmp/dfu-bench-XXXXXX";
+	int i, j, k, opt, stat, failed = 0, first = 1;
+	uint8_t *flash;
+	FILE *out;
+
+	while ((opt = getopt(argc, argv, "n:b:p:e:PR:MDJCL:q:o:l:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			o.nruns = atoi(optarg);
+			break;
+		case 'b':
+			o.timings.baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			o.timings.page_program_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			o.timings.sector_erase_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			o.pipelined = 1;
+			break;
+		case 'R':
+			o.ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			o.memory_image = 1;
+			break;
+		case 'D':
+			o.differential = 1;
+			break;
+		case 'J':
+			o.resume = 1;
+			break;
+		case 'C':
+			o.digest = 1;
+			break;
+		case 'L':
+			o.null_latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			o.null_queue_depth = atoi(optarg);
+			break;
+		case 'o':
+			results = optarg;
+			break;
+		case 'l':
+			log = optarg;
+			break;
+		case 'r':
+			rev = optarg;
+			break;
+		default:
+			help(argc, argv);
+			exit(127);
+		}
+	}
+	if (o.nruns < 1 || o.nruns > MAX_RUNS) {
+		fprintf(stderr, "runs must be between 1 and %d\n", MAX_RUNS);
+		exit(127);
+	}
+	if (optind < argc)
+		filter = argv[optind];
+	out = fopen(results, "w");
+	if (!out) {
+		perror(results);
+		exit(127);
+	}
+	/* Library messages go to the log (or nowhere) */
+	if (!freopen(log ? log : "/dev/null", "w", stderr)) {
+		perror("freopen");
+		exit(127);
+	}
+	/* Nordic zip temporary files are created in the current directory */
+	if (!mkdtemp(tmpdir) || chdir(tmpdir) < 0) {
+		perror(tmpdir);
+		exit(127);
+	}
+	flash = malloc(2 * 1024 * 1024);
+	if (!flash) {
+		perror("malloc");
+		exit(127);
+	}
+	fprintf(out, "{\n\t\"revision\": \"%s\",\n\t\"runs\": %d,\n", rev,
+		o.nruns);
+	fprintf(out, "\t\"baud\": %lu,\n\t\"page_program_us\": %lu,\n"
+		"\t\"sector_erase_us\": %lu,\n\t\"pipelined\": %s,\n"
+		"\t\"ring_size\": %lu,\n\t\"memory_image\": %s,\n"
+		"\t\"differential\": %s,\n\t\"resume\": %s,\n"
+		"\t\"digest\": %s,\n"
+		"\t\"null_latency_ms\": %lu,\n"
+		"\t\"null_queue_depth\": %d,\n",
+		o.timings.baud, o.timings.page_program_us,
+		o.timings.sector_erase_us, o.pipelined ? "true" : "false",
+		o.ring_size, o.memory_image ? "true" : "false",
+		o.differential ? "true" : "false",
+		o.resume ? "true" : "false", o.digest ? "true" : "false",
+		o.null_latency,
+		o.null_queue_depth);
+	fprintf(out, "\t\"results\": [");
+	printf("revision %s, %d runs (median), baud %lu%s\n", rev, o.nruns,
+	       o.timings.baud, o.pipelined ? ", pipelined" : "");
+	print_header();
+	for (i = 0; i < ARRAY_SIZE(targets); i++)
+		for (j = 0; j < bench_nformats; j++) {
+			const struct bench_target *t = &targets[i];
+			const struct bench_format *fmt = &bench_formats[j];
+			struct bench_image img;
+			int ok = 1;
+
+			snprintf(name, sizeof(name), "%s/%s", t->name,
+				 fmt->name);
+			if (filter && !strstr(name, filter))
+				continue;
+			if (fmt->null_target_only && t->emu_ops)
+				continue;
+			memset(&img, 0, sizeof(img));
+			stat = fmt->build(&img, t->flash_base, t->image_size);
+			if (stat > 0)
+				/* Format doesn't make sense for target */
+				continue;
+			if (stat < 0)
+				exit(127);
+			if (fmt->pages_reject && t->whole_pages) {
+				/* The flash must fail, once is enough */
+				ok = bench_run(t, &img, &o, flash, &runs[0],
+					       0) < 0;
+				unlink(JOURNAL);
+				if (ok)
+					printf("%-18s rejected\n", name);
+				else {
+					printf("%-18s FAILED\n", name);
+					failed++;
+				}
+				json_result(out, t->name, fmt->name, &img,
+					    &runs[0], ok, first);
+				first = 0;
+				bench_free_image(&img);
+				continue;
+			}
+			for (k = 0; k < o.nruns; k++) {
+				if (o.resume) {
+					unlink(JOURNAL);
+					if (bench_run(t, &img, &o, flash,
+						      &runs[k], 1) < 0)
+						ok = 0;
+				}
+				if (bench_run(t, &img, &o, flash,
+					      &runs[k], 0) < 0)
+					ok = 0;
+			}
+			qsort(runs, o.nruns, sizeof(runs[0]), _cmp_wall);
+			if (!ok) {
+				printf("%-18s FAILED\n", name);
+				failed++;
+			} else
+				print_result(name, &img, &runs[o.nruns / 2]);
+			json_result(out, t->name, fmt->name, &img,
+				    &runs[o.nruns / 2], ok, first);
+			first = 0;
+			bench_free_image(&img);
+		}
+	fprintf(out, "\n\t]\n}\n");
+	fclose(out);
+	if (chdir("/") < 0 || rmdir(tmpdir) < 0)
+		perror(tmpdir);
+	exit(failed ? 1 : 0);
+}
@@ -0,0 +1,541 @@
+/*
+ * libdfu, microbenchmarks (linux only)
+ * Ring buffer helpers from dfu-internal.h and format decoders in
+ * isolation: synthetic images are appended from memory, buffer_size bytes
+ * at a time, to a file written by the null target. Buffers are either
+ * copied (dfu_binary_file_append_buffer()) or lent
+ * (dfu_binary_file_append_segment()). There's no interface
+ * traffic and no host idle (the host has no idle op), so times are
+ * decoding plus write chunks handling only (nordic zip decoding still
+ * writes its temporary files).
+ * Reports ns/byte and cycles/byte of input for every format and buffer
+ * size, cycles are cpu cycles if perf events are available, time stamp
+ * counter ticks otherwise.
+ * Author Davide Ciminaghi, 2016
+ * Public domain
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined __x86_64__ || defined __i386__
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+#include <dfu.h>
+#include <dfu-internal.h>
+#include <dfu-null.h>
+#include "bench-images.h"
+
+#define MAX_RUNS 64
+
+/* Default image size and ring helpers iterations */
+#define IMAGE_SIZE (256 * 1024)
+#define RING_ITERATIONS (1 << 24)
+
+static const int buffer_sizes[] = { 16, 64, 256, 1024, 65536, };
+
+/* Copied buffers must fit the library's input buffer (2048 bytes) */
+#define MAX_COPIED_BUFFER_SIZE 1024
+
+static const char *append_modes[] = { "copy", "lend", };
+
+/*
+ * Clocks
+ */
+
+static int cycles_fd = -1;
+static const char *cycles_source = "none";
+
+static void cycles_init(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* This thread only, on any cpu */
+	cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (cycles_fd >= 0) {
+		cycles_source = "cpu cycles";
+		return;
+	}
+#ifdef HAVE_TSC
+	cycles_source = "tsc";
+#endif
+}
+
+static int have_cycles(void)
+{
+	return strcmp(cycles_source, "none");
+}
+
+static unsigned long long _cycles(void)
+{
+	unsigned long long v;
+
+	if (cycles_fd >= 0 && read(cycles_fd, &v, sizeof(v)) == sizeof(v))
+		return v;
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static unsigned long long _now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Measured time of a run or loop */
+struct mb_time {
+	unsigned long long ns;
+	unsigned long long cycles;
+};
+
+static void mb_start(struct mb_time *t)
+{
+	t->cycles = _cycles();
+	t->ns = _now_ns();
+}
+
+static void mb_stop(struct mb_time *t)
+{
+	t->ns = _now_ns() - t->ns;
+	t->cycles = _cycles() - t->cycles;
+}
+
+/*
+ * Host: just a clock, no idle op so that dfu_idle() never waits
+ */
+
+static unsigned long mb_get_current_time(struct dfu_host *host)
+{
+	return _now_ns() / 1000000;
+}
+
+static unsigned long mb_get_current_time_us(struct dfu_host *host)
+{
+	return _now_ns() / 1000;
+}
+
+static const struct dfu_host_ops mb_host_ops = {
+	.get_current_time = mb_get_current_time,
+	.get_current_time_us = mb_get_current_time_us,
+};
+
+/*
+ * Ring helpers
+ */
+
+struct mb_ring_result {
+	const char *name;
+	struct mb_time t;
+};
+
+/* Not a constant, as in the library */
+static volatile int ring_size = 2048;
+static volatile int sink;
+
+#define ring_helper_loop(helper, iterations, t)				\
+	do {								\
+		int _size = ring_size, _acc = 0, _i;			\
+									\
+		mb_start(t);						\
+		for (_i = 0; _i < (iterations); _i++)			\
+			_acc += helper(_i * 7 & (_size - 1),		\
+				       _i * 13 & (_size - 1), _size);	\
+		mb_stop(t);						\
+		sink = _acc;						\
+	} while (0)
+
+/*
+ * A write chunk's life: taken by the decoder, published, taken by the
+ * target and freed.
+ */
+static void write_chunk_loop(int iterations, struct mb_time *t)
+{
+	static struct dfu_binary_file bf;
+	static struct dfu_write_chunk wcs[CONFIG_MAX_CHUNKS];
+	struct dfu_write_chunk *wc;
+	unsigned int i;
+
+	memset(&bf, 0, sizeof(bf));
+	memset(wcs, 0, sizeof(wcs));
+	bf.write_chunks = wcs;
+	bf.max_chunks = ARRAY_SIZE(wcs);
+	bf.decoded_size = ring_size;
+	mb_start(t);
+	for (i = 0; i < iterations; i++) {
+		wc = bf_get_write_chunk(&bf);
+		if (!wc)
+			break;
+		wc->addr = i * 256;
+		wc->start = (i * 256) & (bf.decoded_size - 1);
+		wc->len = 256;
+		dfu_store_release(&bf.write_chunks_ready,
+				  bf.write_chunks_head);
+		wc = bf_next_write_chunk(&bf, 0);
+		if (!wc)
+			break;
+		bf_put_write_chunk(&bf);
+	}
+	mb_stop(t);
+	if (i < iterations)
+		fprintf(stderr, "write chunk loop stopped at %u\n", i);
+}
+
+static void mb_ring_helpers(int iterations, struct mb_ring_result *r)
+{
+	r[0].name = "_count";
+	ring_helper_loop(_count, iterations, &r[0].t);
+	r[1].name = "_space";
+	ring_helper_loop(_space, iterations, &r[1].t);
+	r[2].name = "_count_to_end";
+	ring_helper_loop(_count_to_end, iterations, &r[2].t);
+	r[3].name = "_space_to_end";
+	ring_helper_loop(_space_to_end, iterations, &r[3].t);
+	r[4].name = "write chunk get/put";
+	write_chunk_loop(iterations, &r[4].t);
+}
+
+#define NRING_RESULTS 5
+
+/*
+ * Decoders
+ */
+
+struct mb_options {
+	unsigned long image_size;
+	int nruns;
+};
+
+struct mb_result {
+	/* Fastest run */
+	struct mb_time t;
+	unsigned long bytes_decoded;
+	int verified;
+};
+
+/* Where the null target puts image data (nordic zip: data file only) */
+static unsigned long _mem_base(const struct bench_image *img)
+{
+	return img->zip ? NZ_FWFILE_DATA_FLAG : 0;
+}
+
+static int _verify(const struct bench_image *img, const uint8_t *mem)
+{
+	unsigned long off = 0;
+	int i;
+
+	for (i = 0; i < img->nblocks; i++) {
+		const struct bench_block *b = &img->blocks[i];
+
+		if (memcmp(&mem[b->addr], &img->data[off], b->size))
+			return 0;
+		off += b->size;
+	}
+	return 1;
+}
+
+/*
+ * Decodes the whole of @img, appending (or lending if @lend) @bufsize bytes
+ * at a time. If @mem is not NULL, decoded data are copied there.
+ */
+static int mb_run(const struct bench_image *img, int bufsize, int lend,
+		  uint8_t *mem, unsigned long mem_size, struct mb_time *t,
+		  struct dfu_stats *stats)
+{
+	struct null_target_pars pars = {
+		.chunk_size = img->chunk_size,
+		.mem = mem,
+		.mem_base = _mem_base(img),
+		.mem_size = mem_size,
+	};
+	struct dfu_data *dfu;
+	struct dfu_binary_file *f;
+	unsigned long off, sz;
+	int stat, ret = -1;
+
+	dfu = dfu_init(&null_interface_ops, NULL, NULL, NULL, NULL,
+		       &null_dfu_target_ops, &pars, &mb_host_ops,
+		       img->zip ? &posix_fc_ops : NULL, NULL);
+	if (!dfu)
+		return -1;
+	f = dfu_new_binary_file(NULL, 0, img->size, dfu, 0, NULL, NULL);
+	if (!f) {
+		dfu_fini(dfu);
+		return -1;
+	}
+	if (dfu_binary_file_flush_start(f) < 0)
+		goto end;
+	mb_start(t);
+	for (off = 0; off < img->size; off += stat) {
+		sz = min(bufsize, img->size - off);
+		/* The image outlives the file, nothing to do on release */
+		stat = lend ?
+			dfu_binary_file_append_segment(f, &img->buf[off], sz,
+						       NULL, NULL) :
+			dfu_binary_file_append_buffer(f, &img->buf[off], sz);
+		if (stat < 0)
+			goto end;
+		/* No room, let chunks be written and the decoder go on */
+		if (!stat && dfu_idle(dfu) == DFU_ERROR)
+			goto end;
+	}
+	if (dfu_binary_file_append_buffer(f, NULL, 0) < 0)
+		goto end;
+	do {
+		stat = dfu_idle(dfu);
+	} while (stat == DFU_CONTINUE);
+	mb_stop(t);
+	ret = stat == DFU_ALL_DONE ? 0 : -1;
+end:
+	dfu_get_stats(dfu, stats);
+	dfu_binary_file_fini(f);
+	dfu_fini(dfu);
+	return ret;
+}
+
+/* First run checks decoded data, the fastest of the following ones counts */
+static int mb_decoder(const struct bench_image *img, int bufsize, int lend,
+		      const struct mb_options *o, uint8_t *mem,
+		      struct mb_result *r)
+{
+	struct dfu_stats stats;
+	struct mb_time t;
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	memset(mem, 0, o->image_size);
+	if (mb_run(img, bufsize, lend, mem, o->image_size, &t, &stats) < 0)
+		return -1;
+	r->verified = _verify(img, mem);
+	r->bytes_decoded = stats.bytes_decoded;
+	for (i = 0; i < o->nruns; i++) {
+		if (mb_run(img, bufsize, lend, NULL, 0, &t, &stats) < 0)
+			return -1;
+		if (!i || t.ns < r->t.ns)
+			r->t = t;
+	}
+	return r->verified ? 0 : -1;
+}
+
+/*
+ * Output
+ */
+
+static double _per(unsigned long long v, unsigned long n)
+{
+	return n ? (double)v / n : 0.0;
+}
+
+static void print_ring_results(const struct mb_ring_result *r, int n,
+			       int iterations)
+{
+	int i;
+
+	printf("%-22s %9s %9s\n", "ring helper", "ns/op", "cycles/op");
+	for (i = 0; i < n; i++) {
+		printf("%-22s %9.2f ", r[i].name,
+		       _per(r[i].t.ns, iterations));
+		if (have_cycles())
+			printf("%9.2f\n", _per(r[i].t.cycles, iterations));
+		else
+			printf("%9s\n", "-");
+	}
+}
+
+static void print_decoder_header(void)
+{
+	printf("%-16s %6s %7s %9s %9s %9s %9s %s\n", "format", "append",
+	       "bufsize", "in bytes", "ns/byte", "cyc/byte", "MB/s", "verify");
+}
+
+static void print_decoder_result(const char *name, const char *mode,
+				 int bufsize, const struct bench_image *img,
+				 const struct mb_result *r)
+{
+	printf("%-16s %6s %7d %9lu %9.3f ", name, mode, bufsize, img->size,
+	       _per(r->t.ns, img->size));
+	if (have_cycles())
+		printf("%9.3f ", _per(r->t.cycles, img->size));
+	else
+		printf("%9s ", "-");
+	printf("%9.2f %s\n", _per(img->size * 1000ULL, r->t.ns),
+	       r->verified ? "ok" : "FAILED");
+}
+
+static void json_ring_results(FILE *out, const struct mb_ring_result *r,
+			      int n, int iterations)
+{
+	int i;
+
+	fprintf(out, "\t\"ring_helpers\": [");
+	for (i = 0; i < n; i++) {
+		fprintf(out, "%s\n\t\t{ \"name\": \"%s\", ",
+			i ? "," : "", r[i].name);
+		fprintf(out, "\"ns_per_op\": %.3f, ",
+			_per(r[i].t.ns, iterations));
+		fprintf(out, "\"cycles_per_op\": %.3f }",
+			_per(r[i].t.cycles, iterations));
+	}
+	fprintf(out, "\n\t],\n");
+}
+
+static void json_decoder_result(FILE *out, const char *format,
+				const char *mode, int bufsize,
+				const struct bench_image *img,
+				const struct mb_result *r, int ok, int first)
+{
+	fprintf(out, "%s\n\t\t{\n", first ? "" : ",");
+	fprintf(out, "\t\t\t\"format\": \"%s\",\n", format);
+	fprintf(out, "\t\t\t\"append\": \"%s\",\n", mode);
+	fprintf(out, "\t\t\t\"buffer_size\": %d,\n", bufsize);
+	fprintf(out, "\t\t\t\"ok\": %s,\n", ok ? "true" : "false");
+	fprintf(out, "\t\t\t\"file_bytes\": %lu,\n", img->size);
+	fprintf(out, "\t\t\t\"bytes_decoded\": %lu,\n", r->bytes_decoded);
+	fprintf(out, "\t\t\t\"ns\": %llu,\n", r->t.ns);
+	fprintf(out, "\t\t\t\"cycles\": %llu,\n", r->t.cycles);
+	fprintf(out, "\t\t\t\"ns_per_byte\": %.4f,\n",
+		_per(r->t.ns, img->size));
+	fprintf(out, "\t\t\t\"cycles_per_byte\": %.4f\n",
+		_per(r->t.cycles, img->size));
+	fprintf(out, "\t\t}");
+}
+
+static void help(int argc, char *argv[])
+{
+	fprintf(stderr, "Use %s [-n runs] [-s image_size] [-o results_file] "
+		"[-l log_file] [-r revision] [format_filter]\n", argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mb_options o = { .image_size = IMAGE_SIZE, .nruns = 5, };
+	struct mb_ring_result ring[NRING_RESULTS];
+	const char *results = "micro-results.json", *log = NULL;
+	const char *rev = "unknown", *filter = NULL;
+	char tmpdir[] = "/tmp/dfu-microbench-XXXXXX";
+	int i, j, k, opt, stat, failed = 0, first = 1;
+	uint8_t *mem;
+	FILE *out;
+
+	while ((opt = getopt(argc, argv, "n:s:o:l:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			o.nruns = atoi(optarg);
+			break;
+		case 's':
+			o.image_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			results = optarg;
+			break;
+		case 'l':
+			log = optarg;
+			break;
+		case 'r':
+			rev = optarg;
+			break;
+		default:
+			help(argc, argv);
+			exit(127);
+		}
+	}
+	if (o.nruns < 1 || o.nruns > MAX_RUNS) {
+		fprintf(stderr, "runs must be between 1 and %d\n", MAX_RUNS);
+		exit(127);
+	}
+	/* Sparse hex images are made of MAX_BLOCKS blocks */
+	if (o.image_size < 1024 || o.image_size % (MAX_BLOCKS * 4)) {
+		fprintf(stderr, "invalid image size\n");
+		exit(127);
+	}
+	if (optind < argc)
+		filter = argv[optind];
+	out = fopen(results, "w");
+	if (!out) {
+		perror(results);
+		exit(127);
+	}
+	/* Library messages go to the log (or nowhere) */
+	if (!freopen(log ? log : "/dev/null", "w", stderr)) {
+		perror("freopen");
+		exit(127);
+	}
+	/* Nordic zip temporary files are created in the current directory */
+	if (!mkdtemp(tmpdir) || chdir(tmpdir) < 0) {
+		perror(tmpdir);
+		exit(127);
+	}
+	mem = malloc(o.image_size);
+	if (!mem) {
+		perror("malloc");
+		exit(127);
+	}
+	cycles_init();
+	printf("revision %s, best of %d runs, cycles: %s\n\n", rev, o.nruns,
+	       cycles_source);
+	fprintf(out, "{\n\t\"revision\": \"%s\",\n\t\"runs\": %d,\n", rev,
+		o.nruns);
+	fprintf(out, "\t\"cycles\": \"%s\",\n", cycles_source);
+	mb_ring_helpers(RING_ITERATIONS, ring);
+	print_ring_results(ring, NRING_RESULTS, RING_ITERATIONS);
+	json_ring_results(out, ring, NRING_RESULTS, RING_ITERATIONS);
+	printf("\n");
+	print_decoder_header();
+	fprintf(out, "\t\"decoders\": [");
+	for (i = 0; i < bench_nformats; i++) {
+		const struct bench_format *fmt = &bench_formats[i];
+		struct bench_image img;
+
+		if (filter && !strstr(fmt->name, filter))
+			continue;
+		if (fmt->pages_reject)
+			/* The null target wants whole pages */
+			continue;
+		memset(&img, 0, sizeof(img));
+		stat = fmt->build(&img, 0, o.image_size);
+		if (stat > 0)
+			continue;
+		if (stat < 0)
+			exit(127);
+		for (j = 0; j < ARRAY_SIZE(buffer_sizes); j++)
+			for (k = 0; k < ARRAY_SIZE(append_modes); k++) {
+				const char *mode = append_modes[k];
+				int bs = buffer_sizes[j], ok;
+				struct mb_result r;
+
+				if (!k && bs > MAX_COPIED_BUFFER_SIZE)
+					continue;
+				ok = mb_decoder(&img, bs, k, &o, mem, &r) >= 0;
+				if (!ok) {
+					printf("%-16s %6s %7d FAILED\n",
+					       fmt->name, mode, bs);
+					failed++;
+				} else
+					print_decoder_result(fmt->name, mode,
+							     bs, &img, &r);
+				json_decoder_result(out, fmt->name, mode, bs,
+						    &img, &r, ok, first);
+				first = 0;
+			}
+		bench_free_image(&img);
+	}
+	fprintf(out, "\n\t]\n}\n");
+	fclose(out);
+	if (chdir("/") < 0 || rmdir(tmpdir) < 0)
+		perror(tmpdir);
+	exit(failed ? 1 : 0);
+}
@@ -13,6 +13,7 @@ OBJCOPY = $(CROSS_COMPILE)objcopy
 STRIP = $(CROSS_COMPILE)strip
 INSTALL ?= /usr/bin/install
 DEBUG ?= n
+PROFILING ?= n
 ESPTOOL ?= /home/develop/yun/esp8266/esp-open-sdk/esptool/esptool.py
 
 # Internal libraries
@@ -41,6 +42,10 @@ ifeq ($(DEBUG),y)
 CFLAGS += -g -DDEBUG
 endif
 
+ifeq ($(PROFILING),y)
+CFLAGS += -DCONFIG_DFU_PROFILING
+endif
+
 ifeq ($(HAVE_PRINT_TRACE),y)
 CFLAGS += -DHAVE_PRINT_TRACE=y
 endif
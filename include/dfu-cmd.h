@@ -55,6 +55,10 @@ struct dfu_cmdstate {
 	/* Number of bytes received up to now */
 	int received;
 	struct dfu_timeout timeout;
+	/* Start time of command (usecs) */
+	unsigned long cmd_start;
+	/* Profiling: start time of current buffer */
+	dfu_profile_declare(buf_start);
 };
 
 struct dfu_cmddescr {
@@ -75,6 +79,25 @@ struct dfu_cmddescr {
 	void *priv;
 };
 
+#define DFU_CMD_MAX_CMDBUFS 12
+
+/*
+ * Storage for the command being run by a target instance.
+ * Targets describe their commands on the stack and copy them here via
+ * dfu_cmd_setup(), so that commands survive the function which started
+ * them and different target instances don't share any command data.
+ */
+struct dfu_cmd_storage {
+	struct dfu_cmddescr descr;
+	struct dfu_cmdbuf cmdbufs[DFU_CMD_MAX_CMDBUFS];
+};
+
+/*
+ * Copy @descr and its command buffers to @s, returns pointer to the copied
+ * descriptor (or NULL in case @descr has too many buffers)
+ */
+extern const struct dfu_cmddescr *
+dfu_cmd_setup(struct dfu_cmd_storage *s, const struct dfu_cmddescr *descr);
 
 extern int dfu_cmd_start(struct dfu_target *, const struct dfu_cmddescr *descr);
 extern int dfu_cmd_on_interface_event(struct dfu_target *target,
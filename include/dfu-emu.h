@@ -0,0 +1,150 @@
+/*
+ * libdfu, software target emulators (linux only)
+ * LGPL v2.1
+ *
+ * An emulator speaks a target's programming protocol over a byte stream:
+ * bytes sent by the host are fed with dfu_emu_write() and replies are
+ * collected with dfu_emu_read(). Both directions are paced according to
+ * the emulated baud rate, and flash programming/erase keep the emulated
+ * target busy for a configurable time, so that the real target code can
+ * be timed end to end without any hardware.
+ * An emulator can be driven by the loopback interface (in process, see
+ * linux_loopback_interface_ops) or by a program serving a pseudo terminal
+ * (see samples/linux-emu-pty.c).
+ */
+#ifndef __DFU_EMU_H__
+#define __DFU_EMU_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct dfu_emu;
+
+struct dfu_emu_ops {
+	/* Check parameters, returns 0 if ok */
+	int (*init)(struct dfu_emu *);
+	/* Target reset: go back to initial state */
+	void (*reset)(struct dfu_emu *);
+	/* One byte received from the host */
+	void (*input)(struct dfu_emu *, uint8_t c);
+};
+
+struct dfu_emu_timings {
+	/* Line speed (bits/sec, 10 bits per byte), 0 means no pacing */
+	unsigned long baud;
+	/* Time needed to program a flash page (usecs) */
+	unsigned long page_program_us;
+	/* Time needed to erase a flash sector (usecs) */
+	unsigned long sector_erase_us;
+};
+
+/* Must be a power of 2 */
+#define DFU_EMU_OUTBUF_SIZE 1024
+
+#define DFU_EMU_BUFSIZE 512
+
+struct dfu_emu {
+	const struct dfu_emu_ops *ops;
+	/* Device data, the same the corresponding target driver gets */
+	const void *pars;
+	struct dfu_emu_timings timings;
+	/* Emulated flash contents */
+	uint8_t *flash;
+	unsigned long flash_size;
+	/* Time (usecs) at which the target will be done with current job */
+	uint64_t clock;
+	/* Time at which the last byte received/sent leaves the line */
+	uint64_t in_line;
+	uint64_t out_line;
+	/* Bytes sent to the host and time they become available */
+	uint8_t out[DFU_EMU_OUTBUF_SIZE];
+	uint64_t out_time[DFU_EMU_OUTBUF_SIZE];
+	unsigned int out_head;
+	unsigned int out_tail;
+	/* Protocol parser state */
+	int state;
+	uint8_t cmd;
+	uint8_t csum;
+	uint32_t addr;
+	unsigned int cnt;
+	unsigned int len;
+	uint8_t buf[DFU_EMU_BUFSIZE];
+	/* Counters */
+	unsigned long pages_programmed;
+	unsigned long sectors_erased;
+	unsigned long errors;
+};
+
+extern const struct dfu_emu_ops stm32_usart_emu_ops;
+extern const struct dfu_emu_ops stk500_emu_ops;
+
+/*
+ * Setup emulator @e, @pars is the target's device data (for instance
+ * &stm32f469bi_device_data or &atmega328p_device_data), @flash and
+ * @flash_size are the emulated flash memory.
+ */
+extern int dfu_emu_init(struct dfu_emu *e, const struct dfu_emu_ops *ops,
+			const void *pars, const struct dfu_emu_timings *t,
+			void *flash, unsigned long flash_size);
+
+/* Reset emulated target, pending output is discarded */
+extern void dfu_emu_reset(struct dfu_emu *e);
+
+/* Host to target, returns number of bytes written */
+extern int dfu_emu_write(struct dfu_emu *e, const void *buf,
+			 unsigned long len);
+
+/* Target to host, only returns bytes which have already gone through */
+extern int dfu_emu_read(struct dfu_emu *e, void *buf, unsigned long len);
+
+/*
+ * Returns number of usecs before next output byte becomes available
+ * (0 if it already is) or -1 if there's no output pending
+ */
+extern long dfu_emu_next_output(struct dfu_emu *e);
+
+/* For emulators only */
+
+/* Send @len bytes to the host */
+extern void dfu_emu_send(struct dfu_emu *e, const void *buf,
+			 unsigned long len);
+
+static inline void dfu_emu_send_byte(struct dfu_emu *e, uint8_t c)
+{
+	dfu_emu_send(e, &c, 1);
+}
+
+/* Keep the emulated target busy for @us usecs */
+static inline void dfu_emu_busy(struct dfu_emu *e, unsigned long us)
+{
+	e->clock += us;
+}
+
+/* Switch to @state and collect @len bytes before invoking input() again */
+static inline void dfu_emu_expect(struct dfu_emu *e, int state,
+				  unsigned int len)
+{
+	e->state = state;
+	e->cnt = 0;
+	e->len = len;
+}
+
+/*
+ * Store byte @c into parser buffer, returns 1 when the bytes expected by
+ * the current state have all been collected
+ */
+static inline int dfu_emu_collect(struct dfu_emu *e, uint8_t c)
+{
+	if (e->cnt < sizeof(e->buf))
+		e->buf[e->cnt] = c;
+	return ++e->cnt >= e->len;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DFU_EMU_H__ */
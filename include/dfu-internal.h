@@ -11,6 +11,10 @@
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #endif /* min */
 
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif /* max */
+
 #ifndef BIT
 #define BIT(a) (1 << (a))
 #endif
@@ -89,7 +93,10 @@ struct dfu_target_ops {
 	int (*get_write_chunk_size)(struct dfu_target *);
 	/* Optional: returns true if chunk address alignment can be ignored */
 	int (*ignore_chunk_alignment)(struct dfu_target *);
-	/* Read memory area */
+	/*
+	 * Read memory area (synchronous, any address and size), returns 0
+	 * on success, negative on error
+	 */
 	int (*read_memory)(struct dfu_target *, void *buf, phys_addr_t addr,
 			   unsigned long sz);
 	/* Finalization method */
@@ -97,16 +104,115 @@ struct dfu_target_ops {
 	/*
 	 * Returns !0 if an erase operation must be performed to write @l
 	 * bytes starting from @addr. If an erase must be performed, the
-	 * operation is immediately started.
+	 * operation is immediately started. Sector contents preceding
+	 * @preserve must survive the erase: chunks there were not written
+	 * (unchanged or resumed, see dfu_binary_file_set_differential() and
+	 * dfu_binary_file_set_journal()). @preserve is 0 normally.
 	 */
 	int (*must_erase)(struct dfu_target *, phys_addr_t addr,
-			  unsigned long l);
+			  unsigned long l, phys_addr_t preserve);
+	/*
+	 * Optional: max number of chunks which can be passed on to
+	 * chunk_available() before the first of them is done (1 if
+	 * missing). Chunks must be declared done in order, via
+	 * dfu_binary_file_chunk_done(). Setting the target busy still
+	 * stops new chunks from coming.
+	 */
+	int (*get_queue_depth)(struct dfu_target *);
+	/*
+	 * Optional: value of erased flash bytes (0xff if missing). Targets
+	 * implementing this get no chunks made of erased bytes only: flash
+	 * must be erased before writing (erase_all() or must_erase())
+	 */
+	int (*get_erased_value)(struct dfu_target *);
+	/*
+	 * Optional for targets implementing must_erase(): max number of
+	 * bytes of a sector which can survive its erase (see @preserve
+	 * there). Differential mode and resume journals are refused if this
+	 * is missing or returns 0.
+	 */
+	unsigned long (*get_preserve_size)(struct dfu_target *);
 };
 
+/*
+ * Default number of write chunks (power of 2), binary files created with
+ * dfu_new_binary_file_arena() size their own
+ */
 #ifndef CONFIG_MAX_CHUNKS
 #define CONFIG_MAX_CHUNKS 32
 #endif
 
+/* Max number of write chunks being written by a target (power of 2) */
+#ifndef CONFIG_MAX_WRITE_QUEUE_DEPTH
+#define CONFIG_MAX_WRITE_QUEUE_DEPTH 8
+#endif
+
+/* Max number of lent segments queued by a binary file (power of 2) */
+#ifndef CONFIG_MAX_SEGMENTS
+#define CONFIG_MAX_SEGMENTS 8
+#endif
+
+/*
+ * Max number of separate address ranges of pages already written the page
+ * assembler keeps track of (see struct bf_pages)
+ */
+#ifndef CONFIG_BF_PAGES_RANGES
+#define CONFIG_BF_PAGES_RANGES 16
+#endif
+
+/*
+ * Max number of dfu instances (sessions) which can be active at the same
+ * time. Each instance has its own interface, target, host, binary file and
+ * timeouts list.
+ */
+#ifndef CONFIG_DFU_MAX_INSTANCES
+#define CONFIG_DFU_MAX_INSTANCES 1
+#endif
+
+/* Max number of pending timeouts for each dfu instance */
+#ifndef CONFIG_DFU_MAX_TIMEOUTS
+#define CONFIG_DFU_MAX_TIMEOUTS 8
+#endif
+
+/*
+ * Max time (msecs) the host is allowed to sleep when the interface or the
+ * binary file have a poll_idle() method (they can't wake the host up)
+ */
+#ifndef CONFIG_DFU_POLL_PERIOD
+#define CONFIG_DFU_POLL_PERIOD 10
+#endif
+
+/*
+ * Ring indexes shared between threads (pipeline mode, see binary-file.c):
+ * the owner stores them with release semantics after filling/consuming
+ * data, the other side loads them with acquire semantics before touching
+ * data.
+ */
+#define dfu_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define dfu_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+/* Reference counts, shared between threads too */
+#define dfu_atomic_inc(p) __atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define dfu_atomic_dec(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+
+/*
+ * A buffer lent to a binary file, see dfu_binary_file_append_segment().
+ * Data are written as they are (zero copy write chunks) when possible,
+ * otherwise they're copied to the input buffer.
+ */
+struct dfu_segment {
+	const char *buf;
+	int len;
+	/* Bytes already fed to the decoder (written as they are or copied) */
+	int done;
+	/*
+	 * One reference while being fed, plus one for each zero copy write
+	 * chunk: release() is invoked when this drops to 0
+	 */
+	int refs;
+	void (*release)(const void *buf, void *priv);
+	void *priv;
+};
+
 /*
  * A chunk which can be written to flash (i.e. typically one or more flash
  * pages)
@@ -117,14 +223,24 @@ struct dfu_write_chunk {
 	int len;
 	/* !0 when a chunk is being filled */
 	int pending;
-	/* !0 when a chunk is being written */
-	int write_pending;
+	/*
+	 * Zero copy chunk: data are here (in @seg), not in the decoded
+	 * buffer
+	 */
+	const char *data;
+	struct dfu_segment *seg;
 };
 
 struct dfu_timeout {
+	/* Timeout in millisecs, from the moment the timeout is set */
 	int timeout;
 	void (*cb)(struct dfu_data *, const void *);
 	const void *priv;
+	/* Instance this timeout has been set for, NULL if not pending */
+	struct dfu_data *dfu;
+	/* Private to dfu.c: expiry time and position in timeouts heap */
+	unsigned long expires;
+	int heap_index;
 };
 
 struct dfu_binary_file {
@@ -145,6 +261,34 @@ struct dfu_binary_file {
 	int rx_done;
 	int flushing;
 	int tot_appended;
+	/* Published by the decoder, see dfu_get_stats() */
+	int tot_decoded;
+	/*
+	 * head and tail are private to the decoder. The producer appends
+	 * data at appended_head, the decoder gives consumed space back by
+	 * updating released_tail.
+	 */
+	int appended_head;
+	int released_tail;
+	/* All of the file has been decoded and enqueued for writing */
+	int decode_done;
+	/*
+	 * Pipeline mode: decoding runs in the host's worker thread,
+	 * dfu_idle() only writes chunks to the target(s).
+	 */
+	int pipelined;
+	/*
+	 * Memory image: the input buffer is the whole file (read only, see
+	 * dfu_new_binary_file_from_memory()), nothing is appended
+	 */
+	int image;
+	/*
+	 * The producer wants ops->on_space_available() as soon as
+	 * space_watermark bytes can be appended
+	 */
+	int space_wanted;
+	int space_watermark;
+	int decode_error;
 	/* Head/tail of decoded buffer */
 	/*
 	 * The decoded buffer is managed as a strange circular buffer, with
@@ -181,15 +325,107 @@ struct dfu_binary_file {
 	int decoded_chunk_size;
 	/* Size of a write chunk */
 	int write_chunk_size;
-	/* Decoded chunks data */
-	struct dfu_write_chunk write_chunks[CONFIG_MAX_CHUNKS];
-	/* Head/Tail of write chunks */
+	/*
+	 * Page assembler (see bf_fill_erased()): flash page size if the target
+	 * wants whole, aligned write chunks, 0 otherwise
+	 */
+	int page_size;
+	/* Gaps in pages are filled with this */
+	int erased_value;
+	/*
+	 * Target reports its erased value: chunks made of erased bytes only
+	 * are completed without being written
+	 */
+	int elide_erased;
+	/*
+	 * Differential mode: chunks already in the target's memory are not
+	 * written (see dfu_binary_file_set_differential()). diff_wc is the
+	 * index of the chunk found to be different, if it couldn't be written
+	 * at once (sector being erased), -1 otherwise. Target memory is read
+	 * synchronously (dfu_idle() is invoked meanwhile, by must_erase() too):
+	 * diff_reading stops chunks from being written
+	 */
+	int differential;
+	int diff_wc;
+	int diff_reading;
+	/*
+	 * Resume journal (see dfu_binary_file_set_journal()): file descriptor
+	 * (-1 if none) and path, generation of this session, chain value of
+	 * the last record and number of records. While resuming, chunks are
+	 * checked against the records of the interrupted session
+	 */
+	int journal_fd;
+	const char *journal_path;
+	uint32_t journal_gen;
+	uint32_t journal_chain;
+	unsigned long journal_n;
+	int resuming;
+	/*
+	 * End address of the highest chunk which was not written (unchanged or
+	 * resumed)
+	 */
+	phys_addr_t skipped_end;
+	/*
+	 * File digest (see dfu_binary_file_set_digest()): running crc32 of the
+	 * bytes appended so far, updated by the producer
+	 */
+	int digest;
+	uint32_t digest_crc;
+	/* Decoded chunks data, max_chunks of them (power of 2) */
+	struct dfu_write_chunk *write_chunks;
+	int max_chunks;
+	/*
+	 * Head/Tail of write chunks. The tail is the oldest chunk not yet
+	 * written by this file's target. Chunks before write_chunks_ready are
+	 * completely decoded and can be passed on to the target(s), it is
+	 * published by the decoder.
+	 */
 	int write_chunks_head;
+	int write_chunks_ready;
 	int write_chunks_tail;
+	/*
+	 * Chunks from write_chunks_tail to write_chunks_sent have been passed
+	 * on to the target and are being written, write_queue_depth of them
+	 * at most
+	 */
+	int write_chunks_sent;
+	int write_queue_depth;
+	/*
+	 * Gang programming: the leader owns the buffers and write chunks and
+	 * decodes the file only once. Gang members (whose leader field points
+	 * to the leader) only keep track of their own write chunks tail.
+	 * On the leader, gang_tail is the oldest write chunk which has not
+	 * been written by all the gang members yet.
+	 */
+	struct dfu_binary_file *leader;
+	struct dfu_binary_file *gang[CONFIG_DFU_MAX_INSTANCES];
+	int gang_size;
+	int gang_tail;
+	/*
+	 * Lent segments: the producer adds them at segs_head and recycles
+	 * the released ones starting from segs_tail, the decoder feeds them
+	 * in order starting from segs_fed. segs_offset is the number of
+	 * bytes fed so far (zero copy chunks must start at a write chunk
+	 * boundary).
+	 */
+	struct dfu_segment segs[CONFIG_MAX_SEGMENTS];
+	int segs_head;
+	int segs_fed;
+	int segs_tail;
+	unsigned long segs_offset;
 	void *format_data;
 	void *priv;
 };
 
+/*
+ * Returns the binary file owning buffers and write chunks for @bf, that is
+ * the gang leader for gang members and @bf itself otherwise.
+ */
+static inline struct dfu_binary_file *bf_leader(struct dfu_binary_file *bf)
+{
+	return bf->leader ? bf->leader : bf;
+}
+
 static inline int _count(int head, int tail, int size)
 {
 	return (head - tail) & (size - 1);
@@ -239,9 +475,11 @@ static inline int bf_dec_count(struct dfu_binary_file *bf)
 	return _count(bf->decoded_head, bf->decoded_tail, bf->decoded_size);
 }
 
+/* decoded_tail is moved forward by the writer */
 static inline int bf_dec_space(struct dfu_binary_file *bf)
 {
-	return _space(bf->decoded_head, bf->decoded_tail, bf->decoded_size);
+	return _space(bf->decoded_head, dfu_load_acquire(&bf->decoded_tail),
+		      bf->decoded_size);
 }
 
 static inline int bf_dec_count_to_end(struct dfu_binary_file *bf)
@@ -259,20 +497,53 @@ static inline int bf_write_count_to_end(struct dfu_binary_file *bf)
 
 static inline int bf_dec_space_to_end(struct dfu_binary_file *bf)
 {
-	return _space_to_end(bf->decoded_head, bf->decoded_tail,
+	return _space_to_end(bf->decoded_head,
+			     dfu_load_acquire(&bf->decoded_tail),
 			     bf->decoded_size);
 }
 
+/* Returns number of decoded chunks still to be written by @bf's target */
 static inline int bf_wc_count(struct dfu_binary_file *bf)
 {
-	return _count(bf->write_chunks_head, bf->write_chunks_tail,
-		      ARRAY_SIZE(bf->write_chunks));
+	return _count(dfu_load_acquire(&bf_leader(bf)->write_chunks_ready),
+		      bf->write_chunks_tail, bf->max_chunks);
+}
+
+/* Returns number of decoded chunks not yet passed on to @bf's target */
+static inline int bf_wc_to_send(struct dfu_binary_file *bf)
+{
+	return _count(dfu_load_acquire(&bf_leader(bf)->write_chunks_ready),
+		      bf->write_chunks_sent, bf->max_chunks);
+}
+
+/* Returns number of chunks being written by @bf's target */
+static inline int bf_wc_in_flight(struct dfu_binary_file *bf)
+{
+	return _count(bf->write_chunks_sent, bf->write_chunks_tail,
+		      bf->max_chunks);
+}
+
+/*
+ * Returns the oldest write chunk in use, @bf must be a leader (or a file
+ * which is not part of a gang).
+ */
+static inline int bf_wc_used_tail(struct dfu_binary_file *bf)
+{
+	return bf->gang_size ? dfu_load_acquire(&bf->gang_tail) :
+		dfu_load_acquire(&bf->write_chunks_tail);
+}
+
+/* Returns number of chunks in use (not written by some target yet) */
+static inline int bf_wc_used(struct dfu_binary_file *bf)
+{
+	return _count(bf->write_chunks_head, bf_wc_used_tail(bf),
+		      bf->max_chunks);
 }
 
 static inline int bf_wc_space(struct dfu_binary_file *bf)
 {
-	return _space(bf->write_chunks_head, bf->write_chunks_tail,
-		      ARRAY_SIZE(bf->write_chunks));
+	return _space(bf->write_chunks_head, bf_wc_used_tail(bf),
+		      bf->max_chunks);
 }
 
 /*
@@ -287,28 +558,142 @@ bf_get_write_chunk(struct dfu_binary_file *bf)
 		return NULL;
 	out = &bf->write_chunks[bf->write_chunks_head];
 	bf->write_chunks_head++;
-	bf->write_chunks_head &= (ARRAY_SIZE(bf->write_chunks) - 1);
+	bf->write_chunks_head &= (bf->max_chunks - 1);
 	return out;
 }
 
 /*
  * Returns pointer to next write chunk ready for being passed on to target
- * and marks chunk as pending (for writing);
+ * and marks chunk as sent, NULL if there's no such chunk or the target's
+ * queue is full.
  * Does not advance tail, call bf_put_write_chunk instead when chunk has
  * actually been written
  */
 static inline struct dfu_write_chunk *
 bf_next_write_chunk(struct dfu_binary_file *bf, int ignore_pending)
 {
-	if (!bf_wc_count(bf))
+	struct dfu_write_chunk *wc;
+
+	if (!bf_wc_to_send(bf) ||
+	    bf_wc_in_flight(bf) >= bf->write_queue_depth)
 		return NULL;
-	/* First chunk to be written is already pending, nothing to do */
-	if (bf->write_chunks[bf->write_chunks_tail].write_pending ||
-	    (bf->write_chunks[bf->write_chunks_tail].pending &&
-	     !ignore_pending))
+	wc = &bf_leader(bf)->write_chunks[bf->write_chunks_sent];
+	/* Next chunk to be written is still being filled, nothing to do */
+	if (wc->pending && !ignore_pending)
 		return NULL;
-	bf->write_chunks[bf->write_chunks_tail].write_pending = 1;
-	return &bf->write_chunks[bf->write_chunks_tail];
+	bf->write_chunks_sent = (bf->write_chunks_sent + 1) &
+		(bf->max_chunks - 1);
+	return wc;
+}
+
+/* The last chunk returned by bf_next_write_chunk() has not been sent */
+static inline void bf_unsend_write_chunk(struct dfu_binary_file *bf)
+{
+	bf->write_chunks_sent = (bf->write_chunks_sent - 1) &
+		(bf->max_chunks - 1);
+}
+
+/*
+ * Frees write chunks which have been written by all gang members, @bf must
+ * be a gang leader
+ */
+extern void bf_gang_update_tail(struct dfu_binary_file *bf);
+
+/* Drops a reference to a lent segment, releasing it if it was the last */
+extern void bf_segment_put(struct dfu_segment *seg);
+
+/*
+ * Page assembler, for formats whose records carry an address (intel hex,
+ * s-records):
+ * when bf->page_size is not 0, decoders keep the decoded buffer's head at
+ * the same offset in a page as the address being decoded, and may hold the
+ * last pages back until they are complete. Gaps inside a page are filled
+ * with @n erased bytes via this function, so that each page becomes a
+ * single write chunk. The caller checks bf_dec_space().
+ */
+extern void bf_fill_erased(struct dfu_binary_file *bf, int n);
+
+/*
+ * Page assembler state of a format: @next_addr follows the last decoded
+ * byte. When @open is set, [open_addr, next_addr) has been decoded but not
+ * returned yet (it still can be modified). @done holds the @ndone address
+ * ranges of the pages returned so far, sorted: pages can't be written
+ * twice (the second write would erase the first one's data). When there
+ * are too many of them, the closest ranges are merged.
+ */
+struct bf_pages_range {
+	uint32_t start;
+	uint32_t end;
+};
+
+struct bf_pages {
+	uint32_t next_addr;
+	uint32_t open_addr;
+	int open;
+	struct bf_pages_range done[CONFIG_BF_PAGES_RANGES];
+	int ndone;
+};
+
+/*
+ * Page assembler: data at @a can be merged with the pages being assembled
+ * (they go back inside them or they leave a gap shorter than a page)
+ */
+static inline int bf_pages_in_window(struct dfu_binary_file *bf,
+				     struct bf_pages *pg, uint32_t a)
+{
+	return a >= pg->open_addr &&
+		(a <= pg->next_addr || a - pg->next_addr < bf->page_size);
+}
+
+/*
+ * Page assembler: returns 1 if some of the pages holding @len bytes at @a
+ * have already been returned (data going back there can't be written
+ * anymore), 0 otherwise
+ */
+extern int bf_pages_written(struct dfu_binary_file *bf, struct bf_pages *pg,
+			    uint32_t a, int len);
+
+/*
+ * Page assembler: return the pages being assembled but the last @keep
+ * ones (next records could still go back there). Returns the new decoded
+ * total, *addr is set if @decoded_tot was 0
+ */
+extern int bf_pages_release(struct dfu_binary_file *bf, struct bf_pages *pg,
+			    int decoded_tot, phys_addr_t *addr, int keep);
+
+/*
+ * Page assembler: fill the last page with erased bytes and return all the
+ * pages being assembled. Returns the new decoded total, pages are left
+ * open if there's no room for the erased bytes
+ */
+extern int bf_pages_close(struct dfu_binary_file *bf, struct bf_pages *pg,
+			  int decoded_tot, phys_addr_t *addr);
+
+/*
+ * For formats decoding more than one run of contiguous data per
+ * decode_chunk() invocation (records jumping back and forth): the @len
+ * decoded bytes starting at the decoded buffer's write tail (the first
+ * byte not enqueued yet, where the run's data were decoded to) are
+ * enqueued for writing at @addr now, the write tail moves past them and
+ * the format goes on with the next run (the last one is returned by
+ * decode_chunk() as usual).
+ * Returns 1 if the run has been enqueued, 0 if there's no room for
+ * another run (the format returns this one and stops decoding), negative
+ * on error.
+ */
+extern int bf_decoded_run(struct dfu_binary_file *bf, int len,
+			  phys_addr_t addr);
+
+/* A write chunk has been written (by all gang members) */
+static inline void bf_free_write_chunk(struct dfu_write_chunk *wc)
+{
+	struct dfu_segment *seg = wc->seg;
+
+	wc->pending = 0;
+	if (seg) {
+		wc->seg = NULL;
+		bf_segment_put(seg);
+	}
 }
 
 
@@ -319,41 +704,79 @@ bf_next_write_chunk(struct dfu_binary_file *bf, int ignore_pending)
  */
 static inline void bf_put_write_chunk(struct dfu_binary_file *bf)
 {
-	struct dfu_write_chunk *wc = &bf->write_chunks[bf->write_chunks_tail];
+	struct dfu_binary_file *l = bf_leader(bf);
+	struct dfu_write_chunk *wc = &l->write_chunks[bf->write_chunks_tail];
 
-	bf->decoded_tail = wc->start + wc->len;
-	bf->decoded_tail &= (bf->decoded_size - 1);
-	wc->pending = wc->write_pending = 0;
-	bf->write_chunks_tail++;
-	bf->write_chunks_tail &= (ARRAY_SIZE(bf->write_chunks) - 1);
+	int tail = (bf->write_chunks_tail + 1) &
+		(bf->max_chunks - 1);
+
+	if (l->gang_size) {
+		bf->write_chunks_tail = tail;
+		/* Chunk is freed when all gang members have written it */
+		bf_gang_update_tail(l);
+		return;
+	}
+	/* Chunk and its data can be reused by the decoder from now on */
+	bf_free_write_chunk(wc);
+	if (!wc->data)
+		dfu_store_release(&bf->decoded_tail,
+				  (wc->start + wc->len) &
+				  (bf->decoded_size - 1));
+	dfu_store_release(&bf->write_chunks_tail, tail);
 }
 
 struct dfu_host_ops {
 	int (*init)(struct dfu_host *);
 	void (*udelay)(struct dfu_host *, unsigned long us);
-	/* Returns int with last events flags set */
+	/*
+	 * Wait for events until next_timeout (absolute time, as returned by
+	 * get_current_time()), -1 means wait forever.
+	 * Returns int with last events flags set
+	 */
 	int (*idle)(struct dfu_host *, long next_timeout);
 	int (*set_interface_event)(struct dfu_host *, void *);
 	int (*set_binary_file_event)(struct dfu_host *, void *);
 	unsigned long (*get_current_time)(struct dfu_host *);
+	/* Optional, microseconds (for profiling), wrapping is allowed */
+	unsigned long (*get_current_time_us)(struct dfu_host *);
+	/* Make a blocked idle() return, can be invoked from any thread */
+	void (*wakeup)(struct dfu_host *);
+	/*
+	 * Optional, run work(arg) in a separate thread until it returns a
+	 * negative value or stop_worker() is invoked. When work() returns 0
+	 * (nothing to do), the thread sleeps until kick_worker() is invoked.
+	 */
+	int (*start_worker)(struct dfu_host *, int (*work)(void *), void *arg);
+	void (*kick_worker)(struct dfu_host *);
+	void (*stop_worker)(struct dfu_host *);
 	int (*fini)(struct dfu_host *);
 };
 
 struct dfu_format_ops {
 	/*
 	 * Returns zero if start_buf contains the beginning of a file encoded
-	 * with this format
+	 * with this format, positive if more data are needed to tell,
+	 * negative otherwise
 	 */
 	int (*probe)(struct dfu_binary_file *);
 	/*
 	 * Decode file chunk starting from current tail and update tail
 	 * Write decoded data into binary file's decoded [circular] buffer,
 	 * and update decoded_head. Return number of bytes written into
-	 * decoded buffer.
+	 * decoded buffer (previous runs, if any, are handed to
+	 * bf_decoded_run()).
 	 */
 	int (*decode_chunk)(struct dfu_binary_file *, phys_addr_t *addr);
 	/* Finalization method */
 	int (*fini)(struct dfu_binary_file *);
+	/*
+	 * Optional, zero copy decoding of lent segments: @len bytes at @buf
+	 * (starting at a write chunk boundary of the input) are to be
+	 * written as they are. Returns @len and sets *addr if they can,
+	 * 0 if they must go through the input buffer and decode_chunk()
+	 */
+	int (*decode_segment)(struct dfu_binary_file *, const void *buf,
+			      int len, phys_addr_t *addr);
 };
 
 #define declare_file_rx_method(n,o)				\
@@ -375,17 +798,35 @@ extern const struct dfu_format_ops registered_formats_start[],
 #define declare_dfu_format(n,p,d,f)					\
     static const struct							\
     dfu_format_ops format_ ## n						\
-    __attribute__((section(".binary-formats"), used)) = {		\
+    /* Explicit alignment, so that the compiler doesn't add padding */	\
+    __attribute__((section(".binary-formats"), used,			\
+		   aligned(sizeof(void *)))) = {			\
 	.probe = p,							\
 	.decode_chunk = d,						\
 	.fini = f,							\
     };
+
+/* Same as above, for formats supporting zero copy decoding */
+#define declare_dfu_format_zero_copy(n,p,d,f,s)				\
+    static const struct							\
+    dfu_format_ops format_ ## n						\
+    __attribute__((section(".binary-formats"), used,			\
+		   aligned(sizeof(void *)))) = {			\
+	.probe = p,							\
+	.decode_chunk = d,						\
+	.fini = f,							\
+	.decode_segment = s,						\
+    };
 #else
 #define declare_dfu_format(n,p,d,f)					\
     int (* n ## _probe_ptr)(struct dfu_binary_file *) = p;		\
     int (* n ## _decode_chunk_ptr)(struct dfu_binary_file *bf,		\
 				   phys_addr_t *out_buf) = d;		\
     int (* n ## _fini_ptr)(struct dfu_binary_file *) = f
+
+/* No zero copy under arduino (segments are just copied) */
+#define declare_dfu_format_zero_copy(n,p,d,f,s)				\
+    declare_dfu_format(n,p,d,f)
 #endif
 
 struct dfu_interface {
@@ -409,27 +850,60 @@ struct dfu_target {
 	void *priv;
 };
 
-static inline int dfu_target_busy(struct dfu_target *t)
-{
-	return t->busy;
-}
-
-static inline void dfu_target_set_busy(struct dfu_target *t)
-{
-	t->busy = 1;
-}
-
-static inline void dfu_target_set_ready(struct dfu_target *t)
-{
-	t->busy = 0;
-}
-
 struct dfu_host {
+	struct dfu_data *dfu;
 	const struct dfu_host_ops *ops;
 	void *priv;
 };
 
+/*
+ * log2 histogram of times in usecs: bucket 0 holds 0 usecs samples,
+ * bucket i holds samples in the [2^(i-1), 2^i) range
+ */
+#define DFU_HISTOGRAM_NBUCKETS (sizeof(unsigned long) * 8 + 1)
+
+struct dfu_histogram {
+	unsigned long count;
+	unsigned long long total;
+	unsigned long min;
+	unsigned long max;
+	unsigned long buckets[DFU_HISTOGRAM_NBUCKETS];
+};
+
+extern void dfu_histogram_add(struct dfu_histogram *h, unsigned long us);
+
+extern void dfu_histogram_get(const struct dfu_histogram *h,
+			      struct dfu_phase_stats *out);
+
+/* Counters updated by the thread running dfu_idle(), see dfu_get_stats() */
+struct dfu_session_stats {
+	unsigned long bytes_written;
+	unsigned long long if_bytes_sent;
+	unsigned long long if_bytes_received;
+	struct dfu_histogram chunk_latency;
+	/*
+	 * Time (usecs) chunks being written have been passed to the target,
+	 * indexed by write chunk index (modulo CONFIG_MAX_WRITE_QUEUE_DEPTH)
+	 */
+	unsigned long chunk_start[CONFIG_MAX_WRITE_QUEUE_DEPTH];
+	unsigned long chunk_errors;
+	unsigned long chunks_elided;
+	unsigned long chunks_unchanged;
+	unsigned long chunks_resumed;
+	unsigned long erases;
+	unsigned long long erase_time;
+	unsigned long cmd_retries;
+	unsigned long cmd_timeouts;
+	/* Msecs, flush start and end of writing */
+	unsigned long start;
+	unsigned long end;
+	int started;
+	int ended;
+};
+
 struct dfu_data {
+	/* Instance index, 0 .. CONFIG_DFU_MAX_INSTANCES - 1 */
+	int id;
 	struct dfu_interface *interface;
 	struct dfu_target *target;
 	struct dfu_host *host;
@@ -437,8 +911,26 @@ struct dfu_data {
 	struct dfu_file_container *fc;
 	int busy;
 	int error;
+	/* Pending timeouts, binary min-heap ordered by expiry time */
+	struct dfu_timeout *timeouts[CONFIG_DFU_MAX_TIMEOUTS];
+	int ntimeouts;
+	/*
+	 * Set when some component has more work to do right away, cleared
+	 * at the beginning of each dfu_idle()
+	 */
+	int idle_again;
+	struct dfu_session_stats stats;
 };
 
+/*
+ * Returns instance index of @dfu, modules can use it to pick per-instance
+ * private data from static arrays of CONFIG_DFU_MAX_INSTANCES elements
+ */
+static inline int dfu_id(struct dfu_data *dfu)
+{
+	return dfu->id;
+}
+
 static inline void dfu_notify_error(struct dfu_data *dfu)
 {
 	dfu->error++;
@@ -449,6 +941,32 @@ static inline int dfu_error(struct dfu_data *dfu)
 	return dfu->error;
 }
 
+/*
+ * Tell the core that there's more work to do on next dfu_idle() call, so
+ * that the host doesn't block waiting for events
+ */
+static inline void dfu_idle_again(struct dfu_data *dfu)
+{
+	dfu->idle_again = 1;
+}
+
+static inline int dfu_target_busy(struct dfu_target *t)
+{
+	return t->busy;
+}
+
+static inline void dfu_target_set_busy(struct dfu_target *t)
+{
+	t->busy = 1;
+}
+
+static inline void dfu_target_set_ready(struct dfu_target *t)
+{
+	t->busy = 0;
+	/* Next chunk can be written */
+	dfu_idle_again(t->dfu);
+}
+
 extern int dfu_interface_open(struct dfu_interface *, const char *name,
 			      const void *params);
 extern int dfu_interface_fini(struct dfu_interface *);
@@ -525,6 +1043,40 @@ extern int dfu_cancel_timeout(struct dfu_timeout *);
 
 extern unsigned long dfu_get_current_time(struct dfu_data *dfu);
 
+/* Microseconds, falls back to get_current_time() * 1000 */
+extern unsigned long dfu_get_current_time_us(struct dfu_data *dfu);
+
+/* Targets invoke this when an erase started at @start_us is over */
+static inline void dfu_stats_erase_done(struct dfu_data *dfu,
+					unsigned long start_us)
+{
+	dfu->stats.erases++;
+	dfu->stats.erase_time += dfu_get_current_time_us(dfu) - start_us;
+}
+
+/*
+ * Profiling helpers, see enum dfu_phase. They compile out when
+ * CONFIG_DFU_PROFILING is not defined:
+ *
+ *	dfu_profile_declare(t);
+ *
+ *	dfu_profile_start(dfu, t);
+ *	... do phase work ...
+ *	dfu_profile_end(dfu, DFU_PHASE_xxx, t);
+ */
+#ifdef CONFIG_DFU_PROFILING
+extern void dfu_profile_add(struct dfu_data *dfu, enum dfu_phase p,
+			    unsigned long start_us);
+
+#define dfu_profile_declare(t) unsigned long t
+#define dfu_profile_start(dfu, t) ((t) = dfu_get_current_time_us(dfu))
+#define dfu_profile_end(dfu, p, t) dfu_profile_add(dfu, p, t)
+#else
+#define dfu_profile_declare(t)
+#define dfu_profile_start(dfu, t) do { } while (0)
+#define dfu_profile_end(dfu, p, t) do { } while (0)
+#endif
+
 
 /* To be invokedby target when a chunk has been written */
 extern void dfu_binary_file_chunk_done(struct dfu_binary_file *,
@@ -556,6 +1108,53 @@ extern void crc32_init(uint32_t *crc);
 extern void crc32_iteration(const uint8_t *buf, uint32_t size, uint32_t *crc);
 extern void crc32_done(uint32_t *crc);
 
+/*
+ * Hex digits (ascii formats). hex_digits[] holds digit values plus one, 0
+ * for characters which are not hex digits
+ */
+extern const uint8_t hex_digits[256];
+
+static inline int hex_digit(char c)
+{
+	return hex_digits[(uint8_t)c] - 1;
+}
+
+/* Byte from two hex digits, negative if some of them is not a hex digit */
+static inline int hex_byte(const uint8_t *src)
+{
+	int hi = hex_digits[src[0]], lo = hex_digits[src[1]];
+
+	if (!hi || !lo)
+		return -1;
+	return (hi << 4) + lo - 0x11;
+}
+
+/*
+ * Decode @n bytes from 2 * @n contiguous hex digits, adding them to *sum
+ * (record checksums). Returns negative if some digit is invalid
+ */
+extern int hex_to_bytes(const uint8_t *src, uint8_t *dst, int n,
+			unsigned int *sum);
+
+/*
+ * Same as above, from the input buffer at *index (whose 2 * @n chars must
+ * have been appended already, @n <= 8). Updates *index, returns @n or
+ * negative
+ */
+extern int hex_get_bytes(struct dfu_binary_file *f, int *index, uint8_t *dst,
+			 int n, unsigned int *sum);
+
+/*
+ * Decode @len ascii chars (an even number) from the input buffer at *index
+ * to the decoded buffer at *out_index, adding decoded bytes to *sum. Spans
+ * which are contiguous in both buffers are decoded at once, only bytes
+ * across the input buffer's end are decoded one by one.
+ * Updates indexes, returns @len, 0 if the input buffer's head was met,
+ * negative on invalid digits
+ */
+extern int hex_decode_buf(struct dfu_binary_file *f, int *index,
+			  int *out_index, int len, unsigned int *sum);
+
 
 /* nordic zip binary format functions and declarations */
 
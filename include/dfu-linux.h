@@ -7,6 +7,8 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdio.h>
+/* BYTE_ORDER, for cpu_to_be32() and friends */
+#include <endian.h>
 #include <sys/time.h>
 
 
@@ -26,6 +28,7 @@ static inline unsigned get_time(void)
 extern const struct dfu_interface_ops linux_serial_stm32_interface_ops;
 extern const struct dfu_interface_ops linux_serial_arduino_uno_interface_ops;
 extern const struct dfu_interface_ops linux_spi_bp_nordic_target_interface_ops;
+extern const struct dfu_interface_ops linux_loopback_interface_ops;
 extern const struct dfu_host_ops linux_dfu_host_ops;
 
 #define dfu_log(a,args...) fprintf(stderr, "[%08u] DFU: " a, get_time(), ##args)
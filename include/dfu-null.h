@@ -0,0 +1,49 @@
+#ifndef __DFU_NULL_H__
+#define __DFU_NULL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct dfu_target_ops;
+struct dfu_interface_ops;
+
+/*
+ * Null target: every chunk is written as soon as it is made available (or
+ * after a fixed latency, see below), no interface traffic at all. Measures
+ * the host side of the library (input, decoding and write chunks handling)
+ * on its own.
+ */
+extern struct dfu_target_ops null_dfu_target_ops;
+
+/* Does nothing, to be used with the null target */
+extern const struct dfu_interface_ops null_interface_ops;
+
+/* Optional null target parameters */
+struct null_target_pars {
+	/* Write chunk size (power of 2), CONFIG_NULL_TARGET_CHUNK_SIZE if 0 */
+	int chunk_size;
+	/* Behave like targets which can write chunks at any address */
+	int ignore_chunk_alignment;
+	/*
+	 * Optional: chunks falling within [mem_base, mem_base + mem_size)
+	 * are copied to mem (for checking decoded data), others are dropped
+	 */
+	void *mem;
+	unsigned long mem_base;
+	unsigned long mem_size;
+	/*
+	 * Optional: chunks are done write_latency msecs after being passed
+	 * on to the target (like on a link with such a round trip time), up
+	 * to queue_depth of them (default 1) can be written at the same
+	 * time
+	 */
+	unsigned long write_latency;
+	int queue_depth;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DFU_NULL_H__ */
@@ -54,6 +54,15 @@ struct dfu_binary_file_ops {
 	 * This is invoked when an event has been detected on the file
 	 */
 	int (*on_event)(struct dfu_binary_file *);
+	/*
+	 * Invoked by dfu_idle() when at least the space watermark (see
+	 * dfu_binary_file_set_space_watermark()) can be appended: once at
+	 * start and then once after each append (successful or not), until
+	 * the end of file is appended. Producers with data ready can use
+	 * this instead of polling, they're not woken up while the file
+	 * buffer is full.
+	 */
+	int (*on_space_available)(struct dfu_binary_file *);
 };
 
 /* This represents an open file */
@@ -109,7 +118,11 @@ struct dfu_fc_esp8226_args {
 	struct spi_flash_sector *sectors;
 };
 
-
+/*
+ * Initialize a dfu instance. Up to CONFIG_DFU_MAX_INSTANCES instances can
+ * be active at the same time, each one with its own interface, target and
+ * file. Returns NULL in case of errors or if no free instance is available.
+ */
 extern struct dfu_data *dfu_init(const struct dfu_interface_ops *iops,
 				 const char *interface_path,
 				 const void *interface_pars,
@@ -146,17 +159,189 @@ dfu_new_binary_file(const void *buf,
 		    const struct dfu_binary_file_ops *,
 		    void *priv);
 
+/*
+ * Same as dfu_new_binary_file(), but the input buffer, the decoded buffer
+ * and the write chunks live in @arena (@arena_size bytes, owned by the
+ * caller and not to be freed before dfu_binary_file_fini()) instead of the
+ * library's static buffers.
+ * Buffers are sized at runtime according to the target's write chunk size:
+ * they are made as big as the arena allows. NULL is returned if the arena
+ * is too small.
+ */
+extern struct dfu_binary_file *
+dfu_new_binary_file_arena(const void *buf,
+			  unsigned long buf_sz,
+			  unsigned long totsz,
+			  struct dfu_data *dfu,
+			  unsigned long addr,
+			  const struct dfu_binary_file_ops *,
+			  void *priv,
+			  void *arena,
+			  unsigned long arena_size);
+
+/*
+ * Binary file whose contents are all in memory already (a mmap()ed file,
+ * for instance): decoders read @buf directly, nothing is copied and nothing
+ * has to be appended (dfu_binary_file_append_buffer() fails). Raw binary
+ * images are written straight from @buf.
+ * @buf must stay valid and unchanged until dfu_binary_file_fini().
+ */
+extern struct dfu_binary_file *
+dfu_new_binary_file_from_memory(const void *buf,
+				unsigned long buf_sz,
+				struct dfu_data *dfu,
+				unsigned long addr,
+				const struct dfu_binary_file_ops *,
+				void *priv);
+
+/*
+ * Returns the size of an arena giving @dfu's binary file input and decoded
+ * buffers of (at least) @ring_size bytes, 0 on error.
+ */
+extern unsigned long dfu_binary_file_arena_size(struct dfu_data *dfu,
+						unsigned long ring_size);
+
 /*
  * Append buf to file's buffer. Data are appended only if the whole buffer
  * fits, otherwise 0 is returned. On success, the number of appended bytes
  * is returned. -1 is returned on error.
  * If file is being flushed (dfu_binary_file_written() already called),
  * appending data also triggers data flush to target.
+ * Appending a 0 bytes buffer tells that the whole file has been appended.
+ *
+ * This function and dfu_binary_file_get_tot_appended() can be invoked from
+ * a thread other than the one running dfu_idle(), without any locking: the
+ * file buffer is a lock-free ring and dfu_idle() is woken up when new data
+ * are available. There must be a single producer at a time, though
+ * (i.e. don't append from the ops->on_event() callback and from another
+ * thread at the same time).
  */
 extern int dfu_binary_file_append_buffer(struct dfu_binary_file *,
 					 const void *buf,
 					 unsigned long buf_sz);
 
+/*
+ * As dfu_binary_file_append_buffer(), but appends as many bytes as fit
+ * (possibly 0) instead of all or nothing: producers can stream data and
+ * go on with the rest of their buffer as soon as space is available.
+ * Returns the number of appended bytes, -1 on error.
+ */
+extern int dfu_binary_file_append_partial(struct dfu_binary_file *,
+					  const void *buf,
+					  unsigned long buf_sz);
+
+/*
+ * Number of bytes which could be appended right now (0 if the file buffer
+ * is full). Producer side, same rules as dfu_binary_file_append_buffer().
+ */
+extern int dfu_binary_file_get_space(struct dfu_binary_file *);
+
+/*
+ * Minimum free space (bytes) for ops->on_space_available() to be invoked,
+ * a quarter of the file buffer by default. Returns 0 on success, -1 if
+ * @bytes is out of range (1 to the file buffer's size)
+ */
+extern int dfu_binary_file_set_space_watermark(struct dfu_binary_file *,
+					       int bytes);
+
+/*
+ * Zero copy append: lend @buf (@buf_sz bytes, owned by the caller) to the
+ * binary file instead of copying it. Data are written to the target
+ * straight from @buf when the file format allows it (raw binary files),
+ * otherwise they're copied to the file buffer as they are needed.
+ * release(@buf, @priv) is invoked once the library is done with @buf
+ * (possibly from the decoder's thread in pipeline mode, see
+ * dfu_binary_file_set_pipelined()), @buf must not be modified until then.
+ * Up to CONFIG_MAX_SEGMENTS buffers can be lent at the same time: returns
+ * @buf_sz on success, 0 if no more buffers can be lent at the moment,
+ * -1 on error. As dfu_binary_file_append_buffer(), a 0 bytes buffer tells
+ * that the whole file has been appended. The two functions must not be
+ * mixed on the same file.
+ */
+extern int dfu_binary_file_append_segment(struct dfu_binary_file *,
+					  const void *buf,
+					  unsigned long buf_sz,
+					  void (*release)(const void *buf,
+							  void *priv),
+					  void *priv);
+
+/*
+ * Gang programming: make the target of @dfu write the same file as @leader.
+ * The file is received and decoded only once (by the leader), each gang
+ * member then writes decoded data at its own pace. A member whose dfu
+ * instance fails (leader included) is just dropped from the gang.
+ * Limitation: decoded data are freed only once all the members have
+ * written them, so a member can't lag more than the leader's decoded
+ * buffer (or write chunks) behind the others. Past that point the whole
+ * gang goes at the pace of its slowest board.
+ * Must be invoked before dfu_binary_file_flush_start(@leader), then
+ * dfu_idle() must be invoked for all the gang members' dfu instances, but
+ * the failed ones (see dfu_abort()).
+ * Gang members must be finalized before the leader.
+ * Returns the gang member's binary file, NULL on error.
+ */
+extern struct dfu_binary_file *
+dfu_binary_file_join_gang(struct dfu_binary_file *leader,
+			  struct dfu_data *dfu);
+
+/*
+ * Pipeline mode: decode @bf in a separate thread (provided by the host),
+ * dfu_idle() then only takes care of writing decoded chunks, so that the
+ * target is never kept waiting while a chunk is being decoded.
+ * Must be invoked before appending data and before
+ * dfu_binary_file_flush_start(), only for gang leaders. All gang members
+ * must be driven by the same thread.
+ * Returns 0 on success, -1 if not supported.
+ */
+extern int dfu_binary_file_set_pipelined(struct dfu_binary_file *, int on);
+
+/*
+ * Differential mode: before writing a chunk, the target's memory is read
+ * back and the chunk is skipped if it's there already (incremental updates
+ * over slow links). Targets erasing sectors on demand only erase a sector
+ * when some chunk in it differs (don't invoke dfu_target_erase_all()).
+ * Records may come out of order, as long as data not seen yet and lying
+ * between a changed chunk and the highest unchanged one in the same sector
+ * are unchanged too. Must be invoked before dfu_binary_file_flush_start(),
+ * for each gang member. Returns 0 on success, -1 if the target can't read
+ * its memory or can't save the unchanged part of a sector it erases (stm32
+ * when CONFIG_STM32_USART_SAVE_SIZE is 0, as on hosts other than linux).
+ */
+extern int dfu_binary_file_set_differential(struct dfu_binary_file *, int on);
+
+/*
+ * Resume journal: chunks written are recorded (address, length and crc32)
+ * in file @path of the file container. If @path holds the journal of an
+ * interrupted session, chunks matching its records are not written again,
+ * up to the first one which doesn't match. The journal is removed when the
+ * whole file has been written. Must be invoked before
+ * dfu_binary_file_flush_start(), not for gangs.
+ * Returns 1 when resuming (don't invoke dfu_target_erase_all()), 0 if a new
+ * journal was started, -1 on error or if the target can't save the part of
+ * a sector which was written already (see
+ * dfu_binary_file_set_differential()).
+ */
+extern int dfu_binary_file_set_journal(struct dfu_binary_file *,
+				       const char *path);
+
+/*
+ * File digest: a crc32 of all the bytes appended (or of the whole memory
+ * image) is computed on the fly, to be compared with the original file's
+ * (end to end integrity check). It's logged when the file has been written.
+ * Must be invoked before appending data and before
+ * dfu_binary_file_flush_start(), for gang leaders only.
+ * Returns 0 on success, -1 if data have been appended already.
+ */
+extern int dfu_binary_file_set_digest(struct dfu_binary_file *, int on);
+
+/*
+ * Get the file digest in @crc (same crc32 as zlib's and the crc32 utility's).
+ * Returns 0 on success, -1 if the digest is off or the file has not been
+ * appended completely.
+ */
+extern int dfu_binary_file_get_digest(struct dfu_binary_file *,
+				      uint32_t *crc);
+
 extern int dfu_binary_file_flush_start(struct dfu_binary_file *);
 
 extern int dfu_binary_file_written(struct dfu_binary_file *);
@@ -193,6 +378,155 @@ extern struct dfu_file_rx_method dfu_rx_method_http_arduino;
 
 extern int dfu_idle(struct dfu_data *dfu);
 
+/*
+ * Make a dfu_idle() blocked waiting for events return as soon as possible.
+ * This is the only function which can be invoked from a thread other than
+ * the one running dfu_idle().
+ */
+extern void dfu_wakeup(struct dfu_data *dfu);
+
+/*
+ * Give up on @dfu's session (target setup failed, for instance): dfu_idle()
+ * returns DFU_ERROR from now on, gang members don't wait for it anymore.
+ * Sessions whose dfu_idle() has returned DFU_ERROR are failed already.
+ */
+extern void dfu_abort(struct dfu_data *dfu);
+
+/*
+ * Profiling: when built with CONFIG_DFU_PROFILING (make PROFILING=y), the
+ * time spent in each phase of dfu_idle() and in each dfu-cmd command
+ * buffer is collected into per instance histograms. Some phases are nested
+ * (decoding and writing happen in the binary file's idle phase, unless
+ * the file is pipelined).
+ */
+enum dfu_phase {
+	/* Interface and binary file polling */
+	DFU_PHASE_POLL = 0,
+	/* Timeout callbacks */
+	DFU_PHASE_TIMEOUTS,
+	/* Target's on_idle() */
+	DFU_PHASE_TARGET_IDLE,
+	/* Binary file's idle (decoding and writing chunks) */
+	DFU_PHASE_FILE_IDLE,
+	/* Host's idle (waiting for events) */
+	DFU_PHASE_HOST_IDLE,
+	/* Event callbacks */
+	DFU_PHASE_EVENTS,
+	/* Format's decode_chunk() */
+	DFU_PHASE_DECODE,
+	/* Enqueueing decoded data for writing */
+	DFU_PHASE_ENQUEUE,
+	/* Target's chunk_available() */
+	DFU_PHASE_CHUNK_AVAILABLE,
+	/* Target's must_erase() */
+	DFU_PHASE_MUST_ERASE,
+	/* Whole erase operation (start to completion) */
+	DFU_PHASE_ERASE,
+	/*
+	 * dfu-cmd command buffers, from start to completion. One phase for
+	 * each enum dfu_cmd_dir value, same order.
+	 */
+	DFU_PHASE_CMDBUF_OUT,
+	DFU_PHASE_CMDBUF_IN,
+	DFU_PHASE_CMDBUF_OUT_IN,
+	DFU_PHASE_CMDBUF_DELAY,
+	/* Whole dfu-cmd commands */
+	DFU_PHASE_CMD,
+	DFU_NPHASES,
+};
+
+/* All times are in microseconds */
+struct dfu_phase_stats {
+	unsigned long count;
+	unsigned long long total;
+	unsigned long min;
+	unsigned long max;
+	/* Estimated from a log2 histogram */
+	unsigned long p50;
+	unsigned long p99;
+};
+
+/*
+ * Session statistics, always available. Byte counters are not reset when
+ * a new binary file is started on the same instance.
+ */
+struct dfu_stats {
+	/* Bytes appended to the binary file */
+	unsigned long bytes_received;
+	/* Bytes decoded and enqueued for writing */
+	unsigned long bytes_decoded;
+	/* Bytes the target said have been written */
+	unsigned long bytes_written;
+	/* Bytes sent to and received from the target via the interface */
+	unsigned long long if_bytes_sent;
+	unsigned long long if_bytes_received;
+	/* From chunk_available() to dfu_binary_file_chunk_done() */
+	struct dfu_phase_stats chunk_latency;
+	unsigned long chunk_errors;
+	/* Chunks made of erased bytes only, not sent to the target */
+	unsigned long chunks_elided;
+	/* Differential mode: chunks already in the target's memory */
+	unsigned long chunks_unchanged;
+	/* Chunks written by an interrupted session (resume journal) */
+	unsigned long chunks_resumed;
+	/* Number of erase operations and total erase time (usecs) */
+	unsigned long erases;
+	unsigned long long erase_time;
+	/* dfu-cmd command buffers retried and commands timed out */
+	unsigned long cmd_retries;
+	unsigned long cmd_timeouts;
+	/*
+	 * Msecs from dfu_binary_file_flush_start() to the end of writing
+	 * (or to now if still writing) and resulting bytes written per second
+	 */
+	unsigned long elapsed;
+	unsigned long throughput;
+};
+
+/*
+ * Get statistics for @dfu. Can be invoked at any time from the thread
+ * running dfu_idle(). Returns 0 on success, -1 on error
+ */
+extern int dfu_get_stats(struct dfu_data *dfu, struct dfu_stats *out);
+
+extern void dfu_log_stats(struct dfu_data *dfu);
+
+#ifdef CONFIG_DFU_PROFILING
+/*
+ * Get statistics for phase @p of @dfu. Data are collected by the thread(s)
+ * running dfu_idle() and the pipeline worker, read them when done.
+ * Returns 0 on success, -1 on error (or when profiling is disabled)
+ */
+extern int dfu_get_phase_stats(struct dfu_data *dfu, enum dfu_phase p,
+			       struct dfu_phase_stats *out);
+
+extern void dfu_reset_phase_stats(struct dfu_data *dfu);
+
+extern const char *dfu_phase_name(enum dfu_phase p);
+
+/* Log statistics for all phases with at least one sample */
+extern void dfu_log_phase_stats(struct dfu_data *dfu);
+#else
+static inline int dfu_get_phase_stats(struct dfu_data *dfu, enum dfu_phase p,
+				      struct dfu_phase_stats *out)
+{
+	return -1;
+}
+
+static inline void dfu_reset_phase_stats(struct dfu_data *dfu)
+{
+}
+
+static inline const char *dfu_phase_name(enum dfu_phase p)
+{
+	return "";
+}
+
+static inline void dfu_log_phase_stats(struct dfu_data *dfu)
+{
+}
+#endif
+
 #ifndef dfu_log
 #error HOST MUST DEFINE A dfu_log MACRO
 #endif
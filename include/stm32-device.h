@@ -32,13 +32,14 @@ struct stm32_memory_area {
 	unsigned long size;
 	/* Pointer to sectors map (in case of flash area) */
 	const struct stm32_flash_sector *sectors;
-	/* Points to ram containing a bitmask for erased/to-be-erased sectors */
-	unsigned long *sectors_bitmask_ptr;
 	int nsectors;
 	int sectors_offset;
 };
 
 
+/* Max number of memory areas for a single boot mode */
+#define STM32_MAX_AREAS 8
+
 struct stm32_device_data {
 	/* Single and dual bank mode memory maps */
 	const struct stm32_memory_area *areas[2];
@@ -0,0 +1,203 @@
+/*
+ * libdfu, usage sample (gang programming several arduino uno boards via
+ * serial ports under linux)
+ * Boards go at their own pace only within the decoded buffer: a board
+ * lagging a whole buffer behind slows the others down to its own speed
+ * (see dfu_binary_file_join_gang()). A board which fails is dropped.
+ * Public domain
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dfu.h>
+#include <dfu-linux.h>
+#include <dfu-stk500.h>
+
+#define MAX_BOARDS 16
+
+struct private_data {
+	void *ptr;
+	int file_size;
+};
+
+struct board {
+	const char *port;
+	struct dfu_data *dfu;
+	struct dfu_binary_file *f;
+	int ret;
+};
+
+static void help(int argc, char *argv[])
+{
+	fprintf(stderr, "Use %s <fname> <serial_port> [<serial_port> ...]\n",
+		argv[0]);
+}
+
+static void *map_file(const char *path, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	void *out;
+
+	if (fd < 0) {
+		perror("open");
+		return NULL;
+	}
+	out = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (out == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	close(fd);
+	return out;
+}
+
+static int binary_file_on_space_available(struct dfu_binary_file *f)
+{
+	struct private_data *priv = dfu_binary_file_get_priv(f);
+	int tot = dfu_binary_file_get_tot_appended(f), stat;
+
+	stat = dfu_binary_file_append_partial(f, &((char *)priv->ptr)[tot],
+					      priv->file_size - tot);
+	if (stat < 0)
+		return stat;
+	tot = dfu_binary_file_get_tot_appended(f);
+	if (tot == priv->file_size)
+		dfu_binary_file_append_buffer(f, NULL, 0);
+	return 0;
+}
+
+static struct dfu_binary_file_ops binary_file_ops = {
+	.on_space_available = binary_file_on_space_available,
+};
+
+static int setup_board(struct board *b)
+{
+	if (dfu_target_reset(b->dfu) < 0) {
+		fprintf(stderr, "%s: error resetting target\n", b->port);
+		return -1;
+	}
+	if (dfu_target_probe(b->dfu) < 0) {
+		fprintf(stderr, "%s: error probing target\n", b->port);
+		return -1;
+	}
+	if (dfu_target_erase_all(b->dfu) < 0) {
+		fprintf(stderr, "%s: error erasing target memory\n", b->port);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *fpath;
+	int ret, i, nboards, running, failed = 0;
+	struct stat s;
+	struct board boards[MAX_BOARDS], *b;
+	struct private_data priv;
+
+	if (argc < 3 || argc - 2 > MAX_BOARDS) {
+		help(argc, argv);
+		exit(127);
+	}
+	fpath = argv[1];
+	nboards = argc - 2;
+
+	ret = stat(fpath, &s);
+	if (ret < 0) {
+		perror("stat");
+		exit(127);
+	}
+	priv.ptr = map_file(fpath, s.st_size);
+	priv.file_size = s.st_size;
+	if (!priv.ptr)
+		exit(127);
+	for (i = 0; i < nboards; i++) {
+		b = &boards[i];
+		b->port = argv[i + 2];
+		b->ret = DFU_CONTINUE;
+		b->dfu = dfu_init(&linux_serial_arduino_uno_interface_ops,
+				  b->port,
+				  NULL,
+				  /* No interface start cb */
+				  NULL,
+				  NULL,
+				  &stk500_dfu_target_ops,
+				  &atmega328p_device_data,
+				  &linux_dfu_host_ops,
+				  NULL,
+				  NULL);
+		if (!b->dfu) {
+			fprintf(stderr, "%s: error initializing libdfu\n",
+				b->port);
+			exit(127);
+		}
+		/* First board receives and decodes the file */
+		b->f = !i ?
+			dfu_new_binary_file(NULL, 0, s.st_size, b->dfu, 0,
+					    &binary_file_ops, &priv) :
+			dfu_binary_file_join_gang(boards[0].f, b->dfu);
+		if (!b->f) {
+			fprintf(stderr, "%s: error setting up binary file\n",
+				b->port);
+			exit(127);
+		}
+		if (setup_board(b) < 0) {
+			/* Leave the others alone (leader included) */
+			dfu_abort(b->dfu);
+			b->ret = DFU_ERROR;
+			failed++;
+		}
+	}
+	/* Decode in a separate thread, boards only wait for serial i/o */
+	if (dfu_binary_file_set_pipelined(boards[0].f, 1) < 0)
+		fprintf(stderr, "Pipeline mode not available\n");
+	if (dfu_binary_file_flush_start(boards[0].f) < 0) {
+		fprintf(stderr, "Error programming file\n");
+		exit(127);
+	}
+	/* Drive all boards from the same loop */
+	do {
+		for (i = 0, running = 0; i < nboards; i++) {
+			b = &boards[i];
+			if (b->ret != DFU_CONTINUE)
+				continue;
+			b->ret = dfu_idle(b->dfu);
+			switch (b->ret) {
+			case DFU_ERROR:
+				fprintf(stderr, "%s: error programming file\n",
+					b->port);
+				failed++;
+				break;
+			case DFU_ALL_DONE:
+				fprintf(stderr, "%s: programming DONE\n",
+					b->port);
+				break;
+			case DFU_CONTINUE:
+				running++;
+				break;
+			default:
+				fprintf(stderr,
+					"Invalid ret value %d from dfu_idle()\n",
+					b->ret);
+				b->ret = DFU_ERROR;
+				failed++;
+				break;
+			}
+		}
+	} while (running);
+	/* Let targets run, members first */
+	for (i = nboards - 1; i >= 0; i--) {
+		b = &boards[i];
+		if (b->ret == DFU_ALL_DONE)
+			dfu_target_go(b->dfu);
+		dfu_binary_file_fini(b->f);
+		dfu_fini(b->dfu);
+	}
+	fprintf(stderr, "%d boards programmed, %d failed\n",
+		nboards - failed, failed);
+	exit(failed ? 1 : 0);
+}
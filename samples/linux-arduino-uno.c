@@ -42,16 +42,7 @@ static void *map_file(const char *path, size_t len)
 	return out;
 }
 
-static int binary_file_poll_idle(struct dfu_binary_file *f)
-{
-	struct private_data *priv = dfu_binary_file_get_priv(f);
-	int tot = dfu_binary_file_get_tot_appended(f);
-
-	/* Always ready */
-	return tot < priv->file_size ? DFU_FILE_EVENT : 0;
-}
-
-static int binary_file_on_event(struct dfu_binary_file *f)
+static int binary_file_on_space_available(struct dfu_binary_file *f)
 {
 	struct private_data *priv = dfu_binary_file_get_priv(f);
 	int tot = dfu_binary_file_get_tot_appended(f), stat;
@@ -61,8 +52,8 @@ static int binary_file_on_event(struct dfu_binary_file *f)
 		return -1;
 	}
 	dfu_dbg("tot = %d, appending %d\n", tot, priv->file_size - tot);
-	stat = dfu_binary_file_append_buffer(f, &((char *)priv->ptr)[tot],
-					     priv->file_size - tot);
+	stat = dfu_binary_file_append_partial(f, &((char *)priv->ptr)[tot],
+					      priv->file_size - tot);
 	if (stat < 0)
 		return stat;
 	dfu_dbg("appended %d bytes\n", stat);
@@ -76,8 +67,7 @@ static int binary_file_on_event(struct dfu_binary_file *f)
 }
 
 static struct dfu_binary_file_ops binary_file_ops = {
-	.poll_idle = binary_file_poll_idle,
-	.on_event = binary_file_on_event,
+	.on_space_available = binary_file_on_space_available,
 };
 
 int main(int argc, char *argv[])
@@ -114,6 +104,7 @@ int main(int argc, char *argv[])
 		       &stk500_dfu_target_ops,
 		       &atmega328p_device_data,
 		       &linux_dfu_host_ops,
+		       NULL,
 		       NULL);
 	if (!dfu) {
 		fprintf(stderr, "Error initializing libdfu\n");
@@ -122,7 +113,7 @@ int main(int argc, char *argv[])
 	ptr = map_file(fpath, s.st_size);
 	priv.ptr = ptr;
 	priv.file_size = s.st_size;
-	f = dfu_new_binary_file(ptr, s.st_size, s.st_size, dfu, 0,
+	f = dfu_new_binary_file(NULL, 0, s.st_size, dfu, 0,
 				&binary_file_ops, &priv);
 	if (!f) {
 		fprintf(stderr, "Error setting up binary file struct\n");
@@ -167,6 +158,8 @@ int main(int argc, char *argv[])
 			break;
 		}
 	} while(ret == DFU_CONTINUE);
+	dfu_log_stats(dfu);
+	dfu_log_phase_stats(dfu);
 	/* Let target run */
 	exit(dfu_target_go(dfu));
 }
@@ -0,0 +1,243 @@
+/*
+ * libdfu, usage sample (programming an emulated stm32 or stk500 target via
+ * the loopback interface under linux)
+ * Author Davide Ciminaghi, 2016
+ * Public domain
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dfu.h>
+#include <dfu-linux.h>
+#include <dfu-stm32.h>
+#include <dfu-stk500.h>
+#include <dfu-emu.h>
+
+#define APPEND_SIZE 512
+
+struct private_data {
+	void *ptr;
+	int file_size;
+};
+
+static void help(int argc, char *argv[])
+{
+	fprintf(stderr, "Use %s [-b baud] [-p page_program_us] "
+		"[-e sector_erase_us] [-o flash_dump_file] stm32|stk500 "
+		"<fname>\n", argv[0]);
+}
+
+static void *map_file(const char *path, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	void *out;
+
+	if (fd < 0) {
+		perror("open");
+		return NULL;
+	}
+	out = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (out == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	close(fd);
+	return out;
+}
+
+static int binary_file_on_space_available(struct dfu_binary_file *f)
+{
+	struct private_data *priv = dfu_binary_file_get_priv(f);
+	int tot = dfu_binary_file_get_tot_appended(f), stat, sz;
+
+	if (!priv) {
+		dfu_err("NO PRIVATE DATA FOR BINARY FILE");
+		return -1;
+	}
+	/* Append in small pieces, file can be bigger than the input buffer */
+	sz = priv->file_size - tot;
+	if (sz > APPEND_SIZE)
+		sz = APPEND_SIZE;
+	dfu_dbg("tot = %d, appending %d\n", tot, sz);
+	stat = dfu_binary_file_append_partial(f, &((char *)priv->ptr)[tot], sz);
+	if (stat < 0)
+		return stat;
+	dfu_dbg("appended %d bytes\n", stat);
+	tot = dfu_binary_file_get_tot_appended(f);
+	if (tot == priv->file_size) {
+		dfu_dbg("nothing more to append\n");
+		dfu_binary_file_append_buffer(f, NULL, 0);
+		return 0;
+	}
+	return 0;
+}
+
+static struct dfu_binary_file_ops binary_file_ops = {
+	.on_space_available = binary_file_on_space_available,
+};
+
+static int dump_flash(const char *path, const void *flash, size_t size)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+	if (fwrite(flash, 1, size, f) != size) {
+		perror("fwrite");
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct dfu_emu emu;
+	struct dfu_emu_timings t = { .baud = 115200, };
+	const struct dfu_emu_ops *ops;
+	const struct dfu_target_ops *tops;
+	const void *pars;
+	unsigned long flash_size;
+	void *flash;
+	const char *fpath, *dump = NULL;
+	int ret, opt;
+	struct stat s;
+	struct dfu_data *dfu;
+	struct dfu_binary_file *f;
+	void *ptr;
+	struct private_data priv;
+
+	while ((opt = getopt(argc, argv, "b:p:e:o:")) != -1) {
+		switch (opt) {
+		case 'b':
+			t.baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			t.page_program_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			t.sector_erase_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			dump = optarg;
+			break;
+		default:
+			help(argc, argv);
+			exit(127);
+		}
+	}
+	if (optind + 2 > argc) {
+		help(argc, argv);
+		exit(127);
+	}
+	if (!strcmp(argv[optind], "stm32")) {
+		ops = &stm32_usart_emu_ops;
+		tops = &stm32_dfu_target_ops;
+		pars = &stm32f469bi_device_data;
+		flash_size = 2 * 1024 * 1024;
+	} else if (!strcmp(argv[optind], "stk500")) {
+		ops = &stk500_emu_ops;
+		tops = &stk500_dfu_target_ops;
+		pars = &atmega328p_device_data;
+		flash_size = 32 * 1024;
+	} else {
+		help(argc, argv);
+		exit(127);
+	}
+	fpath = argv[optind + 1];
+
+	ret = stat(fpath, &s);
+	if (ret < 0) {
+		perror("stat");
+		exit(127);
+	}
+	flash = malloc(flash_size);
+	if (!flash) {
+		perror("malloc");
+		exit(127);
+	}
+	/* Unknown contents, writes to sectors which were not erased fail */
+	memset(flash, 0, flash_size);
+	if (dfu_emu_init(&emu, ops, pars, &t, flash, flash_size) < 0) {
+		fprintf(stderr, "Error initializing emulator\n");
+		exit(127);
+	}
+	dfu = dfu_init(&linux_loopback_interface_ops,
+		       NULL,
+		       &emu,
+		       /* No interface start cb */
+		       NULL,
+		       NULL,
+		       tops,
+		       pars,
+		       &linux_dfu_host_ops,
+		       NULL,
+		       NULL);
+	if (!dfu) {
+		fprintf(stderr, "Error initializing libdfu\n");
+		exit(127);
+	}
+	ptr = map_file(fpath, s.st_size);
+	priv.ptr = ptr;
+	priv.file_size = s.st_size;
+	f = dfu_new_binary_file(NULL, 0, s.st_size, dfu, 0,
+				&binary_file_ops, &priv);
+	if (!f) {
+		fprintf(stderr, "Error setting up binary file struct\n");
+		exit(127);
+	}
+	/* Reset and probe target */
+	if (dfu_target_reset(dfu) < 0) {
+		fprintf(stderr, "Error resetting target\n");
+		exit(127);
+	}
+	if (dfu_target_probe(dfu) < 0) {
+		fprintf(stderr, "Error probing target\n");
+		exit(127);
+	}
+	if (dfu_target_erase_all(dfu) < 0) {
+		fprintf(stderr, "Error erasing target memory\n");
+		exit(127);
+	}
+	/* Start programming data */
+	if (dfu_binary_file_flush_start(f) < 0) {
+		fprintf(stderr, "Error programming file\n");
+		exit(127);
+	}
+	/* Loop around waiting for events */
+	do {
+		ret = dfu_idle(dfu);
+		switch (ret) {
+		case DFU_ERROR:
+			fprintf(stderr, "Error programming file\n");
+			break;
+		case DFU_ALL_DONE:
+			fprintf(stderr, "Programming DONE\n");
+			break;
+		case DFU_CONTINUE:
+			break;
+		default:
+			fprintf(stderr,
+				"Invalid ret value %d from dfu_idle()\n", ret);
+			break;
+		}
+	} while(ret == DFU_CONTINUE);
+	dfu_log_stats(dfu);
+	dfu_log_phase_stats(dfu);
+	fprintf(stderr, "emulator: %lu pages programmed, %lu sectors erased, "
+		"%lu errors\n", emu.pages_programmed, emu.sectors_erased,
+		emu.errors);
+	if (ret == DFU_ERROR || emu.errors)
+		exit(1);
+	/* Let target run */
+	ret = dfu_target_go(dfu);
+	if (dump && dump_flash(dump, flash, emu.flash_size) < 0)
+		exit(127);
+	exit(ret);
+}
@@ -0,0 +1,192 @@
+/*
+ * libdfu, usage sample (emulated stm32 or stk500 target on a pseudo
+ * terminal). Prints the slave pty name, which can then be used as serial
+ * port by linux-stm32 or linux-arduino-uno.
+ * Author Davide Ciminaghi, 2016
+ * Public domain
+ */
+/* For posix_openpt() and friends */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dfu.h>
+#include <dfu-linux.h>
+#include <dfu-stm32.h>
+#include <dfu-stk500.h>
+#include <dfu-emu.h>
+
+static volatile sig_atomic_t done;
+
+static void help(int argc, char *argv[])
+{
+	fprintf(stderr, "Use %s [-b baud] [-p page_program_us] "
+		"[-e sector_erase_us] [-o flash_dump_file] stm32|stk500\n",
+		argv[0]);
+}
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static int open_pty(int *slave)
+{
+	struct termios config;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if (grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror("grantpt/unlockpt");
+		return -1;
+	}
+	/*
+	 * Keep the slave open, so that its configuration (raw) survives
+	 * and reading master doesn't return EIO when no client is there
+	 */
+	*slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (*slave < 0) {
+		perror("open slave pty");
+		return -1;
+	}
+	if (tcgetattr(*slave, &config) < 0) {
+		perror("tcgetattr");
+		return -1;
+	}
+	cfmakeraw(&config);
+	if (tcsetattr(*slave, TCSANOW, &config) < 0) {
+		perror("tcsetattr");
+		return -1;
+	}
+	return fd;
+}
+
+static int dump_flash(const char *path, const void *flash, size_t size)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+	if (fwrite(flash, 1, size, f) != size) {
+		perror("fwrite");
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct dfu_emu emu;
+	struct dfu_emu_timings t = { .baud = 115200, };
+	const struct dfu_emu_ops *ops;
+	const void *pars;
+	const char *dump = NULL;
+	unsigned long flash_size;
+	void *flash;
+	char buf[256];
+	struct pollfd pfd;
+	long us;
+	int fd, slave, opt, stat;
+
+	while ((opt = getopt(argc, argv, "b:p:e:o:")) != -1) {
+		switch (opt) {
+		case 'b':
+			t.baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			t.page_program_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			t.sector_erase_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			dump = optarg;
+			break;
+		default:
+			help(argc, argv);
+			exit(127);
+		}
+	}
+	if (optind >= argc) {
+		help(argc, argv);
+		exit(127);
+	}
+	if (!strcmp(argv[optind], "stm32")) {
+		ops = &stm32_usart_emu_ops;
+		pars = &stm32f469bi_device_data;
+		flash_size = 2 * 1024 * 1024;
+	} else if (!strcmp(argv[optind], "stk500")) {
+		ops = &stk500_emu_ops;
+		pars = &atmega328p_device_data;
+		flash_size = 32 * 1024;
+	} else {
+		help(argc, argv);
+		exit(127);
+	}
+	flash = malloc(flash_size);
+	if (!flash) {
+		perror("malloc");
+		exit(127);
+	}
+	/* Unknown contents, writes to sectors which were not erased fail */
+	memset(flash, 0, flash_size);
+	if (dfu_emu_init(&emu, ops, pars, &t, flash, flash_size) < 0) {
+		fprintf(stderr, "Error initializing emulator\n");
+		exit(127);
+	}
+	fd = open_pty(&slave);
+	if (fd < 0)
+		exit(127);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!done) {
+		/* Wait for host data or for the next reply byte to be due */
+		us = dfu_emu_next_output(&emu);
+		stat = poll(&pfd, 1, us < 0 ? -1 : (us + 999) / 1000);
+		if (stat < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (stat > 0) {
+			stat = read(fd, buf, sizeof(buf));
+			if (stat < 0) {
+				perror("read");
+				break;
+			}
+			dfu_emu_write(&emu, buf, stat);
+		}
+		while ((stat = dfu_emu_read(&emu, buf, sizeof(buf))) > 0)
+			if (write(fd, buf, stat) < 0) {
+				perror("write");
+				break;
+			}
+	}
+	fprintf(stderr, "%lu pages programmed, %lu sectors erased, "
+		"%lu errors\n", emu.pages_programmed, emu.sectors_erased,
+		emu.errors);
+	if (dump && dump_flash(dump, flash, emu.flash_size) < 0)
+		exit(127);
+	close(slave);
+	close(fd);
+	exit(0);
+}
@@ -26,16 +26,7 @@ static void help(int argc, char *argv[])
 	fprintf(stderr, "Use %s <fname> <serial_port>\n", argv[0]);
 }
 
-static int binary_file_poll_idle(struct dfu_binary_file *f)
-{
-	struct private_data *priv = dfu_binary_file_get_priv(f);
-	int tot = dfu_binary_file_get_tot_appended(f);
-
-	/* Always ready */
-	return tot < priv->file_size ? DFU_FILE_EVENT : 0;
-}
-
-static int binary_file_on_event(struct dfu_binary_file *f)
+static int binary_file_on_space_available(struct dfu_binary_file *f)
 {
 	struct private_data *priv = dfu_binary_file_get_priv(f);
 	int tot = dfu_binary_file_get_tot_appended(f), stat;
@@ -55,7 +46,7 @@ static int binary_file_on_event(struct dfu_binary_file *f)
 	}
 	dfu_dbg("%s: tot = %d, appending %d\n", __func__,
 		tot, priv->file_size - tot);
-	stat = dfu_binary_file_append_buffer(f, priv->buf, stat);
+	stat = dfu_binary_file_append_partial(f, priv->buf, stat);
 	if (stat < 0)
 		return stat;
 	dfu_dbg("appended %d bytes\n", stat);
@@ -69,8 +60,7 @@ static int binary_file_on_event(struct dfu_binary_file *f)
 }
 
 static struct dfu_binary_file_ops binary_file_ops = {
-	.poll_idle = binary_file_poll_idle,
-	.on_event = binary_file_on_event,
+	.on_space_available = binary_file_on_space_available,
 };
 
 int main(int argc, char *argv[])
@@ -105,7 +95,8 @@ int main(int argc, char *argv[])
 		       &nordic_spi_dfu_target_ops,
 		       NULL,
 		       &linux_dfu_host_ops,
-		       &posix_fc_ops);
+		       &posix_fc_ops,
+		       NULL);
 	if (!dfu) {
 		fprintf(stderr, "Error initializing libdfu\n");
 		exit(127);
@@ -159,6 +150,8 @@ int main(int argc, char *argv[])
 			break;
 		}
 	} while(ret == DFU_CONTINUE);
+	dfu_log_stats(dfu);
+	dfu_log_phase_stats(dfu);
 	/* Let target run */
 	exit(dfu_target_go(dfu));
 }
@@ -12,22 +12,62 @@
 #define CONFIG_DECODED_BINARY_FILE_BUFSIZE 2048
 #endif
 
-static char bf_buf[CONFIG_BINARY_FILE_BUFSIZE];
-static char bf_decoded_buf[CONFIG_DECODED_BINARY_FILE_BUFSIZE];
+/*
+ * Smallest rings for binary files living in a caller provided arena: the
+ * longest intel hex or s-record record (255 data bytes, over 512 chars)
+ * must fit
+ */
+#ifndef CONFIG_MIN_BINARY_FILE_BUFSIZE
+#define CONFIG_MIN_BINARY_FILE_BUFSIZE 1024
+#endif
+
+/* Differential mode: target memory is read back this many bytes at a time */
+#ifndef CONFIG_BINARY_FILE_DIFF_BUFSIZE
+#define CONFIG_BINARY_FILE_DIFF_BUFSIZE 256
+#endif
+
+/* One binary file per dfu instance */
+static char bf_buf[CONFIG_DFU_MAX_INSTANCES][CONFIG_BINARY_FILE_BUFSIZE];
+static char bf_decoded_buf[CONFIG_DFU_MAX_INSTANCES]
+	[CONFIG_DECODED_BINARY_FILE_BUFSIZE];
+static struct dfu_write_chunk bf_write_chunks[CONFIG_DFU_MAX_INSTANCES]
+	[CONFIG_MAX_CHUNKS];
+
+static struct dfu_binary_file bfiles[CONFIG_DFU_MAX_INSTANCES];
 
-static struct dfu_binary_file bfile;
+static char bf_diff_buf[CONFIG_DFU_MAX_INSTANCES]
+	[CONFIG_BINARY_FILE_DIFF_BUFSIZE];
 
-static int _bf_init(struct dfu_binary_file *bf, char *b, char *db,
-		    int db_size, struct dfu_data *dfu)
+/*
+ * Number of chunks the target can write at the same time, there must always
+ * be a free write chunk for the decoder
+ */
+static int _bf_queue_depth(struct dfu_binary_file *bf)
+{
+	struct dfu_target *tgt = bf->dfu ? bf->dfu->target : NULL;
+	int depth = 1;
+
+	if (tgt && tgt->ops->get_queue_depth)
+		depth = tgt->ops->get_queue_depth(tgt);
+	depth = min(depth, CONFIG_MAX_WRITE_QUEUE_DEPTH);
+	depth = min(depth, bf->max_chunks - 1);
+	return depth < 1 ? 1 : depth;
+}
+
+static int _bf_init(struct dfu_binary_file *bf, char *b, int b_size, char *db,
+		    int db_size, struct dfu_write_chunk *wcs, int nwcs,
+		    struct dfu_data *dfu)
 {
 	struct dfu_target *tgt = dfu ? dfu->target : NULL;
 	int cs;
 
 	bf->buf = b;
 	bf->head = bf->tail = 0;
+	bf->appended_head = bf->released_tail = 0;
 	bf->decoded_buf = db;
 	bf->decoded_head = bf->decoded_tail = bf->write_tail = 0;
 	bf->decoded_size = db_size;
+	bf->decoded_chunk_size = 0;
 	bf->write_chunk_size = db_size;
 	if (tgt && tgt->ops->get_write_chunk_size) {
 		/*
@@ -44,20 +84,58 @@ static int _bf_init(struct dfu_binary_file *bf, char *b, char *db,
 		bf->write_chunk_size = cs;
 		bf->decoded_size = (db_size / cs) * cs;
 	}
+	bf->page_size = 0;
+	/* Pages being assembled must leave room for decoding */
+	if (tgt && tgt->ops->get_write_chunk_size &&
+	    bf->decoded_size >= 4 * bf->write_chunk_size &&
+	    !(tgt->ops->ignore_chunk_alignment &&
+	      tgt->ops->ignore_chunk_alignment(tgt)))
+		bf->page_size = bf->write_chunk_size;
+	bf->elide_erased = tgt && tgt->ops->get_erased_value;
+	bf->erased_value = bf->elide_erased ?
+		tgt->ops->get_erased_value(tgt) : 0xff;
+	bf->differential = 0;
+	bf->diff_wc = -1;
+	bf->diff_reading = 0;
+	bf->journal_fd = -1;
+	bf->journal_path = NULL;
+	bf->resuming = 0;
+	bf->skipped_end = 0;
+	bf->digest = 0;
 	bf->write_chunks_head = bf->write_chunks_tail = 0;
-	memset(bf->write_chunks, 0, sizeof(bf->write_chunks));
+	bf->write_chunks_ready = bf->write_chunks_sent = 0;
+	bf->write_chunks = wcs;
+	bf->max_chunks = nwcs;
+	if (wcs)
+		memset(wcs, 0, nwcs * sizeof(*wcs));
+	bf->leader = NULL;
+	memset(bf->gang, 0, sizeof(bf->gang));
+	bf->gang_size = 0;
+	bf->gang_tail = 0;
+	memset(bf->segs, 0, sizeof(bf->segs));
+	bf->segs_head = bf->segs_fed = bf->segs_tail = 0;
+	bf->segs_offset = 0;
 	bf->written = 0;
 	bf->really_written = 0;
 	bf->rx_done = 0;
+	bf->tot_decoded = 0;
 	bf->flushing = 0;
+	bf->decode_done = 0;
+	bf->pipelined = 0;
+	bf->image = 0;
+	bf->space_wanted = 1;
+	bf->space_watermark = b_size > 4 ? b_size / 4 : 1;
+	bf->decode_error = 0;
 	bf->format_data = NULL;
 	bf->format_ops = NULL;
+	bf->ops = NULL;
 	bf->rx_method = NULL;
-	bf->max_size = sizeof(bf_buf);
+	bf->max_size = b_size;
 	bf->tot_appended = 0;
 	bf->dfu = dfu;
 	if (dfu)
 		dfu->bf = bf;
+	bf->write_queue_depth = _bf_queue_depth(bf);
 	bf->format_data = NULL;
 	bf->priv = NULL;
 	dfu_cancel_timeout(&bf->rx_timeout);
@@ -66,7 +144,48 @@ static int _bf_init(struct dfu_binary_file *bf, char *b, char *db,
 
 static void _bf_fini(struct dfu_binary_file *bf, struct dfu_data *dfu)
 {
-	_bf_init(bf, NULL, NULL, 0, dfu);
+	_bf_init(bf, NULL, 0, NULL, 0, NULL, 0, dfu);
+}
+
+/* Give all of the lent segments back, nothing is going to be written */
+static void _bf_release_segments(struct dfu_binary_file *bf)
+{
+	struct dfu_segment *seg;
+	int i;
+
+	for (i = bf->segs_tail; i != bf->segs_head;
+	     i = (i + 1) & (ARRAY_SIZE(bf->segs) - 1)) {
+		seg = &bf->segs[i];
+		if (seg->refs && seg->release)
+			seg->release(seg->buf, seg->priv);
+		seg->refs = 0;
+	}
+	bf->segs_tail = bf->segs_head;
+}
+
+/* Resume journal (see dfu_binary_file_set_journal()) */
+static void _bf_journal_close(struct dfu_binary_file *bf)
+{
+	if (bf->journal_fd < 0)
+		return;
+	dfu_file_close(bf->dfu, bf->journal_fd);
+	bf->journal_fd = -1;
+	bf->resuming = 0;
+}
+
+static void _bf_gang_leave(struct dfu_binary_file *bf)
+{
+	struct dfu_binary_file *l = bf->leader;
+	int i;
+
+	for (i = 0; i < l->gang_size && l->gang[i] != bf; i++);
+	if (i == l->gang_size)
+		return;
+	for ( ; i < l->gang_size - 1; i++)
+		l->gang[i] = l->gang[i + 1];
+	l->gang[--l->gang_size] = NULL;
+	/* Don't wait for this member anymore */
+	bf_gang_update_tail(l);
 }
 
 int dfu_binary_file_fini(struct dfu_binary_file *bf)
@@ -75,6 +194,19 @@ int dfu_binary_file_fini(struct dfu_binary_file *bf)
 
 	if (!bf)
 		return -1;
+	if (bf->gang_size > 1) {
+		dfu_err("%s: gang members must be finalized first\n",
+			__func__);
+		return -1;
+	}
+	if (bf->leader)
+		_bf_gang_leave(bf);
+	/* Interrupted: the journal is kept for the next session */
+	_bf_journal_close(bf);
+	if (bf->pipelined && bf->flushing)
+		/* Decoder must be stopped before finalizing the format */
+		bf->dfu->host->ops->stop_worker(bf->dfu->host);
+	_bf_release_segments(bf);
 	if (bf->rx_method && bf->rx_method->ops->fini) {
 		ret = bf->rx_method->ops->fini(bf);
 		if (ret < 0)
@@ -89,9 +221,25 @@ int dfu_binary_file_fini(struct dfu_binary_file *bf)
 	return 0;
 }
 
-static int _bf_find_format(struct dfu_binary_file *bf)
+/*
+ * Worst case number of write chunks taken by a decoded chunk: it can be
+ * split at both ends
+ */
+static int _bf_wc_needed(struct dfu_binary_file *bf)
+{
+	int n = bf->decoded_chunk_size / bf->write_chunk_size + 2;
+
+	return min(n, bf->max_chunks - 1);
+}
+
+/*
+ * Returns 0 if a format was found, 1 if more data are needed, negative
+ * if no format could be found
+ */
+static int _bf_find_format(struct dfu_binary_file *bf, int all_appended)
 {
 	const struct dfu_format_ops *ptr;
+	int stat;
 
 	for (ptr = registered_formats_start;
 	     ptr != registered_formats_end; ptr++) {
@@ -102,10 +250,14 @@ static int _bf_find_format(struct dfu_binary_file *bf)
 			 * See arduino/build_src_zip
 			 */
 			return -1;
-		if (!ptr->probe(bf)) {
-			bf->format_ops = ptr;
+		stat = ptr->probe(bf);
+		if (!stat) {
+			dfu_store_release(&bf->format_ops, ptr);
 			return 0;
 		}
+		if (stat > 0 && !all_appended)
+			/* Wait for more data before trying the next formats */
+			return 1;
 	}
 	return -1;
 }
@@ -125,7 +277,7 @@ static int bf_enqueue_for_writing(struct dfu_binary_file *bf, int len,
 		(unsigned int)addr);
 	do {
 		wc = NULL;
-		if (!ign_al && bf_wc_count(bf)) {
+		if (!ign_al && bf_wc_used(bf)) {
 			/*
 			 * Check whether last write chunk before head is
 			 * pending
@@ -133,7 +285,7 @@ static int bf_enqueue_for_writing(struct dfu_binary_file *bf, int len,
 			int w = bf->write_chunks_head - 1;
 
 			if (w < 0)
-				w = ARRAY_SIZE(bf->write_chunks) - 1;
+				w = bf->max_chunks - 1;
 			if (bf->write_chunks[w].pending)
 				wc = &bf->write_chunks[w];
 		}
@@ -187,6 +339,7 @@ static int bf_enqueue_for_writing(struct dfu_binary_file *bf, int len,
 		/* New chunk */
 		wc->start = bf->write_tail;
 		wc->len = min(len, bf->write_chunk_size);
+		wc->data = NULL;
 		if (ign_al)
 			/*
 			 * In case alignment is ignored, we're not guaranteed
@@ -237,111 +390,873 @@ static void _set_rx_timeout(struct dfu_binary_file *bf, int moveit)
 		dfu_err("WARNING: unable to set rx timeout\n");
 }
 
+/*
+ * Synchronous target reads (differential mode, sectors saved by
+ * must_erase()) can take longer than the rx timeout on slow links: stop
+ * it meanwhile. Returns 1 if it was running
+ */
+static int _bf_stop_rx_timeout(struct dfu_binary_file *bf)
+{
+	if (!bf->rx_timeout.dfu)
+		return 0;
+	dfu_cancel_timeout(&bf->rx_timeout);
+	return 1;
+}
+
+static void _bf_restart_rx_timeout(struct dfu_binary_file *bf, int running)
+{
+	if (running)
+		_set_rx_timeout(bf, 0);
+}
+
+/*
+ * Pipeline mode: tell the decoder (@bf is the leader) that new data or
+ * new space are available
+ */
+static void _bf_kick_decoder(struct dfu_binary_file *bf)
+{
+	struct dfu_host *host = bf->dfu->host;
+
+	/* Kicks are not lost if the worker hasn't been started yet */
+	if (bf->pipelined)
+		host->ops->kick_worker(host);
+}
+
+/*
+ * Wake up the loop driving @bf (the leader). Gang members are driven by
+ * the same loop, waking up one of them is enough, but not a failed one
+ * (the application doesn't invoke its dfu_idle() anymore)
+ */
+static void _bf_wakeup(struct dfu_binary_file *bf)
+{
+	int i;
+
+	for (i = 0; i < bf->gang_size && dfu_error(bf->gang[i]->dfu); i++)
+		;
+	dfu_wakeup(i < bf->gang_size ? bf->gang[i]->dfu : bf->dfu);
+}
+
+void bf_gang_update_tail(struct dfu_binary_file *bf)
+{
+	struct dfu_binary_file *m;
+	struct dfu_write_chunk *wc;
+	const int nchunks = bf->max_chunks;
+	int i, n, tail, to_be_freed = -1;
+
+	/* Look for the alive member which is late the most */
+	for (i = 0; i < bf->gang_size; i++) {
+		m = bf->gang[i];
+		if (dfu_error(m->dfu))
+			/* Failed member, don't wait for it */
+			continue;
+		n = _count(m->write_chunks_tail, bf->gang_tail, nchunks);
+		if (to_be_freed < 0 || n < to_be_freed)
+			to_be_freed = n;
+	}
+	if (to_be_freed <= 0)
+		return;
+	/* Free chunks written by all alive members */
+	for (tail = bf->gang_tail; to_be_freed > 0; to_be_freed--) {
+		wc = &bf->write_chunks[tail];
+		bf_free_write_chunk(wc);
+		if (!wc->data)
+			dfu_store_release(&bf->decoded_tail,
+					  (wc->start + wc->len) &
+					  (bf->decoded_size - 1));
+		tail = (tail + 1) & (nchunks - 1);
+	}
+	dfu_store_release(&bf->gang_tail, tail);
+	_bf_kick_decoder(bf);
+}
+
+/*
+ * Returns 1 if @len bytes at @buf all equal @v. Bytes are compared a word
+ * at a time, four words per iteration (compilers vectorize this)
+ */
+static int _bf_is_erased(const char *buf, int len, int v)
+{
+	unsigned long w[4], pattern = (unsigned char)v * (~0UL / 0xff);
+	const int wsz = sizeof(w);
+
+	for ( ; len >= wsz; buf += wsz, len -= wsz) {
+		memcpy(w, buf, wsz);
+		if ((w[0] ^ pattern) | (w[1] ^ pattern) |
+		    (w[2] ^ pattern) | (w[3] ^ pattern))
+			return 0;
+	}
+	for ( ; len; len--)
+		if (*buf++ != (char)v)
+			return 0;
+	return 1;
+}
+
+/* A chunk won't be written, the target must preserve it (see must_erase) */
+static void _bf_skipped(struct dfu_binary_file *bf,
+			const struct dfu_write_chunk *wc)
+{
+	if (wc->addr + wc->len > bf->skipped_end)
+		bf->skipped_end = wc->addr + wc->len;
+}
+
+/*
+ * Target memory preceding the returned address must survive erasing the
+ * sector of @wc: chunks there were not written. In differential mode,
+ * chunks preceding @wc in its sector could be unchanged as well
+ */
+static phys_addr_t _bf_preserve_end(const struct dfu_binary_file *bf,
+				    const struct dfu_write_chunk *wc)
+{
+	if (bf->differential)
+		return max(bf->skipped_end, wc->addr);
+	return bf->skipped_end;
+}
+
+/*
+ * Resume journal: a header followed by one record per written chunk, all
+ * little endian. Each record's chain value covers the previous one, so that
+ * records left over by older sessions are not taken as valid
+ */
+#define JOURNAL_MAGIC 0x4a554644
+
+struct bf_journal_header {
+	uint32_t magic;
+	/* Incremented by every session */
+	uint32_t gen;
+};
+
+struct bf_journal_record {
+	uint32_t addr;
+	uint32_t len;
+	/* crc32 of chunk data */
+	uint32_t crc;
+	uint32_t gen;
+	uint32_t chain;
+};
+
+static uint32_t _bf_crc(const char *buf, int len)
+{
+	uint32_t crc;
+
+	crc32_init(&crc);
+	crc32_iteration((const uint8_t *)buf, len, &crc);
+	crc32_done(&crc);
+	return crc;
+}
+
+/* Chain value of @r, following a record whose chain value is @prev */
+static uint32_t _bf_journal_chain(const struct bf_journal_record *r,
+				  uint32_t prev)
+{
+	uint32_t crc;
+
+	prev = cpu_to_le32(prev);
+	crc32_init(&crc);
+	crc32_iteration((const uint8_t *)&prev, sizeof(prev), &crc);
+	crc32_iteration((const uint8_t *)r, sizeof(*r) - sizeof(r->chain),
+			&crc);
+	crc32_done(&crc);
+	return crc;
+}
+
+/*
+ * Resuming: returns 1 if the next record of the journal describes chunk @wc
+ * (with @data), 0 if it doesn't (chunks are written from here on)
+ */
+static int _bf_journal_check(struct dfu_binary_file *bf,
+			     const struct dfu_write_chunk *wc,
+			     const char *data)
+{
+	struct bf_journal_record r;
+
+	if (dfu_file_read(bf->dfu, bf->journal_fd, &r, sizeof(r)) ==
+	    sizeof(r) &&
+	    le32_to_cpu(r.chain) == _bf_journal_chain(&r, bf->journal_chain) &&
+	    le32_to_cpu(r.addr) == wc->addr &&
+	    le32_to_cpu(r.len) == wc->len &&
+	    le32_to_cpu(r.crc) == _bf_crc(data, wc->len)) {
+		bf->journal_chain = le32_to_cpu(r.chain);
+		bf->journal_n++;
+		return 1;
+	}
+	dfu_log("resuming from chunk @0x%08x\n", (unsigned int)wc->addr);
+	bf->resuming = 0;
+	/* Records following the last valid one are overwritten */
+	if (dfu_file_seek(bf->dfu, bf->journal_fd,
+			  sizeof(struct bf_journal_header) +
+			  bf->journal_n * sizeof(r)) < 0) {
+		dfu_err("%s: cannot seek journal, dropping it\n", __func__);
+		_bf_journal_close(bf);
+	}
+	return 0;
+}
+
+/* Chunk @wc has been written, record it */
+static void _bf_journal_add(struct dfu_binary_file *bf,
+			    const struct dfu_write_chunk *wc)
+{
+	const char *data = wc->data ? wc->data :
+		&((char *)bf_leader(bf)->decoded_buf)[wc->start];
+	struct bf_journal_record r;
+	uint32_t chain;
+
+	r.addr = cpu_to_le32(wc->addr);
+	r.len = cpu_to_le32(wc->len);
+	r.crc = cpu_to_le32(_bf_crc(data, wc->len));
+	r.gen = cpu_to_le32(bf->journal_gen);
+	chain = _bf_journal_chain(&r, bf->journal_chain);
+	r.chain = cpu_to_le32(chain);
+	if (dfu_file_write(bf->dfu, bf->journal_fd, &r, sizeof(r)) !=
+	    sizeof(r)) {
+		dfu_err("%s: cannot write journal, dropping it\n", __func__);
+		_bf_journal_close(bf);
+		return;
+	}
+	bf->journal_chain = chain;
+	bf->journal_n++;
+}
+
+/*
+ * Differential mode: returns 1 if the target's memory contains @len bytes
+ * at @buf from @addr already, 0 if it doesn't, negative on error
+ */
+static int _bf_unchanged(struct dfu_binary_file *bf, phys_addr_t addr,
+			 const char *buf, int len)
+{
+	struct dfu_target *tgt = bf->dfu->target;
+	char *rbuf = bf_diff_buf[dfu_id(bf->dfu)];
+	int l;
+
+	for ( ; len; addr += l, buf += l, len -= l) {
+		l = min(len, CONFIG_BINARY_FILE_DIFF_BUFSIZE);
+		if (tgt->ops->read_memory(tgt, rbuf, addr, l) < 0)
+			return -1;
+		if (memcmp(rbuf, buf, l))
+			return 0;
+	}
+	return 1;
+}
+
 /* Send first available write chunk to target for writing */
 static int _bf_do_write(struct dfu_binary_file *bf)
 {
+	struct dfu_binary_file *l = bf_leader(bf);
 	struct dfu_target *tgt = bf->dfu->target;
 	const struct dfu_target_ops *tops = tgt->ops;
 	int stat;
 	struct dfu_write_chunk *wc;
+	const char *data;
+	int to_running;
+	dfu_profile_declare(t);
 
-	if (dfu_target_busy(tgt))
+	if (dfu_target_busy(tgt) || bf->diff_reading)
 		/* Target is busy */
 		return 0;
 	/*
 	 * Get next non-pending write chunk. Be happy with a pending chunk
 	 * if this is the last one
 	 */
-	wc = bf_next_write_chunk(bf, bf->written && bf_wc_count(bf) == 1);
+	wc = bf_next_write_chunk(bf, dfu_load_acquire(&l->decode_done) &&
+				 bf_wc_to_send(bf) == 1);
 	if (!wc)
-		/* Nothing to write */
+		/* Nothing to write, or target's queue is full */
 		return 0;
 
-	if (tops->must_erase && tops->must_erase(tgt, wc->addr, wc->len)) {
-		wc->write_pending = 0;
-		/* Must erase sector */
+	data = wc->data ? wc->data : &((char *)l->decoded_buf)[wc->start];
+	bf->dfu->stats.chunk_start[(wc - l->write_chunks) &
+				   (CONFIG_MAX_WRITE_QUEUE_DEPTH - 1)] =
+		dfu_get_current_time_us(bf->dfu);
+	if (bf->resuming) {
+		if (bf_wc_in_flight(bf) > 1) {
+			/* Journal is checked when no chunk is being written */
+			bf_unsend_write_chunk(bf);
+			return 0;
+		}
+		if (_bf_journal_check(bf, wc, data)) {
+			dfu_dbg("%s: chunk @0x%08x written already\n",
+				__func__, (unsigned)wc->addr);
+			bf->dfu->stats.chunks_resumed++;
+			_bf_skipped(bf, wc);
+			dfu_binary_file_chunk_done(bf, wc->addr, 0);
+			return 0;
+		}
+	}
+	if (bf->differential && bf->diff_wc != wc - l->write_chunks) {
+		if (bf_wc_in_flight(bf) > 1) {
+			/* Memory is read when no chunk is being written */
+			bf_unsend_write_chunk(bf);
+			return 0;
+		}
+		bf->diff_reading = 1;
+		to_running = _bf_stop_rx_timeout(bf);
+		stat = _bf_unchanged(bf, wc->addr, data, wc->len);
+		_bf_restart_rx_timeout(bf, to_running);
+		bf->diff_reading = 0;
+		if (stat < 0) {
+			dfu_err("%s: cannot read target memory\n", __func__);
+			bf_unsend_write_chunk(bf);
+			return stat;
+		}
+		if (stat) {
+			dfu_dbg("%s: chunk @0x%08x is unchanged\n", __func__,
+				(unsigned)wc->addr);
+			bf->dfu->stats.chunks_unchanged++;
+			_bf_skipped(bf, wc);
+			dfu_binary_file_chunk_done(bf, wc->addr, 0);
+			return 0;
+		}
+		/* Don't read it again if must_erase() says wait */
+		bf->diff_wc = wc - l->write_chunks;
+	}
+
+	if (tops->must_erase) {
+		dfu_profile_start(bf->dfu, t);
+		/* Differential mode: sectors could be read back first */
+		bf->diff_reading = bf->differential;
+		to_running = _bf_stop_rx_timeout(bf);
+		stat = tops->must_erase(tgt, wc->addr, wc->len,
+					_bf_preserve_end(bf, wc));
+		_bf_restart_rx_timeout(bf, to_running);
+		bf->diff_reading = 0;
+		dfu_profile_end(bf->dfu, DFU_PHASE_MUST_ERASE, t);
+		if (stat) {
+			bf_unsend_write_chunk(bf);
+			/* Must erase sector */
+			return 0;
+		}
+	}
+
+	bf->diff_wc = -1;
+	if (bf->elide_erased &&
+	    _bf_is_erased(data, wc->len, bf->erased_value)) {
+		if (bf_wc_in_flight(bf) > 1) {
+			/* Chunks are done in order, wait for previous ones */
+			bf_unsend_write_chunk(bf);
+			return 0;
+		}
+		/* Flash is erased already, nothing to write */
+		dfu_dbg("%s: chunk @0x%08x is blank\n", __func__,
+			(unsigned)wc->addr);
+		bf->dfu->stats.chunks_elided++;
+		dfu_binary_file_chunk_done(bf, wc->addr, 0);
 		return 0;
 	}
 
 	dfu_dbg("%s: writing chunk %d @0x%08x, size = %d\n",
-		__func__, (int)(wc - bf->write_chunks), (unsigned)wc->addr,
+		__func__, (int)(wc - l->write_chunks), (unsigned)wc->addr,
 		wc->len);
 	_set_rx_timeout(bf, 1);
-	stat = tops->chunk_available(tgt,
-				     wc->addr,
-				     &((char *)bf->decoded_buf)[wc->start],
-				     wc->len);
+	dfu_profile_start(bf->dfu, t);
+	stat = tops->chunk_available(tgt, wc->addr, data, wc->len);
+	dfu_profile_end(bf->dfu, DFU_PHASE_CHUNK_AVAILABLE, t);
 	if (stat < 0) {
+		if (bf_wc_in_flight(bf) > 1) {
+			/* Previous chunks are still being written */
+			bf_unsend_write_chunk(bf);
+			return stat;
+		}
 		dfu_dbg("%s: error from chunk_available(), throwing away write cchunk\n", __func__);
 		bf_put_write_chunk(bf);
+		_bf_kick_decoder(l);
 	}
 	return stat;
 }
 
 /*
- * Decode chunk and start writing it
- * Assumes interface can write to target
+ * Memory images: formats which can write data as they are get write chunks
+ * pointing straight into the image. Returns number of bytes enqueued
  */
-static int _bf_do_flush(struct dfu_binary_file *bf)
+static int _bf_image_zero_copy(struct dfu_binary_file *bf)
+{
+	const char *ptr = bf->buf;
+	struct dfu_write_chunk *wc;
+	phys_addr_t addr;
+	int l, tot = 0;
+
+	while (bf_count(bf) && bf_wc_space(bf)) {
+		l = min(bf_count(bf), bf->write_chunk_size);
+		if (bf->format_ops->decode_segment(bf, &ptr[bf->tail], l,
+						   &addr) != l)
+			break;
+		wc = bf_get_write_chunk(bf);
+		wc->start = bf->write_tail;
+		wc->len = l;
+		wc->addr = addr;
+		wc->pending = 0;
+		wc->data = &ptr[bf->tail];
+		wc->seg = NULL;
+		bf->tail += l;
+		tot += l;
+	}
+	if (tot)
+		dfu_store_release(&bf->tot_decoded, bf->tot_decoded + tot);
+	return tot;
+}
+
+/*
+ * Make decoded write chunks visible to the target(s). The last chunk is
+ * kept back while it can still grow, unless the whole file has been
+ * decoded.
+ */
+static void _bf_publish_chunks(struct dfu_binary_file *bf, int all)
+{
+	int h = bf->write_chunks_head;
+	int last = (h - 1) & (bf->max_chunks - 1);
+
+	if (!all && bf_wc_used(bf) && bf->write_chunks[last].pending)
+		h = last;
+	dfu_store_release(&bf->write_chunks_ready, h);
+}
+
+/* Enqueue @len decoded bytes for writing at @addr */
+static int _bf_enqueue_run(struct dfu_binary_file *bf, int len,
+			   phys_addr_t addr)
+{
+	dfu_dbg("%s: chunk decoded, addr = 0x%08x, len = %d\n", __func__,
+		(unsigned int)addr, len);
+	dfu_store_release(&bf->tot_decoded, bf->tot_decoded + len);
+	if (len > bf->decoded_chunk_size)
+		/* Stay on the safe side */
+		bf->decoded_chunk_size = len;
+	if (bf_enqueue_for_writing(bf, len, addr) < 0) {
+		dfu_err("%s: error enqueueing\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Decode chunk and enqueue it for writing
+ */
+static int _bf_decode(struct dfu_binary_file *bf, int all_appended)
 {
 	int stat;
 	phys_addr_t addr;
+	dfu_profile_declare(t);
 
 	if (!bf_count(bf))
 		/* Nothing to flush */
 		return 0;
 
 	if (!bf->format_ops) {
-		if (_bf_find_format(bf) < 0)
-			return -1;
-		_set_rx_timeout(bf, 0);
+		stat = _bf_find_format(bf, all_appended);
+		if (stat)
+			return stat < 0 ? stat : 0;
+		if (!bf->pipelined)
+			_set_rx_timeout(bf, 0);
 	}
-	if (bf_dec_space(bf) < 2 * bf->decoded_chunk_size)
+	if (bf->image && bf->format_ops->decode_segment)
+		return _bf_image_zero_copy(bf) > 0;
+	if (bf_dec_space(bf) < 2 * bf->decoded_chunk_size && bf_wc_used(bf))
+		/*
+		 * Wait for some chunks to be written. If there's none,
+		 * nothing is going to free decoded space (formats holding
+		 * data back, see bf_fill_erased()): formats check for space
+		 * anyway
+		 */
+		return 0;
+	if (bf_wc_space(bf) < _bf_wc_needed(bf))
+		/* Sparse records, wait for some chunks to be written */
 		return 0;
 
+	dfu_profile_start(bf->dfu, t);
 	stat = bf->format_ops->decode_chunk(bf, &addr);
+	dfu_profile_end(bf->dfu, DFU_PHASE_DECODE, t);
 	if (stat <= 0) {
 		if (stat < 0)
 			dfu_err("%s: error in decode_chunk\n", __func__);
 		return stat;
 	}
-	dfu_dbg("%s: chunk decoded, addr = 0x%08x, len = %d\n", __func__,
-		(unsigned int)addr, stat);
-	if (stat > bf->decoded_chunk_size)
-		/* Stay on the safe side */
-		bf->decoded_chunk_size = stat;
+	dfu_profile_start(bf->dfu, t);
+	stat = _bf_enqueue_run(bf, stat, addr);
+	dfu_profile_end(bf->dfu, DFU_PHASE_ENQUEUE, t);
+	return stat < 0 ? stat : 1;
+}
 
-	stat = bf_enqueue_for_writing(bf, stat, addr);
-	if (stat < 0) {
-		dfu_err("%s: error enqueueing\n", __func__);
+int bf_decoded_run(struct dfu_binary_file *bf, int len, phys_addr_t addr)
+{
+	if (!len)
+		return 1;
+	/* Chunks for this run, then for the next one */
+	if (bf_wc_space(bf) < len / bf->write_chunk_size + 2 +
+	    _bf_wc_needed(bf))
+		return 0;
+	if (_bf_enqueue_run(bf, len, addr) < 0)
 		return -1;
+	/* Writers can start with this run */
+	_bf_publish_chunks(bf, 0);
+	return 1;
+}
+
+void bf_fill_erased(struct dfu_binary_file *bf, int n)
+{
+	char *ptr = bf->decoded_buf;
+	int sz;
+
+	while (n > 0) {
+		sz = min(n, bf->decoded_size - bf->decoded_head);
+		memset(&ptr[bf->decoded_head], bf->erased_value, sz);
+		bf->decoded_head = (bf->decoded_head + sz) &
+			(bf->decoded_size - 1);
+		n -= sz;
 	}
+}
+
+static inline uint32_t _page_start(struct dfu_binary_file *bf, uint32_t a)
+{
+	return a & ~(bf->page_size - 1);
+}
+
+/* Too many written ranges, merge the two closest ones (gap included) */
+static void _pages_merge_closest(struct bf_pages *pg)
+{
+	struct bf_pages_range *r = pg->done;
+	int i, best = 1;
+
+	for (i = 2; i < pg->ndone; i++)
+		if (r[i].start - r[i - 1].end < r[best].start - r[best - 1].end)
+			best = i;
+	r[best - 1].end = r[best].end;
+	memmove(&r[best], &r[best + 1], (pg->ndone - best - 1) * sizeof(*r));
+	pg->ndone--;
+}
+
+/* Pages in [start, end) have been returned, keep ranges sorted and merged */
+static void _pages_done(struct bf_pages *pg, uint32_t start, uint32_t end)
+{
+	struct bf_pages_range *r = pg->done;
+	int i, j;
+
+	if (start == end)
+		return;
+	for (i = 0; i < pg->ndone && r[i].end < start; i++)
+		;
+	if (i < pg->ndone && r[i].start <= end) {
+		/* Overlapping or adjacent, merge (following ones too) */
+		r[i].start = min(r[i].start, start);
+		r[i].end = max(r[i].end, end);
+		for (j = i + 1; j < pg->ndone && r[j].start <= r[i].end; j++)
+			r[i].end = max(r[i].end, r[j].end);
+		memmove(&r[i + 1], &r[j], (pg->ndone - j) * sizeof(*r));
+		pg->ndone -= j - i - 1;
+		return;
+	}
+	if (pg->ndone == CONFIG_BF_PAGES_RANGES) {
+		_pages_merge_closest(pg);
+		_pages_done(pg, start, end);
+		return;
+	}
+	memmove(&r[i + 1], &r[i], (pg->ndone - i) * sizeof(*r));
+	r[i].start = start;
+	r[i].end = end;
+	pg->ndone++;
+}
+
+int bf_pages_written(struct dfu_binary_file *bf, struct bf_pages *pg,
+		     uint32_t a, int len)
+{
+	uint32_t start = _page_start(bf, a);
+	uint32_t end = _page_start(bf, a + max(len, 1) - 1) + bf->page_size;
+	int i;
+
+	for (i = 0; i < pg->ndone; i++)
+		if (pg->done[i].start < end && pg->done[i].end > start)
+			return 1;
 	return 0;
 }
 
+int bf_pages_release(struct dfu_binary_file *bf, struct bf_pages *pg,
+		     int decoded_tot, phys_addr_t *addr, int keep)
+{
+	uint32_t a;
+
+	if (pg->next_addr == pg->open_addr ||
+	    _page_start(bf, pg->next_addr - 1) - pg->open_addr <
+	    keep * bf->page_size)
+		return decoded_tot;
+	a = _page_start(bf, pg->next_addr - 1) - (keep - 1) * bf->page_size;
+	if (!decoded_tot)
+		*addr = pg->open_addr;
+	decoded_tot += a - pg->open_addr;
+	_pages_done(pg, pg->open_addr, a);
+	pg->open_addr = a;
+	return decoded_tot;
+}
+
+int bf_pages_close(struct dfu_binary_file *bf, struct bf_pages *pg,
+		   int decoded_tot, phys_addr_t *addr)
+{
+	int fill = (bf->page_size - (pg->next_addr & (bf->page_size - 1))) &
+		(bf->page_size - 1);
+
+	if (bf_dec_space(bf) < fill)
+		return decoded_tot;
+	bf_fill_erased(bf, fill);
+	pg->next_addr += fill;
+	if (!decoded_tot)
+		*addr = pg->open_addr;
+	_pages_done(pg, pg->open_addr, pg->next_addr);
+	pg->open = 0;
+	return decoded_tot + pg->next_addr - pg->open_addr;
+}
+
+void bf_segment_put(struct dfu_segment *seg)
+{
+	/* The slot can be recycled as soon as refs drops to 0 */
+	void (*release)(const void *, void *) = seg->release;
+	const void *buf = seg->buf;
+	void *priv = seg->priv;
+
+	if (!dfu_atomic_dec(&seg->refs) && release)
+		release(buf, priv);
+}
+
+/*
+ * Lent segments can be written as they are when the format supports it,
+ * all of the input buffer has been decoded and the input is at a write
+ * chunk boundary. Segment data must fill a whole chunk, unless they are
+ * the very last ones.
+ */
+static int _bf_can_zero_copy(struct dfu_binary_file *bf,
+			     struct dfu_segment *seg, int last)
+{
+	int l = (bf->write_chunks_head - 1) &
+		(bf->max_chunks - 1);
+
+	if (!bf->format_ops || !bf->format_ops->decode_segment ||
+	    bf_count(bf) || (bf->segs_offset & (bf->write_chunk_size - 1)))
+		return 0;
+	if (bf_wc_used(bf) && bf->write_chunks[l].pending)
+		return 0;
+	return seg->len - seg->done >= bf->write_chunk_size || last;
+}
+
+/*
+ * Enqueue write chunks pointing to @seg's data. Returns number of bytes
+ * enqueued
+ */
+static int _bf_seg_zero_copy(struct dfu_binary_file *bf,
+			     struct dfu_segment *seg, int last)
+{
+	struct dfu_write_chunk *wc;
+	phys_addr_t addr;
+	int l, tot = 0;
+
+	while (seg->done < seg->len && bf_wc_space(bf)) {
+		l = min(seg->len - seg->done, bf->write_chunk_size);
+		if (l < bf->write_chunk_size && !last)
+			break;
+		if (bf->format_ops->decode_segment(bf, &seg->buf[seg->done],
+						   l, &addr) != l)
+			break;
+		wc = bf_get_write_chunk(bf);
+		wc->start = bf->write_tail;
+		wc->len = l;
+		wc->addr = addr;
+		wc->pending = 0;
+		wc->data = &seg->buf[seg->done];
+		dfu_atomic_inc(&seg->refs);
+		wc->seg = seg;
+		seg->done += l;
+		bf->segs_offset += l;
+		tot += l;
+	}
+	if (tot)
+		dfu_store_release(&bf->tot_decoded, bf->tot_decoded + tot);
+	return tot;
+}
+
+/*
+ * Copy @seg's data to the input buffer. If the format could write data as
+ * they are, stop at the next write chunk boundary.
+ */
+static int _bf_seg_copy(struct dfu_binary_file *bf, struct dfu_segment *seg)
+{
+	char *ptr = bf->buf;
+	int sz, tot = 0, n = min(seg->len - seg->done,
+				 _space(bf->head, bf->tail, bf->max_size));
+
+	if (!bf->format_ops || bf->format_ops->decode_segment)
+		n = min(n, bf->write_chunk_size -
+			(bf->segs_offset & (bf->write_chunk_size - 1)));
+	while (n) {
+		sz = min(n, _space_to_end(bf->head, bf->tail, bf->max_size));
+		memcpy(&ptr[bf->head], &seg->buf[seg->done], sz);
+		bf->head = (bf->head + sz) & (bf->max_size - 1);
+		seg->done += sz;
+		bf->segs_offset += sz;
+		tot += sz;
+		n -= sz;
+	}
+	/* The decoder is the producer of the input buffer in this case */
+	dfu_store_release(&bf->appended_head, bf->head);
+	return tot;
+}
+
+/*
+ * Feed lent segments to the decoder, in order. Returns number of bytes fed,
+ * negative on error
+ */
+static int _bf_feed_segments(struct dfu_binary_file *bf, int all_appended)
+{
+	int head = dfu_load_acquire(&bf->segs_head);
+	int tot = 0, stat, last, copied;
+	struct dfu_segment *seg;
+
+	while (bf->segs_fed != head) {
+		seg = &bf->segs[bf->segs_fed];
+		last = all_appended &&
+			((bf->segs_fed + 1) & (ARRAY_SIZE(bf->segs) - 1)) ==
+			head;
+		stat = copied = 0;
+		if (_bf_can_zero_copy(bf, seg, last)) {
+			stat = _bf_seg_zero_copy(bf, seg, last);
+			if (!stat && !bf_wc_space(bf))
+				/* Wait for chunks to be written */
+				break;
+		}
+		if (!stat) {
+			stat = _bf_seg_copy(bf, seg);
+			copied = 1;
+		}
+		if (!stat)
+			/* Input buffer is full */
+			break;
+		tot += stat;
+		if (seg->done == seg->len) {
+			bf->segs_fed = (bf->segs_fed + 1) &
+				(ARRAY_SIZE(bf->segs) - 1);
+			bf_segment_put(seg);
+		}
+		if (copied && (!bf->format_ops ||
+			       bf->format_ops->decode_segment) &&
+		    !(bf->segs_offset & (bf->write_chunk_size - 1)))
+			/*
+			 * Chunk boundary reached, the input buffer must be
+			 * decoded before going on with zero copy
+			 */
+			break;
+	}
+	return tot;
+}
+
+/*
+ * Decoding stage: runs in dfu_idle() or in the host's worker thread
+ * (pipeline mode), in which case it only shares ring indexes with the
+ * rest of the world.
+ * Returns 1 if something new can be written, 0 if there's nothing to do,
+ * negative on error
+ */
+static int _bf_do_flush(struct dfu_binary_file *bf)
+{
+	int stat, all_appended, done, fed, tail = bf->tail;
+
+	if (bf->decode_done)
+		return 0;
+	/* Pick up appended data: written must be read before head */
+	all_appended = dfu_load_acquire(&bf->written);
+	bf->head = dfu_load_acquire(&bf->appended_head);
+	if (bf->image && !(bf->format_ops && bf->format_ops->decode_segment) &&
+	    bf_count(bf) > bf->decoded_size)
+		/*
+		 * Decoders need room for two chunks in the decoded buffer:
+		 * don't show them more input than a ring would hold
+		 */
+		bf->head = (bf->tail + bf->decoded_size) &
+			(bf->max_size - 1);
+	fed = _bf_feed_segments(bf, all_appended);
+	stat = _bf_decode(bf, all_appended);
+	/* Give consumed space back to the producer */
+	dfu_store_release(&bf->released_tail, bf->tail);
+	if (bf->pipelined && bf->tail != tail &&
+	    dfu_load_acquire(&bf->space_wanted))
+		/* dfu_idle() tells the producer */
+		_bf_wakeup(bf);
+	if (stat < 0)
+		return stat;
+	/* Formats set rx_done when they meet the end of file record */
+	done = all_appended && (bf->rx_done ||
+				(bf->tail ==
+				 dfu_load_acquire(&bf->appended_head) &&
+				 bf->segs_fed ==
+				 dfu_load_acquire(&bf->segs_head)));
+	_bf_publish_chunks(bf, done);
+	if (done) {
+		dfu_store_release(&bf->decode_done, 1);
+		return 1;
+	}
+	/*
+	 * Some formats consume input without decoding anything (zip
+	 * headers, for instance): that's progress too, go on decoding
+	 */
+	return stat ? stat : fed || bf->tail != tail;
+}
+
+/* Pipeline mode: decoding stage, invoked by the host's worker thread */
+static int _bf_decode_work(void *arg)
+{
+	struct dfu_binary_file *bf = arg;
+	int stat = _bf_do_flush(bf);
+
+	if (stat < 0)
+		dfu_store_release(&bf->decode_error, 1);
+	if (stat)
+		/* Writers have something to do */
+		_bf_wakeup(bf);
+	return stat;
+}
+
+/*
+ * New input data, wake up the decoder. This can run in the producer's
+ * thread
+ */
+static void _bf_data_available(struct dfu_binary_file *bf)
+{
+	if (bf->pipelined)
+		_bf_kick_decoder(bf);
+	else
+		_bf_wakeup(bf);
+}
+
+/*
+ * Producer side of the input buffer: data is copied at appended_head,
+ * the decoder gives space back via released_tail. Only appended_head,
+ * tot_appended and written are modified here, so that a producer thread
+ * can append data while dfu_idle() is running.
+ * If @partial is set, as many bytes as fit are appended, otherwise all
+ * of them or nothing.
+ */
 static int _bf_append_data(struct dfu_binary_file *bf, const void *buf,
-			   unsigned long buf_sz)
+			   unsigned long buf_sz, int partial)
 {
 	int sz, tot = 0, ret;
+	int head = bf->appended_head;
+	int tail = dfu_load_acquire(&bf->released_tail);
 	char *ptr = bf->buf;
 	const char *src = buf;
 
 	if (!buf_sz) {
 		/* size is 0, file written */
-		bf->written = 1;
+		dfu_store_release(&bf->written, 1);
+		_bf_data_available(bf);
 		return 0;
 	}
-	if (bf_space(bf) < buf_sz) {
+	if (bf->image) {
+		dfu_err("%s: memory image, cannot append\n", __func__);
+		return -1;
+	}
+	if (partial)
+		buf_sz = min(_space(head, tail, bf->max_size), buf_sz);
+	if (!buf_sz || _space(head, tail, bf->max_size) < buf_sz) {
 		ret = 0;
 		goto end;
 	}
-	sz = min(bf_space_to_end(bf), buf_sz);
+	sz = min(_space_to_end(head, tail, bf->max_size), buf_sz);
 	if (sz <= 0) {
 		ret = sz;
 		goto end;
 	}
-	memcpy(&ptr[bf->head], src, sz);
-	bf->head = (bf->head + sz) & (ARRAY_SIZE(bf_buf) - 1);
+	memcpy(&ptr[head], src, sz);
+	head = (head + sz) & (bf->max_size - 1);
 	buf_sz -= sz;
 	src += sz;
 	tot = sz;
@@ -350,18 +1265,52 @@ static int _bf_append_data(struct dfu_binary_file *bf, const void *buf,
 		ret = sz;
 		goto end;
 	}
-	sz = min(bf_space(bf), buf_sz);
+	sz = min(_space(head, tail, bf->max_size), buf_sz);
 	tot += sz;
-	memcpy(&ptr[bf->head], src, sz);
-	bf->head = (bf->head + sz) & (ARRAY_SIZE(bf_buf) - 1);
+	memcpy(&ptr[head], src, sz);
+	head = (head + sz) & (bf->max_size - 1);
 	ret = tot;
 end:
-	bf->tot_appended += tot;
-	dfu_dbg("%s: flushing = %d, appended = %d, tot_appended = %d\n",
-		__func__, bf->flushing, tot, bf->tot_appended);
+	/* The producer is active, tell it when it can go on */
+	dfu_store_release(&bf->space_wanted, 1);
+	if (bf->digest && tot)
+		crc32_iteration(buf, tot, &bf->digest_crc);
+	/* Publish new data */
+	dfu_store_release(&bf->appended_head, head);
+	dfu_store_release(&bf->tot_appended, bf->tot_appended + tot);
+	dfu_dbg("%s: appended = %d, tot_appended = %d\n",
+		__func__, tot, bf->tot_appended);
+	if (tot)
+		_bf_data_available(bf);
 	return ret;
 }
 
+static struct dfu_binary_file *
+_bf_new(const void *buf, unsigned long buf_sz, struct dfu_data *dfu,
+	const struct dfu_binary_file_ops *ops, void *priv, char *b, int b_size,
+	char *db, int db_size, struct dfu_write_chunk *wcs, int nwcs)
+{
+	struct dfu_binary_file *bf;
+
+	if (!dfu)
+		return NULL;
+	bf = &bfiles[dfu_id(dfu)];
+	if (bf->buf)
+		/* Busy, one bfile per dfu instance allowed at present */
+		return NULL;
+	if (_bf_init(bf, b, b_size, db, db_size, wcs, nwcs, dfu) < 0)
+		return NULL;
+	bf->ops = ops;
+	bf->priv = priv;
+	if (!buf || !buf_sz)
+		return bf;
+	if (_bf_append_data(bf, buf, buf_sz, 0) < 0) {
+		_bf_fini(bf, dfu);
+		return NULL;
+	}
+	return bf;
+}
+
 struct dfu_binary_file *
 dfu_new_binary_file(const void *buf,
 		    unsigned long buf_sz,
@@ -371,21 +1320,144 @@ dfu_new_binary_file(const void *buf,
 		    const struct dfu_binary_file_ops *ops,
 		    void *priv)
 {
-	if (bfile.buf)
-		/* Busy, one bfile at a time allowed at present */
+	int id;
+
+	if (!dfu)
 		return NULL;
-	if (_bf_init(&bfile, bf_buf, bf_decoded_buf,
-		     sizeof(bf_decoded_buf), dfu) < 0)
+	id = dfu_id(dfu);
+	return _bf_new(buf, buf_sz, dfu, ops, priv,
+		       bf_buf[id], sizeof(bf_buf[id]),
+		       bf_decoded_buf[id], sizeof(bf_decoded_buf[id]),
+		       bf_write_chunks[id], ARRAY_SIZE(bf_write_chunks[id]));
+}
+
+/*
+ * Arena layout: write chunks, input ring and decoded ring (both rings have
+ * the same size, a power of 2). Rings hold at least four write chunks
+ * (the decoder wants room for two decoded chunks before decoding), and
+ * there are four write chunks for each chunk fitting in the decoded ring
+ * (zero copy chunks don't use the ring).
+ */
+static int _bf_target_chunk_size(struct dfu_data *dfu)
+{
+	struct dfu_target *tgt = dfu->target;
+
+	if (!tgt || !tgt->ops->get_write_chunk_size)
+		return 0;
+	return tgt->ops->get_write_chunk_size(tgt);
+}
+
+static int _bf_arena_min_ring(int cs)
+{
+	int ring = CONFIG_MIN_BINARY_FILE_BUFSIZE;
+
+	while (ring < 4 * cs)
+		ring <<= 1;
+	return ring;
+}
+
+static int _bf_arena_chunks(int ring, int cs)
+{
+	int n = 4;
+
+	while (cs && n < 4 * (ring / cs))
+		n <<= 1;
+	return n;
+}
+
+static unsigned long _bf_arena_size(int ring, int cs)
+{
+	return 2 * (unsigned long)ring +
+		_bf_arena_chunks(ring, cs) * sizeof(struct dfu_write_chunk) +
+		__alignof__(struct dfu_write_chunk) - 1;
+}
+
+/* Rings larger than this are not allowed (indexes are ints) */
+#define BF_ARENA_MAX_RING (1 << 28)
+
+unsigned long dfu_binary_file_arena_size(struct dfu_data *dfu,
+					 unsigned long ring_size)
+{
+	int cs, ring;
+
+	if (!dfu || ring_size > BF_ARENA_MAX_RING)
+		return 0;
+	cs = _bf_target_chunk_size(dfu);
+	ring = _bf_arena_min_ring(cs);
+	while (ring < ring_size)
+		ring <<= 1;
+	return _bf_arena_size(ring, cs);
+}
+
+struct dfu_binary_file *
+dfu_new_binary_file_arena(const void *buf,
+			  unsigned long buf_sz,
+			  unsigned long totsz,
+			  struct dfu_data *dfu,
+			  unsigned long addr,
+			  const struct dfu_binary_file_ops *ops,
+			  void *priv,
+			  void *arena,
+			  unsigned long arena_size)
+{
+	const unsigned long al = __alignof__(struct dfu_write_chunk);
+	struct dfu_write_chunk *wcs;
+	int cs, ring, nwcs;
+	char *b;
+
+	if (!dfu || !arena)
 		return NULL;
-	if (!buf || !buf_sz)
-		return &bfile;
-	if (_bf_append_data(&bfile, buf, buf_sz) < 0) {
-		_bf_fini(&bfile, dfu);
+	cs = _bf_target_chunk_size(dfu);
+	ring = _bf_arena_min_ring(cs);
+	if (_bf_arena_size(ring, cs) > arena_size) {
+		dfu_err("%s: arena is too small (%lu bytes, %lu needed)\n",
+			__func__, arena_size, _bf_arena_size(ring, cs));
 		return NULL;
 	}
-	bfile.ops = ops;
-	bfile.priv = priv;
-	return &bfile;
+	/* Biggest rings fitting in the arena */
+	while (ring < BF_ARENA_MAX_RING &&
+	       _bf_arena_size(ring << 1, cs) <= arena_size)
+		ring <<= 1;
+	nwcs = _bf_arena_chunks(ring, cs);
+	wcs = (struct dfu_write_chunk *)(((unsigned long)arena + al - 1) &
+					 ~(al - 1));
+	b = (char *)&wcs[nwcs];
+	dfu_dbg("%s: rings = %d bytes, %d write chunks\n", __func__, ring,
+		nwcs);
+	return _bf_new(buf, buf_sz, dfu, ops, priv, b, ring, b + ring, ring,
+		       wcs, nwcs);
+}
+
+struct dfu_binary_file *
+dfu_new_binary_file_from_memory(const void *buf,
+				unsigned long buf_sz,
+				struct dfu_data *dfu,
+				unsigned long addr,
+				const struct dfu_binary_file_ops *ops,
+				void *priv)
+{
+	struct dfu_binary_file *bf;
+	int id, size = 1;
+
+	if (!dfu || !buf || !buf_sz || buf_sz >= BF_ARENA_MAX_RING)
+		return NULL;
+	/*
+	 * Indexes are still masked with max_size - 1, they never wrap around
+	 * as long as max_size is bigger than the image
+	 */
+	while (size <= buf_sz)
+		size <<= 1;
+	id = dfu_id(dfu);
+	bf = _bf_new(NULL, 0, dfu, ops, priv, (char *)buf, size,
+		     bf_decoded_buf[id], sizeof(bf_decoded_buf[id]),
+		     bf_write_chunks[id], ARRAY_SIZE(bf_write_chunks[id]));
+	if (!bf)
+		return NULL;
+	bf->image = 1;
+	bf->head = bf->appended_head = buf_sz;
+	bf->tot_appended = buf_sz;
+	bf->written = 1;
+	return bf;
 }
 
 struct dfu_binary_file *
@@ -408,6 +1480,44 @@ dfu_binary_file_start_rx(struct dfu_file_rx_method *method,
 	return out;
 }
 
+struct dfu_binary_file *
+dfu_binary_file_join_gang(struct dfu_binary_file *leader, struct dfu_data *dfu)
+{
+	struct dfu_binary_file *bf;
+
+	if (!leader || leader->leader) {
+		dfu_err("%s: invalid gang leader\n", __func__);
+		return NULL;
+	}
+	if (leader->flushing) {
+		dfu_err("%s: gang leader is already being flushed\n",
+			__func__);
+		return NULL;
+	}
+	if (leader->gang_size >= ARRAY_SIZE(leader->gang))
+		return NULL;
+	bf = dfu_new_binary_file(NULL, 0, 0, dfu, 0, NULL, NULL);
+	if (!bf)
+		return NULL;
+	if (bf->write_chunk_size != leader->write_chunk_size) {
+		dfu_err("%s: gang targets must be identical\n", __func__);
+		_bf_fini(bf, dfu);
+		return NULL;
+	}
+	/* Members use the leader's write chunks and buffers */
+	bf->max_chunks = leader->max_chunks;
+	if (!leader->gang_size) {
+		/* The leader is a gang member too */
+		leader->gang[leader->gang_size++] = leader;
+		leader->gang_tail = leader->write_chunks_tail;
+	}
+	bf->leader = leader;
+	bf->write_chunks_tail = bf->write_chunks_sent = leader->gang_tail;
+	bf->write_queue_depth = _bf_queue_depth(bf);
+	leader->gang[leader->gang_size++] = bf;
+	return bf;
+}
+
 int dfu_binary_file_append_buffer(struct dfu_binary_file *f,
 				  const void *buf,
 				  unsigned long buf_sz)
@@ -417,17 +1527,197 @@ int dfu_binary_file_append_buffer(struct dfu_binary_file *f,
 	/*
 	 * Check whether the whole buffer can be appended
 	 */
-	dfu_dbg("%s: bf_space(f) = %u, buf_sz = %lu\n", __func__, bf_space(f),
-		buf_sz);
-	cnt = _bf_append_data(f, buf, buf_sz);
+	dfu_dbg("%s: buf_sz = %lu\n", __func__, buf_sz);
+	cnt = _bf_append_data(f, buf, buf_sz, 0);
 	if (cnt < 0)
 		return cnt;
 	return cnt;
 }
 
+int dfu_binary_file_append_partial(struct dfu_binary_file *f,
+				   const void *buf,
+				   unsigned long buf_sz)
+{
+	dfu_dbg("%s: buf_sz = %lu\n", __func__, buf_sz);
+	if (!buf_sz)
+		/* End of file */
+		return _bf_append_data(f, NULL, 0, 0);
+	return _bf_append_data(f, buf, buf_sz, 1);
+}
+
+int dfu_binary_file_set_space_watermark(struct dfu_binary_file *f,
+					int bytes)
+{
+	if (bytes < 1 || bytes > f->max_size)
+		return -1;
+	f->space_watermark = bytes;
+	return 0;
+}
+
+int dfu_binary_file_get_space(struct dfu_binary_file *f)
+{
+	if (f->image)
+		return 0;
+	/* Producer side: appended_head is ours, released_tail the decoder's */
+	return _space(f->appended_head, dfu_load_acquire(&f->released_tail),
+		      f->max_size);
+}
+
+int dfu_binary_file_append_segment(struct dfu_binary_file *f,
+				   const void *buf, unsigned long buf_sz,
+				   void (*release)(const void *buf,
+						   void *priv),
+				   void *priv)
+{
+	const int nsegs = ARRAY_SIZE(f->segs);
+	struct dfu_segment *seg;
+
+	if (!buf_sz)
+		/* End of file */
+		return _bf_append_data(f, NULL, 0, 0);
+	if (buf_sz > 0x7fffffffUL || f->image)
+		return -1;
+	/* Recycle released segments */
+	while (f->segs_tail != f->segs_head &&
+	       !dfu_load_acquire(&f->segs[f->segs_tail].refs))
+		f->segs_tail = (f->segs_tail + 1) & (nsegs - 1);
+	if (!_space(f->segs_head, f->segs_tail, nsegs))
+		return 0;
+	seg = &f->segs[f->segs_head];
+	seg->buf = buf;
+	seg->len = buf_sz;
+	seg->done = 0;
+	seg->refs = 1;
+	seg->release = release;
+	seg->priv = priv;
+	if (f->digest)
+		crc32_iteration(buf, buf_sz, &f->digest_crc);
+	/* Publish new segment */
+	dfu_store_release(&f->segs_head, (f->segs_head + 1) & (nsegs - 1));
+	dfu_store_release(&f->tot_appended, f->tot_appended + buf_sz);
+	_bf_data_available(f);
+	return buf_sz;
+}
+
+static void _bf_stats_start(struct dfu_binary_file *bf)
+{
+	struct dfu_session_stats *s = &bf->dfu->stats;
+
+	s->start = dfu_get_current_time(bf->dfu);
+	s->started = 1;
+	s->ended = 0;
+}
+
 int dfu_binary_file_flush_start(struct dfu_binary_file *bf)
 {
+	struct dfu_host *host = bf->dfu->host;
+	int i;
+
+	/* The leader is a gang member too */
+	if (!bf->gang_size)
+		_bf_stats_start(bf);
+	for (i = 0; i < bf->gang_size; i++)
+		_bf_stats_start(bf->gang[i]);
 	bf->flushing = 1;
+	if (bf->pipelined &&
+	    host->ops->start_worker(host, _bf_decode_work, bf) < 0) {
+		dfu_err("%s: cannot start decoder\n", __func__);
+		bf->flushing = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int dfu_binary_file_set_pipelined(struct dfu_binary_file *bf, int on)
+{
+	const struct dfu_host_ops *hops = bf->dfu->host->ops;
+
+	if (bf->leader || bf->flushing)
+		return -1;
+	if (on && (!hops->start_worker || !hops->kick_worker ||
+		   !hops->stop_worker))
+		/* Not supported by host */
+		return -1;
+	bf->pipelined = on;
+	return 0;
+}
+
+/*
+ * Differential mode and resume: targets erasing sectors on demand must be
+ * able to save the chunks which are not written
+ */
+static int _bf_can_preserve(struct dfu_binary_file *bf)
+{
+	struct dfu_target *tgt = bf->dfu->target;
+	const struct dfu_target_ops *tops = tgt->ops;
+
+	if (!tops->must_erase)
+		return 1;
+	if (tops->get_preserve_size && tops->get_preserve_size(tgt))
+		return 1;
+	dfu_err("%s: target can't save sector contents\n", __func__);
+	return 0;
+}
+
+int dfu_binary_file_set_differential(struct dfu_binary_file *bf, int on)
+{
+	const struct dfu_target_ops *tops = bf->dfu->target->ops;
+
+	if (bf->flushing ||
+	    (on && (!tops->read_memory || !_bf_can_preserve(bf))))
+		return -1;
+	bf->differential = on;
+	return 0;
+}
+
+int dfu_binary_file_set_journal(struct dfu_binary_file *bf, const char *path)
+{
+	struct bf_journal_header h;
+	int fd, resuming;
+
+	if (bf->flushing || bf->leader || bf->gang_size ||
+	    bf->journal_fd >= 0 || !_bf_can_preserve(bf))
+		return -1;
+	fd = dfu_file_open(bf->dfu, path, 1, 0);
+	if (fd < 0)
+		return -1;
+	resuming = dfu_file_read(bf->dfu, fd, &h, sizeof(h)) == sizeof(h) &&
+		le32_to_cpu(h.magic) == JOURNAL_MAGIC;
+	bf->journal_gen = resuming ? le32_to_cpu(h.gen) + 1 : 0;
+	h.magic = cpu_to_le32(JOURNAL_MAGIC);
+	h.gen = cpu_to_le32(bf->journal_gen);
+	if (dfu_file_seek(bf->dfu, fd, 0) < 0 ||
+	    dfu_file_write(bf->dfu, fd, &h, sizeof(h)) != sizeof(h)) {
+		dfu_err("%s: cannot write journal\n", __func__);
+		dfu_file_close(bf->dfu, fd);
+		return -1;
+	}
+	bf->journal_fd = fd;
+	bf->journal_path = path;
+	bf->journal_chain = 0;
+	bf->journal_n = 0;
+	bf->resuming = resuming;
+	return resuming;
+}
+
+int dfu_binary_file_set_digest(struct dfu_binary_file *bf, int on)
+{
+	if (bf->flushing || (bf->tot_appended && !bf->image))
+		return -1;
+	bf->digest = on;
+	crc32_init(&bf->digest_crc);
+	if (on && bf->image)
+		crc32_iteration((const uint8_t *)bf->buf, bf->tot_appended,
+				&bf->digest_crc);
+	return 0;
+}
+
+int dfu_binary_file_get_digest(struct dfu_binary_file *bf, uint32_t *crc)
+{
+	if (!bf->digest || !dfu_load_acquire(&bf->written))
+		return -1;
+	*crc = bf->digest_crc;
+	crc32_done(crc);
 	return 0;
 }
 
@@ -438,7 +1728,7 @@ int dfu_binary_file_written(struct dfu_binary_file *f)
 
 int dfu_binary_file_get_tot_appended(struct dfu_binary_file *f)
 {
-	return f->tot_appended;
+	return dfu_load_acquire(&f->tot_appended);
 }
 
 void *dfu_binary_file_get_priv(struct dfu_binary_file *f)
@@ -446,38 +1736,126 @@ void *dfu_binary_file_get_priv(struct dfu_binary_file *f)
 	return f->priv;
 }
 
+/* All done ? */
+static void _bf_check_done(struct dfu_binary_file *bf)
+{
+	struct dfu_interface *iface = bf->dfu->interface;
+	uint32_t crc;
+
+	if (bf->really_written ||
+	    !dfu_load_acquire(&bf_leader(bf)->decode_done) || bf_wc_count(bf))
+		return;
+	bf->really_written = 1;
+	bf->dfu->stats.end = dfu_get_current_time(bf->dfu);
+	bf->dfu->stats.ended = 1;
+	if (!dfu_binary_file_get_digest(bf_leader(bf), &crc))
+		dfu_log("file crc32: 0x%08x (%d bytes)\n", (unsigned int)crc,
+			dfu_load_acquire(&bf_leader(bf)->tot_appended));
+	dfu_cancel_timeout(&bf->rx_timeout);
+	if (bf->journal_fd >= 0) {
+		_bf_journal_close(bf);
+		if (dfu_file_remove(bf->dfu, bf->journal_path) < 0)
+			dfu_err("%s: cannot remove journal\n", __func__);
+	}
+	if (bf->rx_method && bf->rx_method->ops->done)
+		bf->rx_method->ops->done(bf, 0);
+	if (iface->ops->done)
+		iface->ops->done(iface);
+	/* Nothing else could wake up dfu_idle() (memory images, for instance) */
+	dfu_idle_again(bf->dfu);
+}
+
 /* Target is telling us that a chunk is done */
 void dfu_binary_file_chunk_done(struct dfu_binary_file *bf,
 				phys_addr_t chunk_addr, int status)
 {
+	struct dfu_session_stats *s = &bf->dfu->stats;
+	const struct dfu_write_chunk *wc;
+
 	dfu_dbg("%s, status = %d\n", __func__, status);
 	if (status) {
 		/* ERROR: do nothing, the target will signal this */
+		s->chunk_errors++;
 		return;
 	}
 	dfu_log_noprefix(".");
+	wc = &bf_leader(bf)->write_chunks[bf->write_chunks_tail];
+	if (bf->journal_fd >= 0 && !bf->resuming)
+		_bf_journal_add(bf, wc);
+	s->bytes_written += wc->len;
+	dfu_histogram_add(&s->chunk_latency,
+			  dfu_get_current_time_us(bf->dfu) -
+			  s->chunk_start[bf->write_chunks_tail &
+					 (CONFIG_MAX_WRITE_QUEUE_DEPTH - 1)]);
 	/* Free written chunk */
 	bf_put_write_chunk(bf);
-	/* All done ? */
-	if (bf->written && !bf_wc_count(bf)) {
-		struct dfu_interface *iface = bf->dfu->interface;
+	_bf_kick_decoder(bf_leader(bf));
+	_bf_check_done(bf);
+}
 
-		bf->really_written = 1;
-		dfu_cancel_timeout(&bf->rx_timeout);
-		if (bf->rx_method->ops->done)
-			bf->rx_method->ops->done(bf, status);
-		if (iface->ops->done)
-			iface->ops->done(iface);
-	}
+/*
+ * Tell the producer that it can go on appending to @bf (the leader), from
+ * @dfu's idle (any gang member's, the leader could have failed)
+ */
+static void _bf_notify_space(struct dfu_binary_file *bf,
+			     struct dfu_data *dfu)
+{
+	int appended;
+
+	if (!bf->ops || !bf->ops->on_space_available ||
+	    !dfu_load_acquire(&bf->space_wanted) ||
+	    dfu_load_acquire(&bf->written) ||
+	    dfu_binary_file_get_space(bf) < bf->space_watermark)
+		return;
+	appended = dfu_load_acquire(&bf->tot_appended);
+	dfu_store_release(&bf->space_wanted, 0);
+	bf->ops->on_space_available(bf);
+	if (dfu_load_acquire(&bf->space_wanted) &&
+	    dfu_load_acquire(&bf->tot_appended) != appended)
+		/*
+		 * Data appended, there could be room for more. If nothing
+		 * could be appended, wait for the decoder to free some space
+		 */
+		dfu_idle_again(dfu);
 }
 
 int dfu_binary_file_on_idle(struct dfu_binary_file *bf)
 {
+	struct dfu_binary_file *l;
+	int stat, sent, i;
+
 	if (!bf)
 		return 0;
-	if (_bf_do_write(bf) < 0)
+	l = bf_leader(bf);
+	if (dfu_load_acquire(&l->decode_error))
 		return -1;
-	if (bf->flushing)
-		return _bf_do_flush(bf);
+	/* Any gang member can feed the producer on behalf of the leader */
+	_bf_notify_space(l, bf->dfu);
+	if (l->gang_size)
+		/* Some gang member could have failed in the meanwhile */
+		bf_gang_update_tail(l);
+	if (l->pipelined && !l->rx_timeout.dfu && !l->really_written &&
+	    dfu_load_acquire(&l->format_ops))
+		/* Format has just been detected by the decoder */
+		_set_rx_timeout(l, 0);
+	/* Fill the target's queue (chunks could also be written at once) */
+	do {
+		sent = bf->write_chunks_sent;
+		if (_bf_do_write(bf) < 0)
+			return -1;
+	} while (bf->write_chunks_sent != sent);
+	/* Decoding could have finished after the last chunk was written */
+	_bf_check_done(bf);
+	if (!l->flushing || l->pipelined)
+		/* Not decoding yet, or decoding in the worker thread */
+		return 0;
+	/* Any gang member can go on decoding on behalf of the leader */
+	stat = _bf_do_flush(l);
+	if (stat <= 0)
+		return stat;
+	/* A chunk has been decoded: write it and go on decoding */
+	dfu_idle_again(l->dfu);
+	for (i = 0; i < l->gang_size; i++)
+		dfu_idle_again(l->gang[i]->dfu);
 	return 0;
 }
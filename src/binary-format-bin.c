@@ -5,16 +5,18 @@ struct binary_format_data {
 	unsigned long curr_addr;
 };
 
-/* Just one instance for the moment */
-static struct binary_format_data bfdata;
+/* One instance per dfu instance */
+static struct binary_format_data bfdata[CONFIG_DFU_MAX_INSTANCES];
 
 /* Binary format, anything is ok */
 int binary_probe(struct dfu_binary_file *f)
 {
+	struct binary_format_data *fd = &bfdata[dfu_id(f->dfu)];
+
 	dfu_log("raw binary format probed\n");
-	f->format_data = &bfdata;
+	f->format_data = fd;
 	/* FIXME: GET DEFAULT START ADDR */
-	bfdata.curr_addr = 0;
+	fd->curr_addr = 0;
 	return 0;
 }
 
@@ -37,10 +39,14 @@ static int _subcopy(struct dfu_binary_file *bf, void *out_buf, int out_sz)
 	return tot;
 }
 
-/* Fix this */
+/*
+ * Decode at most one write chunk at a time: the binary file layer expects
+ * decoded chunks to be much smaller than the decoded buffer
+ */
 int binary_decode_chunk(struct dfu_binary_file *bf, phys_addr_t *addr)
 {
-	int tot = 0, sz, out_sz = bf_dec_space_to_end(bf);
+	int tot = 0, sz, out_sz = min(bf_dec_space_to_end(bf),
+				      bf->write_chunk_size);
 	struct binary_format_data *data = bf->format_data;
 
 	if (!out_sz)
@@ -50,8 +56,8 @@ int binary_decode_chunk(struct dfu_binary_file *bf, phys_addr_t *addr)
 	bf->decoded_head = (bf->decoded_head + sz) & (bf->decoded_size - 1);
 	tot += sz;
 
-	out_sz = bf_dec_space(bf);
-	if (!out_sz)
+	out_sz = min(bf_dec_space(bf), bf->write_chunk_size - tot);
+	if (out_sz <= 0)
 		goto end;
 	sz = _subcopy(bf, &((char *)bf->decoded_buf)[bf->decoded_head], out_sz);
 	bf->decoded_head = (bf->decoded_head + sz) & (bf->decoded_size - 1);
@@ -63,9 +69,21 @@ end:
 	return tot;
 }
 
+/* Zero copy, raw data are written as they are */
+int binary_decode_segment(struct dfu_binary_file *bf, const void *buf,
+			  int len, phys_addr_t *addr)
+{
+	struct binary_format_data *data = bf->format_data;
+
+	*addr = data->curr_addr;
+	data->curr_addr += len;
+	return len;
+}
+
 int binary_fini(struct dfu_binary_file *bf)
 {
 	return 0;
 }
 
-declare_dfu_format(binary, binary_probe, binary_decode_chunk, binary_fini);
+declare_dfu_format_zero_copy(binary, binary_probe, binary_decode_chunk,
+			     binary_fini, binary_decode_segment);
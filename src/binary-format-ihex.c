@@ -16,20 +16,31 @@ struct ihex_line_data {
 	int byte_count;
 	int address;
 	enum ihex_record_type record_type;
+	/* Sum of the record's bytes decoded so far (checksum) */
+	unsigned int sum;
 };
 
 struct ihex_format_data {
 	uint32_t curr_addr;
+	/* Page assembler (next_addr is used without pages too) */
+	struct bf_pages pages;
+	/* Records decoded so far, to tell where a bad one is */
+	unsigned long records;
 };
 
-/* Just one instance for the moment */
-static struct ihex_format_data ihdata;
+/* One instance per dfu instance */
+static struct ihex_format_data ihdata[CONFIG_DFU_MAX_INSTANCES];
 
 static inline uint32_t _hi_addr(uint32_t a)
 {
 	return a & 0xffff0000;
 }
 
+static inline unsigned int _sum_bytes(uint32_t v)
+{
+	return (v >> 24) + ((v >> 16) & 0xff) + ((v >> 8) & 0xff) + (v & 0xff);
+}
+
 static inline int __go_on(int index, int amount, int buf_size)
 {
 	return (index + amount) & (buf_size - 1);
@@ -55,54 +66,32 @@ static inline int _dec_next(struct dfu_binary_file *f, int index)
 	return _dec_go_on(f, index, 1);
 }
 
-static inline int _hex_to_int(char c)
-{
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	if (c >= 'a' && c <= 'f')
-		return c - 'a' + 10;
-	if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-	return -1;
-}
-
 /*
  * Decode given number of ascii chars (nbytes), part of a single multibyte
- * (big endian) quantity or of a buffer of bytes, taking data from an
- * input buffer starting at offset *index.
+ * (big endian) quantity, taking data from an input buffer starting at
+ * offset *index.
  * Update *index and stop at buffer's head or when all bytes have
  * been decoded. Return number of bytes decoded ( > 0), not enough input
  * bytes ( == 0) or error ( < 0)
  */
 static int _decode_hex(struct dfu_binary_file *f, int *index, int nbytes,
-		       int *out, int *out_index)
+		       int *out)
 {
 	int i, stat = 0, ret;
-	char *ptr = f->buf, *dst;
+	char *ptr = f->buf;
 	int _out = 0;
 
-	if (out && (nbytes > sizeof(*out) * 2))
+	if (nbytes > sizeof(*out) * 2)
 		return -1;
 	for (i = 0; i < nbytes && *index != f->head;
 	     i++, *index = _next(f, *index)) {
-		stat = _hex_to_int(ptr[*index]);
+		stat = hex_digit(ptr[*index]);
 		if (stat < 0)
 			return stat;
 		/* big endian */
 		_out |= (stat << (4 * (nbytes - (i + 1))));
-		/* FIXME: do this faster (fewer *out_index updates ?) */
-		if (out_index) {
-			dst = &((char *)f->decoded_buf)[*out_index];
-			if (!(i & 0x1)) {
-				*dst = (stat << 4);
-				continue;
-			}
-			*dst |= stat;
-			*out_index = _dec_next(f, *out_index);
-		}
 	}
-	if (out)
-		*out = _out;
+	*out = _out;
 	ret = *index == f->head ? 0 : i;
 	dfu_dbg("%s returns %d\n", __func__, ret);
 	return ret;
@@ -111,55 +100,68 @@ static int _decode_hex(struct dfu_binary_file *f, int *index, int nbytes,
 static inline int _decode_hex_byte(struct dfu_binary_file *f, int *index,
 				   int *out)
 {
-	return _decode_hex(f, index, 2, out, NULL);
+	return _decode_hex(f, index, 2, out);
 }
 
 static inline int _decode_hex_word(struct dfu_binary_file *f, int *index,
 				   int *out)
 {
-	return _decode_hex(f, index, 4, out, NULL);
+	return _decode_hex(f, index, 4, out);
 }
 
 static inline int _decode_hex_dword(struct dfu_binary_file *f, int *index,
 				    int *out)
 {
-	return _decode_hex(f, index, 8, out, NULL);
+	return _decode_hex(f, index, 8, out);
 }
 
-static inline int _decode_hex_buf(struct dfu_binary_file *f, int *index,
-				  int *out_index, int len)
-{
-	return _decode_hex(f, index, len, NULL, out_index);
-}
-
-
 /*
- * Check line's checksum
- * Assumes f->tail points to checksum start and that the checksum field
- * in *ld is up to date
- * Updates bf->tail
+ * Check line's checksum: the sum of all of the record's bytes, checksum
+ * included, is 0 (modulo 256).
+ * Assumes bf->tail points to checksum start and that the sum field in *ld
+ * is up to date (whole line available, see _peek_line_header()).
+ * Returns number of ascii chars to skip (the checksum) or error
  */
 static int _check_line(struct dfu_binary_file *bf, struct ihex_line_data *ld)
 {
+	struct ihex_format_data *priv = bf->format_data;
+	uint8_t *ptr = bf->buf, c[2];
+	int cks;
+
+	c[0] = ptr[bf->tail];
+	c[1] = ptr[_next(bf, bf->tail)];
+	cks = hex_byte(c);
+	priv->records++;
+	if (cks < 0 || (ld->sum + cks) & 0xff) {
+		dfu_err("IHEX: bad checksum, record %lu (address 0x%08x)\n",
+			priv->records, (unsigned int)_hi_addr(priv->curr_addr) |
+			ld->address);
+		return -1;
+	}
 	return 2;
 }
 
 /*
- * Search for the beginning of a line, update index and return number of
- * bytes read before finding the ':'
+ * Search for the beginning of a line, update index (first char after the
+ * ':') and return number of bytes read, ':' included. Contiguous parts of
+ * the input buffer are searched at once
  */
 static inline int _search_line(struct dfu_binary_file *f, int *index)
 {
-	char *ptr = f->buf;
-	int ret;
+	const char *ptr = f->buf, *p;
+	int end;
 
 	*index = f->tail;
-	for (ret = 0; ptr[*index] != ':' && *index != f->head;
-	     *index = _next(f, *index), ret++);
-	if (ptr[*index] != ':')
-		return 0;
-	*index = _next(f, *index);
-	return ret + 1;
+	while (*index != f->head) {
+		end = f->head > *index ? f->head : f->max_size;
+		p = memchr(&ptr[*index], ':', end - *index);
+		if (p) {
+			*index = _next(f, p - ptr);
+			return _go_on(f, *index, -f->tail);
+		}
+		*index = end & (f->max_size - 1);
+	}
+	return 0;
 }
 
 /*
@@ -171,34 +173,55 @@ static int _peek_line_header(struct dfu_binary_file *f,
 			     struct ihex_line_data *odata)
 {
 	int index = f->tail, stat, rt, ret = 0, line_length;
+	uint8_t *ptr = f->buf, h[4];
 
 	stat = _search_line(f, &index);
 	if (stat <= 0)
 		return stat;
 	ret += stat;
 	odata->start_index = index;
-	stat = _decode_hex_byte(f, &index, &odata->byte_count);
-	dfu_dbg("%s: byte count = %u\n", __func__, odata->byte_count);
-	if (stat <= 0)
-		return stat;
-	ret += stat;
-	stat = _decode_hex_word(f, &index, &odata->address);
-	dfu_dbg("%s: address = 0x%04x\n", __func__, odata->address);
-	if (stat <= 0)
-		return stat;
-	ret += stat;
-	stat = _decode_hex_byte(f, &index, &rt);
-	dfu_dbg("%s: record type = 0x%02x\n", __func__, rt);
-	if (stat <= 0)
-		return stat;
-	ret += stat;
-	odata->record_type = rt;
+	if (index + 8 <= f->max_size && _go_on(f, f->head, -index) >= 8) {
+		/* Contiguous header: count, address and type at once */
+		odata->sum = 0;
+		if (hex_to_bytes(&ptr[index], h, sizeof(h), &odata->sum) < 0)
+			return -1;
+		odata->byte_count = h[0];
+		odata->address = (h[1] << 8) | h[2];
+		odata->record_type = h[3];
+		index = _go_on(f, index, 8);
+		ret += 8;
+	} else {
+		stat = _decode_hex_byte(f, &index, &odata->byte_count);
+		if (stat <= 0)
+			return stat;
+		ret += stat;
+		stat = _decode_hex_word(f, &index, &odata->address);
+		if (stat <= 0)
+			return stat;
+		ret += stat;
+		stat = _decode_hex_byte(f, &index, &rt);
+		if (stat <= 0)
+			return stat;
+		ret += stat;
+		odata->record_type = rt;
+		odata->sum = odata->byte_count + (odata->address >> 8) +
+			(odata->address & 0xff) + rt;
+	}
+	dfu_dbg("%s: byte count = %u, address = 0x%04x, type = 0x%02x\n",
+		__func__, odata->byte_count, odata->address,
+		odata->record_type);
 	if (odata->record_type < IHEX_DATA ||
 	    odata->record_type > IHEX_START_LINEAR_ADDRESS)
 		return -1;
 	odata->data_start_index = index;
 	/* Data bytes + header length (without ':') + checksum */
 	line_length = odata->byte_count * 2 + ret + 2;
+	if (line_length >= f->max_size) {
+		/* The ring will never hold the whole line */
+		dfu_err("IHEX: %d bytes record, ring is %d bytes\n",
+			line_length, f->max_size);
+		return -1;
+	}
 	/* A whole line cannot be read, give up */
 	dfu_dbg("%s, count = %d, line_length = %d\n", __func__,
 		bf_count(f), line_length);
@@ -212,19 +235,26 @@ int ihex_probe(struct dfu_binary_file *f)
 {
 	int cnt = bf_count(f), stat;
 	struct ihex_line_data ld;
-	struct ihex_format_data *fd = &ihdata;
+	struct ihex_format_data *fd = &ihdata[dfu_id(f->dfu)];
 
-	if (cnt < 9)
-		/* Buffer does not contain a line header */
+	if (!cnt)
+		return 1;
+	if (((char *)f->buf)[f->tail] != ':')
+		/* Not the beginning of a line */
 		return -1;
 	/* Check whether the file contains a valid line header */
 	stat = _peek_line_header(f, &ld);
-	if (stat <= 0)
+	if (stat < 0)
 		return stat;
+	if (!stat)
+		/* Line not yet complete */
+		return 1;
 	dfu_log("Intel HEX format probed\n");
 	/* Format probed, initialize private data */
 	f->format_data = fd;
 	fd->curr_addr = 0;
+	memset(&fd->pages, 0, sizeof(fd->pages));
+	fd->records = 0;
 	return 0;
 }
 
@@ -247,17 +277,19 @@ static void _print_bad_line(struct dfu_binary_file *bf,
 #endif
 
 /*
- * Decode a data line. bf->tail must point to line's data section
+ * Decode a data line. bf->tail must point to line's data section.
+ * Data are written @back bytes before the decoded buffer's head (data
+ * going back inside the page being assembled)
  */
 static int _decode_data_line(struct dfu_binary_file *bf,
-			     struct ihex_line_data *ld)
+			     struct ihex_line_data *ld, int back)
 {
 	int index, out_index, stat, ret = 0, space;
 
 	space = bf_dec_space(bf);
 	dfu_dbg("%s: space = %d, ld->byte_count = %d\n", __func__, space,
 		ld->byte_count);
-	if (space < ld->byte_count)
+	if (space < ld->byte_count - back)
 		/* Not enough bytes in output buffer, do nothing */
 		return 0;
 	if (ld->data_start_index != bf->tail) {
@@ -265,16 +297,22 @@ static int _decode_data_line(struct dfu_binary_file *bf,
 		return -1;
 	}
 	index = bf->tail;
-	out_index = bf->decoded_head;
-	stat = _decode_hex_buf(bf, &index, &out_index, ld->byte_count * 2);
+	out_index = _dec_go_on(bf, bf->decoded_head, -back);
+	stat = hex_decode_buf(bf, &index, &out_index, ld->byte_count * 2,
+			      &ld->sum);
 	dfu_dbg("%s: decoded %d bytes\n", __func__, stat);
 	if (stat <= 0) {
+		if (stat < 0)
+			dfu_err("IHEX: invalid data, record %lu\n",
+				((struct ihex_format_data *)
+				 bf->format_data)->records + 1);
 		_print_bad_line(bf, ld, index);
 		return stat;
 	}
 	ret += stat;
 	bf->tail = _go_on(bf, bf->tail, stat);
-	bf->decoded_head = out_index;
+	if (ld->byte_count > back)
+		bf->decoded_head = out_index;
 	dfu_dbg("%s: new tail is %d, decoded_head is %d\n", __func__, bf->tail,
 		bf->decoded_head);
 	/* Check line (checksum) */
@@ -290,14 +328,25 @@ static int _decode_data_line(struct dfu_binary_file *bf,
 
 /*
  * Decode new file chunk (some lines in general)
- * Stop on line boundary
+ * Stop on line boundary.
+ * If the target wants whole pages (bf->page_size), data are assembled in
+ * pages: gaps shorter than a page are filled with the erased value and
+ * lines going back inside the last two pages overwrite what has been
+ * decoded so far. Pages are returned when they can't be modified anymore
+ * (a line going elsewhere, or end of file), so that each of them becomes
+ * a single write chunk. Lines going back to a page which has already been
+ * returned are an error: the target would erase it and lose its data.
+ * Runs of data ending at address jumps (or completed pages) are handed to
+ * bf_decoded_run() and decoding goes on with the next run, only the last
+ * one is returned.
  */
-int ihex_decode_chunk(struct dfu_binary_file *bf, uint32_t *addr)
+int ihex_decode_chunk(struct dfu_binary_file *bf, phys_addr_t *addr)
 {
 	struct ihex_line_data ld;
-	int stat, index, tot, decoded_tot, stopit;
+	int stat, index, tot, decoded_tot, stopit, fill, back;
 	struct ihex_format_data *priv = bf->format_data;
-	uint32_t curr_addr, next_addr = 0;
+	struct bf_pages *pg = &priv->pages;
+	uint32_t curr_addr;
 
 	for (stopit = 0, tot = 0, decoded_tot = 0; !bf->rx_done && !stopit; ) {
 		stat = _peek_line_header(bf, &ld);
@@ -309,42 +358,102 @@ int ihex_decode_chunk(struct dfu_binary_file *bf, uint32_t *addr)
 		switch (ld.record_type) {
 		case IHEX_DATA:
 			curr_addr = _hi_addr(priv->curr_addr) | ld.address;
-			if (tot && curr_addr != next_addr) {
+			fill = back = 0;
+			if (bf->page_size &&
+			    bf_pages_written(bf, pg, curr_addr,
+					     ld.byte_count)) {
+				dfu_err("IHEX: record %lu goes back to a page "
+					"already written (address 0x%08x)\n",
+					priv->records + 1,
+					(unsigned int)curr_addr);
+				return -1;
+			}
+			if (pg->open &&
+			    !bf_pages_in_window(bf, pg, curr_addr)) {
+				/* Line for another page, complete this one */
+				dfu_dbg("%s: closing pages\n", __func__);
+				decoded_tot = bf_pages_close(bf, pg,
+							     decoded_tot, addr);
+				if (pg->open)
+					return decoded_tot;
+				goto next_run;
+			}
+			if (pg->open) {
+				/* Data can go back and forth */
+				if (curr_addr > pg->next_addr)
+					fill = curr_addr - pg->next_addr;
+				else
+					back = pg->next_addr - curr_addr;
+			} else if (bf->page_size)
+				/* Pages start at their beginning */
+				fill = curr_addr & (bf->page_size - 1);
+			else if (tot && curr_addr != pg->next_addr) {
+				/* Address jump, line starts the next run */
+				dfu_dbg("%s: address jump\n", __func__);
+				goto next_run;
+			}
+			if (bf_dec_space(bf) < fill + ld.byte_count - back) {
 				/*
-				 * Address jump, discard line and stop
-				 * decoding
+				 * No room for this line's data, leave it
+				 * alone and stop decoding. Pages being
+				 * assembled could be taking all the room:
+				 * give them back, but the last one
 				 */
-				dfu_dbg("%s: address jump\n", __func__);
-				return decoded_tot;
+				dfu_dbg("%s: decoded buffer full\n", __func__);
+				if (!pg->open)
+					return decoded_tot;
+				return bf_pages_release(bf, pg, decoded_tot,
+							addr, 1);
 			}
 			/* peek line header does not update tail, do it now */
 			bf->tail = _go_on(bf, bf->tail, stat);
 			dfu_dbg("%s: tail = %d\n", __func__, bf->tail);
-			if (!tot)
+			if (!bf->page_size && !tot)
 				*addr = curr_addr;
-			/*
-			 * Calculate next line's start address, we'll have
-			 * to bail out in case next_line's address does not
-			 * match the calculated one (output buffer shall contain
-			 * countiguous data)
-			 */
-			next_addr = curr_addr + ld.byte_count;
+			if (bf->page_size && !pg->open) {
+				pg->open = 1;
+				pg->open_addr = curr_addr - fill;
+				pg->next_addr = pg->open_addr;
+			}
+			bf_fill_erased(bf, fill);
 			/* decode line and write data to output buffer */
 			/* note that _decode_data_line() verifies checksum */
-			stat = _decode_data_line(bf, &ld);
+			stat = _decode_data_line(bf, &ld, back);
 			if (stat <= 0) {
 				dfu_dbg("%s %d stat = %d\n", __func__, __LINE__,
 					stat);
 				return stat;
 			}
 			tot += stat;
-			decoded_tot += ld.byte_count;
-			if (!stat)
-				return decoded_tot;
+			/*
+			 * Calculate next line's start address, we'll have
+			 * to bail out in case next_line's address does not
+			 * match the calculated one (output buffer shall contain
+			 * countiguous data)
+			 */
+			if (ld.byte_count > back)
+				pg->next_addr = curr_addr + ld.byte_count;
+			if (!bf->page_size)
+				decoded_tot += ld.byte_count;
+			else
+				decoded_tot = bf_pages_release(bf, pg,
+							       decoded_tot,
+							       addr, 2);
 			break;
 		case IHEX_EOF:
+			if (pg->open) {
+				/* Last page must be complete too */
+				decoded_tot = bf_pages_close(bf, pg,
+							     decoded_tot, addr);
+				if (pg->open)
+					return decoded_tot;
+			}
 			/* peek line header does not update tail, do it now */
 			bf->tail = _go_on(bf, bf->tail, stat);
+			stat = _check_line(bf, &ld);
+			if (stat < 0)
+				return stat;
+			bf->tail = _go_on(bf, bf->tail, stat);
 			bf->rx_done = 1;
 			/* Force written flag to 1 */
 			dfu_binary_file_append_buffer(bf, NULL, 0);
@@ -369,15 +478,15 @@ int ihex_decode_chunk(struct dfu_binary_file *bf, uint32_t *addr)
 				dfu_err("IHEX: not enough bytes for addr\n");
 				return stat;
 			}
+			ld.sum += _sum_bytes(a);
 			if (ld.record_type == IHEX_EXT_LINEAR_ADDRESS)
 				a <<= 16;
 			bf->tail = index;
 			/* verify checksum */
 			stat = _check_line(bf, &ld);
-			if (stat < 0) {
-				dfu_err("IHEX: invalid checksum\n");
+			if (stat < 0)
 				return stat;
-			}
+			bf->tail = _go_on(bf, bf->tail, stat);
 			if (ld.record_type == IHEX_START_SEG_ADDRESS ||
 			    ld.record_type == IHEX_START_LINEAR_ADDRESS) {
 				dfu_log("IHEX Entry: 0x%08x\n", a);
@@ -385,13 +494,25 @@ int ihex_decode_chunk(struct dfu_binary_file *bf, uint32_t *addr)
 				break;
 			}
 			priv->curr_addr = a;
-			next_addr = a;
 			dfu_log("IHEX, new address: 0x%08x\n",
 				/* esp8266: uint32_t is unsigned long ! */
 				(unsigned int)priv->curr_addr);
 			dfu_dbg("tail = %d\n", bf->tail);
+			if (tot && a != pg->next_addr)
+				/*
+				 * Address jump, data decoded so far are
+				 * not contiguous with the next line's
+				 */
+				goto next_run;
+			break;
 		}
 		}
+		continue;
+	next_run:
+		stat = bf_decoded_run(bf, decoded_tot, *addr);
+		if (stat <= 0)
+			return stat < 0 ? stat : decoded_tot;
+		tot = decoded_tot = 0;
 	}
 	return decoded_tot;
 }
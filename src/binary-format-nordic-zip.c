@@ -137,8 +137,8 @@ struct nordic_zip_format_data {
 	char manifest_buffer[MAX_MANIFEST_SIZE];
 };
 
-/* Just one instance for the moment */
-static struct nordic_zip_format_data nzdata;
+/* One instance per dfu instance */
+static struct nordic_zip_format_data nzdata[CONFIG_DFU_MAX_INSTANCES];
 
 static inline int __go_on(int index, int amount, int buf_size)
 {
@@ -186,7 +186,7 @@ int _search_signature(struct dfu_binary_file *f, int *index,
 	consumed = 0;
 	do {
 		/* Look for first signature char */
-		for ( ; ptr[*index] != signature[0] && *index != f->head;
+		for ( ; *index != f->head && ptr[*index] != signature[0];
 		     *index = _next(f, *index), consumed++);
 		if (*index == f->head)
 			/* Not enough bytes */
@@ -268,7 +268,7 @@ int _peek_local_file_header(struct dfu_binary_file *f,
 	for (i = 0, ptr = lfh->c; i < sizeof(lfh->s.base) && index != f->head;
 	     i++, ptr++, index = _next(f, index), stat++)
 		*ptr = ((char *)f->buf)[index];
-	if (index == f->head)
+	if (i < sizeof(lfh->s.base))
 		/* Not enough characters in buffer */
 		return 0;
 	if (lfh->s.base.file_name_len > MAX_FNAME) {
@@ -280,13 +280,13 @@ int _peek_local_file_header(struct dfu_binary_file *f,
 	     i++, ptr++,
 		     index = _next(f, index), stat++)
 		*ptr = ((char *)f->buf)[index];
-	if (index == f->head)
+	if (i < lfh->s.base.file_name_len)
 		/* Not enough characters in buffer */
-		return -1;
-	if (bf_count(f) < sizeof(lfh->s.base) + lfh->s.base.file_name_len +
+		return 0;
+	if (_count(f->head, index, f->max_size) <
 	    lfh->s.base.extra_field_len)
 		/* Extra field not yet in buffer */
-		return -1;
+		return 0;
 	/* Pretend we took the extra field too out of the file's buffer */
 	stat += lfh->s.base.extra_field_len;
 	return stat;
@@ -295,14 +295,27 @@ int _peek_local_file_header(struct dfu_binary_file *f,
 /* Nordic zip header, check we're dealing with a zip file at least */
 int nz_probe(struct dfu_binary_file *f)
 {
-	int stat;
-	struct nordic_zip_format_data *fd = &nzdata;
+	static const char lh_signature[] = { 0x50, 0x4b, 0x03, 0x04, };
+	int stat, i, index;
+	struct nordic_zip_format_data *fd = &nzdata[dfu_id(f->dfu)];
 	union zip_local_file_header zlh;
 
+	/* A zip file starts with a local file header */
+	for (i = 0, index = f->tail; i < sizeof(lh_signature);
+	     i++, index = _next(f, index)) {
+		if (index == f->head)
+			/* Signature not yet in buffer */
+			return 1;
+		if (((char *)f->buf)[index] != lh_signature[i])
+			return -1;
+	}
 	/* Check whether the file contains a valid header */
 	stat = _peek_local_file_header(f, &zlh, -1);
-	if (stat <= 0)
+	if (stat < 0)
 		return -1;
+	if (!stat)
+		/* Header not yet complete */
+		return 1;
 	dfu_log("ZIP format probed\n");
 	/* Format probed, initialize private data */
 	f->format_data = fd;
@@ -408,6 +421,9 @@ static int _decode_local_header(struct dfu_binary_file *bf, int start)
 	}
 	priv->curr_rf = rf;
 	priv->state = STORING_FILE;
+	if (rf->local_buf)
+		/* Kept in memory (manifest), no temporary file needed */
+		return stat;
 	rf->fd = dfu_file_open(dfu, rf->name, 1, rf->size);
 	if (rf->fd < 0) {
 		dfu_err("%s: could not open file %s\n", __func__,
@@ -534,7 +550,7 @@ static int _send_file_chunk(struct dfu_binary_file *bf, uint32_t *addr)
 		return stat;
 	}
 	/* Update decoded head */
-	bf->decoded_head = _go_on(bf, bf->decoded_head, sz);
+	bf->decoded_head = _dec_go_on(bf, bf->decoded_head, sz);
 	*addr = _state_to_address(priv->state, priv->send_image_index) +
 		rf->done;
 	dfu_dbg("%s: address = 0x%08x\n", __func__, (unsigned int)*addr);
@@ -562,7 +578,7 @@ static int _realign_decoded_head(struct dfu_binary_file *bf, uint32_t *addr)
 	 */
 	*addr = NZ_FWFILE_THROW_AWAY;
 	sz = bf->write_chunk_size - (bf->decoded_head % bf->write_chunk_size);
-	bf->decoded_head = _go_on(bf, bf->decoded_head, sz);
+	bf->decoded_head = _dec_go_on(bf, bf->decoded_head, sz);
 	return sz;
 }
 
@@ -1005,7 +1021,8 @@ int nzbf_get_file_type_and_size(struct dfu_binary_file *bf,
 				phys_addr_t addr,
 				enum nzbf_type *t, unsigned int *size)
 {
-	struct nordic_zip_format_data *priv = bf->format_data;
+	/* Gang members: file is decoded by the gang leader */
+	struct nordic_zip_format_data *priv = bf_leader(bf)->format_data;
 	struct firmware_image *fi;
 	struct received_file *rf;
 	int image_index;
@@ -1023,7 +1040,8 @@ int nzbf_get_file_type_and_size(struct dfu_binary_file *bf,
 int nzbf_calc_crc(struct dfu_binary_file *bf, phys_addr_t addr,
 		  unsigned int length, uint32_t *out)
 {
-	struct nordic_zip_format_data *priv = bf->format_data;
+	/* Gang members: file is decoded by the gang leader */
+	struct nordic_zip_format_data *priv = bf_leader(bf)->format_data;
 	struct firmware_image *fi;
 	struct received_file *rf;
 	int image_index;
@@ -1037,7 +1055,7 @@ int nzbf_calc_crc(struct dfu_binary_file *bf, phys_addr_t addr,
 	fi = &priv->images[image_index];
 	rf = (t == NZ_TYPE_COMMAND) ? fi->dat_file : fi->bin_file;
 	crc32_init(out);
-	fd = dfu_file_open(bf->dfu, rf->name, 0, 0);
+	fd = dfu_file_open(bf_leader(bf)->dfu, rf->name, 0, 0);
 	if (fd < 0) {
 		dfu_err("%s: could not open file %s\n", __func__, rf->name);
 		return fd;
@@ -1046,14 +1064,15 @@ int nzbf_calc_crc(struct dfu_binary_file *bf, phys_addr_t addr,
 		sz = min(sizeof(buf), length - i);
 		if (!sz)
 			break;
-		if (dfu_file_read(bf->dfu, fd, buf, sz) < 0) {
+		if (dfu_file_read(bf_leader(bf)->dfu, fd, buf, sz) < 0) {
 			dfu_err("%s: error reading file\n", __func__);
 			ret = -1;
 			break;
 		}
 		crc32_iteration(buf, sz, out);
+		i += sz;
 	}
 	crc32_done(out);
-	dfu_file_close(bf->dfu, fd);
+	dfu_file_close(bf_leader(bf)->dfu, fd);
 	return ret;
 }
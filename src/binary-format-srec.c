@@ -0,0 +1,345 @@
+/*
+ * Motorola S-record format
+ * LGPL v2.1
+ */
+
+#include "dfu.h"
+#include "dfu-internal.h"
+
+/*
+ * Record types: S0 header, S1/S2/S3 data (16, 24 and 32 bits addresses),
+ * S5/S6 count of data records, S7/S8/S9 entry point and end of file (32,
+ * 24 and 16 bits addresses). S4 is reserved
+ */
+static const int srec_addr_len[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2, };
+
+struct srec_record {
+	int type;
+	uint32_t address;
+	/* Data bytes (byte count minus address and checksum) */
+	int data_len;
+	/* Sum of the record's bytes decoded so far (checksum) */
+	unsigned int sum;
+};
+
+struct srec_format_data {
+	/* Page assembler (next_addr is used without pages too) */
+	struct bf_pages pages;
+	/* Records decoded so far, to tell where a bad one is */
+	unsigned long records;
+	/* Data records, for S5/S6 */
+	unsigned long data_records;
+};
+
+/* One instance per dfu instance */
+static struct srec_format_data srdata[CONFIG_DFU_MAX_INSTANCES];
+
+static inline int _go_on(struct dfu_binary_file *f, int index, int amount)
+{
+	return (index + amount) & (f->max_size - 1);
+}
+
+/*
+ * Search for the beginning of a record, update index (first char after the
+ * 'S') and return number of bytes read, 'S' included. Contiguous parts of
+ * the input buffer are searched at once
+ */
+static int _search_record(struct dfu_binary_file *f, int *index)
+{
+	const char *ptr = f->buf, *p;
+	int end;
+
+	*index = f->tail;
+	while (*index != f->head) {
+		end = f->head > *index ? f->head : f->max_size;
+		p = memchr(&ptr[*index], 'S', end - *index);
+		if (p) {
+			*index = _go_on(f, p - ptr, 1);
+			return _go_on(f, *index, -f->tail);
+		}
+		*index = end & (f->max_size - 1);
+	}
+	return 0;
+}
+
+/*
+ * Look for the next record and decode its header (type, byte count and
+ * address). Returns the header's length, from the tail (f->tail is NOT
+ * updated), 0 if the whole record is not there yet, negative on error
+ */
+static int _peek_record(struct dfu_binary_file *f, struct srec_record *r)
+{
+	const char *ptr = f->buf;
+	int index, stat, alen, i;
+	uint8_t h[4];
+
+	stat = _search_record(f, &index);
+	if (stat <= 0)
+		return stat;
+	/* Type and byte count */
+	if (bf_count(f) < stat + 3)
+		return 0;
+	r->type = ptr[index] - '0';
+	if (r->type < 0 || r->type > 9 || !srec_addr_len[r->type])
+		return -1;
+	alen = srec_addr_len[r->type];
+	index = _go_on(f, index, 1);
+	r->sum = 0;
+	if (hex_get_bytes(f, &index, h, 1, &r->sum) < 0 || h[0] < alen + 1)
+		return -1;
+	r->data_len = h[0] - alen - 1;
+	if (stat + 3 + 2 * h[0] >= f->max_size) {
+		/* The ring will never hold the whole record */
+		dfu_err("SREC: %d bytes record, ring is %d bytes\n",
+			stat + 3 + 2 * h[0], f->max_size);
+		return -1;
+	}
+	/* Whole record: type, byte count, address, data and checksum */
+	if (bf_count(f) < stat + 3 + 2 * h[0])
+		return 0;
+	if (hex_get_bytes(f, &index, h, alen, &r->sum) < 0)
+		return -1;
+	for (i = 0, r->address = 0; i < alen; i++)
+		r->address = (r->address << 8) | h[i];
+	return stat + 3 + 2 * alen;
+}
+
+/*
+ * Check record's checksum: the ones' complement of the sum of byte count,
+ * address and data bytes. bf->tail must point to the checksum.
+ * Returns number of ascii chars to skip (the checksum) or error
+ */
+static int _check_record(struct dfu_binary_file *bf, struct srec_record *r)
+{
+	struct srec_format_data *priv = bf->format_data;
+	uint8_t *ptr = bf->buf, c[2];
+	int cks;
+
+	c[0] = ptr[bf->tail];
+	c[1] = ptr[_go_on(bf, bf->tail, 1)];
+	cks = hex_byte(c);
+	priv->records++;
+	if (cks < 0 || ((r->sum + cks) & 0xff) != 0xff) {
+		dfu_err("SREC: bad checksum, record %lu (address 0x%08x)\n",
+			priv->records, (unsigned int)r->address);
+		return -1;
+	}
+	return 2;
+}
+
+/* Skip the data of a record carrying no payload, check its checksum */
+static int _skip_record(struct dfu_binary_file *bf, struct srec_record *r)
+{
+	uint8_t tmp[8];
+	int i, n, stat;
+
+	for (i = r->data_len; i > 0; i -= n) {
+		n = min(i, (int)sizeof(tmp));
+		if (hex_get_bytes(bf, &bf->tail, tmp, n, &r->sum) < 0)
+			return -1;
+	}
+	stat = _check_record(bf, r);
+	if (stat < 0)
+		return stat;
+	bf->tail = _go_on(bf, bf->tail, stat);
+	return 0;
+}
+
+/*
+ * Decode a data record. bf->tail must point to its data. Data are written
+ * @back bytes before the decoded buffer's head (data going back inside the
+ * page being assembled). The caller checks bf_dec_space()
+ */
+static int _decode_data(struct dfu_binary_file *bf, struct srec_record *r,
+			int back)
+{
+	struct srec_format_data *priv = bf->format_data;
+	int index = bf->tail, stat;
+	int out_index = (bf->decoded_head - back) & (bf->decoded_size - 1);
+
+	stat = hex_decode_buf(bf, &index, &out_index, r->data_len * 2,
+			      &r->sum);
+	if (stat < 0) {
+		dfu_err("SREC: invalid data, record %lu\n",
+			priv->records + 1);
+		return stat;
+	}
+	bf->tail = index;
+	if (r->data_len > back)
+		bf->decoded_head = out_index;
+	stat = _check_record(bf, r);
+	if (stat < 0)
+		return stat;
+	bf->tail = _go_on(bf, bf->tail, stat);
+	priv->data_records++;
+	return 0;
+}
+
+/* Motorola S-record, check for a valid first record */
+int srec_probe(struct dfu_binary_file *f)
+{
+	struct srec_format_data *fd = &srdata[dfu_id(f->dfu)];
+	struct srec_record r;
+	int stat;
+
+	if (!bf_count(f))
+		return 1;
+	if (((char *)f->buf)[f->tail] != 'S')
+		/* Not the beginning of a record */
+		return -1;
+	stat = _peek_record(f, &r);
+	if (stat < 0)
+		return stat;
+	if (!stat)
+		/* Record not yet complete */
+		return 1;
+	dfu_log("Motorola S-record format probed\n");
+	f->format_data = fd;
+	memset(fd, 0, sizeof(*fd));
+	return 0;
+}
+
+/*
+ * Decode new file chunk (some records in general), same as intel hex (see
+ * ihex_decode_chunk()): data are assembled in pages if the target wants
+ * them, runs ending at address jumps or completed pages are handed to
+ * bf_decoded_run(), the last one is returned. S7/S8/S9 records end the file.
+ */
+int srec_decode_chunk(struct dfu_binary_file *bf, phys_addr_t *addr)
+{
+	struct srec_format_data *priv = bf->format_data;
+	struct bf_pages *pg = &priv->pages;
+	struct srec_record r;
+	int stat, decoded_tot = 0, run = 0, fill, back;
+
+	while (!bf->rx_done) {
+		stat = _peek_record(bf, &r);
+		if (stat <= 0) {
+			if (stat < 0)
+				dfu_err("SREC: bad record %lu\n",
+					priv->records + 1);
+			return stat < 0 ? stat : decoded_tot;
+		}
+		switch (r.type) {
+		case 1:
+		case 2:
+		case 3:
+			fill = back = 0;
+			if (bf->page_size &&
+			    bf_pages_written(bf, pg, r.address, r.data_len)) {
+				dfu_err("SREC: record %lu goes back to a page "
+					"already written (address 0x%08x)\n",
+					priv->records + 1,
+					(unsigned int)r.address);
+				return -1;
+			}
+			if (pg->open &&
+			    !bf_pages_in_window(bf, pg, r.address)) {
+				/* Record for another page, complete this one */
+				decoded_tot = bf_pages_close(bf, pg,
+							     decoded_tot, addr);
+				if (pg->open)
+					return decoded_tot;
+				goto next_run;
+			}
+			if (pg->open) {
+				/* Data can go back and forth */
+				if (r.address > pg->next_addr)
+					fill = r.address - pg->next_addr;
+				else
+					back = pg->next_addr - r.address;
+			} else if (bf->page_size)
+				/* Pages start at their beginning */
+				fill = r.address & (bf->page_size - 1);
+			else if (run && r.address != pg->next_addr)
+				/* Address jump, record starts the next run */
+				goto next_run;
+			if (bf_dec_space(bf) < fill + r.data_len - back) {
+				/*
+				 * No room for this record's data: give back
+				 * the pages being assembled, but the last one
+				 */
+				if (!pg->open)
+					return decoded_tot;
+				return bf_pages_release(bf, pg, decoded_tot,
+							addr, 1);
+			}
+			bf->tail = _go_on(bf, bf->tail, stat);
+			if (!bf->page_size && !run)
+				*addr = r.address;
+			if (bf->page_size && !pg->open) {
+				pg->open = 1;
+				pg->open_addr = r.address - fill;
+				pg->next_addr = pg->open_addr;
+			}
+			bf_fill_erased(bf, fill);
+			stat = _decode_data(bf, &r, back);
+			if (stat < 0)
+				return stat;
+			run = 1;
+			if (r.data_len > back)
+				pg->next_addr = r.address + r.data_len;
+			if (!bf->page_size)
+				decoded_tot += r.data_len;
+			else
+				decoded_tot = bf_pages_release(bf, pg,
+							       decoded_tot,
+							       addr, 2);
+			break;
+		case 7:
+		case 8:
+		case 9:
+			if (pg->open) {
+				/* Last page must be complete too */
+				decoded_tot = bf_pages_close(bf, pg,
+							     decoded_tot, addr);
+				if (pg->open)
+					return decoded_tot;
+			}
+			bf->tail = _go_on(bf, bf->tail, stat);
+			if (_skip_record(bf, &r) < 0)
+				return -1;
+			dfu_log("SREC Entry: 0x%08x\n",
+				(unsigned int)r.address);
+			dfu_target_set_entry(bf->dfu, r.address);
+			bf->rx_done = 1;
+			/* Force written flag to 1 */
+			dfu_binary_file_append_buffer(bf, NULL, 0);
+			dfu_log("SREC: file ended\n");
+			break;
+		case 5:
+		case 6:
+			bf->tail = _go_on(bf, bf->tail, stat);
+			if (_skip_record(bf, &r) < 0)
+				return -1;
+			if (r.address != (priv->data_records &
+					  (r.type == 5 ? 0xffff : 0xffffff))) {
+				dfu_err("SREC: %u data records, %lu decoded\n",
+					(unsigned int)r.address,
+					priv->data_records);
+				return -1;
+			}
+			break;
+		default:
+			/* S0 header */
+			bf->tail = _go_on(bf, bf->tail, stat);
+			if (_skip_record(bf, &r) < 0)
+				return -1;
+			break;
+		}
+		continue;
+	next_run:
+		stat = bf_decoded_run(bf, decoded_tot, *addr);
+		if (stat <= 0)
+			return stat < 0 ? stat : decoded_tot;
+		run = decoded_tot = 0;
+	}
+	return decoded_tot;
+}
+
+int srec_fini(struct dfu_binary_file *bf)
+{
+	return 0;
+}
+
+declare_dfu_format(srec, srec_probe, srec_decode_chunk, srec_fini);
@@ -2,23 +2,31 @@
 #include "dfu.h"
 #include "dfu-internal.h"
 
-#ifndef CONFIG_DFU_MAX_TIMEOUTS
-#define CONFIG_DFU_MAX_TIMEOUTS 4
-#endif
+/*
+ * One of these for each dfu instance. Instances are completely independent
+ * of each other and can be driven from the same event loop by invoking
+ * dfu_idle() on each of them.
+ */
+struct dfu_instance {
+	struct dfu_data dfu;
+	struct dfu_interface interface;
+	struct dfu_target target;
+	struct dfu_host host;
+	struct dfu_file_container file_container;
+};
 
-static struct dfu_data dfu;
-static struct dfu_interface interface;
-static struct dfu_target target;
-static struct dfu_host host;
-static struct dfu_file_container file_container;
+static struct dfu_instance instances[CONFIG_DFU_MAX_INSTANCES];
 
-static struct dfu_timeout *timeouts[CONFIG_DFU_MAX_TIMEOUTS];
+static struct dfu_instance *_find_free_instance(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(instances); i++)
+		if (!instances[i].dfu.busy)
+			return &instances[i];
+	return NULL;
+}
 
-/*
- * We just support one dfu instance at a time for the moment, that should
- * be enough
- * It shouldn't be too difficult extending to more than dfu at the same time
- */
 struct dfu_data *dfu_init(const struct dfu_interface_ops *iops,
 			  const char *interface_path,
 			  const void *interface_pars,
@@ -31,53 +39,69 @@ struct dfu_data *dfu_init(const struct dfu_interface_ops *iops,
 			  const void *fc_args)
 {
 	int stat;
+	struct dfu_instance *inst;
+	struct dfu_data *dfu;
+	struct dfu_interface *interface;
+	struct dfu_target *target;
+	struct dfu_host *host;
+	struct dfu_file_container *file_container;
 
 	if (!iops || !tops || !hops)
 		return NULL;
-	if (dfu.busy)
+	inst = _find_free_instance();
+	if (!inst)
 		return NULL;
-	dfu.busy = 1;
-	dfu.error = 0;
-	dfu.interface = &interface;
-	dfu.target = &target;
-	dfu.host = &host;
-	dfu.fc = fcops ? &file_container : NULL;
-	if (dfu.fc)
-		dfu.fc->ops = fcops;
-	interface.dfu = &dfu;
-	interface.ops = iops;
-	interface.start_cb = start_cb;
-	interface.start_cb_data = start_cb_data;
-	target.dfu = &dfu;
-	target.ops = tops;
-	target.pars = target_pars;
-	target.busy = 0;
-	host.ops = hops;
+	memset(inst, 0, sizeof(*inst));
+	dfu = &inst->dfu;
+	interface = &inst->interface;
+	target = &inst->target;
+	host = &inst->host;
+	file_container = &inst->file_container;
+	dfu->id = inst - instances;
+	dfu->busy = 1;
+	dfu->error = 0;
+	dfu->interface = interface;
+	dfu->target = target;
+	dfu->host = host;
+	dfu->fc = fcops ? file_container : NULL;
+	if (dfu->fc)
+		dfu->fc->ops = fcops;
+	interface->dfu = dfu;
+	interface->ops = iops;
+	interface->start_cb = start_cb;
+	interface->start_cb_data = start_cb_data;
+	target->dfu = dfu;
+	target->ops = tops;
+	target->pars = target_pars;
+	target->busy = 0;
+	host->dfu = dfu;
+	host->ops = hops;
+	dfu_reset_phase_stats(dfu);
 	if (hops->init) {
-		stat = hops->init(&host);
+		stat = hops->init(host);
 		if (stat < 0)
 			goto error;
 	}
 	if (tops->init) {
-		target.interface = &interface;
-		stat = tops->init(&target, &interface);
+		target->interface = interface;
+		stat = tops->init(target, interface);
 		if (stat < 0)
 			goto error;
 	}
-	stat = dfu_interface_open(&interface, interface_path, interface_pars);
+	stat = dfu_interface_open(interface, interface_path, interface_pars);
 	if (stat < 0)
 		goto error;
 	if (fcops && fcops->init) {
-		file_container.dfu = &dfu;
-		file_container.ops = fcops;
-		stat = fcops->init(&file_container, fc_args);
+		file_container->dfu = dfu;
+		file_container->ops = fcops;
+		stat = fcops->init(file_container, fc_args);
 		if (stat < 0)
 			goto error;
 	}
-	return &dfu;
+	return dfu;
 
 error:
-	dfu.busy = 0;
+	dfu->busy = 0;
 	return NULL;
 }
 
@@ -90,9 +114,11 @@ int dfu_fini(struct dfu_data *dfu)
 	/*
 	 * Cancel all timeouts
 	 */
-	for (i = 0; i < ARRAY_SIZE(timeouts); i++)
-		if (timeouts[i])
-			timeouts[i] = NULL;
+	for (i = 0; i < dfu->ntimeouts; i++) {
+		dfu->timeouts[i]->dfu = NULL;
+		dfu->timeouts[i] = NULL;
+	}
+	dfu->ntimeouts = 0;
 	/* Finalize everything */
 	if (dfu->interface && dfu_interface_has_fini(dfu->interface)) {
 		ret = dfu_interface_fini(dfu->interface);
@@ -119,55 +145,91 @@ int dfu_fini(struct dfu_data *dfu)
 	return ret;
 }
 
-static int _insert_timeout(struct dfu_data *dfu, struct dfu_timeout *to)
+/*
+ * Pending timeouts are kept in a binary min-heap (one for each instance),
+ * ordered by expiry time. Each timeout keeps track of its own position in
+ * the heap, so that it can be found without searching for it when it is
+ * cancelled.
+ */
+static inline int _expires_before(struct dfu_timeout *a, struct dfu_timeout *b)
 {
-	int i, j;
-	struct dfu_timeout *ptr;
-	unsigned long now = dfu_get_current_time(dfu);
+	return time_before(a->expires, b->expires);
+}
 
-	for (i = 0, to->timeout += now; i < ARRAY_SIZE(timeouts); i++) {
-		ptr = timeouts[i];
-		if (!ptr) {
-			/* Last element */
-			timeouts[i] = to;
-			return 0;
-		}
-		if (time_after(to->timeout, ptr->timeout)) {
-			to->timeout -= ptr->timeout;
-			continue;
-		}
-		/*
-		 * Shift everything right by one and make slot available for
-		 * new timeout
-		 */
-		if (timeouts[ARRAY_SIZE(timeouts) - 1])
-			/* No space */
-			return -1;
-		for (j = ARRAY_SIZE(timeouts) - 1; j >= i; j--)
-			timeouts[j] = timeouts[j - 1];
-		timeouts[i] = to;
-		timeouts[i+1]->timeout -= to->timeout;
-		return 0;
+static inline void _heap_set(struct dfu_data *dfu, int i,
+			     struct dfu_timeout *to)
+{
+	dfu->timeouts[i] = to;
+	to->heap_index = i;
+}
+
+static void _heap_up(struct dfu_data *dfu, int i)
+{
+	struct dfu_timeout *to = dfu->timeouts[i];
+	int parent;
+
+	for ( ; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!_expires_before(to, dfu->timeouts[parent]))
+			break;
+		_heap_set(dfu, i, dfu->timeouts[parent]);
+	}
+	_heap_set(dfu, i, to);
+}
+
+static void _heap_down(struct dfu_data *dfu, int i)
+{
+	struct dfu_timeout *to = dfu->timeouts[i];
+	const int n = dfu->ntimeouts;
+	int child;
+
+	for ( ; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && _expires_before(dfu->timeouts[child + 1],
+						     dfu->timeouts[child]))
+			child++;
+		if (!_expires_before(dfu->timeouts[child], to))
+			break;
+		_heap_set(dfu, i, dfu->timeouts[child]);
 	}
-	/* No space */
-	return -1;
+	_heap_set(dfu, i, to);
 }
 
 static int _remove_timeout(struct dfu_timeout *to)
 {
+	struct dfu_data *dfu = to->dfu;
+	struct dfu_timeout *last;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(timeouts) && timeouts[i] != to; i++);
-	if (i == ARRAY_SIZE(timeouts))
+	if (!dfu)
+		/* Not pending */
+		return -1;
+	i = to->heap_index;
+	last = dfu->timeouts[--dfu->ntimeouts];
+	dfu->timeouts[dfu->ntimeouts] = NULL;
+	to->dfu = NULL;
+	if (last == to)
+		return 0;
+	/* Move last timeout to the freed slot and restore heap property */
+	_heap_set(dfu, i, last);
+	if (i > 0 && _expires_before(last, dfu->timeouts[(i - 1) / 2]))
+		_heap_up(dfu, i);
+	else
+		_heap_down(dfu, i);
+	return 0;
+}
+
+static int _insert_timeout(struct dfu_data *dfu, struct dfu_timeout *to)
+{
+	if (to->dfu)
+		/* Already pending, re-arm it */
+		_remove_timeout(to);
+	if (dfu->ntimeouts >= ARRAY_SIZE(dfu->timeouts))
+		/* No space */
 		return -1;
-	if (i < (ARRAY_SIZE(timeouts) - 1) && timeouts[i+1])
-		timeouts[i+1]->timeout += timeouts[i]->timeout;
-	/* Timeout found, shift everything left  */
-	for ( ; i < (ARRAY_SIZE(timeouts) - 1); i++)
-		timeouts[i] = timeouts[i+1];
-	/* Make sure unused slots always contain a NULL pointer */
-	/* Note that i should be = ARRAY_SIZE(timeouts) - 1 */
-	timeouts[i] = NULL;
+	to->expires = dfu_get_current_time(dfu) + to->timeout;
+	to->dfu = dfu;
+	_heap_set(dfu, dfu->ntimeouts, to);
+	_heap_up(dfu, dfu->ntimeouts++);
 	return 0;
 }
 
@@ -183,11 +245,32 @@ int dfu_cancel_timeout(struct dfu_timeout *to)
 	return _remove_timeout(to);
 }
 
-static int _trigger_timeout(struct dfu_data *dfu, struct dfu_timeout *to)
+/* Trigger all expired timeouts */
+static void _trigger_timeouts(struct dfu_data *dfu)
 {
-	dfu_dbg("%s: triggering timeout %p\n", __func__, to);
-	timeouts[0]->cb(dfu, timeouts[0]->priv);
-	return _remove_timeout(to);
+	unsigned long now = dfu_get_current_time(dfu);
+	struct dfu_timeout *to;
+	int n;
+
+	/*
+	 * Don't loop forever in case some callback sets an already expired
+	 * timeout again
+	 */
+	for (n = dfu->ntimeouts; n > 0 && dfu->ntimeouts; n--) {
+		to = dfu->timeouts[0];
+		if (time_before(now, to->expires))
+			break;
+		dfu_dbg("%s: triggering timeout %p\n", __func__, to);
+		/* Remove first, callback could set the same timeout again */
+		_remove_timeout(to);
+		to->cb(dfu, to->priv);
+	}
+}
+
+/* Returns expiry time of next timeout, -1 if no timeout is pending */
+static inline long _next_timeout(struct dfu_data *dfu)
+{
+	return dfu->ntimeouts ? dfu->timeouts[0]->expires : -1;
 }
 
 static void _trigger_interface_event(struct dfu_data *dfu)
@@ -198,9 +281,15 @@ static void _trigger_interface_event(struct dfu_data *dfu)
 
 static void _trigger_file_event(struct dfu_data *dfu)
 {
-	if (!dfu->bf || !dfu->bf->ops || !dfu->bf->ops->on_event)
+	struct dfu_binary_file *bf;
+
+	if (!dfu->bf)
+		return;
+	/* Gang members: file is received by the leader */
+	bf = bf_leader(dfu->bf);
+	if (!bf->ops || !bf->ops->on_event)
 		return;
-	dfu->bf->ops->on_event(dfu->bf);
+	bf->ops->on_event(bf);
 }
 
 static void _poll_interface(struct dfu_data *dfu)
@@ -211,6 +300,8 @@ static void _poll_interface(struct dfu_data *dfu)
 		break;
 	case DFU_INTERFACE_EVENT:
 		_trigger_interface_event(dfu);
+		/* There could be more */
+		dfu_idle_again(dfu);
 		break;
 	default:
 		dfu_log("%s: unexpected retval from interface poll_idle()\n",
@@ -221,12 +312,12 @@ static void _poll_interface(struct dfu_data *dfu)
 
 static inline int _bf_is_pollable(struct dfu_binary_file *bf)
 {
-	return (bf->ops && bf->ops->poll_idle);
+	return bf && bf_leader(bf)->ops && bf_leader(bf)->ops->poll_idle;
 }
 
 static void _poll_file(struct dfu_data *dfu)
 {
-	struct dfu_binary_file *bf = dfu->bf;
+	struct dfu_binary_file *bf = bf_leader(dfu->bf);
 
 	switch(bf->ops->poll_idle(bf)) {
 	case 0:
@@ -234,6 +325,8 @@ static void _poll_file(struct dfu_data *dfu)
 		break;
 	case DFU_FILE_EVENT:
 		_trigger_file_event(dfu);
+		/* There could be more */
+		dfu_idle_again(dfu);
 		break;
 	default:
 		dfu_log("%s: unexpected retval from file poll_idle()\n",
@@ -242,14 +335,32 @@ static void _poll_file(struct dfu_data *dfu)
 	}
 }
 
+/*
+ * Deadline for the host's idle: now if there's more work to do, next
+ * timeout otherwise. Components which can only be polled must be polled
+ * at least every CONFIG_DFU_POLL_PERIOD msecs.
+ */
+static long _idle_deadline(struct dfu_data *dfu, int polled)
+{
+	long next = _next_timeout(dfu), now;
+
+	if (!dfu->idle_again && !polled)
+		return next;
+	now = dfu_get_current_time(dfu);
+	if (dfu->idle_again)
+		return now;
+	now += CONFIG_DFU_POLL_PERIOD;
+	return next < 0 || next > now ? now : next;
+}
+
 /*
  * Idle loop: either rely on host's idle operation or poll everything to
  * check whether some event has happened
  */
 int dfu_idle(struct dfu_data *dfu)
 {
-	unsigned long now;
-	int next_timeout, stat;
+	int stat, polled;
+	dfu_profile_declare(t);
 
 	if (!dfu || !dfu->busy)
 		/* Uninitialized data structure, cannot call dfu_idle */
@@ -257,36 +368,52 @@ int dfu_idle(struct dfu_data *dfu)
 	if (dfu_error(dfu))
 		/* An asynchronous error occurred, tell the user */
 		return DFU_ERROR;
-	if (dfu_interface_has_poll_idle(dfu->interface))
+	dfu->idle_again = 0;
+	polled = 0;
+	dfu_profile_start(dfu, t);
+	if (dfu_interface_has_poll_idle(dfu->interface)) {
 		_poll_interface(dfu);
-	if (_bf_is_pollable(dfu->bf))
+		polled = 1;
+	}
+	if (_bf_is_pollable(dfu->bf)) {
 		_poll_file(dfu);
-	next_timeout = !timeouts[0] ? -1 : timeouts[0]->timeout;
-	now = dfu_get_current_time(dfu);
-	if (timeouts[0] && time_after(now, next_timeout))
-		if (_trigger_timeout(dfu, timeouts[0]) < 0) {
-			dfu_err("removing timeout");
-			return DFU_ERROR;
-		}
-	if (dfu->target->ops->on_idle)
+		polled = 1;
+	}
+	if (polled)
+		dfu_profile_end(dfu, DFU_PHASE_POLL, t);
+	dfu_profile_start(dfu, t);
+	_trigger_timeouts(dfu);
+	dfu_profile_end(dfu, DFU_PHASE_TIMEOUTS, t);
+	if (dfu->target->ops->on_idle) {
+		dfu_profile_start(dfu, t);
 		dfu->target->ops->on_idle(dfu->target);
-	if (dfu_binary_file_on_idle(dfu->bf) < 0)
+		dfu_profile_end(dfu, DFU_PHASE_TARGET_IDLE, t);
+	}
+	dfu_profile_start(dfu, t);
+	stat = dfu_binary_file_on_idle(dfu->bf);
+	dfu_profile_end(dfu, DFU_PHASE_FILE_IDLE, t);
+	if (stat < 0) {
+		/* Session failed, gang members must not wait for it */
+		dfu_notify_error(dfu);
 		return DFU_ERROR;
+	}
 	if (dfu->host->ops->idle) {
 		/* next timeout could have changed ! */
-		next_timeout = !timeouts[0] ? -1 : timeouts[0]->timeout;
-		stat = dfu->host->ops->idle(dfu->host, next_timeout);
+		dfu_profile_start(dfu, t);
+		stat = dfu->host->ops->idle(dfu->host,
+					    _idle_deadline(dfu, polled));
+		dfu_profile_end(dfu, DFU_PHASE_HOST_IDLE, t);
 		if (stat < 0)
 			return stat;
+		dfu_profile_start(dfu, t);
 		if (stat & DFU_TIMEOUT)
-			if (_trigger_timeout(dfu, timeouts[0]) < 0) {
-				dfu_err("removing timeout");
-				return DFU_ERROR;
-			}
+			_trigger_timeouts(dfu);
 		if (stat & DFU_FILE_EVENT)
 			_trigger_file_event(dfu);
 		if (stat & DFU_INTERFACE_EVENT)
 			_trigger_interface_event(dfu);
+		if (stat)
+			dfu_profile_end(dfu, DFU_PHASE_EVENTS, t);
 	}
 	if (dfu_binary_file_written(dfu->bf))
 		return DFU_ALL_DONE;
@@ -300,6 +427,32 @@ unsigned long dfu_get_current_time(struct dfu_data *dfu)
 	return 0xffffffffUL;
 }
 
+unsigned long dfu_get_current_time_us(struct dfu_data *dfu)
+{
+	if (dfu->host->ops->get_current_time_us)
+		return dfu->host->ops->get_current_time_us(dfu->host);
+	return dfu_get_current_time(dfu) * 1000;
+}
+
+void dfu_wakeup(struct dfu_data *dfu)
+{
+	if (dfu->host->ops->wakeup)
+		dfu->host->ops->wakeup(dfu->host);
+}
+
+void dfu_abort(struct dfu_data *dfu)
+{
+	struct dfu_binary_file *l;
+
+	dfu_notify_error(dfu);
+	if (!dfu->bf)
+		return;
+	l = bf_leader(dfu->bf);
+	if (l->gang_size)
+		/* Free the chunks the others were waiting for */
+		bf_gang_update_tail(l);
+}
+
 int dfu_set_binary_file_event(struct dfu_data *dfu, void *event_data)
 {
 	if (!dfu->host->ops->set_binary_file_event)
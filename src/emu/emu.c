@@ -0,0 +1,126 @@
+/*
+ * libdfu, software target emulators, common code
+ * LGPL v2.1
+ */
+#include <time.h>
+#include "dfu.h"
+#include "dfu-internal.h"
+#include "dfu-emu.h"
+
+static uint64_t _now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Time needed to transfer one byte (start + 8 data + stop bits) */
+static inline uint64_t _byte_time(struct dfu_emu *e)
+{
+	return e->timings.baud ? 10000000ULL / e->timings.baud : 0;
+}
+
+static inline unsigned int _out_count(struct dfu_emu *e)
+{
+	return e->out_head - e->out_tail;
+}
+
+int dfu_emu_init(struct dfu_emu *e, const struct dfu_emu_ops *ops,
+		 const void *pars, const struct dfu_emu_timings *t,
+		 void *flash, unsigned long flash_size)
+{
+	if (!e || !ops || !ops->input || !flash || !flash_size) {
+		dfu_err("%s: invalid parameters\n", __func__);
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->ops = ops;
+	e->pars = pars;
+	if (t)
+		e->timings = *t;
+	e->flash = flash;
+	e->flash_size = flash_size;
+	if (ops->init && ops->init(e) < 0)
+		return -1;
+	dfu_emu_reset(e);
+	return 0;
+}
+
+void dfu_emu_reset(struct dfu_emu *e)
+{
+	e->out_head = e->out_tail = 0;
+	e->clock = e->in_line = e->out_line = _now();
+	e->state = 0;
+	e->cnt = e->len = 0;
+	if (e->ops->reset)
+		e->ops->reset(e);
+}
+
+int dfu_emu_write(struct dfu_emu *e, const void *buf, unsigned long len)
+{
+	const uint8_t *ptr = buf;
+	uint64_t now = _now(), bt = _byte_time(e);
+	unsigned long i;
+
+	if (e->in_line < now)
+		e->in_line = now;
+	for (i = 0; i < len; i++) {
+		/* Byte is there when it has gone through the line */
+		e->in_line += bt;
+		/* Target might still be busy with previous command */
+		if (e->clock < e->in_line)
+			e->clock = e->in_line;
+		e->ops->input(e, ptr[i]);
+	}
+	return len;
+}
+
+int dfu_emu_read(struct dfu_emu *e, void *buf, unsigned long len)
+{
+	uint8_t *ptr = buf;
+	uint64_t now = _now();
+	unsigned int i;
+
+	for (i = 0; i < len && _out_count(e); i++, e->out_tail++) {
+		unsigned int index = e->out_tail & (DFU_EMU_OUTBUF_SIZE - 1);
+
+		if (e->out_time[index] > now)
+			break;
+		ptr[i] = e->out[index];
+	}
+	return i;
+}
+
+long dfu_emu_next_output(struct dfu_emu *e)
+{
+	uint64_t now = _now(), t;
+
+	if (!_out_count(e))
+		return -1;
+	t = e->out_time[e->out_tail & (DFU_EMU_OUTBUF_SIZE - 1)];
+	return t > now ? t - now : 0;
+}
+
+void dfu_emu_send(struct dfu_emu *e, const void *buf, unsigned long len)
+{
+	const uint8_t *ptr = buf;
+	uint64_t bt = _byte_time(e);
+	unsigned long i;
+
+	/* Replies start when the target is done */
+	if (e->out_line < e->clock)
+		e->out_line = e->clock;
+	for (i = 0; i < len; i++, e->out_head++) {
+		unsigned int index = e->out_head & (DFU_EMU_OUTBUF_SIZE - 1);
+
+		if (_out_count(e) >= DFU_EMU_OUTBUF_SIZE) {
+			dfu_err("%s: output buffer full\n", __func__);
+			e->errors++;
+			return;
+		}
+		e->out_line += bt;
+		e->out[index] = ptr[i];
+		e->out_time[index] = e->out_line;
+	}
+}
@@ -0,0 +1,248 @@
+/*
+ * STK500v1 (optiboot like) bootloader emulator
+ * LGPL v2.1
+ */
+#include "dfu.h"
+#include "dfu-internal.h"
+#include "dfu-emu.h"
+#include "stk500-device.h"
+
+enum stk500_emu_cmd {
+	STK_GET_SYNC = 0x30,
+	STK_GET_SIGN_ON = 0x31,
+	STK_SET_PARAMETER = 0x40,
+	STK_GET_PARAMETER = 0x41,
+	STK_SET_DEVICE = 0x42,
+	STK_SET_DEVICE_EXT = 0x45,
+	STK_ENTER_PROGMODE = 0x50,
+	STK_LEAVE_PROGMODE = 0x51,
+	STK_CHIP_ERASE = 0x52,
+	STK_LOAD_ADDRESS = 0x55,
+	STK_UNIVERSAL = 0x56,
+	STK_PROG_PAGE = 0x64,
+	STK_READ_PAGE = 0x74,
+};
+
+enum stk500_emu_resp {
+	STK_OK = 0x10,
+	STK_FAILED = 0x11,
+	STK_UNKNOWN = 0x12,
+	STK_INSYNC = 0x14,
+	STK_NOSYNC = 0x15,
+};
+
+enum stk500_emu_param {
+	STK_HW_VER = 0x80,
+	STK_SW_MAJOR = 0x81,
+	STK_SW_MINOR = 0x82,
+};
+
+#define STK_CRC_EOP 0x20
+
+enum stk500_emu_state {
+	WAIT_CMD = 0,
+	/* Fixed size command arguments */
+	WAIT_ARGS,
+	/* Program page data */
+	WAIT_DATA,
+	WAIT_EOP,
+};
+
+/*
+ * Number of argument bytes for each command (before data), -1 for
+ * unknown commands
+ */
+static int _nargs(uint8_t cmd)
+{
+	switch (cmd) {
+	case STK_GET_SYNC:
+	case STK_GET_SIGN_ON:
+	case STK_ENTER_PROGMODE:
+	case STK_LEAVE_PROGMODE:
+	case STK_CHIP_ERASE:
+		return 0;
+	case STK_GET_PARAMETER:
+		return 1;
+	case STK_SET_PARAMETER:
+	case STK_LOAD_ADDRESS:
+		return 2;
+	case STK_PROG_PAGE:
+	case STK_READ_PAGE:
+		/* be16 length, memory type */
+		return 3;
+	case STK_UNIVERSAL:
+		return 4;
+	case STK_SET_DEVICE_EXT:
+		return 5;
+	case STK_SET_DEVICE:
+		return 20;
+	default:
+		return -1;
+	}
+}
+
+static int _param(uint8_t p)
+{
+	switch (p) {
+	case STK_HW_VER:
+		return 2;
+	case STK_SW_MAJOR:
+		return 1;
+	case STK_SW_MINOR:
+		return 18;
+	default:
+		return 3;
+	}
+}
+
+/* Like optiboot: ignored, chip erase included */
+static uint8_t _universal(struct dfu_emu *e)
+{
+	return 0;
+}
+
+static int _prog_page(struct dfu_emu *e)
+{
+	const struct stk500_device_data *dd = e->pars;
+	unsigned long addr = e->addr << 1, page_size;
+	unsigned int len = (e->buf[0] << 8) | e->buf[1];
+
+	if (e->buf[2] != 'F')
+		/* Eeprom is not emulated */
+		return 0;
+	if (addr + len > e->flash_size) {
+		dfu_err("%s: invalid address 0x%08lx\n", __func__, addr);
+		return -1;
+	}
+	/* Page write also erases the page */
+	memcpy(&e->flash[addr], &e->buf[3], len);
+	page_size = dd->flash->paged ? dd->flash->page_size : len;
+	for (; len; len -= len > page_size ? page_size : len) {
+		e->pages_programmed++;
+		dfu_emu_busy(e, e->timings.page_program_us);
+	}
+	return 0;
+}
+
+static void _read_page(struct dfu_emu *e)
+{
+	unsigned long addr = e->addr << 1;
+	unsigned int i, len = (e->buf[0] << 8) | e->buf[1];
+	int flash = e->buf[2] == 'F';
+
+	for (i = 0; i < len; i++)
+		dfu_emu_send_byte(e, flash && addr + i < e->flash_size ?
+				  e->flash[addr + i] : 0xff);
+}
+
+/* Complete command has been received (EOP included) */
+static void _do_cmd(struct dfu_emu *e)
+{
+	static const char sign_on[] = "AVR STK";
+
+	if (_nargs(e->cmd) < 0) {
+		e->errors++;
+		dfu_emu_send_byte(e, STK_UNKNOWN);
+		return;
+	}
+	dfu_emu_send_byte(e, STK_INSYNC);
+	switch (e->cmd) {
+	case STK_GET_SIGN_ON:
+		dfu_emu_send(e, sign_on, sizeof(sign_on) - 1);
+		break;
+	case STK_GET_PARAMETER:
+		dfu_emu_send_byte(e, _param(e->buf[0]));
+		break;
+	case STK_CHIP_ERASE:
+		/* Ignored like optiboot does, page writes erase pages */
+		break;
+	case STK_LOAD_ADDRESS:
+		/* Little endian word address */
+		e->addr = e->buf[0] | (e->buf[1] << 8);
+		break;
+	case STK_UNIVERSAL:
+		dfu_emu_send_byte(e, _universal(e));
+		break;
+	case STK_PROG_PAGE:
+		if (_prog_page(e) < 0) {
+			e->errors++;
+			dfu_emu_send_byte(e, STK_FAILED);
+			return;
+		}
+		break;
+	case STK_READ_PAGE:
+		_read_page(e);
+		break;
+	default:
+		break;
+	}
+	dfu_emu_send_byte(e, STK_OK);
+}
+
+static void stk500_emu_input(struct dfu_emu *e, uint8_t c)
+{
+	unsigned int len;
+
+	switch (e->state) {
+	case WAIT_CMD:
+		e->cmd = c;
+		if (_nargs(c) > 0)
+			dfu_emu_expect(e, WAIT_ARGS, _nargs(c));
+		else
+			dfu_emu_expect(e, WAIT_EOP, 0);
+		return;
+	case WAIT_EOP:
+		if (c != STK_CRC_EOP) {
+			e->errors++;
+			dfu_emu_send_byte(e, STK_NOSYNC);
+		} else
+			_do_cmd(e);
+		dfu_emu_expect(e, WAIT_CMD, 0);
+		return;
+	default:
+		break;
+	}
+	if (!dfu_emu_collect(e, c))
+		return;
+	if (e->state == WAIT_ARGS && e->cmd == STK_PROG_PAGE) {
+		len = (e->buf[0] << 8) | e->buf[1];
+		if (len + 3 > sizeof(e->buf)) {
+			e->errors++;
+			dfu_emu_send_byte(e, STK_NOSYNC);
+			dfu_emu_expect(e, WAIT_CMD, 0);
+			return;
+		}
+		if (len) {
+			/* Go on collecting data after args */
+			e->state = WAIT_DATA;
+			e->len += len;
+			return;
+		}
+	}
+	dfu_emu_expect(e, WAIT_EOP, 0);
+}
+
+static int stk500_emu_init(struct dfu_emu *e)
+{
+	const struct stk500_device_data *dd = e->pars;
+
+	if (!dd || !dd->flash) {
+		dfu_err("%s: invalid device data\n", __func__);
+		return -1;
+	}
+	if (e->flash_size > dd->flash->length)
+		e->flash_size = dd->flash->length;
+	return 0;
+}
+
+static void stk500_emu_reset(struct dfu_emu *e)
+{
+	dfu_emu_expect(e, WAIT_CMD, 0);
+	e->addr = 0;
+}
+
+const struct dfu_emu_ops stk500_emu_ops = {
+	.init = stk500_emu_init,
+	.reset = stk500_emu_reset,
+	.input = stk500_emu_input,
+};
@@ -0,0 +1,428 @@
+/*
+ * STM32 system memory bootloader (USART protocol, AN3155) emulator
+ * LGPL v2.1
+ */
+#include "dfu.h"
+#include "dfu-internal.h"
+#include "dfu-emu.h"
+#include "stm32-device.h"
+
+#define ACK 0x79
+#define NACK 0x1f
+#define SYNC 0x7f
+
+#define BOOTLOADER_VERSION 0x31
+
+enum stm32_emu_cmd {
+	CMD_GET = 0x00,
+	CMD_GET_VERSION = 0x01,
+	CMD_GID = 0x02,
+	CMD_READ_MEMORY = 0x11,
+	CMD_GO = 0x21,
+	CMD_WRITE_MEMORY = 0x31,
+	CMD_ERASE = 0x43,
+	CMD_EXTENDED_ERASE = 0x44,
+};
+
+enum stm32_emu_state {
+	/* After reset, waiting for 0x7f */
+	WAIT_SYNC = 0,
+	WAIT_CMD,
+	WAIT_CMD_COMPLEMENT,
+	/* Address + checksum */
+	WAIT_ADDRESS,
+	/* Write memory: number of bytes - 1 */
+	WAIT_WRITE_LEN,
+	/* Write memory: data + checksum */
+	WAIT_WRITE_DATA,
+	/* Read memory: number of bytes - 1 and its complement */
+	WAIT_READ_LEN,
+	/* Erase: number of sectors - 1 */
+	WAIT_ERASE_N,
+	/* Erase: sectors + checksum */
+	WAIT_ERASE_SECTORS,
+	/* Extended erase: be16 number of sectors - 1 */
+	WAIT_EXT_ERASE_N,
+	/* Extended erase: be16 sectors + checksum */
+	WAIT_EXT_ERASE_SECTORS,
+	/* Global/mass erase: checksum */
+	WAIT_MASS_ERASE_CHECKSUM,
+};
+
+static const uint8_t get_reply[] = {
+	/* Number of bytes - 1, bootloader version, supported commands */
+	11, BOOTLOADER_VERSION,
+	CMD_GET, CMD_GET_VERSION, CMD_GID, CMD_READ_MEMORY, CMD_GO,
+	CMD_WRITE_MEMORY, CMD_EXTENDED_ERASE, 0x63, 0x73, 0x82, 0x92,
+	ACK,
+};
+
+static const struct stm32_memory_area *_areas(struct dfu_emu *e, int *n)
+{
+	const struct stm32_device_data *pars = e->pars;
+
+	*n = pars->nareas[pars->boot_mode];
+	return pars->areas[pars->boot_mode];
+}
+
+static const struct stm32_memory_area *_flash_area(struct dfu_emu *e)
+{
+	const struct stm32_memory_area *a;
+	int i, n;
+
+	for (a = _areas(e, &n), i = 0; i < n; i++, a++)
+		if (a->type == FLASH)
+			return a;
+	return NULL;
+}
+
+static const struct stm32_memory_area *_find_area(struct dfu_emu *e,
+						  uint32_t addr,
+						  unsigned long len)
+{
+	const struct stm32_memory_area *a;
+	int i, n;
+
+	for (a = _areas(e, &n), i = 0; i < n; i++, a++)
+		if (addr >= a->start && addr + len <= a->start + a->size)
+			return a;
+	return NULL;
+}
+
+/* Returns pointer to emulated flash or NULL if out of flash image */
+static uint8_t *_flash_ptr(struct dfu_emu *e, uint32_t addr,
+			   unsigned long len)
+{
+	const struct stm32_memory_area *a = _find_area(e, addr, len);
+	/* Emulated flash starts at the first flash area */
+	phys_addr_t base = _flash_area(e)->start;
+
+	if (!a || a->type != FLASH)
+		return NULL;
+	if (addr < base || addr + len > base + e->flash_size)
+		return NULL;
+	return &e->flash[addr - base];
+}
+
+static int _erase_sector(struct dfu_emu *e, int sector)
+{
+	const struct stm32_memory_area *a;
+	phys_addr_t start;
+	uint8_t *ptr;
+	int i, n, s;
+
+	for (a = _areas(e, &n), i = 0; i < n; i++, a++) {
+		if (a->type != FLASH || sector < a->sectors_offset ||
+		    sector >= a->sectors_offset + a->nsectors)
+			continue;
+		for (s = 0, start = a->start; s < sector - a->sectors_offset;
+		     s++)
+			start += a->sectors[s].size;
+		ptr = _flash_ptr(e, start, a->sectors[s].size);
+		if (ptr)
+			memset(ptr, 0xff, a->sectors[s].size);
+		e->sectors_erased++;
+		dfu_emu_busy(e, e->timings.sector_erase_us);
+		return 0;
+	}
+	return -1;
+}
+
+static void _mass_erase(struct dfu_emu *e)
+{
+	const struct stm32_memory_area *a;
+	int i, n, s;
+
+	for (a = _areas(e, &n), i = 0; i < n; i++, a++)
+		if (a->type == FLASH)
+			for (s = 0; s < a->nsectors; s++)
+				_erase_sector(e, a->sectors_offset + s);
+}
+
+static uint8_t _xor(const uint8_t *buf, unsigned int len)
+{
+	uint8_t out = 0;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		out ^= buf[i];
+	return out;
+}
+
+static void _reply(struct dfu_emu *e, uint8_t r)
+{
+	if (r != ACK)
+		e->errors++;
+	dfu_emu_send_byte(e, r);
+	if (r != ACK)
+		dfu_emu_expect(e, WAIT_CMD, 0);
+}
+
+static void _on_cmd(struct dfu_emu *e)
+{
+	const struct stm32_device_data *pars = e->pars;
+	uint8_t gid_reply[] = { 1, pars->part_id[0], pars->part_id[1], ACK, };
+	uint8_t version_reply[] = { BOOTLOADER_VERSION, 0, 0, ACK, };
+
+	if (e->buf[0] != (e->cmd ^ 0xff)) {
+		_reply(e, NACK);
+		return;
+	}
+	switch (e->cmd) {
+	case CMD_GET:
+		_reply(e, ACK);
+		dfu_emu_send(e, get_reply, sizeof(get_reply));
+		break;
+	case CMD_GET_VERSION:
+		_reply(e, ACK);
+		dfu_emu_send(e, version_reply, sizeof(version_reply));
+		break;
+	case CMD_GID:
+		_reply(e, ACK);
+		dfu_emu_send(e, gid_reply, sizeof(gid_reply));
+		break;
+	case CMD_READ_MEMORY:
+	case CMD_GO:
+	case CMD_WRITE_MEMORY:
+		_reply(e, ACK);
+		dfu_emu_expect(e, WAIT_ADDRESS, 5);
+		return;
+	case CMD_ERASE:
+		_reply(e, ACK);
+		dfu_emu_expect(e, WAIT_ERASE_N, 1);
+		return;
+	case CMD_EXTENDED_ERASE:
+		_reply(e, ACK);
+		dfu_emu_expect(e, WAIT_EXT_ERASE_N, 2);
+		return;
+	default:
+		_reply(e, NACK);
+		return;
+	}
+	dfu_emu_expect(e, WAIT_CMD, 0);
+}
+
+static void _on_address(struct dfu_emu *e)
+{
+	if (_xor(e->buf, 4) != e->buf[4]) {
+		_reply(e, NACK);
+		return;
+	}
+	e->addr = (e->buf[0] << 24) | (e->buf[1] << 16) | (e->buf[2] << 8) |
+		e->buf[3];
+	if (!_find_area(e, e->addr, 1)) {
+		_reply(e, NACK);
+		return;
+	}
+	_reply(e, ACK);
+	switch (e->cmd) {
+	case CMD_WRITE_MEMORY:
+		dfu_emu_expect(e, WAIT_WRITE_LEN, 1);
+		break;
+	case CMD_READ_MEMORY:
+		dfu_emu_expect(e, WAIT_READ_LEN, 2);
+		break;
+	default:
+		/* Go: the application would start here */
+		dfu_emu_expect(e, WAIT_CMD, 0);
+		break;
+	}
+}
+
+static void _on_write_data(struct dfu_emu *e)
+{
+	unsigned int i, n = e->len - 1;
+	const struct stm32_memory_area *a = _find_area(e, e->addr, n);
+	uint8_t *ptr;
+
+	if ((_xor(e->buf, n) ^ e->csum) != e->buf[n] || !a) {
+		_reply(e, NACK);
+		return;
+	}
+	if (a->type != FLASH) {
+		/* Ram or option bytes: just ignore data */
+		_reply(e, ACK);
+		dfu_emu_expect(e, WAIT_CMD, 0);
+		return;
+	}
+	ptr = _flash_ptr(e, e->addr, n);
+	if (!ptr) {
+		_reply(e, NACK);
+		return;
+	}
+	/* Flash bits can only be cleared by programming */
+	for (i = 0; i < n; i++)
+		if ((ptr[i] & e->buf[i]) != e->buf[i]) {
+			dfu_err("%s: programming non erased flash @0x%08x\n",
+				__func__, (unsigned int)(e->addr + i));
+			_reply(e, NACK);
+			return;
+		}
+	for (i = 0; i < n; i++)
+		ptr[i] &= e->buf[i];
+	dfu_emu_busy(e, e->timings.page_program_us);
+	e->pages_programmed++;
+	_reply(e, ACK);
+	dfu_emu_expect(e, WAIT_CMD, 0);
+}
+
+static void _on_read_len(struct dfu_emu *e)
+{
+	unsigned int n = e->buf[0] + 1;
+	const struct stm32_memory_area *a = _find_area(e, e->addr, n);
+	uint8_t *ptr = _flash_ptr(e, e->addr, n);
+
+	if (e->buf[1] != (e->buf[0] ^ 0xff) || !a) {
+		_reply(e, NACK);
+		return;
+	}
+	_reply(e, ACK);
+	if (ptr)
+		dfu_emu_send(e, ptr, n);
+	else {
+		/* Not emulated */
+		memset(e->buf, 0, n);
+		dfu_emu_send(e, e->buf, n);
+	}
+	dfu_emu_expect(e, WAIT_CMD, 0);
+}
+
+static void _on_erase_sectors(struct dfu_emu *e, int ext)
+{
+	unsigned int i, n = e->len - 1;
+	int s;
+
+	if ((_xor(e->buf, n) ^ e->csum) != e->buf[n]) {
+		_reply(e, NACK);
+		return;
+	}
+	for (i = 0; i < n; i += ext ? 2 : 1) {
+		s = ext ? (e->buf[i] << 8) | e->buf[i + 1] : e->buf[i];
+		if (_erase_sector(e, s) < 0) {
+			dfu_err("%s: invalid sector %d\n", __func__, s);
+			_reply(e, NACK);
+			return;
+		}
+	}
+	_reply(e, ACK);
+	dfu_emu_expect(e, WAIT_CMD, 0);
+}
+
+static void stm32_usart_emu_input(struct dfu_emu *e, uint8_t c)
+{
+	unsigned int n;
+
+	switch (e->state) {
+	case WAIT_SYNC:
+		if (c != SYNC)
+			/* Autobaud failed */
+			return;
+		_reply(e, ACK);
+		dfu_emu_expect(e, WAIT_CMD, 0);
+		return;
+	case WAIT_CMD:
+		if (c == SYNC) {
+			/*
+			 * A real target would nack this, accept it so that
+			 * the host can resync without resetting us (a pty
+			 * has no modem lines)
+			 */
+			_reply(e, ACK);
+			return;
+		}
+		e->cmd = c;
+		dfu_emu_expect(e, WAIT_CMD_COMPLEMENT, 1);
+		return;
+	default:
+		break;
+	}
+	if (!dfu_emu_collect(e, c))
+		return;
+	switch (e->state) {
+	case WAIT_CMD_COMPLEMENT:
+		_on_cmd(e);
+		break;
+	case WAIT_ADDRESS:
+		_on_address(e);
+		break;
+	case WAIT_WRITE_LEN:
+		e->csum = e->buf[0];
+		dfu_emu_expect(e, WAIT_WRITE_DATA, e->buf[0] + 2);
+		break;
+	case WAIT_WRITE_DATA:
+		_on_write_data(e);
+		break;
+	case WAIT_READ_LEN:
+		_on_read_len(e);
+		break;
+	case WAIT_ERASE_N:
+		if (e->buf[0] == 0xff) {
+			/* Global erase, followed by 0x00 */
+			e->csum = 0x00;
+			dfu_emu_expect(e, WAIT_MASS_ERASE_CHECKSUM, 1);
+			break;
+		}
+		e->csum = e->buf[0];
+		dfu_emu_expect(e, WAIT_ERASE_SECTORS, e->buf[0] + 2);
+		break;
+	case WAIT_ERASE_SECTORS:
+		_on_erase_sectors(e, 0);
+		break;
+	case WAIT_EXT_ERASE_N:
+		n = (e->buf[0] << 8) | e->buf[1];
+		e->csum = e->buf[0] ^ e->buf[1];
+		if (n >= 0xfff0) {
+			/* Special erase (mass, bank 1, bank 2) */
+			dfu_emu_expect(e, WAIT_MASS_ERASE_CHECKSUM, 1);
+			break;
+		}
+		if ((n + 1) * 2 + 1 > sizeof(e->buf)) {
+			_reply(e, NACK);
+			break;
+		}
+		dfu_emu_expect(e, WAIT_EXT_ERASE_SECTORS, (n + 1) * 2 + 1);
+		break;
+	case WAIT_EXT_ERASE_SECTORS:
+		_on_erase_sectors(e, 1);
+		break;
+	case WAIT_MASS_ERASE_CHECKSUM:
+		if (e->buf[0] != e->csum) {
+			_reply(e, NACK);
+			break;
+		}
+		_mass_erase(e);
+		_reply(e, ACK);
+		dfu_emu_expect(e, WAIT_CMD, 0);
+		break;
+	default:
+		dfu_emu_expect(e, WAIT_CMD, 0);
+		break;
+	}
+}
+
+static int stm32_usart_emu_init(struct dfu_emu *e)
+{
+	const struct stm32_device_data *pars = e->pars;
+	int n;
+
+	if (!pars || !_areas(e, &n) || n <= 0) {
+		dfu_err("%s: invalid device data\n", __func__);
+		return -1;
+	}
+	if (!_flash_area(e)) {
+		dfu_err("%s: device has no flash\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+static void stm32_usart_emu_reset(struct dfu_emu *e)
+{
+	dfu_emu_expect(e, WAIT_SYNC, 0);
+}
+
+const struct dfu_emu_ops stm32_usart_emu_ops = {
+	.init = stm32_usart_emu_init,
+	.reset = stm32_usart_emu_reset,
+	.input = stm32_usart_emu_input,
+};
@@ -7,6 +7,7 @@
  */
 #include <dfu.h>
 #include <dfu-internal.h>
+#include <stdlib.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,8 +21,10 @@ struct posix_simple_file_data {
 static int posix_simple_file_close(struct dfu_simple_file *f)
 {
 	struct posix_simple_file_data *priv = f->priv;
+	int ret = close(priv->fd);
 
-	return close(priv->fd);
+	free(priv);
+	return ret;
 }
 
 static int posix_simple_file_read(struct dfu_simple_file *f, char *buf,
@@ -44,7 +47,7 @@ static int posix_simple_file_seek(struct dfu_simple_file *f, unsigned long ptr)
 {
 	struct posix_simple_file_data *priv = f->priv;
 
-	return lseek(priv->fd, SEEK_SET, ptr);
+	return lseek(priv->fd, ptr, SEEK_SET) < 0 ? -1 : 0;
 }
 
 static struct dfu_simple_file_ops posix_simple_file_ops = {
@@ -66,6 +69,10 @@ static int posix_fc_open(struct dfu_file_container *fc,
 	if (!data)
 		return -1;
 	data->fd = open(name, flags,  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (data->fd < 0) {
+		free(data);
+		return -1;
+	}
 	f->priv = data;
 	f->ops = &posix_simple_file_ops;
 	return 0;
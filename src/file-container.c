@@ -93,7 +93,7 @@ int dfu_file_write(struct dfu_data *dfu, int fd, const void *buf,
 	if (fd < 0 || fd >= MAX_DFU_FILES)
 		return -1;
 	f = &files[fd];
-	if (!f->ops->read)
+	if (!f->ops->write)
 		return -1;
 	ret = f->ops->write(f, buf, sz);
 	if (ret < 0)
@@ -0,0 +1,131 @@
+/*
+ * Hex digits decoding, for ascii formats (intel hex, s-records)
+ * LGPL v2.1
+ */
+
+#include "dfu.h"
+#include "dfu-internal.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Hex digit values plus one, 0 for characters which are not hex digits (so
+ * that the table can be zero initialized)
+ */
+const uint8_t hex_digits[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#ifdef __SSE2__
+/*
+ * 16 hex digits to 8 bytes, returns their sum or negative if some digit is
+ * invalid
+ */
+static inline int _hex_to_bytes_16(const uint8_t *src, uint8_t *dst)
+{
+	const __m128i v = _mm_loadu_si128((const __m128i *)src);
+	/* Lower case letters ('0'..'9' have bit 5 set already) */
+	const __m128i lc = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	const __m128i digit =
+		_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+			      _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+	const __m128i alpha =
+		_mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+			      _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lc));
+	__m128i nib, out;
+
+	if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+		return -1;
+	nib = _mm_or_si128(
+		_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+		_mm_and_si128(alpha,
+			      _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+	/* Even digits are high nibbles, odd digits low nibbles */
+	out = _mm_or_si128(_mm_slli_epi16(nib, 4), _mm_srli_epi16(nib, 8));
+	out = _mm_and_si128(out, _mm_set1_epi16(0xff));
+	out = _mm_packus_epi16(out, _mm_setzero_si128());
+	_mm_storel_epi64((__m128i *)dst, out);
+	return _mm_cvtsi128_si32(_mm_sad_epu8(out, _mm_setzero_si128()));
+}
+#endif
+
+int hex_to_bytes(const uint8_t *src, uint8_t *dst, int n, unsigned int *sum)
+{
+	int b;
+
+#ifdef __SSE2__
+	for ( ; n >= 8; n -= 8, src += 16, dst += 8) {
+		b = _hex_to_bytes_16(src, dst);
+		if (b < 0)
+			return b;
+		*sum += b;
+	}
+#endif
+	for ( ; n; n--, src += 2) {
+		b = hex_byte(src);
+		if (b < 0)
+			return b;
+		*dst++ = b;
+		*sum += b;
+	}
+	return 0;
+}
+
+int hex_get_bytes(struct dfu_binary_file *f, int *index, uint8_t *dst, int n,
+		  unsigned int *sum)
+{
+	const uint8_t *ptr = f->buf;
+	uint8_t tmp[16];
+	int i;
+
+	if (*index + 2 * n <= f->max_size) {
+		if (hex_to_bytes(&ptr[*index], dst, n, sum) < 0)
+			return -1;
+	} else {
+		/* Across the end of the input buffer */
+		if (n > sizeof(tmp) / 2)
+			return -1;
+		for (i = 0; i < 2 * n; i++)
+			tmp[i] = ptr[(*index + i) & (f->max_size - 1)];
+		if (hex_to_bytes(tmp, dst, n, sum) < 0)
+			return -1;
+	}
+	*index = (*index + 2 * n) & (f->max_size - 1);
+	return n;
+}
+
+int hex_decode_buf(struct dfu_binary_file *f, int *index, int *out_index,
+		   int len, unsigned int *sum)
+{
+	uint8_t *ptr = f->buf, *dst = f->decoded_buf, tmp[2];
+	int done, in, n, b, mask = f->max_size - 1;
+
+	for (done = 0; done < len; done += 2 * n) {
+		/* Contiguous input */
+		in = (f->head >= *index ? f->head : f->max_size) - *index;
+		n = min(min(len - done, in) / 2, f->decoded_size - *out_index);
+		if (!n) {
+			/* Byte across the end of the input buffer */
+			if (!in || ((*index + 1) & mask) == f->head)
+				return 0;
+			tmp[0] = ptr[*index];
+			tmp[1] = ptr[(*index + 1) & mask];
+			b = hex_byte(tmp);
+			if (b < 0)
+				return b;
+			dst[*out_index] = b;
+			*sum += b;
+			n = 1;
+		} else if (hex_to_bytes(&ptr[*index], &dst[*out_index], n,
+					sum) < 0)
+			return -1;
+		*index = (*index + 2 * n) & mask;
+		*out_index = (*out_index + n) & (f->decoded_size - 1);
+	}
+	dfu_dbg("%s returns %d\n", __func__, len);
+	return len;
+}
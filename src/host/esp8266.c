@@ -29,6 +29,11 @@ unsigned long esp8266_get_current_time(struct dfu_host *host)
 	return system_get_time() / 1000;
 }
 
+unsigned long esp8266_get_current_time_us(struct dfu_host *host)
+{
+	return system_get_time();
+}
+
 /*
  * We don't have any strchr apparently
  */
@@ -47,4 +52,5 @@ const struct dfu_host_ops esp8266_dfu_host_ops = {
 	.udelay = esp8266_udelay,
 	.idle = esp8266_idle,
 	.get_current_time = esp8266_get_current_time,
+	.get_current_time_us = esp8266_get_current_time_us,
 };
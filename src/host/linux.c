@@ -1,7 +1,12 @@
 #include <stdlib.h>
-#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include "dfu.h"
 #include "dfu-internal.h"
 
@@ -24,23 +29,163 @@ void print_trace (void)
 	free (strings);
 }
 
+/*
+ * All instances share a single epoll instance, so that the instance being
+ * idled doesn't miss events for the other ones and idle instances cost
+ * nothing. Each epoll registration carries the instance index and the kind
+ * of event source.
+ */
+enum linux_event_source {
+	INTERFACE_SOURCE = 0,
+	FILE_SOURCE = 1,
+	TIMER_SOURCE = 2,
+	WAKEUP_SOURCE = 3,
+};
+
+#define SOURCE_BITS 2
+#define SOURCE_MASK ((1 << SOURCE_BITS) - 1)
+
 struct linux_host_data {
+	int in_use;
+	struct dfu_host *host;
 	struct linux_event_data interface_event_data;
 	struct linux_event_data file_event_data;
+	/* Fires on next timeout, absolute CLOCK_MONOTONIC time */
+	int timer_fd;
+	long armed_timeout;
+	/*
+	 * Events collected while waiting on behalf of another instance,
+	 * returned on next idle call for this instance
+	 */
+	int pending_events;
+	/* Worker thread (binary file decoder in pipeline mode) */
+	pthread_t worker;
+	pthread_mutex_t worker_lock;
+	pthread_cond_t worker_cond;
+	int worker_running;
+	int worker_kicked;
+	int worker_stop;
+	int (*work)(void *);
+	void *work_arg;
 };
 
-static struct linux_host_data lhd = {
-	.interface_event_data = {
-		.fd = -1,
-	},
-	.file_event_data = {
-		.fd = -1,
-	},
-};
+static struct linux_host_data lhd[CONFIG_DFU_MAX_INSTANCES];
+
+static int epoll_fd = -1;
+/* For dfu_wakeup() */
+static int wakeup_fd = -1;
+static int nusers;
+
+static int _epoll_ctl(int op, int fd, int events, int index,
+		      enum linux_event_source src)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.u32 = (index << SOURCE_BITS) | src;
+	if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+		dfu_err("%s: epoll_ctl(%d, %d): %s\n", __func__, op, fd,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int _setup_common(void)
+{
+	if (nusers++)
+		return 0;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		goto error;
+	}
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd < 0) {
+		perror("eventfd");
+		goto error;
+	}
+	if (_epoll_ctl(EPOLL_CTL_ADD, wakeup_fd, EPOLLIN, 0, WAKEUP_SOURCE) < 0)
+		goto error;
+	return 0;
+
+error:
+	if (wakeup_fd >= 0)
+		close(wakeup_fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	wakeup_fd = epoll_fd = -1;
+	nusers--;
+	return -1;
+}
+
+static void _release_common(void)
+{
+	if (--nusers)
+		return;
+	close(wakeup_fd);
+	close(epoll_fd);
+	wakeup_fd = epoll_fd = -1;
+}
 
 static int linux_init(struct dfu_host *host)
 {
-	host->priv = &lhd;
+	int index = dfu_id(host->dfu);
+	struct linux_host_data *data = &lhd[index];
+
+	if (_setup_common() < 0)
+		return -1;
+	data->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->timer_fd < 0) {
+		perror("timerfd_create");
+		_release_common();
+		return -1;
+	}
+	if (_epoll_ctl(EPOLL_CTL_ADD, data->timer_fd, EPOLLIN, index,
+		       TIMER_SOURCE) < 0) {
+		close(data->timer_fd);
+		_release_common();
+		return -1;
+	}
+	data->in_use = 1;
+	data->host = host;
+	data->interface_event_data.fd = -1;
+	data->file_event_data.fd = -1;
+	data->armed_timeout = -1;
+	data->pending_events = 0;
+	data->worker_running = 0;
+	data->worker_kicked = 0;
+	pthread_mutex_init(&data->worker_lock, NULL);
+	pthread_cond_init(&data->worker_cond, NULL);
+	host->priv = data;
+	return 0;
+}
+
+static void _unregister(struct linux_event_data *e)
+{
+	if (e->fd < 0)
+		return;
+	/* fd could have been closed already, ignore errors */
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, e->fd, NULL);
+	e->fd = -1;
+}
+
+static void linux_stop_worker(struct dfu_host *host);
+
+static int linux_fini(struct dfu_host *host)
+{
+	struct linux_host_data *data = host->priv;
+
+	linux_stop_worker(host);
+	pthread_cond_destroy(&data->worker_cond);
+	pthread_mutex_destroy(&data->worker_lock);
+	_unregister(&data->interface_event_data);
+	_unregister(&data->file_event_data);
+	close(data->timer_fd);
+	data->timer_fd = -1;
+	data->in_use = 0;
+	_release_common();
 	return 0;
 }
 
@@ -64,98 +209,251 @@ static unsigned long _get_current_time(void)
 	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int linux_idle(struct dfu_host *host, long next_timeout)
+static unsigned long _get_current_time_us(void)
 {
-	int stat, ret = 0, nfds;
-	struct linux_host_data *data = host->priv;
-	struct pollfd *ptr;
-	unsigned int delta;
-	int no_actual_timeout;
-	struct pollfd pfd[2] = {
-		{
-			.fd = data->interface_event_data.fd,
-			.events = data->interface_event_data.events,
-			.revents = 0,
-		},
-		{
-			.fd = data->file_event_data.fd,
-			.events = data->interface_event_data.events,
-			.revents = 0,
+	int stat;
+	struct timespec ts;
+
+	stat = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (stat < 0)
+		return 0xffffffff;
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Arm (or disarm if next_timeout < 0) instance's timer */
+static int _arm_timer(struct linux_host_data *data, long next_timeout)
+{
+	struct itimerspec its;
+
+	if (next_timeout == data->armed_timeout)
+		return 0;
+	memset(&its, 0, sizeof(its));
+	if (next_timeout >= 0) {
+		its.it_value.tv_sec = next_timeout / 1000;
+		its.it_value.tv_nsec = (next_timeout % 1000) * 1000000;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			/* All zeroes would disarm the timer */
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(data->timer_fd, TFD_TIMER_ABSTIME, &its,
+			    NULL) < 0) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	data->armed_timeout = next_timeout;
+	return 0;
+}
+
+/* Some instance has work to do right away, don't block */
+static int _must_not_block(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lhd); i++)
+		if (lhd[i].in_use && lhd[i].host->dfu->idle_again)
+			return 1;
+	return 0;
+}
+
+static void _dispatch(const struct epoll_event *ev)
+{
+	struct linux_host_data *d = &lhd[ev->data.u32 >> SOURCE_BITS];
+	uint64_t v;
+
+	switch (ev->data.u32 & SOURCE_MASK) {
+	case INTERFACE_SOURCE:
+		d->pending_events |= DFU_INTERFACE_EVENT;
+		break;
+	case FILE_SOURCE:
+		d->pending_events |= DFU_FILE_EVENT;
+		break;
+	case TIMER_SOURCE:
+		if (read(d->timer_fd, &v, sizeof(v)) == sizeof(v)) {
+			/* Expired timers are not re-armed */
+			d->armed_timeout = -1;
+			d->pending_events |= DFU_TIMEOUT;
 		}
-	};
-
-	if (pfd[0].fd >= 0 && pfd[1].fd >= 0) {
-		nfds = 2;
-		ptr = pfd;
-	} else if (pfd[0].fd < 0 && pfd[1].fd >= 0) {
-		nfds = 1;
-		ptr = &pfd[1];
-	} else if (pfd[0].fd >= 0 && pfd[1].fd < 0) {
-		nfds = 1;
-		ptr = pfd;
-	} else {
-		nfds = 0;
-		ptr = NULL;
+		break;
+	case WAKEUP_SOURCE:
+		/* Just reset the counter, we're awake */
+		if (read(wakeup_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			perror("read wakeup fd");
+		break;
 	}
-	if (next_timeout < 0)
-		/* No timeout, just return with 0 */
+}
+
+int linux_idle(struct dfu_host *host, long next_timeout)
+{
+	int stat, ret, i;
+	struct linux_host_data *data = host->priv;
+	struct epoll_event ev[3 * CONFIG_DFU_MAX_INSTANCES + 1];
+
+	if (!host->dfu->idle_again && _arm_timer(data, next_timeout) < 0)
+		/* Not needed if we're not going to block */
+		return -1;
+	if (data->pending_events) {
+		/* Events already collected by another instance */
+		ret = data->pending_events;
+		data->pending_events = 0;
 		return ret;
+	}
 	/*
-	 * Target could have some event for us which is not a timeout ....
-	 * wake up after 100ms anyway
-	 * FIXME: mmmm this should be done better
+	 * Block until something happens to any instance: fd events, expired
+	 * timers (next_timeout == now expires immediately) or dfu_wakeup()
 	 */
-	delta = min(next_timeout - _get_current_time(), 100);
-	no_actual_timeout = delta == 100;
-	stat = poll(ptr, nfds, delta);
-	switch(stat) {
-	case 0:
-		return no_actual_timeout ? 0 : DFU_TIMEOUT;
-	case -1:
+	stat = epoll_wait(epoll_fd, ev, ARRAY_SIZE(ev),
+			  _must_not_block() ? 0 : -1);
+	if (stat < 0) {
 		if (errno == EINTR)
 			/* Interrupted */
-			break;
-		perror("poll");
+			return 0;
+		perror("epoll_wait");
 		return stat;
-	default:
-		if (pfd[0].revents)
-			ret |= DFU_INTERFACE_EVENT;
-		if (pfd[1].revents)
-			ret |= DFU_FILE_EVENT;
-		return ret;
 	}
-	/* NEVER REACHED */
-	return -1;
+	for (i = 0; i < stat; i++)
+		_dispatch(&ev[i]);
+	ret = data->pending_events;
+	data->pending_events = 0;
+	return ret;
+}
+
+/*
+ * Replace the event source @e with @n, a negative fd just unregisters @e
+ * (must be done before closing the old fd)
+ */
+static int _set_event(struct linux_host_data *data,
+		      struct linux_event_data *e,
+		      const struct linux_event_data *n,
+		      enum linux_event_source src)
+{
+	int op = EPOLL_CTL_ADD;
+
+	if (e->fd >= 0 && e->fd != n->fd)
+		_unregister(e);
+	if (e->fd >= 0)
+		op = EPOLL_CTL_MOD;
+	if (n->fd >= 0 &&
+	    /* poll() event flags have the same values as epoll ones */
+	    _epoll_ctl(op, n->fd, n->events, dfu_id(data->host->dfu),
+		       src) < 0)
+		return -1;
+	*e = *n;
+	return 0;
 }
 
 int linux_set_interface_event(struct dfu_host *host, void *linux_evt_info)
 {
 	struct linux_host_data *data = host->priv;
 
-	data->interface_event_data =
-		*(struct linux_event_data *)linux_evt_info;
-	return 0;
+	return _set_event(data, &data->interface_event_data, linux_evt_info,
+			  INTERFACE_SOURCE);
 }
 
 int linux_set_binary_file_event(struct dfu_host *host, void *linux_evt_info)
 {
 	struct linux_host_data *data = host->priv;
 
-	data->file_event_data =
-		*(struct linux_event_data *)linux_evt_info;
+	return _set_event(data, &data->file_event_data, linux_evt_info,
+			  FILE_SOURCE);
+}
+
+void linux_wakeup(struct dfu_host *host)
+{
+	uint64_t v = 1;
+
+	if (write(wakeup_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("write wakeup fd");
+}
+
+static void *_worker(void *arg)
+{
+	struct linux_host_data *data = arg;
+	int stat;
+
+	pthread_mutex_lock(&data->worker_lock);
+	while (!data->worker_stop) {
+		/* Kicks arriving while working prevent us from sleeping */
+		data->worker_kicked = 0;
+		pthread_mutex_unlock(&data->worker_lock);
+		stat = data->work(data->work_arg);
+		pthread_mutex_lock(&data->worker_lock);
+		if (stat < 0)
+			break;
+		if (stat)
+			continue;
+		while (!data->worker_kicked && !data->worker_stop)
+			pthread_cond_wait(&data->worker_cond,
+					  &data->worker_lock);
+	}
+	pthread_mutex_unlock(&data->worker_lock);
+	return NULL;
+}
+
+static int linux_start_worker(struct dfu_host *host, int (*work)(void *),
+			      void *arg)
+{
+	struct linux_host_data *data = host->priv;
+	int stat;
+
+	if (data->worker_running)
+		return -1;
+	data->work = work;
+	data->work_arg = arg;
+	data->worker_stop = 0;
+	stat = pthread_create(&data->worker, NULL, _worker, data);
+	if (stat) {
+		dfu_err("%s: pthread_create: %s\n", __func__, strerror(stat));
+		return -1;
+	}
+	data->worker_running = 1;
 	return 0;
 }
 
+static void linux_kick_worker(struct dfu_host *host)
+{
+	struct linux_host_data *data = host->priv;
+
+	pthread_mutex_lock(&data->worker_lock);
+	data->worker_kicked = 1;
+	pthread_cond_signal(&data->worker_cond);
+	pthread_mutex_unlock(&data->worker_lock);
+}
+
+static void linux_stop_worker(struct dfu_host *host)
+{
+	struct linux_host_data *data = host->priv;
+
+	if (!data->worker_running)
+		return;
+	pthread_mutex_lock(&data->worker_lock);
+	data->worker_stop = 1;
+	pthread_cond_signal(&data->worker_cond);
+	pthread_mutex_unlock(&data->worker_lock);
+	pthread_join(data->worker, NULL);
+	data->worker_running = 0;
+}
+
 unsigned long linux_get_current_time(struct dfu_host *host)
 {
 	return _get_current_time();
 }
 
+unsigned long linux_get_current_time_us(struct dfu_host *host)
+{
+	return _get_current_time_us();
+}
+
 const struct dfu_host_ops linux_dfu_host_ops = {
 	.init = linux_init,
+	.fini = linux_fini,
 	.udelay = linux_udelay,
 	.idle = linux_idle,
 	.set_interface_event = linux_set_interface_event,
 	.set_binary_file_event = linux_set_binary_file_event,
 	.get_current_time = linux_get_current_time,
+	.get_current_time_us = linux_get_current_time_us,
+	.wakeup = linux_wakeup,
+	.start_worker = linux_start_worker,
+	.kick_worker = linux_kick_worker,
+	.stop_worker = linux_stop_worker,
 };
@@ -26,7 +26,7 @@ static int http_flash_upload_post(const struct http_url *u,
 				  const char *data, int data_len)
 {
 	struct phr_header *h;
-	int stat, ret;
+	int stat, ret, len;
 	struct tcp_conn_data *cd = c->cd;
 	const char *contents, *ptr;
 
@@ -56,14 +56,19 @@ static int http_flash_upload_post(const struct http_url *u,
 	ptr = _find_last_line(data, data_len);
 	if (!ptr)
 		dfu_err("%s: CANNOT FIND CONTENTS END !!!!\n", __func__);
-	stat = dfu_binary_file_append_buffer(c->bf,
-					     contents,
-					     ptr ? ptr - contents :
-					     /* No boundary found, all data */
-					     data_len - (contents - data));
-	if (!stat) {
+	len = ptr ? ptr - contents :
+		/* No boundary found, all data */
+		data_len - (contents - data);
+	/* Retries go on from where the previous attempt stopped */
+	stat = dfu_binary_file_append_partial(c->bf,
+					      contents + c->post_appended,
+					      len - c->post_appended);
+	if (stat > 0)
+		c->post_appended += stat;
+	if (stat >= 0 && c->post_appended < len) {
 		/* No space enough, just tell the server to retry processing */
-		dfu_dbg("%s: no space enough for appending buffer\n", __func__);
+		dfu_dbg("%s: %d bytes left to append\n", __func__,
+			len - c->post_appended);
 		return HTTP_URL_TEMP_ERROR;
 	}
 	if (stat < 0) {
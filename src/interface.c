@@ -70,32 +70,49 @@ int dfu_interface_target_run(struct dfu_interface *iface)
 int dfu_interface_read(struct dfu_interface *iface, char *buf,
 		       unsigned long sz)
 {
+	int ret;
+
 	if (!iface->ops->read)
 		return -1;
 	if (!iface->setup_done)
 		if (_do_setup(iface) < 0)
 			return -1;
-	return iface->ops->read(iface, buf, sz);
+	ret = iface->ops->read(iface, buf, sz);
+	if (ret > 0)
+		iface->dfu->stats.if_bytes_received += ret;
+	return ret;
 }
 
 int dfu_interface_write(struct dfu_interface *iface, const char *buf,
 			       unsigned long sz)
 {
+	int ret;
+
 	if (!iface->ops->write)
 		return -1;
 	if (!iface->setup_done)
 		if (_do_setup(iface) < 0)
 			return -1;
-	return iface->ops->write(iface, buf, sz);
+	ret = iface->ops->write(iface, buf, sz);
+	if (ret > 0)
+		iface->dfu->stats.if_bytes_sent += ret;
+	return ret;
 }
 
 int dfu_interface_write_read(struct dfu_interface *iface, const char *wr_buf,
 			     char *rd_buf, unsigned long sz)
 {
+	int ret;
+
 	if (!iface->ops->write_read)
 		return -1;
 	if (!iface->setup_done)
 		if (_do_setup(iface) < 0)
 			return -1;
-	return iface->ops->write_read(iface, wr_buf, rd_buf, sz);
+	ret = iface->ops->write_read(iface, wr_buf, rd_buf, sz);
+	if (ret > 0) {
+		iface->dfu->stats.if_bytes_sent += ret;
+		iface->dfu->stats.if_bytes_received += ret;
+	}
+	return ret;
 }
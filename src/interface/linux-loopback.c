@@ -0,0 +1,133 @@
+/*
+ * Loopback interface: talk to an in process target emulator (see
+ * dfu-emu.h), interface pars must point to an initialized struct dfu_emu.
+ * Emulator replies are signalled via a timerfd armed at the time the next
+ * reply byte is due.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include "dfu.h"
+#include "dfu-internal.h"
+#include "dfu-emu.h"
+
+struct linux_loopback_data {
+	int fd;
+	struct dfu_emu *emu;
+};
+
+/* One instance per dfu instance */
+static struct linux_loopback_data ldata[CONFIG_DFU_MAX_INSTANCES];
+
+/* Make the interface event fire when the next reply byte is due */
+static int _arm(struct linux_loopback_data *priv)
+{
+	struct itimerspec its;
+	long us = dfu_emu_next_output(priv->emu);
+
+	memset(&its, 0, sizeof(its));
+	if (us >= 0) {
+		its.it_value.tv_sec = us / 1000000;
+		its.it_value.tv_nsec = (us % 1000000) * 1000;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			/* All zeroes would disarm the timer */
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(priv->fd, 0, &its, NULL) < 0) {
+		dfu_err("%s: timerfd_settime: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int linux_loopback_open(struct dfu_interface *iface,
+			       const char *path, const void *pars)
+{
+	struct linux_event_data edata;
+	struct linux_loopback_data *priv = &ldata[dfu_id(iface->dfu)];
+
+	if (!pars) {
+		dfu_err("%s: emulator expected\n", __func__);
+		return -1;
+	}
+	iface->priv = priv;
+	priv->emu = (struct dfu_emu *)pars;
+	priv->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (priv->fd < 0) {
+		dfu_err("%s: timerfd_create: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	edata.fd = priv->fd;
+	edata.events = POLLIN;
+	if (dfu_set_interface_event(iface->dfu, &edata) < 0) {
+		dfu_err("Error setting interface event\n");
+		close(priv->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int linux_loopback_write(struct dfu_interface *iface,
+				const char *buf, unsigned long size)
+{
+	struct linux_loopback_data *priv = iface->priv;
+	int ret = dfu_emu_write(priv->emu, buf, size);
+
+	if (_arm(priv) < 0)
+		return -1;
+	return ret;
+}
+
+static int linux_loopback_read(struct dfu_interface *iface, char *buf,
+			       unsigned long size)
+{
+	struct linux_loopback_data *priv = iface->priv;
+	uint64_t v;
+	int ret;
+
+	/* Clear expirations, timer is re-armed right below */
+	if (read(priv->fd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+		dfu_err("%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	ret = dfu_emu_read(priv->emu, buf, size);
+	if (_arm(priv) < 0)
+		return -1;
+	return ret;
+}
+
+static int linux_loopback_target_reset(struct dfu_interface *iface)
+{
+	struct linux_loopback_data *priv = iface->priv;
+
+	dfu_emu_reset(priv->emu);
+	return _arm(priv);
+}
+
+static int linux_loopback_fini(struct dfu_interface *iface)
+{
+	struct linux_loopback_data *priv = iface->priv;
+	struct linux_event_data edata = { .fd = -1, };
+
+	/* Stop watching fd before closing it */
+	dfu_set_interface_event(iface->dfu, &edata);
+	if (close(priv->fd) < 0) {
+		dfu_err("%s: error closing interface (%s)\n", __func__,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+const struct dfu_interface_ops linux_loopback_interface_ops = {
+	.open = linux_loopback_open,
+	.write = linux_loopback_write,
+	.read = linux_loopback_read,
+	.target_reset = linux_loopback_target_reset,
+	.target_run = linux_loopback_target_reset,
+	.fini = linux_loopback_fini,
+};
@@ -61,6 +61,11 @@ static int linux_serial_arduino_uno_target_reset(struct dfu_interface *iface)
 	/* Set RST to 0 (active) */
 	v = TIOCM_DTR;
 	stat = ioctl(priv->fd, TIOCMBIS, &v);
+	if (stat < 0 && errno == ENOTTY) {
+		/* No modem lines (pty), target can't be reset */
+		dfu_log("cannot reset target, no modem lines\n");
+		return 0;
+	}
 	if (stat < 0) {
 		dfu_err("error resetting target (%s)\n", strerror(errno));
 		return stat;
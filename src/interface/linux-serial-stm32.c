@@ -33,6 +33,11 @@ static int linux_serial_stm32_target_reset(struct dfu_interface *iface)
 	/* Set RST to 0 (active) */
 	v = TIOCM_RTS;
 	stat = ioctl(priv->fd, TIOCMBIS, &v);
+	if (stat < 0 && errno == ENOTTY) {
+		/* No modem lines (pty), target can't be reset */
+		dfu_log("cannot reset target, no modem lines\n");
+		return 0;
+	}
 	if (stat < 0) {
 		dfu_err("error resetting target (%s)\n", strerror(errno));
 		return stat;
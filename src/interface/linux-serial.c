@@ -12,21 +12,22 @@
 #include "dfu-internal.h"
 #include "linux-serial.h"
 
-/* Just one instance */
-static struct linux_serial_data sdata;
+/* One instance per dfu instance */
+static struct linux_serial_data sdata[CONFIG_DFU_MAX_INSTANCES];
 
 int linux_serial_open(struct dfu_interface *iface,
 		      const char *path, const void *pars)
 {
 	struct termios config;
 	struct linux_event_data edata;
+	struct linux_serial_data *priv = &sdata[dfu_id(iface->dfu)];
 
-	iface->priv = &sdata;
-	sdata.fd = open(path, O_RDWR | O_NOCTTY);
-	if (sdata.fd < 0)
-		return sdata.fd;
+	iface->priv = priv;
+	priv->fd = open(path, O_RDWR | O_NOCTTY);
+	if (priv->fd < 0)
+		return priv->fd;
 	/* FIXME: USE pars FOR SERIAL PORT CONFIGURATION ? */
-	if (tcgetattr(sdata.fd, &config) < 0) {
+	if (tcgetattr(priv->fd, &config) < 0) {
 		dfu_err("Error reading termios config\n");
 		return -1;
 	}
@@ -36,11 +37,11 @@ int linux_serial_open(struct dfu_interface *iface,
 		dfu_err("Error setting serial port speed\n");
 		return -1;
 	}
-	if (tcsetattr(sdata.fd, TCSAFLUSH, &config) < 0) {
+	if (tcsetattr(priv->fd, TCSAFLUSH, &config) < 0) {
 		dfu_err("Error setting termios config\n");
 		return -1;
 	}
-	edata.fd = sdata.fd;
+	edata.fd = priv->fd;
 	edata.events = POLLIN;
 	if (dfu_set_interface_event(iface->dfu, &edata) < 0) {
 		dfu_err("Error setting interface event\n");
@@ -89,6 +90,10 @@ int linux_serial_read(struct dfu_interface *iface, char *buf,
 int linux_serial_fini(struct dfu_interface *iface)
 {
 	struct linux_serial_data *priv = iface->priv;
+	struct linux_event_data edata = { .fd = -1, };
+
+	/* Stop watching fd before closing it */
+	dfu_set_interface_event(iface->dfu, &edata);
 
 	if (close(priv->fd) < 0) {
 		dfu_err("%s: error closing interface (%s)\n", __func__,
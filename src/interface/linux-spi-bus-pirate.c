@@ -23,8 +23,8 @@ struct linux_spi_bp_data {
 	int cs_active_state;
 };
 
-/* Just one instance */
-static struct linux_spi_bp_data _data;
+/* One instance per dfu instance */
+static struct linux_spi_bp_data _data[CONFIG_DFU_MAX_INSTANCES];
 
 static int get_reply(struct linux_spi_bp_data *data, uint8_t *buf, int len,
 		     unsigned long timeout_ms)
@@ -192,6 +192,7 @@ int linux_spi_bp_open(struct dfu_interface *iface,
 	int fd;
 	struct termios tios, saved_tios;
 	struct linux_event_data edata;
+	struct linux_spi_bp_data *priv = &_data[dfu_id(iface->dfu)];
 
 	fd = open(path, O_RDWR|O_NOCTTY);
 	if (fd < 0)
@@ -216,8 +217,8 @@ int linux_spi_bp_open(struct dfu_interface *iface,
 		dfu_err("tcsetattr");
 		return -1;
 	}
-	_data.fd = fd;
-	iface->priv = &_data;
+	priv->fd = fd;
+	iface->priv = priv;
 	for (i = 0; i < 20; i++) {
 		if (do_write(fd, "\0", 1) < 1)
 			return -1;
@@ -248,7 +249,7 @@ int linux_spi_bp_open(struct dfu_interface *iface,
 		return ret;
 	}
 	printf("SPI protocol version %c\n", buf[3]);
-	ret = spi_bus_pirate_config(&_data, 0);
+	ret = spi_bus_pirate_config(priv, 0);
 	if (ret < 0)
 		return ret;
 	edata.fd = fd;
@@ -332,6 +333,10 @@ int linux_spi_bp_write_read(struct dfu_interface *iface,
 int linux_spi_bp_fini(struct dfu_interface *iface)
 {
 	 struct linux_spi_bp_data *priv = iface->priv;
+	struct linux_event_data edata = { .fd = -1, };
+
+	/* Stop watching fd before closing it */
+	dfu_set_interface_event(iface->dfu, &edata);
 
 	if (close(priv->fd) < 0) {
 		dfu_err("%s: error closing interface (%s)\n", __func__,
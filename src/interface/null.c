@@ -0,0 +1,24 @@
+/*
+ * Null interface, to be used with the null target (see dfu-null.h)
+ * LGPL v2.1
+ */
+
+#include "dfu.h"
+#include "dfu-internal.h"
+#include "dfu-null.h"
+
+static int null_open(struct dfu_interface *iface, const char *path,
+		     const void *pars)
+{
+	return 0;
+}
+
+static int null_fini(struct dfu_interface *iface)
+{
+	return 0;
+}
+
+const struct dfu_interface_ops null_interface_ops = {
+	.open = null_open,
+	.fini = null_fini,
+};
@@ -422,11 +422,11 @@ const jsmntok_t *jsmn_search_token(const char *buf,
 	return NULL;
 }
 
-int jsmn_scan_tokens(const char *buf,
-		     const jsmntok_t *t,
-		     int ntokens,
-		     const struct json_node **nptr,
-		     void *priv_cb)
+static int _scan_tokens(const char *buf,
+			const jsmntok_t *t,
+			int ntokens,
+			const struct json_node **nptr,
+			void *priv_cb)
 {
 	int i, j, stat;
 #ifdef DEBUG
@@ -456,10 +456,10 @@ int jsmn_scan_tokens(const char *buf,
 	for (i = 0, j = 0; i < t->size; i++) {
 		if (!_next_node(nptr))
 			return ((*nptr)->flags & JSON_STOP_PARSING) ? 0 : -1;
-		stat = jsmn_scan_tokens(buf, t + j + 1,
-					ntokens - j,
-					nptr,
-					priv_cb);
+		stat = _scan_tokens(buf, t + j + 1,
+				    ntokens - j,
+				    nptr,
+				    priv_cb);
 		if (stat <= 0) {
 			dfu_dbg("%s %d\n", __func__, __LINE__);
 			return stat;
@@ -469,3 +469,17 @@ int jsmn_scan_tokens(const char *buf,
 	dfu_dbg("%s %d returns %d\n", __func__, lev--, j + 1);
 	return j + 1;
 }
+
+int jsmn_scan_tokens(const char *buf,
+		     const jsmntok_t *t,
+		     int ntokens,
+		     const struct json_node **nptr,
+		     void *priv_cb)
+{
+	/*
+	 * A scan can stop (JSON_STOP_PARSING or error) with return pointers
+	 * still on the stack, always start from an empty one
+	 */
+	nodes_ptr_stack_index = 0;
+	return _scan_tokens(buf, t, ntokens, nptr, priv_cb);
+}
@@ -0,0 +1,74 @@
+
+#include "dfu.h"
+#include "dfu-internal.h"
+
+/* Per phase latency histograms, built when CONFIG_DFU_PROFILING is set */
+
+/*
+ * One set of histograms per dfu instance. Each phase is only updated by
+ * one thread (decoding phases by the pipeline worker, if any).
+ */
+static struct dfu_histogram histograms[CONFIG_DFU_MAX_INSTANCES][DFU_NPHASES];
+
+static const char *phase_names[] = {
+	[DFU_PHASE_POLL] = "poll",
+	[DFU_PHASE_TIMEOUTS] = "timeouts",
+	[DFU_PHASE_TARGET_IDLE] = "target idle",
+	[DFU_PHASE_FILE_IDLE] = "file idle",
+	[DFU_PHASE_HOST_IDLE] = "host idle",
+	[DFU_PHASE_EVENTS] = "events",
+	[DFU_PHASE_DECODE] = "decode",
+	[DFU_PHASE_ENQUEUE] = "enqueue",
+	[DFU_PHASE_CHUNK_AVAILABLE] = "chunk available",
+	[DFU_PHASE_MUST_ERASE] = "must erase",
+	[DFU_PHASE_ERASE] = "erase",
+	[DFU_PHASE_CMDBUF_OUT] = "cmdbuf out",
+	[DFU_PHASE_CMDBUF_IN] = "cmdbuf in",
+	[DFU_PHASE_CMDBUF_OUT_IN] = "cmdbuf out/in",
+	[DFU_PHASE_CMDBUF_DELAY] = "cmdbuf delay",
+	[DFU_PHASE_CMD] = "cmd",
+};
+
+void dfu_profile_add(struct dfu_data *dfu, enum dfu_phase p,
+		     unsigned long start_us)
+{
+	dfu_histogram_add(&histograms[dfu_id(dfu)][p],
+			  dfu_get_current_time_us(dfu) - start_us);
+}
+
+int dfu_get_phase_stats(struct dfu_data *dfu, enum dfu_phase p,
+			struct dfu_phase_stats *out)
+{
+	if (!dfu || p < 0 || p >= DFU_NPHASES)
+		return -1;
+	dfu_histogram_get(&histograms[dfu_id(dfu)][p], out);
+	return 0;
+}
+
+void dfu_reset_phase_stats(struct dfu_data *dfu)
+{
+	memset(histograms[dfu_id(dfu)], 0, sizeof(histograms[0]));
+}
+
+const char *dfu_phase_name(enum dfu_phase p)
+{
+	if (p < 0 || p >= DFU_NPHASES)
+		return "";
+	return phase_names[p];
+}
+
+void dfu_log_phase_stats(struct dfu_data *dfu)
+{
+	struct dfu_phase_stats s;
+	int i;
+
+	dfu_log("%-16s %8s %12s %8s %8s %8s %8s\n", "phase (usecs)",
+		"count", "total", "min", "p50", "p99", "max");
+	for (i = 0; i < DFU_NPHASES; i++) {
+		if (dfu_get_phase_stats(dfu, i, &s) < 0 || !s.count)
+			continue;
+		dfu_log("%-16s %8lu %12llu %8lu %8lu %8lu %8lu\n",
+			dfu_phase_name(i), s.count, s.total, s.min, s.p50,
+			s.p99, s.max);
+	}
+}
@@ -16,6 +16,8 @@ struct http_lwip_client_priv {
 	struct http_connection *c;
 	int request_ready;
 	int serving_request;
+	/* Request is waiting for room in the binary file */
+	int waiting_space;
 };
 
 #ifdef LWIP_TCP
@@ -102,7 +104,7 @@ static int http_accept(struct tcp_server_socket_lwip_raw *r,
 	/* Store connection pointer into binary file private data */
 	c->bf->priv = c;
 	dfu_dbg("%s: new connection ok, binary file = %p, head = %d\n",
-		__func__, c->bf, c->bf->head);
+		__func__, c->bf, c->bf->appended_head);
 	return 0;
 }
 
@@ -278,6 +280,7 @@ static void http_reset_request_data(struct http_connection *c)
 	c->end_of_headers = 0;
 	c->outgoing_data = NULL;
 	c->outgoing_data_len = 0;
+	c->post_appended = 0;
 }
 
 /*
@@ -467,6 +470,10 @@ static int http_poll_idle(struct dfu_binary_file *bf)
 {
 	struct http_connection *c = client_priv.c;
 
+	if (c && client_priv.request_ready && client_priv.waiting_space &&
+	    !dfu_binary_file_get_space(bf))
+		/* Don't retry until the decoder makes some room */
+		return 0;
 	return c && (client_priv.request_ready || c->outgoing_data_len) ?
 		DFU_FILE_EVENT : 0;
 }
@@ -492,6 +499,7 @@ static int http_on_event(struct dfu_binary_file *bf)
 		 */
 		client_priv.request_ready = 0;
 		client_priv.serving_request = 1;
+		client_priv.waiting_space = 0;
 		stat = http_process_request(c,
 					    c->method,
 					    c->method_len,
@@ -512,6 +520,7 @@ static int http_on_event(struct dfu_binary_file *bf)
 			/* Temporary error, retry later on */
 			client_priv.request_ready = 1;
 			client_priv.serving_request = 0;
+			client_priv.waiting_space = 1;
 			dfu_dbg("%s: temporary error on request\n", __func__);
 			return 0;
 		default:
@@ -24,6 +24,8 @@ struct http_connection {
 	int content_length;
 	const void *outgoing_data;
 	int outgoing_data_len;
+	/* Request contents already appended to the binary file (POST) */
+	int post_appended;
 };
 
 #define HTTP_URL_FATAL_ERROR -1
@@ -0,0 +1,111 @@
+
+#include "dfu.h"
+#include "dfu-internal.h"
+
+static inline int _bucket(unsigned long us)
+{
+	return us ? sizeof(us) * 8 - __builtin_clzl(us) : 0;
+}
+
+void dfu_histogram_add(struct dfu_histogram *h, unsigned long us)
+{
+	if (!h->count || us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+	h->count++;
+	h->total += us;
+	h->buckets[_bucket(us)]++;
+}
+
+/* Upper bound of the bucket containing the @pct percentile */
+static unsigned long _percentile(const struct dfu_histogram *h, int pct)
+{
+	unsigned long long n = ((unsigned long long)h->count * pct + 99) / 100;
+	unsigned long long cnt = 0;
+	unsigned long out;
+	int i;
+
+	for (i = 0; i < DFU_HISTOGRAM_NBUCKETS; i++) {
+		cnt += h->buckets[i];
+		if (cnt >= n)
+			break;
+	}
+	out = i ? (1UL << (i - 1)) * 2 - 1 : 0;
+	if (out > h->max)
+		out = h->max;
+	if (out < h->min)
+		out = h->min;
+	return out;
+}
+
+void dfu_histogram_get(const struct dfu_histogram *h,
+		       struct dfu_phase_stats *out)
+{
+	out->count = h->count;
+	out->total = h->total;
+	out->min = h->min;
+	out->max = h->max;
+	out->p50 = h->count ? _percentile(h, 50) : 0;
+	out->p99 = h->count ? _percentile(h, 99) : 0;
+}
+
+int dfu_get_stats(struct dfu_data *dfu, struct dfu_stats *out)
+{
+	const struct dfu_session_stats *s;
+	struct dfu_binary_file *l;
+
+	if (!dfu || !out)
+		return -1;
+	s = &dfu->stats;
+	memset(out, 0, sizeof(*out));
+	if (dfu->bf) {
+		/* Gang members: file is received and decoded by the leader */
+		l = bf_leader(dfu->bf);
+		out->bytes_received = dfu_binary_file_get_tot_appended(l);
+		out->bytes_decoded = dfu_load_acquire(&l->tot_decoded);
+	}
+	out->bytes_written = s->bytes_written;
+	out->if_bytes_sent = s->if_bytes_sent;
+	out->if_bytes_received = s->if_bytes_received;
+	dfu_histogram_get(&s->chunk_latency, &out->chunk_latency);
+	out->chunk_errors = s->chunk_errors;
+	out->chunks_elided = s->chunks_elided;
+	out->chunks_unchanged = s->chunks_unchanged;
+	out->chunks_resumed = s->chunks_resumed;
+	out->erases = s->erases;
+	out->erase_time = s->erase_time;
+	out->cmd_retries = s->cmd_retries;
+	out->cmd_timeouts = s->cmd_timeouts;
+	if (!s->started)
+		return 0;
+	out->elapsed = (s->ended ? s->end : dfu_get_current_time(dfu)) -
+		s->start;
+	if (out->elapsed)
+		out->throughput = (unsigned long long)out->bytes_written *
+			1000 / out->elapsed;
+	return 0;
+}
+
+void dfu_log_stats(struct dfu_data *dfu)
+{
+	struct dfu_stats s;
+
+	if (dfu_get_stats(dfu, &s) < 0)
+		return;
+	dfu_log("received %lu, decoded %lu, written %lu bytes\n",
+		s.bytes_received, s.bytes_decoded, s.bytes_written);
+	dfu_log("interface: sent %llu, received %llu bytes\n",
+		s.if_bytes_sent, s.if_bytes_received);
+	dfu_log("chunks: %lu written (%lu blank, %lu unchanged, %lu resumed), "
+		"%lu errors, latency (usecs) min %lu p50 %lu p99 %lu max %lu\n",
+		s.chunk_latency.count, s.chunks_elided, s.chunks_unchanged,
+		s.chunks_resumed, s.chunk_errors,
+		s.chunk_latency.min, s.chunk_latency.p50,
+		s.chunk_latency.p99, s.chunk_latency.max);
+	dfu_log("erases: %lu, %llu usecs\n", s.erases, s.erase_time);
+	dfu_log("commands: %lu retries, %lu timeouts\n", s.cmd_retries,
+		s.cmd_timeouts);
+	dfu_log("elapsed %lu msecs, %lu bytes/sec\n", s.elapsed,
+		s.throughput);
+}
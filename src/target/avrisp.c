@@ -17,18 +17,20 @@ struct avrisp_data {
 	struct dfu_cmdstate cmd_state;
 	struct dfu_timeout cmd_timeout;
 	const struct dfu_cmddescr *curr_descr;
+	struct dfu_cmd_storage cmd;
 	phys_addr_t curr_chunk_addr;
 	unsigned long curr_written;
 	unsigned long to_write;
 	const char *page_buf;
+	/*
+	 * Just one command shall be active at any time, so commands can
+	 * share buffers.
+	 */
+	uint8_t cmd_buffer[4];
+	uint8_t reply[4];
 };
 
-static uint8_t cmd_buffer[4];
-
-/*
- * Just one command shall be active at any time.
- */
-static struct avrisp_data data;
+static struct avrisp_data data[CONFIG_DFU_MAX_INSTANCES];
 
 /* Command callbacks */
 
@@ -38,11 +40,11 @@ static struct avrisp_data data;
 static int avrisp_init(struct dfu_target *target,
 		       struct dfu_interface *interface)
 {
-	static struct avrisp_data priv;
+	struct avrisp_data *priv = &data[dfu_id(target->dfu)];
 
 	target->interface = interface;
-	memset(&priv, 0, sizeof(priv));
-	target->priv = &priv;
+	memset(priv, 0, sizeof(*priv));
+	target->priv = priv;
 	if (!target->pars) {
 		dfu_err("%s: target parameters expected\n", __func__);
 		return -1;
@@ -67,15 +69,14 @@ static int _get_sync(struct dfu_target *target)
 {
 	struct avrisp_data *priv = target->priv;
 	const struct stk500_device_data *dd = target->pars;
-	static uint8_t sync_reply[4];
 	int ret;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = &cmd_buffer,
-				.in = &sync_reply,
+				.out = priv->cmd_buffer,
+				.in = priv->reply,
 			},
 			/* Send 0xac, write only */
 			.len = 1,
@@ -83,8 +84,8 @@ static int _get_sync(struct dfu_target *target)
 		[1] = {
 			.dir = OUT_IN,
 			.buf = {
-				.out = &cmd_buffer[1],
-				.in = &sync_reply,
+				.out = &priv->cmd_buffer[1],
+				.in = priv->reply,
 			},
 			/*
 			 * Send 0x53 0x00, write + read: read phase
@@ -97,28 +98,28 @@ static int _get_sync(struct dfu_target *target)
 		[2] = {
 			.dir = OUT,
 			.buf = {
-				.out = &cmd_buffer[3],
-				.in = &sync_reply,
+				.out = &priv->cmd_buffer[3],
+				.in = priv->reply,
 			},
 			/* Send 0x00, write only */
 			.len = 1,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
 	};
 	dfu_dbg("syncing target\n");
-	priv->curr_descr = &descr0;
-	memcpy(cmd_buffer, dd->enter_progmode, sizeof(sync_reply));
-	ret = dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	memcpy(priv->cmd_buffer, dd->enter_progmode, sizeof(priv->cmd_buffer));
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (!ret)
 		dfu_dbg("sync ok\n");
 	else
@@ -162,14 +163,13 @@ static void _chunk_done(struct dfu_target *target,
 static int _write_page(struct dfu_target *target)
 {
 	struct avrisp_data *priv = target->priv;
-	static uint8_t reply[4];
 	static const uint8_t poll_request[] = { 0xf0, 0x00, 0x00, 0x00, };
 	const struct stk500_device_data *dd = target->pars;
-	static struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = 4,
 		},
@@ -185,7 +185,7 @@ static int _write_page(struct dfu_target *target)
 			.dir = OUT_IN,
 			.buf = {
 				.out = &poll_request[2],
-				.in = reply,
+				.in = priv->reply,
 			},
 			/* 0x00: write + read : this adds one more 0 */
 			.len = 1,
@@ -198,13 +198,13 @@ static int _write_page(struct dfu_target *target)
 			.next_on_retry = 1,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = _chunk_done,
@@ -213,35 +213,34 @@ static int _write_page(struct dfu_target *target)
 	phys_addr_t mask = ~((dd->flash->page_size >> 1) - 1);
 	phys_addr_t page_address = address & mask;
 
-	cmd_buffer[0] = 0x4c;
-	cmd_buffer[1] = (page_address >> 8) & 0xff;
-	cmd_buffer[2] = page_address & 0xff;
-	cmd_buffer[3] = 0;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_start(target, &descr0);
+	priv->cmd_buffer[0] = 0x4c;
+	priv->cmd_buffer[1] = (page_address >> 8) & 0xff;
+	priv->cmd_buffer[2] = page_address & 0xff;
+	priv->cmd_buffer[3] = 0;
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_start(target, priv->curr_descr);
 }
 
 static int _load_byte(struct dfu_target *target)
 {
 	struct avrisp_data *priv = target->priv;
-	static uint8_t reply[4];
 	const struct stk500_device_data *dd = target->pars;
-	static struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
-			.len = sizeof(reply),
+			.len = sizeof(priv->reply),
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 	};
@@ -251,11 +250,12 @@ static int _load_byte(struct dfu_target *target)
 			       >> 1) & mask;
 	int hi = priv->curr_written & 0x1;
 
-	cmd_buffer[0] = hi ? 0x48 : 0x40;
-	cmd_buffer[1] = (address >> 8) & 0xff;
-	cmd_buffer[2] = address & 0xff;
-	cmd_buffer[3] = priv->page_buf[priv->curr_written++];
-	ret = dfu_cmd_do_sync(target, &descr0);
+	priv->cmd_buffer[0] = hi ? 0x48 : 0x40;
+	priv->cmd_buffer[1] = (address >> 8) & 0xff;
+	priv->cmd_buffer[2] = address & 0xff;
+	priv->cmd_buffer[3] = priv->page_buf[priv->curr_written++];
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (ret < 0) {
 		priv->curr_descr = NULL;
 		priv->to_write = 0;
@@ -276,6 +276,9 @@ static int _load_byte(struct dfu_target *target)
 						   priv->curr_chunk_addr,
 						   ret);
 	}
+	if (priv->to_write)
+		/* Next byte will be loaded on next idle */
+		dfu_idle_again(target->dfu);
 	return 0;
 }
 
@@ -303,32 +306,31 @@ static int avrisp_target_erase_all(struct dfu_target *target)
 {
 	const struct stk500_device_data *dd = target->pars;
 	struct avrisp_data *priv = target->priv;
-	static uint8_t reply[4];
-	static struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
-				.in = reply,
+				.out = priv->cmd_buffer,
+				.in = priv->reply,
 			},
-			.len = sizeof(reply),
+			.len = sizeof(priv->reply),
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 	};
 	int ret;
 
-	priv->curr_descr = &descr0;
-	memcpy(cmd_buffer, dd->chip_erase, sizeof(reply));
-	ret = dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	memcpy(priv->cmd_buffer, dd->chip_erase, sizeof(priv->cmd_buffer));
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (ret < 0)
 		return ret;
 	/* This can be done synchronously (takes a few msecs) */
@@ -43,6 +43,7 @@ static int _cmd_end(struct dfu_target *target,
 	struct dfu_cmdstate *state = descr->state;
 
 	dfu_dbg("%s, s = %d\n", __func__, s);
+	dfu_profile_end(target->dfu, DFU_PHASE_CMD, state->cmd_start);
 	state->status = s;
 	if (descr->completed)
 		descr->completed(target, descr);
@@ -58,6 +59,8 @@ static int _next_buf(struct dfu_target *target,
 	int stat = 0;
 
 	dfu_dbg("%s\n", __func__);
+	dfu_profile_end(target->dfu, DFU_PHASE_CMDBUF_OUT + buf->dir,
+			state->buf_start);
 	if (buf->completed) {
 		dfu_dbg("%s: completed\n", __func__);
 		stat = buf->completed(descr, buf);
@@ -79,13 +82,17 @@ static int _next_buf(struct dfu_target *target,
 			dfu_cancel_timeout(descr->timeout);
 		state->cmdbuf_index = stat < 0 ? buf->next_on_retry :
 			state->cmdbuf_index + 1;
-		if (stat < 0)
+		if (stat < 0) {
 			state->status = DFU_CMD_STATUS_RETRYING;
+			target->dfu->stats.cmd_retries++;
+		}
 	}
 	
 	if (state->cmdbuf_index >= descr->ncmdbufs &&
 	    state->status != DFU_CMD_STATUS_RETRYING)
 		return _cmd_end(target, descr, DFU_CMD_STATUS_OK);
+	/* Next buffer will be processed by dfu_cmd_on_idle() */
+	dfu_idle_again(target->dfu);
 	return DO_CMDBUF_CONTINUE;
 }
 
@@ -99,6 +106,11 @@ static void _on_cmd_timeout(struct dfu_data *data, const void *priv)
 		return;
 	}
 	
+	dfu_profile_end(data, DFU_PHASE_CMDBUF_OUT +
+			descr->cmdbufs[state->cmdbuf_index].dir,
+			state->buf_start);
+	dfu_profile_end(data, DFU_PHASE_CMD, state->cmd_start);
+	data->stats.cmd_timeouts++;
 	descr->state->status = DFU_CMD_STATUS_TIMEOUT;
 	if (descr->completed)
 		descr->completed(data->target, descr);
@@ -148,6 +160,9 @@ static int _do_cmdbuf(struct dfu_target *target,
 	int stat;
 	char dummy_buf[8];
 
+	if (state->status == DFU_CMD_STATUS_INITIALIZED ||
+	    state->status == DFU_CMD_STATUS_RETRYING)
+		dfu_profile_start(target->dfu, state->buf_start);
 	if (state->status == DFU_CMD_STATUS_INITIALIZED) {
 		if (buf->timeout > 0 && !descr->timeout)
 			dfu_err("%s: cannot setup timeout\n", __func__);
@@ -273,11 +288,30 @@ static int _do_cmdbuf(struct dfu_target *target,
 }
 
 
+const struct dfu_cmddescr *
+dfu_cmd_setup(struct dfu_cmd_storage *s, const struct dfu_cmddescr *descr)
+{
+	if (descr->ncmdbufs > ARRAY_SIZE(s->cmdbufs)) {
+		dfu_err("%s: too many command buffers (%d)\n", __func__,
+			descr->ncmdbufs);
+		return NULL;
+	}
+	memcpy(s->cmdbufs, descr->cmdbufs,
+	       descr->ncmdbufs * sizeof(s->cmdbufs[0]));
+	s->descr = *descr;
+	s->descr.cmdbufs = s->cmdbufs;
+	return &s->descr;
+}
+
 int dfu_cmd_start(struct dfu_target *target, const struct dfu_cmddescr *descr)
 {
 	struct dfu_interface *interface = target->interface;
 	int stat;
-	struct dfu_cmdstate *state = descr->state;
+	struct dfu_cmdstate *state;
+
+	if (!descr)
+		return -1;
+	state = descr->state;
 
 	if (!interface || !dfu_interface_has_write(interface) ||
 	    (!dfu_interface_has_read(interface) &&
@@ -292,6 +326,7 @@ int dfu_cmd_start(struct dfu_target *target, const struct dfu_cmddescr *descr)
 	dfu_target_set_busy(target);
 	state->status = DFU_CMD_STATUS_INITIALIZED;
 	state->cmdbuf_index = 0;
+	state->cmd_start = dfu_get_current_time_us(target->dfu);
 	stat = _do_cmdbuf(target, descr,
 			  &descr->cmdbufs[state->cmdbuf_index]);
 	dfu_dbg("%s: _do_cmdbuf returns %d\n", __func__, stat);
@@ -315,6 +350,7 @@ int dfu_cmd_on_interface_event(struct dfu_target *target,
 	dfu_dbg("%s, status = %d\n", __func__, descr->state->status);
 	if (descr->state->status == DFU_CMD_STATUS_WAITING) {
 		descr->state->status = DFU_CMD_STATUS_INTERFACE_READY;
+		dfu_idle_again(target->dfu);
 		return 0;
 	}
 	if (descr->state->status == DFU_CMD_STATUS_OK ||
@@ -352,9 +388,15 @@ int dfu_cmd_do_sync(struct dfu_target *target,
 	       descr->state->status == DFU_CMD_STATUS_RETRYING ||
 	       descr->state->status == DFU_CMD_STATUS_WAITING ||
 	       descr->state->status == DFU_CMD_STATUS_INTERFACE_READY) {
-			if (dfu_idle(target->dfu) == DFU_CONTINUE)
+			/*
+			 * Commands can also be run when the file has been
+			 * completely written (leaving programming mode, for
+			 * instance)
+			 */
+			if (dfu_idle(target->dfu) != DFU_ERROR)
 				continue;
-			break;
+			/* Session failed, the command won't complete */
+			return DFU_CMD_STATUS_ERROR;
 	}
 	dfu_dbg("%s returns, status = %d\n", __func__, descr->state->status);
 	return descr->state->status;
@@ -73,12 +73,18 @@ struct nordic_spi_data {
 	uint32_t object_crc_from_target;
 	struct nordic_spi_select_object_data sod;
 	enum nordic_spi_send_state send_state;
+	struct dfu_cmd_storage cmd;
+	/*
+	 * Just one command shall be active at any time, so commands can
+	 * share buffers.
+	 */
+	uint8_t reply[15];
+	uint8_t create_obj_cmd[6];
+	uint8_t select_obj_cmd[15];
+	uint8_t write_buf[257];
 };
 
-/*
- * Just one command shall be active at any time.
- */
-static struct nordic_spi_data data;
+static struct nordic_spi_data data[CONFIG_DFU_MAX_INSTANCES];
 
 /* Command callbacks */
 
@@ -88,8 +94,11 @@ static struct nordic_spi_data data;
 static int nordic_spi_init(struct dfu_target *target,
 			   struct dfu_interface *interface)
 {
+	struct nordic_spi_data *priv = &data[dfu_id(target->dfu)];
+
+	memset(priv, 0, sizeof(*priv));
+	target->priv = priv;
 	dfu_log("NORDIC SPI target initialized\n");
-	target->priv = &data;
 	return 0;
 }
 
@@ -111,6 +120,7 @@ static int _check_prn_reply(const struct dfu_cmddescr *descr,
 static int _check_mtu_reply(const struct dfu_cmddescr *descr,
 			    const struct dfu_cmdbuf *buf)
 {
+	struct nordic_spi_data *priv = descr->priv;
 	unsigned char *ptr = buf->buf.in;
 	static const char expected_reply[] =
 		{ NRF_DFU_OP_RESPONSE,
@@ -126,8 +136,8 @@ static int _check_mtu_reply(const struct dfu_cmddescr *descr,
 		ptr[0], ptr[1],
 		ptr[2], ptr[3]);
 	/* MTU is sent as a big endian number */
-	data.advertised_mtu = (ptr[2] << 8) + ptr[3];
-	dfu_dbg("%s: advertised MTU = %u\n", __func__, data.advertised_mtu);
+	priv->advertised_mtu = (ptr[2] << 8) + ptr[3];
+	dfu_dbg("%s: advertised MTU = %u\n", __func__, priv->advertised_mtu);
 	return 0;
 }
 
@@ -157,14 +167,12 @@ static int nordic_spi_probe(struct dfu_target *target)
 		/* PRN = 256 */
 		0x01, 0x00,
 	};
-	static uint8_t set_prn_reply[3];
 	static const uint8_t get_mtu_cmd[] = {
 		NRF_DFU_OP_GET_MTU
 	};
 	static const uint8_t get_mtu_reply_outbuf[4] =
 		{ NRF_DFU_OP_DUMMY, 0, 0, 0 };
-	static uint8_t get_mtu_reply[4];
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Sent PRN to 256 */
 		[0] = {
 			.dir = OUT,
@@ -183,7 +191,7 @@ static int nordic_spi_probe(struct dfu_target *target)
 			.dir = OUT_IN,
 			.buf = {
 				.out = set_prn_cmd,
-				.in = set_prn_reply,
+				.in = priv->reply,
 			},
 			.len = sizeof(set_prn_cmd),
 		},
@@ -197,7 +205,7 @@ static int nordic_spi_probe(struct dfu_target *target)
 			.dir = OUT_IN,
 			.buf = {
 				.out = set_prn_cmd,
-				.in = set_prn_reply,
+				.in = priv->reply,
 			},
 			.len = sizeof(set_prn_cmd),
 			.completed = _check_prn_reply,
@@ -226,9 +234,9 @@ static int nordic_spi_probe(struct dfu_target *target)
 			.dir = OUT_IN,
 			.buf = {
 				.out = get_mtu_reply_outbuf,
-				.in = get_mtu_reply,
+				.in = priv->reply,
 			},
-			.len = sizeof(get_mtu_reply),
+			.len = sizeof(get_mtu_reply_outbuf),
 		},
 		/* WAIT 200ms */
 		{
@@ -241,25 +249,26 @@ static int nordic_spi_probe(struct dfu_target *target)
 			.dir = OUT_IN,
 			.buf = {
 				.out = get_mtu_reply_outbuf,
-				.in = get_mtu_reply,
+				.in = priv->reply,
 			},
 			.completed = _check_mtu_reply,
-			.len = sizeof(get_mtu_reply),
+			.len = sizeof(get_mtu_reply_outbuf),
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
+		.priv = priv,
 	};
-	priv->curr_descr = &descr0;
-	ret = dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (!ret) {
 		dfu_dbg("probe ok\n");
 		priv->send_state = WAITING;
@@ -295,21 +304,17 @@ static int _create_obj(struct dfu_target *target, enum nzbf_type t,
 {
 	int ret;
 	struct nordic_spi_data *priv = target->priv;
-	static uint8_t create_obj_cmd[6] = {
-		NRF_DFU_OP_CREATE,
-	};
-	static uint8_t dummy_create_obj_cmd[6] = {
+	static const uint8_t dummy_create_obj_cmd[6] = {
 		NRF_DFU_OP_DUMMY,
 	};
-	static uint8_t create_obj_reply[6];
 	uint32_t v = cpu_to_le32(size);
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = create_obj_cmd,
+				.out = priv->create_obj_cmd,
 			},
-			.len = sizeof(create_obj_cmd),
+			.len = sizeof(priv->create_obj_cmd),
 		},
 		{
 			.dir = NONE,
@@ -321,32 +326,34 @@ static int _create_obj(struct dfu_target *target, enum nzbf_type t,
 			.dir = OUT_IN,
 			.buf = {
 				.out = dummy_create_obj_cmd,
-				.in = create_obj_reply,
+				.in = priv->reply,
 			},
 			.len = sizeof(dummy_create_obj_cmd),
 			.completed = _check_create_obj_reply,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
+		.priv = priv,
 	};
 
 	if (t > NZ_TYPE_DATA) {
 		dfu_err("%s: invalid type %d\n", __func__, t);
 		return -1;
 	}
-	create_obj_cmd[1] = t;
-	memcpy(&create_obj_cmd[2], &v, sizeof(v));
-	priv->curr_descr = &descr0;
-	ret = dfu_cmd_do_sync(target, &descr0);
+	priv->create_obj_cmd[0] = NRF_DFU_OP_CREATE;
+	priv->create_obj_cmd[1] = t;
+	memcpy(&priv->create_obj_cmd[2], &v, sizeof(v));
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (!ret)
 		dfu_dbg("OBJECT CREATED OK\n");
 	else
@@ -363,7 +370,8 @@ static int _check_select_obj_reply(const struct dfu_cmddescr *descr,
 		  NRF_DFU_OP_SELECT,
 		  NRF_DFU_RES_SUCCESS
 		};
-	struct nordic_spi_select_object_data *sod = &data.sod;
+	struct nordic_spi_data *priv = descr->priv;
+	struct nordic_spi_select_object_data *sod = &priv->sod;
 	uint32_t v;
 
 	dfu_dbg("%s entered\n", __func__);
@@ -387,21 +395,16 @@ static int _select_obj(struct dfu_target *target)
 	int ret;
 	struct nordic_spi_data *priv = target->priv;
 	struct nordic_spi_select_object_data *sod = &priv->sod;
-	static uint8_t select_obj_cmd[15] = {
-		NRF_DFU_OP_SELECT,
-		[1 ... 14] = 0xff,
-	};
-	static uint8_t dummy_select_obj_cmd[15] = {
+	static const uint8_t dummy_select_obj_cmd[15] = {
 		0,
 	};
-	static uint8_t select_obj_reply[15];
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		{
 			.dir = OUT,
 			.buf = {
-				.out = select_obj_cmd,
+				.out = priv->select_obj_cmd,
 			},
-			.len = sizeof(select_obj_cmd),
+			.len = sizeof(priv->select_obj_cmd),
 		},
 		/* WAIT 700ms */
 		{
@@ -414,22 +417,23 @@ static int _select_obj(struct dfu_target *target)
 			.dir = OUT_IN,
 			.buf = {
 				.out = dummy_select_obj_cmd,
-				.in = select_obj_reply,
+				.in = priv->reply,
 			},
-			.len = sizeof(select_obj_cmd),
+			.len = sizeof(priv->select_obj_cmd),
 			.completed = _check_select_obj_reply,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
+		.priv = priv,
 	};
 
 	if (sod->type > NZ_TYPE_DATA) {
@@ -437,9 +441,11 @@ static int _select_obj(struct dfu_target *target)
 		return -1;
 	}
 
-	select_obj_cmd[1] = sod->type;
-	priv->curr_descr = &descr0;
-	ret = dfu_cmd_do_sync(target, &descr0);
+	memset(priv->select_obj_cmd, 0xff, sizeof(priv->select_obj_cmd));
+	priv->select_obj_cmd[0] = NRF_DFU_OP_SELECT;
+	priv->select_obj_cmd[1] = sod->type;
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (ret < 0)
 		dfu_err("Error selecting object\n");
 	return ret;
@@ -474,8 +480,8 @@ static int _send_buffer(struct dfu_target *target,
 			const void *buf, unsigned long sz)
 {
 	struct nordic_spi_data *priv = target->priv;
-	static uint8_t _buf[257];
-	static struct dfu_cmdbuf cmdbufs0[] = {
+	uint8_t *_buf = priv->write_buf;
+	struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = NONE,
 			.buf = {},
@@ -492,19 +498,20 @@ static int _send_buffer(struct dfu_target *target,
 			.timeout = 100,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = _chunk_sent,
+		.priv = priv,
 	};
 
-	if (sz > priv->advertised_mtu || sz > (sizeof(_buf) - 1))
+	if (sz > priv->advertised_mtu || sz > (sizeof(priv->write_buf) - 1))
 		return -1;
 	_buf[0] = NRF_DFU_OP_WRITE;
 	memcpy(&_buf[1], buf, sz);
@@ -513,15 +520,16 @@ static int _send_buffer(struct dfu_target *target,
 
 	/* ASYNCHRONOUS */
 	priv->send_offset = offset;
-	priv->curr_descr = &descr0;
 	priv->curr_chunk_size = sz;
-	return dfu_cmd_start(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_start(target, priv->curr_descr);
 }
 
 static int _check_calc_crc_reply(const struct dfu_cmddescr *descr,
 				 const struct dfu_cmdbuf *buf)
 {
 	int ret;
+	struct nordic_spi_data *priv = descr->priv;
 	unsigned char *ptr = buf->buf.in;
 	static const char expected_reply[] =
 		{ NRF_DFU_OP_RESPONSE,
@@ -535,11 +543,11 @@ static int _check_calc_crc_reply(const struct dfu_cmddescr *descr,
 		dfu_err("%s, error\n", __func__);
 		return -1;
 	}
-	memcpy(&data.object_final_offset, &ptr[3], sizeof(uint32_t));
-	memcpy(&data.object_crc_from_target, &ptr[7], sizeof(uint32_t));
+	memcpy(&priv->object_final_offset, &ptr[3], sizeof(uint32_t));
+	memcpy(&priv->object_crc_from_target, &ptr[7], sizeof(uint32_t));
 	dfu_dbg("object_final_offset = %u, object_crc_from_target = 0x%08x\n",
-		(unsigned)data.object_final_offset,
-		(unsigned)data.object_crc_from_target);
+		(unsigned)priv->object_final_offset,
+		(unsigned)priv->object_crc_from_target);
 	return ret;
 }
 
@@ -566,14 +574,13 @@ static int _calc_crc(struct dfu_target *target, enum nordic_spi_send_state s)
 {
 	int ret;
 	struct nordic_spi_data *priv = target->priv;
-	static uint8_t calc_crc_cmd[1] = {
+	static const uint8_t calc_crc_cmd[1] = {
 		NRF_DFU_OP_CALC_CHK,
 	};
 	static const uint8_t dummy_calc_crc_cmd[11] = {
 		[0 ... 10] = 0,
 	};
-	static uint8_t calc_crc_reply[11];
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
@@ -592,27 +599,28 @@ static int _calc_crc(struct dfu_target *target, enum nordic_spi_send_state s)
 			.dir = OUT_IN,
 			.buf = {
 				.out = dummy_calc_crc_cmd,
-				.in = calc_crc_reply,
+				.in = priv->reply,
 			},
-			.len = sizeof(calc_crc_reply),
+			.len = sizeof(dummy_calc_crc_cmd),
 			.completed = _check_calc_crc_reply,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = _crc_ok,
+		.priv = priv,
 	};
 
-	priv->curr_descr = &descr0;
 	priv->send_state = s;
-	ret = dfu_cmd_start(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_start(target, priv->curr_descr);
 	if (ret < 0)
 		dfu_err("Error in crc calculation\n");
 	return ret;
@@ -671,14 +679,13 @@ static int _exec_obj(struct dfu_target *target, enum nordic_spi_send_state s)
 {
 	int ret;
 	struct nordic_spi_data *priv = target->priv;
-	static uint8_t exec_obj_cmd[1] = {
+	static const uint8_t exec_obj_cmd[1] = {
 		NRF_DFU_OP_EXEC,
 	};
 	static const uint8_t dummy_exec_obj_cmd[4] = {
 		NRF_DFU_OP_DUMMY, 0, 0,
 	};
-	static uint8_t exec_obj_reply[4];
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
@@ -696,9 +703,9 @@ static int _exec_obj(struct dfu_target *target, enum nordic_spi_send_state s)
 			.dir = OUT_IN,
 			.buf = {
 				.out = dummy_exec_obj_cmd,
-				.in = exec_obj_reply,
+				.in = priv->reply,
 			},
-			.len = sizeof(exec_obj_reply),
+			.len = sizeof(dummy_exec_obj_cmd),
 			.completed = _check_exec_obj_reply,
 		},
 		/* WAIT 200ms */
@@ -716,7 +723,7 @@ static int _exec_obj(struct dfu_target *target, enum nordic_spi_send_state s)
 			.dir = OUT,
 			.buf = {
 				.out = exec_obj_cmd,
-				.in = exec_obj_reply,
+				.in = priv->reply,
 			},
 			.len = sizeof(exec_obj_cmd),
 		},
@@ -729,21 +736,22 @@ static int _exec_obj(struct dfu_target *target, enum nordic_spi_send_state s)
 		},
 #endif
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = _chunk_done,
+		.priv = priv,
 	};
 
 	priv->send_state = s;
-	priv->curr_descr = &descr0;
-	ret = dfu_cmd_start(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_start(target, priv->curr_descr);
 	if (ret < 0)
 		dfu_err("Error executing object\n");
 	return ret;
@@ -897,6 +905,8 @@ static int nordic_spi_chunk_available(struct dfu_target *target,
 			return -1;
 		}
 		priv->send_state = THROWING_AWAY;
+		/* Chunk is thrown away on next idle */
+		dfu_idle_again(target->dfu);
 		return sz;
 	}
 
@@ -0,0 +1,139 @@
+/*
+ * Null target, chunks are written instantly (see dfu-null.h)
+ * LGPL v2.1
+ */
+
+#include "dfu.h"
+#include "dfu-internal.h"
+#include "dfu-null.h"
+
+#ifndef CONFIG_NULL_TARGET_CHUNK_SIZE
+#define CONFIG_NULL_TARGET_CHUNK_SIZE 256
+#endif
+
+/* Chunks being written when there's a write latency */
+struct null_target_data {
+	struct dfu_target *target;
+	struct dfu_timeout timeout;
+	/* Addresses and completion times (msecs), oldest at first */
+	phys_addr_t addr[CONFIG_MAX_WRITE_QUEUE_DEPTH];
+	unsigned long done[CONFIG_MAX_WRITE_QUEUE_DEPTH];
+	int first;
+	int n;
+};
+
+static struct null_target_data data[CONFIG_DFU_MAX_INSTANCES];
+
+static int null_init(struct dfu_target *target,
+		     struct dfu_interface *interface)
+{
+	struct null_target_data *priv = &data[dfu_id(target->dfu)];
+
+	memset(priv, 0, sizeof(*priv));
+	priv->target = target;
+	target->priv = priv;
+	return 0;
+}
+
+static void _arm_timeout(struct null_target_data *priv, unsigned long now)
+{
+	priv->timeout.timeout = priv->done[priv->first] - now;
+	if (dfu_set_timeout(priv->target->dfu, &priv->timeout) < 0)
+		dfu_err("%s: cannot set timeout\n", __func__);
+}
+
+/* Chunks whose write latency has elapsed are done, in order */
+static void _write_timeout(struct dfu_data *dfu, const void *p)
+{
+	struct null_target_data *priv = (struct null_target_data *)p;
+	unsigned long now = dfu_get_current_time(dfu);
+	phys_addr_t addr;
+
+	while (priv->n && time_after_eq(now, priv->done[priv->first])) {
+		addr = priv->addr[priv->first];
+		priv->first = (priv->first + 1) &
+			(CONFIG_MAX_WRITE_QUEUE_DEPTH - 1);
+		priv->n--;
+		dfu_binary_file_chunk_done(dfu->bf, addr, 0);
+	}
+	if (priv->n)
+		_arm_timeout(priv, now);
+}
+
+static int null_chunk_available(struct dfu_target *target,
+				phys_addr_t address,
+				const void *buf, unsigned long sz)
+{
+	const struct null_target_pars *pars = target->pars;
+	struct null_target_data *priv = target->priv;
+	unsigned long now;
+	int i;
+
+	if (pars && pars->mem && address >= pars->mem_base &&
+	    address - pars->mem_base + sz <= pars->mem_size)
+		memcpy((char *)pars->mem + address - pars->mem_base, buf, sz);
+	if (!pars || !pars->write_latency) {
+		dfu_binary_file_chunk_done(target->dfu->bf, address, 0);
+		return 0;
+	}
+	if (priv->n >= CONFIG_MAX_WRITE_QUEUE_DEPTH) {
+		dfu_err("%s: too many chunks\n", __func__);
+		return -1;
+	}
+	now = dfu_get_current_time(target->dfu);
+	i = (priv->first + priv->n) & (CONFIG_MAX_WRITE_QUEUE_DEPTH - 1);
+	priv->addr[i] = address;
+	priv->done[i] = now + pars->write_latency;
+	if (!priv->n++) {
+		priv->timeout.cb = _write_timeout;
+		priv->timeout.priv = priv;
+		_arm_timeout(priv, now);
+	}
+	return 0;
+}
+
+static int null_run(struct dfu_target *target)
+{
+	return 0;
+}
+
+static int null_get_write_chunk_size(struct dfu_target *target)
+{
+	const struct null_target_pars *pars = target->pars;
+
+	return pars && pars->chunk_size ? pars->chunk_size :
+		CONFIG_NULL_TARGET_CHUNK_SIZE;
+}
+
+static int null_ignore_chunk_alignment(struct dfu_target *target)
+{
+	const struct null_target_pars *pars = target->pars;
+
+	return pars ? pars->ignore_chunk_alignment : 0;
+}
+
+static int null_get_queue_depth(struct dfu_target *target)
+{
+	const struct null_target_pars *pars = target->pars;
+
+	return pars && pars->queue_depth ? pars->queue_depth : 1;
+}
+
+static int null_fini(struct dfu_target *target)
+{
+	struct null_target_data *priv = target->priv;
+
+	if (priv)
+		dfu_cancel_timeout(&priv->timeout);
+	return 0;
+}
+
+struct dfu_target_ops null_dfu_target_ops = {
+	.init = null_init,
+	.chunk_available = null_chunk_available,
+	.run = null_run,
+	.get_write_chunk_size = null_get_write_chunk_size,
+	.ignore_chunk_alignment = null_ignore_chunk_alignment,
+	.get_queue_depth = null_get_queue_depth,
+	.fini = null_fini,
+};
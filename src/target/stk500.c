@@ -87,16 +87,20 @@ struct stk500_data {
 	uint8_t checksum;
 	struct dfu_timeout cmd_timeout;
 	const struct dfu_cmddescr *curr_descr;
+	struct dfu_cmd_storage cmd;
 	int busy;
 	phys_addr_t curr_chunk_addr;
+	/*
+	 * Just one command shall be active at any time, so commands can
+	 * share buffers.
+	 */
+	uint8_t cmd_buffer[32];
+	uint8_t sync_reply[2];
+	uint8_t result[3];
+	unsigned int param;
 };
 
-static uint8_t cmd_buffer[32];
-
-/*
- * Just one command shall be active at any time.
- */
-static struct stk500_data data;
+static struct stk500_data data[CONFIG_DFU_MAX_INSTANCES];
 
 /* Command callbacks */
 
@@ -113,11 +117,11 @@ static void stk500_completed(struct dfu_cmddescr *descr)
 static int stk500_init(struct dfu_target *target,
 		       struct dfu_interface *interface)
 {
-	static struct stk500_data priv;
+	struct stk500_data *priv = &data[dfu_id(target->dfu)];
 
 	target->interface = interface;
-	memset(&priv, 0, sizeof(priv));
-	target->priv = &priv;
+	memset(priv, 0, sizeof(*priv));
+	target->priv = priv;
 	if (!target->pars) {
 		dfu_err("%s: target parameters expected\n", __func__);
 		return -1;
@@ -171,49 +175,47 @@ static int _get_param(struct dfu_target *target, uint8_t param,
 	int stat;
 	struct stk500_data *priv = target->priv;
 	struct stk500_get_param_cmd *cmdb = (struct stk500_get_param_cmd *)
-		cmd_buffer;
-	static uint8_t param_reply[3];
-	static unsigned int out;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+		priv->cmd_buffer;
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = param_reply,
+				.in = priv->result,
 			},
-			.len = sizeof(param_reply),
+			.len = sizeof(priv->result),
 			.timeout = 300,
 			.completed = _check_get_param_reply,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
-		.priv = &out,
+		.priv = &priv->param,
 	};
 
 	cmdb->code = STK_GET_PARAMETER;
 	cmdb->param = param;
 	cmdb->eop = STK_CRC_EOP;
-	priv->curr_descr = &descr0;
-	stat = dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	stat = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (stat < 0)
 		return stat;
-	*_out = out;
+	*_out = priv->param;
 	return stat;
 }
 
@@ -237,57 +239,56 @@ int _get_sync(struct dfu_target *target)
 {
 	struct stk500_data *priv = target->priv;
 	struct stk500_get_sync_cmd *cmdb = (struct stk500_get_sync_cmd *)
-		cmd_buffer;
-	static uint8_t sync_reply[2];
+		priv->cmd_buffer;
 	int i, ret;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = sizeof(priv->sync_reply),
 			.timeout = 300,
 			.completed = _check_get_sync,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
 	};
-	static const struct dfu_cmddescr descr1 = {
+	const struct dfu_cmddescr descr1 = {
 		.cmdbufs = &cmdbufs0[1],
 		.ncmdbufs = 1,
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
 	};
 
 	dfu_dbg("syncing target\n");
-	for (i = 0; i < MAX_SYNC_ATTEMPTS; i++) {
+	for (i = 0; i < MAX_SYNC_ATTEMPTS && !dfu_error(target->dfu); i++) {
 		cmdb->code= STK_GET_SYNC;
 		cmdb->eop = STK_CRC_EOP;
-		priv->curr_descr = &descr0;
-		ret = dfu_cmd_do_sync(target, &descr0);
+		priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+		ret = dfu_cmd_do_sync(target, priv->curr_descr);
 		if (!ret) {
 			dfu_dbg("sync ok\n");
 			return ret;
@@ -303,15 +304,16 @@ int _get_sync(struct dfu_target *target)
 		 * Flush input and wait 300ms more
 		 */
 		do {
-			if (dfu_cmd_do_sync(target, &descr1) ==
+			priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr1);
+			if (dfu_cmd_do_sync(target, priv->curr_descr) ==
 			    DFU_CMD_STATUS_TIMEOUT)
 				break;
-		} while(1);
+		} while(!dfu_error(target->dfu));
 		dfu_dbg("retrying sync\n");
 	}
-	if (i >= MAX_SYNC_ATTEMPTS)
+	if (i >= MAX_SYNC_ATTEMPTS || dfu_error(target->dfu))
 		dfu_err("cannot sync target\n");
-	return i < MAX_SYNC_ATTEMPTS ? 0 : -1;
+	return i < MAX_SYNC_ATTEMPTS && !dfu_error(target->dfu) ? 0 : -1;
 }
 
 struct stk500_set_device_cmd {
@@ -344,48 +346,47 @@ static int _check_set_device(const struct dfu_cmddescr *descr,
 
 static int _set_device(struct dfu_target *target, int *n_extp)
 {
+	struct stk500_data *priv = target->priv;
 	struct stk500_set_device_cmd *cmdb = (struct stk500_set_device_cmd *)
-		cmd_buffer;
+		priv->cmd_buffer;
 	const struct stk500_device_data *dd = target->pars;
 	int stat;
 	unsigned min, maj;
-	static uint8_t sync_reply, result;
-	struct stk500_data *priv = target->priv;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_sync,
 		},
 		[2] = {
 			.dir = IN,
 			.buf = {
-				.in = &result,
+				.in = priv->result,
 			},
-			.len = sizeof(result),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_set_device,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
@@ -429,8 +430,8 @@ static int _set_device(struct dfu_target *target, int *n_extp)
 	cmdb->eepromsize[0] = dd->eeprom ? dd->eeprom->length >> 8 : 0;
 	cmdb->eepromsize[1] = dd->eeprom ? dd->eeprom->length : 0;
 	cmdb->eop = STK_CRC_EOP;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr);
 }
 
 
@@ -459,43 +460,42 @@ static int _load_address(struct dfu_target *target, uint16_t addr)
 {
 	struct stk500_data *priv = target->priv;
 	struct stk500_load_address_cmd *cmdb =
-		(struct stk500_load_address_cmd *)cmd_buffer;
-	static uint8_t sync_reply, result;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+		(struct stk500_load_address_cmd *)priv->cmd_buffer;
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_sync,
 		},
 		[2] = {
 			.dir = IN,
 			.buf = {
-				.in = &result,
+				.in = priv->result,
 			},
-			.len = sizeof(result),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_load_addr,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
@@ -505,8 +505,8 @@ static int _load_address(struct dfu_target *target, uint16_t addr)
 	/* Convert to flash word address */
 	cmdb->addr = addr >> 1;
 	cmdb->eop = STK_CRC_EOP;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr);
 }
 
 struct stk500_prog_page_cmd {
@@ -546,16 +546,15 @@ static int stk500_chunk_available(struct dfu_target *target,
 	const struct stk500_device_data *dd = target->pars;
 	struct stk500_data *priv = target->priv;
 	struct stk500_prog_page_cmd *cmdb = (struct stk500_prog_page_cmd *)
-		cmd_buffer;
+		priv->cmd_buffer;
 	int i;
 	static const uint8_t end = STK_CRC_EOP;
-	static uint8_t sync_reply, result;
-	static struct dfu_cmdbuf cmdbufs0[] = {
+	struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
@@ -572,29 +571,29 @@ static int stk500_chunk_available(struct dfu_target *target,
 		[3] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_sync,
 		},
 		[4] = {
 			.dir = IN,
 			.buf = {
-				.in = &result,
+				.in = priv->result,
 			},
-			.len = sizeof(result),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_program_page,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = _chunk_done,
@@ -620,8 +619,8 @@ static int stk500_chunk_available(struct dfu_target *target,
 	cmdbufs0[1].len = sz;
 	/* ASYNCHRONOUS */
 	priv->curr_chunk_addr = address;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_start(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_start(target, priv->curr_descr);
 }
 
 struct stk500_universal_cmd {
@@ -633,45 +632,44 @@ struct stk500_universal_cmd {
 static int _universal(struct dfu_target *target, const uint8_t *cmd,
 		      uint8_t *res)
 {
+	struct stk500_data *priv = target->priv;
 	struct stk500_universal_cmd *cmdb = (struct stk500_universal_cmd *)
-		cmd_buffer;
+		priv->cmd_buffer;
 	int ret;
-	static uint8_t sync_reply, result[2];
-	struct stk500_data *priv = target->priv;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_sync,
 		},
 		[2] = {
 			.dir = IN,
 			.buf = {
-				.in = result,
+				.in = priv->result,
 			},
-			.len = sizeof(result),
+			.len = 2,
 			.timeout = 300,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
@@ -680,12 +678,12 @@ static int _universal(struct dfu_target *target, const uint8_t *cmd,
 	cmdb->code = STK_UNIVERSAL;
 	memcpy(cmdb->cmd, cmd, sizeof(cmdb->cmd));
 	cmdb->eop = STK_CRC_EOP;
-	priv->curr_descr = &descr0;
-	ret = dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	ret = dfu_cmd_do_sync(target, priv->curr_descr);
 	if (ret < 0)
 		return ret;
 	if (res)
-		*res = result[0];
+		*res = priv->result[0];
 	return ret;
 }
 
@@ -719,43 +717,42 @@ static int _set_extparams(struct dfu_target *target, int n_extp)
 	struct stk500_data *priv = target->priv;
 	const struct stk500_device_data *dd = target->pars;
 	struct stk500_set_extparams_cmd *cmdb =
-		(struct stk500_set_extparams_cmd *)cmd_buffer;
-	static uint8_t sync_reply, result;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+		(struct stk500_set_extparams_cmd *)priv->cmd_buffer;
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_sync,
 		},
 		[2] = {
 			.dir = IN,
 			.buf = {
-				.in = &result,
+				.in = priv->result,
 			},
-			.len = sizeof(result),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_set_ext_params,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
@@ -769,8 +766,8 @@ static int _set_extparams(struct dfu_target *target, int n_extp)
 	/* bah, avrdude seems wrong, let's copy it anyway */
 	cmdb->reset_disable = dd->rd;
 	cmdb->eop = STK_CRC_EOP;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr);
 }
 
 static int _enter_progmode(struct dfu_target *target)
@@ -820,52 +817,51 @@ static int _check_leave_progmode(const struct dfu_cmddescr *descr,
 static int stk500_run(struct dfu_target *target)
 {
 	struct stk500_data *priv = target->priv;
-	static struct stk500_leave_progmode_cmd *cmdb =
-		(struct stk500_leave_progmode_cmd *)cmd_buffer;
-	static uint8_t sync_reply, result;
-	static const struct dfu_cmdbuf cmdbufs0[] = {
+	struct stk500_leave_progmode_cmd *cmdb =
+		(struct stk500_leave_progmode_cmd *)priv->cmd_buffer;
+	const struct dfu_cmdbuf cmdbufs0[] = {
 		/* Send sync */
 		[0] = {
 			.dir = OUT,
 			.buf = {
-				.out = cmd_buffer,
+				.out = priv->cmd_buffer,
 			},
 			.len = sizeof(*cmdb),
 		},
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &sync_reply,
+				.in = priv->sync_reply,
 			},
-			.len = sizeof(sync_reply),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_sync,
 		},
 		[2] = {
 			.dir = IN,
 			.buf = {
-				.in = &result,
+				.in = priv->result,
 			},
-			.len = sizeof(result),
+			.len = 1,
 			.timeout = 300,
 			.completed = _check_leave_progmode,
 		},
 	};
-	static const struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmdbufs0,
 		.ncmdbufs = ARRAY_SIZE(cmdbufs0),
 		.checksum_ptr = NULL,
 		.checksum_size = 0,
-		.state = &data.cmd_state,
-		.timeout = &data.cmd_timeout,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.checksum_reset = NULL,
 		.checksum_update = NULL,
 		.completed = NULL,
 	};
 	cmdb->code = STK_LEAVE_PROGMODE;
 	cmdb->eop = STK_CRC_EOP;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr);
 }
 
 /* Interface event */
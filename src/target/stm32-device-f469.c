@@ -4,8 +4,6 @@
  * Flash is only supported on 1MB devices at the moment
  */
 
-static unsigned long bitmask_ptr0, bitmask_ptr1;
-
 static const struct stm32_flash_sector _double_bank_sectors0[] = {
 	[0 ... 3] = {
 		.size = 16 * 1024,
@@ -39,7 +37,6 @@ static const struct stm32_memory_area _double_bank_areas[] = {
 		.size = 1024 * 1024,
 		.sectors = _double_bank_sectors0,
 		.nsectors = ARRAY_SIZE(_double_bank_sectors0),
-		.sectors_bitmask_ptr = &bitmask_ptr0,
 		.sectors_offset = 0,
 	},
 	{
@@ -49,7 +46,6 @@ static const struct stm32_memory_area _double_bank_areas[] = {
 		.size = 1024 * 1024,
 		.sectors = _double_bank_sectors1,
 		.nsectors = ARRAY_SIZE(_double_bank_sectors0),
-		.sectors_bitmask_ptr = &bitmask_ptr1,
 		.sectors_offset = 12,
 	},
 	{
@@ -14,6 +14,19 @@
 
 #define MAX_NSECTORS_ERASE 2
 
+/*
+ * Differential mode and resume journal: max number of bytes preceding a
+ * chunk in a sector to be erased, which are read back and written again
+ * after erasing. With 0 (no room, the default but on linux) both modes are
+ * refused (see get_preserve_size).
+ */
+#ifndef CONFIG_STM32_USART_SAVE_SIZE
+#define CONFIG_STM32_USART_SAVE_SIZE 0
+#endif
+
+/* Max bytes per read/write memory command */
+#define MAX_XFER 256
+
 struct stm32_usart_data {
 #define STM32_EXTENDED_MEMORY_ERASE	(1 << 0)
 #define STM32_DOUBLE_NAK		(1 << 1)
@@ -22,11 +35,39 @@ struct stm32_usart_data {
 	struct dfu_cmdstate cmd_state;
 	struct dfu_timeout cmd_timeout;
 	const struct dfu_cmddescr *curr_descr;
+	struct dfu_cmd_storage cmd;
 	int to_be_erased[MAX_NSECTORS_ERASE];
 	int n_to_be_erased;
 	const struct stm32_memory_area *erase_area;
+	/* Erased sectors bitmask, one for each memory area */
+	unsigned long erased_sectors[STM32_MAX_AREAS];
+	/* Data to be written again after erasing (chunks not written) */
+	phys_addr_t save_addr;
+	unsigned long save_len;
+	phys_addr_t skip_addr;
+	unsigned long skip_len;
+	/*
+	 * Just one command shall be active at any time, so commands can
+	 * share buffers.
+	 */
+	uint8_t ack;
+	uint8_t checksum;
+	uint32_t addr;
+	uint8_t nbytes;
+	/* Read memory: number of bytes - 1 and its complement */
+	uint8_t rlen[2];
+	/* Contains number of sectors and sectors indices */
+	uint16_t se_16[MAX_NSECTORS_ERASE + 1];
+	uint8_t se[MAX_NSECTORS_ERASE + 1];
 };
 
+static struct stm32_usart_data data[CONFIG_DFU_MAX_INSTANCES];
+
+#if CONFIG_STM32_USART_SAVE_SIZE > 0
+static uint8_t save_buf[CONFIG_DFU_MAX_INSTANCES]
+	[CONFIG_STM32_USART_SAVE_SIZE];
+#endif
+
 struct stm32_get_cmd_reply {
 	uint8_t len;
 	uint8_t bootloader_version;
@@ -40,20 +81,31 @@ struct stm32_gid_cmd_reply {
 	uint8_t ack;
 };
 
+#define BITS_PER_LONG (sizeof(unsigned long) << 3)
+
 static inline int test_bit(int bitno, unsigned long *l)
 {
-	unsigned long *ptr = l + (bitno / sizeof(unsigned long));
-	int bit = bitno % sizeof(unsigned long);
+	unsigned long *ptr = l + (bitno / BITS_PER_LONG);
+	int bit = bitno % BITS_PER_LONG;
 
-	return *ptr & (1 << bit);
+	return !!(*ptr & (1UL << bit));
 }
 
 static inline void set_bit(int bitno, unsigned long *l)
 {
-	unsigned long *ptr = l + (bitno / sizeof(unsigned long));
-	int bit = bitno % sizeof(unsigned long);
+	unsigned long *ptr = l + (bitno / BITS_PER_LONG);
+	int bit = bitno % BITS_PER_LONG;
 
-	*ptr |= (1 << bit);
+	*ptr |= (1UL << bit);
+}
+
+static unsigned long *erased_bitmask(struct dfu_target *target,
+				     const struct stm32_memory_area *a)
+{
+	const struct stm32_device_data *pars = target->pars;
+	struct stm32_usart_data *priv = target->priv;
+
+	return &priv->erased_sectors[a - pars->areas[pars->boot_mode]];
 }
 
 static const struct stm32_memory_area *
@@ -131,7 +183,7 @@ static int erased(struct dfu_target *target, phys_addr_t addr, unsigned long l,
 	}
 	for (i = 0, index = start_sec - a->sectors_offset; i < nsec;
 	     i++, index++)
-		if (!test_bit(index, a->sectors_bitmask_ptr)) {
+		if (!test_bit(index, erased_bitmask(target, a))) {
 			to_be_erased[(*n_to_be_erased)++] = index +
 				a->sectors_offset;
 			ret = 0;
@@ -139,14 +191,15 @@ static int erased(struct dfu_target *target, phys_addr_t addr, unsigned long l,
 	return ret;
 }
 
-static void mark_erased(const struct stm32_memory_area *a,
+static void mark_erased(struct dfu_target *target,
+			const struct stm32_memory_area *a,
 			int *to_be_erased, int n_to_be_erased)
 {
 	int i;
 
 	for (i = 0; i < n_to_be_erased; i++)
 		set_bit(to_be_erased[i] - a->sectors_offset,
-			a->sectors_bitmask_ptr);
+			erased_bitmask(target, a));
 }
 
 static void checksum_update(const struct dfu_cmddescr *descr, const void *_buf,
@@ -179,13 +232,16 @@ static void _erase_done(struct dfu_target *target,
 {
 	struct stm32_usart_data *priv = target->priv;
 
+	dfu_profile_end(target->dfu, DFU_PHASE_ERASE, descr->state->cmd_start);
+	dfu_stats_erase_done(target->dfu, descr->state->cmd_start);
 	if (descr->state->status != DFU_CMD_STATUS_OK) {
 		dfu_err("ERASE\n");
 		dfu_notify_error(target->dfu);
 		return;
 	}
 	dfu_log("Erase OK\n");
-	mark_erased(priv->erase_area, priv->to_be_erased, priv->n_to_be_erased);
+	mark_erased(target, priv->erase_area, priv->to_be_erased,
+		    priv->n_to_be_erased);
 	priv->curr_descr = NULL;
 }
 
@@ -196,11 +252,8 @@ static int start_erasing(struct dfu_target *target,
 	int i;
 	static const uint8_t cmdb_ext[] = { 0x44, 0xbb, };
 	static const uint8_t cmdb[] = { 0x43, 0xbc, };
-	/* Contains number of sectors and sectors indices */
-	static uint16_t se_16[MAX_NSECTORS_ERASE + 1];
-	static uint8_t se[MAX_NSECTORS_ERASE + 1];
-	static uint8_t ack, checksum;
-	static struct dfu_cmdbuf cmds[] = {
+	struct stm32_usart_data *priv = target->priv;
+	struct dfu_cmdbuf cmds[] = {
 		[0] = {
 			.dir = OUT,
 			.len = sizeof(cmdb),
@@ -208,9 +261,9 @@ static int start_erasing(struct dfu_target *target,
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
@@ -221,22 +274,23 @@ static int start_erasing(struct dfu_target *target,
 		[3] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 10000,
 			.completed = _check_ack,
 		},
 	};
-	static struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmds,
 		.ncmdbufs = ARRAY_SIZE(cmds),
-		.checksum_ptr = &checksum,
-		.checksum_size = sizeof(checksum),
+		.checksum_ptr = &priv->checksum,
+		.checksum_size = sizeof(priv->checksum),
 		.checksum_update = checksum_update,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 		.completed = _erase_done,
 	};
-	struct stm32_usart_data *priv = target->priv;
 	int ext = priv->target_flags & STM32_EXTENDED_MEMORY_ERASE;
 
 	dfu_dbg("Starting memory erase (%s) start = %d, n = %d\n",
@@ -251,32 +305,29 @@ static int start_erasing(struct dfu_target *target,
 	priv->erase_area = a;
 	if (ext) {
 		cmds[0].buf.out = cmdb_ext;
-		se_16[0] = cpu_to_be16(nsectors - 1);
+		priv->se_16[0] = cpu_to_be16(nsectors - 1);
 		for (i = 0; i < nsectors; i++)
-			se_16[1 + i] = cpu_to_be16(sectors[i]);
-		cmds[2].buf.out = se_16;
+			priv->se_16[1 + i] = cpu_to_be16(sectors[i]);
+		cmds[2].buf.out = priv->se_16;
 	} else {
 		cmds[0].buf.out = cmdb;
-		se[0] = nsectors - 1;
+		priv->se[0] = nsectors - 1;
 		for (i = 0; i < nsectors; i++)
-			se[1 + i] = sectors[i];
-		cmds[2].buf.out = se;
+			priv->se[1 + i] = sectors[i];
+		cmds[2].buf.out = priv->se;
 	}
 	cmds[2].len = (1 + nsectors);
 	if (ext)
 		cmds[2].len <<= 1;
-	descr0.state = &priv->cmd_state;
-	descr0.timeout = &priv->cmd_timeout;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_start(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_start(target, priv->curr_descr);
 }
 
 static int get_cmd(struct dfu_target *target, struct stm32_get_cmd_reply *r)
 {
 	struct stm32_usart_data *priv = target->priv;
 	static const uint8_t cmdb[] = { 0, 0xff, };
-	static uint8_t ack;
-	static struct dfu_cmdbuf cmds[] = {
+	struct dfu_cmdbuf cmds[] = {
 		{
 			.dir = OUT,
 			.buf = {
@@ -287,9 +338,9 @@ static int get_cmd(struct dfu_target *target, struct stm32_get_cmd_reply *r)
 		{
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
@@ -299,24 +350,23 @@ static int get_cmd(struct dfu_target *target, struct stm32_get_cmd_reply *r)
 			.timeout = 300,
 		},
 	};
-	static struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmds,
 		.ncmdbufs = ARRAY_SIZE(cmds),
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 	};
 
-	descr0.state = &priv->cmd_state;
-	descr0.timeout = &priv->cmd_timeout;
 	cmds[2].buf.in = r;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr);
 }
 
 static int gid_cmd(struct dfu_target *target, struct stm32_gid_cmd_reply *r)
 {
 	struct stm32_usart_data *priv = target->priv;
 	static const uint8_t cmdb[] = { 0x02, 0xfd, };
-	static uint8_t ack;
-	static struct dfu_cmdbuf cmds[] = {
+	struct dfu_cmdbuf cmds[] = {
 		{
 			.dir = OUT,
 			.buf = {
@@ -327,9 +377,9 @@ static int gid_cmd(struct dfu_target *target, struct stm32_gid_cmd_reply *r)
 		{
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
@@ -339,29 +389,44 @@ static int gid_cmd(struct dfu_target *target, struct stm32_gid_cmd_reply *r)
 			.timeout = 300,
 		},
 	};
-	static struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmds,
 		.ncmdbufs = ARRAY_SIZE(cmds),
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 	};
 
 	cmds[2].buf.in = r;
-	descr0.state = &priv->cmd_state;
-	descr0.timeout = &priv->cmd_timeout;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr);
 }
 
 int stm32_usart_init(struct dfu_target *target,
 		     struct dfu_interface *interface)
 {
-	static struct stm32_usart_data priv;
+	struct stm32_usart_data *priv = &data[dfu_id(target->dfu)];
+	const struct stm32_device_data *pars = target->pars;
+	const struct stm32_memory_area *areas;
+	int i;
+
 	target->interface = interface;
-	memset(&priv, 0, sizeof(priv));
-	target->priv = &priv;
-	if (!target->pars) {
+	memset(priv, 0, sizeof(*priv));
+	target->priv = priv;
+	if (!pars) {
 		dfu_err("%s: no parameters received\n", __func__);
 		return -1;
 	}
+	areas = pars->areas[pars->boot_mode];
+	if (pars->nareas[pars->boot_mode] > STM32_MAX_AREAS) {
+		dfu_err("%s: too many memory areas\n", __func__);
+		return -1;
+	}
+	for (i = 0; i < pars->nareas[pars->boot_mode]; i++)
+		if (areas[i].nsectors > BITS_PER_LONG) {
+			dfu_err("%s: too many sectors in area %s\n", __func__,
+				areas[i].name);
+			return -1;
+		}
 	dfu_log("STM32-USART target initialized\n");
 	return 0;
 }
@@ -426,15 +491,19 @@ static void _chunk_done(struct dfu_target *target,
 	priv->curr_descr = NULL;
 }
 
-/* Chunk of binary data is available for writing */
-int stm32_usart_chunk_available(struct dfu_target *target,
-				phys_addr_t address,
-				const void *buf, unsigned long sz)
+/*
+ * Setup a write memory command, @completed is invoked when done (NULL for
+ * synchronous commands)
+ */
+static const struct dfu_cmddescr *
+_setup_write(struct dfu_target *target, phys_addr_t address,
+	     const void *buf, unsigned long sz,
+	     void (*completed)(struct dfu_target *,
+			       const struct dfu_cmddescr *))
 {
 	static const uint8_t cmdb[] = { 0x31, 0xce, };
-	static uint32_t addr;
-	static uint8_t nbytes, ack, checksum;
-	static struct dfu_cmdbuf cmds[] = {
+	struct stm32_usart_data *priv = target->priv;
+	struct dfu_cmdbuf cmds[] = {
 		/* Command, ~Command */
 		[0] = {
 			.dir = OUT,
@@ -447,9 +516,9 @@ int stm32_usart_chunk_available(struct dfu_target *target,
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
@@ -457,18 +526,18 @@ int stm32_usart_chunk_available(struct dfu_target *target,
 		[2] = {
 			.dir = OUT,
 			.buf = {
-				.out = &addr,
+				.out = &priv->addr,
 			},
 			.flags = START_CHECKSUM|SEND_CHECKSUM,
-			.len = sizeof(addr),
+			.len = sizeof(priv->addr),
 		},
 		/* Wait for acknowledge */
 		[3] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
@@ -477,9 +546,9 @@ int stm32_usart_chunk_available(struct dfu_target *target,
 			.dir = OUT,
 			.flags = START_CHECKSUM,
 			.buf = {
-				.out = &nbytes,
+				.out = &priv->nbytes,
 			},
-			.len = sizeof(nbytes),
+			.len = sizeof(priv->nbytes),
 		},
 		/* Send checksum */
 		[5] = {
@@ -490,37 +559,47 @@ int stm32_usart_chunk_available(struct dfu_target *target,
 		[6] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
 	};
-	static struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmds,
 		.ncmdbufs = ARRAY_SIZE(cmds),
-		.completed = _chunk_done,
+		.completed = completed,
 		.checksum_update = checksum_update,
-		.checksum_ptr = &checksum,
-		.checksum_size = sizeof(checksum),
+		.checksum_ptr = &priv->checksum,
+		.checksum_size = sizeof(priv->checksum),
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 	};
+
+	priv->addr = cpu_to_be32(address);
+	priv->nbytes = sz - 1;
+	cmds[5].len = sz;
+	cmds[5].buf.out = buf;
+	return dfu_cmd_setup(&priv->cmd, &descr0);
+}
+
+/* Chunk of binary data is available for writing */
+int stm32_usart_chunk_available(struct dfu_target *target,
+				phys_addr_t address,
+				const void *buf, unsigned long sz)
+{
 	struct stm32_usart_data *priv = target->priv;
 
-	if (sz > 256) {
+	if (sz > MAX_XFER) {
 		dfu_err("%s: invalid length %lu\n", __func__, sz);
 		return -1;
 	}
-	descr0.state = &priv->cmd_state;
-	descr0.timeout = &priv->cmd_timeout;
 	/* Asynchronous command */
 	priv->curr_chunk_addr = address;
-	priv->curr_descr = &descr0;
-	addr = cpu_to_be32(address);
-	nbytes = sz - 1;
-	cmds[5].len = sz;
-	cmds[5].buf.out = buf;
-	return dfu_cmd_start(target, &descr0);
+	priv->curr_descr = _setup_write(target, address, buf, sz,
+					_chunk_done);
+	return dfu_cmd_start(target, priv->curr_descr);
 }
 
 /* Reset and sync target */
@@ -529,9 +608,8 @@ static int stm32_usart_reset_and_sync(struct dfu_target *target)
 	struct stm32_usart_data *priv = target->priv;
 	struct dfu_interface *interface = target->interface;
 	int stat = 0, i;
-	static uint8_t cmdb[] = { 0x7f, };
-	static uint8_t ack;
-	static struct dfu_cmdbuf cmds[] = {
+	static const uint8_t cmdb[] = { 0x7f, };
+	const struct dfu_cmdbuf cmds[] = {
 		{
 			.dir = OUT,
 			.buf = {
@@ -542,28 +620,28 @@ static int stm32_usart_reset_and_sync(struct dfu_target *target)
 		{
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 100,
 			.completed = _check_ack,
 		},
 	};
-	static struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmds,
 		.ncmdbufs = ARRAY_SIZE(cmds),
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 	};
 
-	descr0.state = &priv->cmd_state;
-	descr0.timeout = &priv->cmd_timeout;
 	for (i = 0; i < 5; i++) {
 		/* Reset and sync: hw reset and enter bootloader */
 		if (dfu_interface_has_target_reset(interface))
 			stat = dfu_interface_target_reset(interface);
 		if (stat < 0)
 			return stat;
-		priv->curr_descr = &descr0;
-		if (!dfu_cmd_do_sync(target, &descr0)) {
+		priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+		if (!dfu_cmd_do_sync(target, priv->curr_descr)) {
 			dfu_dbg("Target sync OK\n");
 			return 0;
 		}
@@ -611,14 +689,24 @@ static int stm32_usart_ignore_chunk_alignment(struct dfu_target *target)
 	return 1;
 }
 
-int stm32_usart_read_memory(struct dfu_target *target, void *buf,
-			    phys_addr_t _addr, unsigned long sz)
+/* Sectors are erased before being written (see must_erase) */
+static int stm32_usart_get_erased_value(struct dfu_target *target)
+{
+	return 0xff;
+}
+
+static unsigned long stm32_usart_get_preserve_size(struct dfu_target *target)
+{
+	return CONFIG_STM32_USART_SAVE_SIZE;
+}
+
+/* Read up to MAX_XFER bytes, synchronous */
+static int _read_memory(struct dfu_target *target, void *buf,
+			phys_addr_t _addr, unsigned long sz)
 {
 	static const uint8_t cmdb[] = { 0x11, 0xee, };
-	static uint8_t ack, checksum;
-	static uint32_t addr;
-	static uint8_t nbytes;
-	static struct dfu_cmdbuf cmds[] = {
+	struct stm32_usart_data *priv = target->priv;
+	struct dfu_cmdbuf cmds[] = {
 		[0] = {
 			.dir = OUT,
 			.buf = {
@@ -629,42 +717,43 @@ int stm32_usart_read_memory(struct dfu_target *target, void *buf,
 		[1] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 200,
 			.completed = _check_ack,
 		},
 		[2] = {
 			.dir = OUT,
 			.buf = {
-				.out = &addr,
+				.out = &priv->addr,
 			},
 			.flags = START_CHECKSUM|SEND_CHECKSUM,
-			.len = sizeof(addr),
+			.len = sizeof(priv->addr),
 		},
 		[3] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 100,
 			.completed = _check_ack,
 		},
+		/* Number of bytes - 1, complement */
 		[4] = {
 			.dir = OUT,
 			.buf = {
-				.out = &nbytes,
+				.out = priv->rlen,
 			},
-			.len = sizeof(nbytes),
+			.len = sizeof(priv->rlen),
 		},
 		[5] = {
 			.dir = IN,
 			.buf = {
-				.in = &ack,
+				.in = &priv->ack,
 			},
-			.len = sizeof(ack),
+			.len = sizeof(priv->ack),
 			.timeout = 100,
 			.completed = _check_ack,
 		},
@@ -673,39 +762,131 @@ int stm32_usart_read_memory(struct dfu_target *target, void *buf,
 			.timeout = 500,
 		},
 	};
-	static struct dfu_cmddescr descr0 = {
+	const struct dfu_cmddescr descr0 = {
 		.cmdbufs = cmds,
 		.ncmdbufs = ARRAY_SIZE(cmds),
-		.checksum_ptr = &checksum,
-		.checksum_size = sizeof(checksum),
+		.checksum_ptr = &priv->checksum,
+		.checksum_size = sizeof(priv->checksum),
 		.checksum_update = checksum_update,
+		.state = &priv->cmd_state,
+		.timeout = &priv->cmd_timeout,
 	};
-	struct stm32_usart_data *priv = target->priv;
 
+	priv->addr = cpu_to_be32(_addr);
+	priv->rlen[0] = sz - 1;
+	priv->rlen[1] = priv->rlen[0] ^ 0xff;
+	cmds[6].buf.in = buf;
+	cmds[6].len = sz;
+
+	priv->curr_descr = dfu_cmd_setup(&priv->cmd, &descr0);
+	return dfu_cmd_do_sync(target, priv->curr_descr) ? -1 : 0;
+}
+
+int stm32_usart_read_memory(struct dfu_target *target, void *buf,
+			    phys_addr_t addr, unsigned long sz)
+{
+	unsigned long l;
+
+	for ( ; sz; addr += l, buf = (char *)buf + l, sz -= l) {
+		l = min(sz, MAX_XFER);
+		if (_read_memory(target, buf, addr, l) < 0) {
+			dfu_err("%s: error reading @0x%08x\n", __func__,
+				(unsigned int)addr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static phys_addr_t _sector_start(const struct stm32_memory_area *a,
+				 int sector)
+{
+	phys_addr_t out = a->start;
+	int i;
+
+	for (i = 0; i < sector - a->sectors_offset; i++)
+		out += a->sectors[i].size;
+	return out;
+}
+
+/*
+ * @sector is going to be erased, read back its contents preceding @preserve
+ * (see must_erase). The @l bytes at @addr are skipped on restore.
+ */
+static int _save(struct dfu_target *target, const struct stm32_memory_area *a,
+		 int sector, phys_addr_t addr, unsigned long l,
+		 phys_addr_t preserve)
+{
+	struct stm32_usart_data *priv = target->priv;
+	phys_addr_t start = _sector_start(a, sector);
+	phys_addr_t end = start + a->sectors[sector - a->sectors_offset].size;
 
-	if (sz > 256) {
-		dfu_err("%s: trying to read more than 256 bytes\n", __func__);
+	end = min(end, preserve);
+	priv->save_len = 0;
+	if (start >= end)
+		return 0;
+#if CONFIG_STM32_USART_SAVE_SIZE > 0
+	if (end - start > CONFIG_STM32_USART_SAVE_SIZE) {
+		dfu_err("%s: %lu bytes to be saved, max is %d\n", __func__,
+			(unsigned long)(end - start),
+			CONFIG_STM32_USART_SAVE_SIZE);
 		return -1;
 	}
-	if (_addr & 0x3) {
-		dfu_err("%s: trying to read from unaligned address\n",
-			__func__);
+	if (stm32_usart_read_memory(target, save_buf[dfu_id(target->dfu)],
+				    start, end - start) < 0)
 		return -1;
+	priv->save_addr = start;
+	priv->save_len = end - start;
+	priv->skip_addr = addr;
+	priv->skip_len = l;
+	return 0;
+#else
+	dfu_err("%s: no room for saving sector contents\n", __func__);
+	return -1;
+#endif
+}
+
+/*
+ * Sector erased, write saved contents again, leaving
+ * room for the chunk which caused the erase
+ */
+static int _restore(struct dfu_target *target)
+{
+#if CONFIG_STM32_USART_SAVE_SIZE > 0
+	struct stm32_usart_data *priv = target->priv;
+	uint8_t *ptr = save_buf[dfu_id(target->dfu)];
+	unsigned long off, l, i;
+
+	for (i = 0; i < priv->skip_len; i++) {
+		off = priv->skip_addr + i - priv->save_addr;
+		if (off < priv->save_len)
+			ptr[off] = 0xff;
 	}
-	addr = _addr;
-	cmds[6].buf.in = buf;
-	cmds[6].len = sz - 1;
-	
-	descr0.state = &priv->cmd_state;
-	descr0.timeout = &priv->cmd_timeout;
-	priv->curr_descr = &descr0;
-	return dfu_cmd_do_sync(target, &descr0);
+	for (off = 0; off < priv->save_len; off += l) {
+		l = min(priv->save_len - off, MAX_XFER);
+		for (i = 0; i < l && ptr[off + i] == 0xff; i++);
+		if (i == l)
+			/* Erased already */
+			continue;
+		priv->curr_descr = _setup_write(target, priv->save_addr + off,
+						&ptr[off], l, NULL);
+		if (dfu_cmd_do_sync(target, priv->curr_descr)) {
+			dfu_err("%s: error writing @0x%08x\n", __func__,
+				(unsigned int)(priv->save_addr + off));
+			priv->save_len = 0;
+			return -1;
+		}
+	}
+	priv->save_len = 0;
+#endif
+	return 0;
 }
 
 static int stm32_usart_must_erase(struct dfu_target *target, phys_addr_t addr,
-				  unsigned long l)
+				  unsigned long l, phys_addr_t preserve)
 {
 	int start, n, stat, to_be_erased[MAX_NSECTORS_ERASE], n_to_be_erased;
+	struct stm32_usart_data *priv = target->priv;
 	const struct stm32_memory_area *a =
 		map_chunk_address(target, addr, l, &start, &n);
 
@@ -738,6 +919,13 @@ static int stm32_usart_must_erase(struct dfu_target *target, phys_addr_t addr,
 		 * Sectors corresponding to this chunk have already been erased
 		 */
 		dfu_dbg("%s: chunk has been erased\n", __func__);
+		if (priv->save_len && _restore(target) < 0)
+			dfu_notify_error(target->dfu);
+		return 0;
+	}
+	if (_save(target, a, to_be_erased[0], addr, l, preserve) < 0) {
+		dfu_err("stm32-usart: cannot save sector contents\n");
+		dfu_notify_error(target->dfu);
 		return 0;
 	}
 	if (start_erasing(target, a, to_be_erased, n_to_be_erased) < 0) {
@@ -750,19 +938,10 @@ static int stm32_usart_must_erase(struct dfu_target *target, phys_addr_t addr,
 
 static int stm32_usart_fini(struct dfu_target *target)
 {
-	const struct stm32_device_data *pars = target->pars;
-	const struct stm32_memory_area *areas = pars->areas[pars->boot_mode];
-	int nareas = pars->nareas[pars->boot_mode], i, n;
+	struct stm32_usart_data *priv = target->priv;
 
-	for (i = 0; i < nareas; i++) {
-		if (!areas[i].sectors_bitmask_ptr || !areas[i].nsectors)
-			continue;
-		n = areas[i].nsectors / (sizeof(unsigned long) << 3);
-		if (areas[i].nsectors % (sizeof(unsigned long) << 3))
-			n++;
-		memset(areas[i].sectors_bitmask_ptr, 0,
-		       n * sizeof(unsigned long));
-	}
+	memset(priv->erased_sectors, 0, sizeof(priv->erased_sectors));
+	priv->save_len = 0;
 	return 0;
 }
 
@@ -778,5 +957,7 @@ struct dfu_target_ops stm32_dfu_target_ops = {
 	.ignore_chunk_alignment = stm32_usart_ignore_chunk_alignment,
 	.read_memory = stm32_usart_read_memory,
 	.must_erase = stm32_usart_must_erase,
+	.get_erased_value = stm32_usart_get_erased_value,
+	.get_preserve_size = stm32_usart_get_preserve_size,
 	.fini = stm32_usart_fini,
 };